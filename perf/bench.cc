@@ -0,0 +1,274 @@
+/*
+ * Микробенчмарки MVCC движка. Результаты печатаются в stdout в JSON,
+ * чтобы их можно было сравнивать между версиями:
+ *
+ * {"benchmarks": [{"name": "insert", "indexes": 1, "ops": N,
+ *                  "seconds": S, "ops_per_sec": R,
+ *                  "cycles_per_op": C, "instructions_per_op": I,
+ *                  "l1d_misses_per_op": L1, "llc_misses_per_op": LLC,
+ *                  "branch_misses_per_op": B}, ...]}
+ *
+ * Первый аргумент - число операций в каждом бенчмарке (по умолчанию 100000).
+ *
+ * Аппаратные счетчики снимаются через perf_event_open только на время
+ * измеряемого цикла. Если какой-то счетчик недоступен (kernel.perf_event_paranoid,
+ * виртуалка без PMU), его поле просто отсутствует в выводе.
+ *
+ * Что меряется:
+ * - insert/replace/delete: по одной операции в транзакции, 1/2/4/8 индексов;
+ * - get_clean/get_dirty: точечные чтения чистых таплов и таплов, поверх
+ *   которых лежит незакоммиченная запись другой транзакции;
+ * - clarify: чтение из read view через цепочку из chain_length версий;
+ * - gc: сколько stories в секунду собирает memtx_tx_story_gc_idle;
+ * - abort: откат транзакций, проигравших конфликт за один ключ.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "box.h"
+#include "memtx_tx.h"
+#include "perf_util.h"
+
+/** Сколько чтений делается в одной читающей транзакции. */
+static const uint32_t READS_PER_TXN = 100;
+
+static bool is_first_result = true;
+
+static struct perf_counters counters;
+
+/** Начать измеряемую фазу: запустить счетчики и засечь время. */
+static double
+phase_start()
+{
+	counters.start();
+	return perf_now();
+}
+
+/** Закончить фазу, начатую phase_start(), и напечатать результат. */
+static void
+report(const char *name, const char *param, uint64_t value, uint64_t ops, double start)
+{
+	double seconds = perf_now() - start;
+	counters.stop();
+	printf("%s\n    {\"name\": \"%s\", ", is_first_result ? "" : ",", name);
+	if (param != NULL)
+		printf("\"%s\": %llu, ", param, (unsigned long long)value);
+	printf("\"ops\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.0f",
+	       (unsigned long long)ops, seconds, ops / seconds);
+	for (int i = 0; i < perf_counter_MAX; i++) {
+		if (counters.is_available((enum perf_counter)i) && ops != 0)
+			printf(", \"%s_per_op\": %.2f", perf_counter_strs[i],
+			       counters.value[i] / ops);
+	}
+	printf("}");
+	is_first_result = false;
+}
+
+static perf_tuple
+bench_tuple(uint32_t field_count, int key, int value)
+{
+	/* Тапл попадает во все индексы: в i-м индексе ключ - поле i. */
+	std::vector<int64_t> data(field_count + 1, key);
+	data[field_count] = value;
+	return perf_tuple(data);
+}
+
+/** Собрать весь мусор, чтобы следующий бенчмарк начинался с чистого листа. */
+static void
+collect_garbage()
+{
+	memtx_tx_story_gc_idle(TXN_TIMEOUT_INFINITY);
+}
+
+static void
+bench_write(uint32_t index_count, uint64_t ops)
+{
+	struct memtx_space *space = memtx_space_new(index_count);
+
+	double start = phase_start();
+	for (uint64_t i = 0; i < ops; i++) {
+		box_txn_begin();
+		perf_insert(space, bench_tuple(index_count, i, 0));
+		box_txn_commit();
+	}
+	report("insert", "indexes", index_count, ops, start);
+
+	start = phase_start();
+	for (uint64_t i = 0; i < ops; i++) {
+		box_txn_begin();
+		perf_replace(space, bench_tuple(index_count, i, 1));
+		box_txn_commit();
+	}
+	report("replace", "indexes", index_count, ops, start);
+
+	start = phase_start();
+	for (uint64_t i = 0; i < ops; i++) {
+		box_txn_begin();
+		perf_delete(space, 0, i);
+		box_txn_commit();
+	}
+	report("delete", "indexes", index_count, ops, start);
+	collect_garbage();
+}
+
+/** Прочитать ключи 0..ops - 1, вернуть начало фазы для report(). */
+static double
+read_all(struct memtx_space *space, uint64_t ops)
+{
+	struct tuple *result;
+	double start = phase_start();
+	for (uint64_t i = 0; i < ops; i += READS_PER_TXN) {
+		box_txn_begin();
+		for (uint64_t j = i; j < i + READS_PER_TXN && j < ops; j++)
+			perf_get(space, 0, j, &result);
+		box_txn_commit();
+	}
+	return start;
+}
+
+static void
+bench_get(struct perf_fiber *reader, struct perf_fiber *writer, uint64_t ops)
+{
+	struct memtx_space *space = memtx_space_new(1);
+	reader->enter();
+	for (uint64_t i = 0; i < ops; i++) {
+		box_txn_begin();
+		perf_insert(space, bench_tuple(1, i, 0));
+		box_txn_commit();
+	}
+	collect_garbage();
+	report("get_clean", NULL, 0, ops, read_all(space, ops));
+
+	/* Писатель перезаписал все ключи, но еще не закоммитился. */
+	writer->enter();
+	box_txn_begin();
+	for (uint64_t i = 0; i < ops; i++)
+		perf_replace(space, bench_tuple(1, i, 1));
+	reader->enter();
+	report("get_dirty", NULL, 0, ops, read_all(space, ops));
+	writer->enter();
+	box_txn_rollback();
+	reader->enter();
+	collect_garbage();
+}
+
+static void
+bench_clarify(struct perf_fiber *reader, struct perf_fiber *writer, uint32_t chain_length, uint64_t ops)
+{
+	struct memtx_space *space = memtx_space_new(1);
+	struct tuple *result;
+	writer->enter();
+	box_txn_begin();
+	perf_insert(space, bench_tuple(1, 0, 0));
+	box_txn_commit();
+
+	/*
+	 * Читатель прочитал ключ, после чего каждая следующая версия
+	 * отправляет его в read view: все версии новее остаются в цепочке,
+	 * и каждое чтение проходит её целиком до видимой версии.
+	 */
+	reader->enter();
+	box_txn_begin();
+	perf_get(space, 0, 0, &result);
+	writer->enter();
+	for (uint32_t i = 1; i <= chain_length; i++) {
+		box_txn_begin();
+		perf_replace(space, bench_tuple(1, 0, i));
+		box_txn_commit();
+	}
+	reader->enter();
+	double start = phase_start();
+	for (uint64_t i = 0; i < ops; i++)
+		perf_get(space, 0, 0, &result);
+	report("clarify", "chain_length", chain_length, ops, start);
+	box_txn_commit();
+	collect_garbage();
+}
+
+static void
+bench_gc(struct perf_fiber *reader, struct perf_fiber *writer, uint64_t ops)
+{
+	struct memtx_space *space = memtx_space_new(1);
+	struct tuple *result;
+	writer->enter();
+	box_txn_begin();
+	perf_insert(space, bench_tuple(1, 0, 0));
+	box_txn_commit();
+
+	/* Пока читатель в read view, GC не может собрать новые stories. */
+	reader->enter();
+	box_txn_begin();
+	perf_get(space, 0, 0, &result);
+	writer->enter();
+	for (uint64_t i = 0; i < ops; i++) {
+		box_txn_begin();
+		perf_replace(space, bench_tuple(1, i, 1));
+		box_txn_commit();
+	}
+	reader->enter();
+	box_txn_commit();
+
+	double start = phase_start();
+	size_t freed = memtx_tx_story_gc_idle(TXN_TIMEOUT_INFINITY);
+	report("gc", NULL, 0, freed, start);
+}
+
+static void
+bench_abort(uint32_t client_count, uint64_t ops)
+{
+	struct memtx_space *space = memtx_space_new(1);
+	std::vector<perf_fiber> clients(client_count);
+	struct tuple *result;
+	clients[0].enter();
+	box_txn_begin();
+	perf_insert(space, bench_tuple(1, 0, 0));
+	box_txn_commit();
+
+	/*
+	 * Все клиенты читают и пишут один ключ, первый коммитится, остальные
+	 * получают конфликт. Меряется раунд целиком, в пересчете на аборт.
+	 */
+	uint64_t aborts = 0;
+	double start = phase_start();
+	while (aborts < ops) {
+		for (auto &client : clients) {
+			client.enter();
+			box_txn_begin();
+			perf_get(space, 0, 0, &result);
+			perf_replace(space, bench_tuple(1, 0, 1));
+		}
+		clients[0].enter();
+		box_txn_commit();
+		for (uint32_t i = 1; i < client_count; i++) {
+			clients[i].enter();
+			aborts += txn_has_flag(in_txn(), TXN_IS_CONFLICTED);
+			box_txn_rollback();
+		}
+	}
+	report("abort", "clients", client_count, aborts, start);
+	collect_garbage();
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t ops = argc > 1 ? strtoull(argv[1], NULL, 10) : 100000;
+	memtx_tx_manager_init();
+	perf_fiber reader, writer;
+	reader.enter();
+
+	printf("{\"benchmarks\": [");
+	for (uint32_t index_count : {1, 2, 4, 8})
+		bench_write(index_count, ops);
+	bench_get(&reader, &writer, ops);
+	for (uint32_t chain_length : {1, 10, 100, 1000})
+		bench_clarify(&reader, &writer, chain_length, ops / 10);
+	bench_gc(&reader, &writer, ops);
+	for (uint32_t client_count : {2, 16})
+		bench_abort(client_count, ops / 10);
+	printf("\n]}\n");
+
+	memtx_tx_manager_free();
+	return 0;
+}
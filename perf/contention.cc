@@ -0,0 +1,142 @@
+/*
+ * Бенчмарк конфликтов: N клиентов-корутин делают read-modify-write
+ * счетчиков на K горячих ключах. Между чтением, записью и коммитом
+ * клиент отдает управление, поэтому транзакции реально пересекаются
+ * и конфликтуют. Сконфликтовавшая транзакция перезапускается с той же
+ * задержкой, что и в box_txn_run (box_txn_backoff), но ждет её, отдавая
+ * управление другим клиентам, а не блокируя поток.
+ *
+ * Выводит на каждую конфигурацию пропускную способность, долю абортов и
+ * число транзакций, исчерпавших перезапуски, а в конце - горячие ключи.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "box.h"
+#include "memtx_tx.h"
+#include "perf_util.h"
+
+struct client {
+	struct memtx_space *space;
+	uint32_t key_count;
+	uint64_t txn_count;
+	struct box_txn_run_opts opts;
+	/* Клиент спит (в backoff) до этого момента. */
+	double wake_at;
+	uint64_t commits;
+	uint64_t aborts;
+	uint64_t give_ups;
+};
+
+static Task
+client_body(struct client *client)
+{
+	for (uint64_t n = 0; n < client->txn_count; n++) {
+		int key = rand() % client->key_count;
+		for (uint32_t attempt = 0; ; attempt++) {
+			box_txn_begin();
+			struct tuple *old = NULL;
+			perf_get(client->space, 0, key, &old);
+			co_await std::suspend_always{};
+			int value = old == NULL ? 0 : perf_field(old, 1);
+			perf_replace(client->space, {key, value + 1});
+			co_await std::suspend_always{};
+			struct txn *txn = in_txn();
+			bool is_conflicted = txn_has_flag(txn, TXN_IS_CONFLICTED);
+			if (!is_conflicted && box_txn_commit() == 0) {
+				client->commits++;
+				break;
+			}
+			if (is_conflicted)
+				box_txn_rollback();
+			client->aborts++;
+			if (attempt >= client->opts.max_retries) {
+				client->give_ups++;
+				break;
+			}
+			client->wake_at = perf_now() + box_txn_backoff(&client->opts, attempt);
+			co_await std::suspend_always{};
+		}
+	}
+}
+
+static void
+run(uint32_t client_count, uint32_t key_count, uint64_t txn_count)
+{
+	struct memtx_space *space = memtx_space_new(1);
+	std::vector<struct client> clients(client_count);
+	std::vector<Task> tasks;
+	for (uint32_t i = 0; i < client_count; i++) {
+		struct client *c = &clients[i];
+		*c = {};
+		c->space = space;
+		c->key_count = key_count;
+		c->txn_count = txn_count;
+		box_txn_run_opts_create(&c->opts);
+		tasks.push_back(client_body(c));
+		tasks.back().fiber()->id = i + 1;
+	}
+
+	double start = perf_now();
+	uint32_t alive = client_count;
+	while (alive > 0) {
+		alive = 0;
+		for (uint32_t i = 0; i < client_count; i++) {
+			auto handle = std::coroutine_handle<Task::promise_type>::from_promise(*tasks[i].promise);
+			if (handle.done())
+				continue;
+			alive++;
+			if (clients[i].wake_at > 0 && clients[i].wake_at > perf_now())
+				continue;
+			clients[i].wake_at = 0;
+			current_task = &tasks[i];
+			handle.resume();
+			current_task = nullptr;
+		}
+	}
+	double elapsed = perf_now() - start;
+
+	uint64_t commits = 0, aborts = 0, give_ups = 0;
+	for (auto &c : clients) {
+		commits += c.commits;
+		aborts += c.aborts;
+		give_ups += c.give_ups;
+	}
+	printf("clients=%-3u keys=%-5u commits/s=%-10.0f abort_rate=%-6.3f give_ups=%llu\n",
+	       client_count, key_count, commits / elapsed,
+	       (double)aborts / (commits + aborts), (unsigned long long)give_ups);
+	for (auto &t : tasks)
+		std::coroutine_handle<Task::promise_type>::from_promise(*t.promise).destroy();
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t txn_count = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000;
+	memtx_tx_manager_init();
+	for (uint32_t key_count : {1, 16, 1024})
+		for (uint32_t client_count : {1, 2, 4, 8, 16})
+			run(client_count, key_count, txn_count);
+
+	struct memtx_tx_hot_key keys[8];
+	uint32_t count = memtx_tx_hot_keys(keys, 8);
+	printf("hot keys:\n");
+	for (uint32_t i = 0; i < count; i++) {
+		/* Ключи здесь целые и сохранены целиком. */
+		const char *key = keys[i].key;
+		long long key_value = mp_typeof(*key) == MP_UINT ?
+				      (long long)mp_decode_uint(&key) :
+				      (long long)mp_decode_int(&key);
+		printf("space=%u index=%u key=%lld conflicts=%llu (+-%llu) read=%llu point_hole=%llu gap=%llu secondary=%llu\n",
+		       keys[i].space_id, keys[i].index_id, key_value,
+		       (unsigned long long)keys[i].conflicts,
+		       (unsigned long long)keys[i].error,
+		       (unsigned long long)keys[i].by_reason[MEMTX_TX_CONFLICT_READ],
+		       (unsigned long long)keys[i].by_reason[MEMTX_TX_CONFLICT_POINT_HOLE],
+		       (unsigned long long)keys[i].by_reason[MEMTX_TX_CONFLICT_GAP],
+		       (unsigned long long)keys[i].by_reason[MEMTX_TX_CONFLICT_SECONDARY]);
+	}
+	memtx_tx_manager_free();
+	return 0;
+}
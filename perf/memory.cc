@@ -0,0 +1,210 @@
+/*
+ * Память метаданных MVCC при долгих read view.
+ *
+ *   memtx_tx_memory [-r readers] [-k hot keys] [-s sample ms] [-t hold s]
+ *
+ * Писатель непрерывно обновляет горячие ключи спейса с двумя индексами, а
+ * иногда вставляет и удаляет "холодные" ключи. Читатели (по умолчанию
+ * прогоны с 1, 4 и 16) по очереди открывают транзакции, читают горячие
+ * ключи и пару отсутствующих и остаются открытыми: первая же запись
+ * отправляет их в read view, и GC больше не может собирать версии новее
+ * их rv_psn. После hold секунд читатели закрываются, а писатель
+ * продолжает работать, пока память не вернется к уровню до читателей.
+ *
+ * Каждые sample мс печатается строка CSV с байтами по видам объектов:
+ * story (без связей), link, tracker, point hole, gap item. В конце прогона
+ * строка-комментарий (#) с пиком, временем, за которое память была
+ * освобождена после закрытия читателей (reclaim, -1 - не дождались), и
+ * сколько после этого собирает memtx_tx_story_gc_idle.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <vector>
+
+#include "box.h"
+#include "memtx_tx.h"
+#include "perf_util.h"
+
+/** Отсутствующие ключи, которые читают читатели и иногда вставляет писатель. */
+static const int COLD_KEY_BASE = 1 << 20;
+static const int COLD_KEYS = 16;
+/** Сколько секунд ждать возврата памяти к исходному уровню. */
+static const double RECLAIM_TIMEOUT = 10;
+
+struct config {
+	uint32_t key_count;
+	double sample_interval;
+	double hold;
+};
+
+static void
+write_one(struct memtx_space *space, uint32_t key_count, uint64_t n)
+{
+	box_txn_begin();
+	if (n % 10 != 0) {
+		int key = rand() % key_count;
+		perf_replace(space, {key, COLD_KEY_BASE * 2 + key, (int)n});
+	} else {
+		int key = COLD_KEY_BASE + rand() % COLD_KEYS;
+		struct tuple *old;
+		perf_get(space, 0, key, &old);
+		if (old == NULL)
+			perf_insert(space, {key, key, (int)n});
+		else
+			perf_delete(space, 0, key);
+	}
+	box_txn_commit();
+}
+
+static void
+sample(double time, const char *phase, uint32_t reader_count)
+{
+	struct memtx_tx_statistics s;
+	memtx_tx_statistics_collect(&s);
+	printf("%u,%.3f,%s,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu\n",
+	       reader_count, time, phase,
+	       s.objects[MEMTX_TX_OBJECT_STORY].count,
+	       s.objects[MEMTX_TX_OBJECT_STORY].total - s.links.total,
+	       s.links.total,
+	       s.objects[MEMTX_TX_OBJECT_READ_TRACKER].total,
+	       s.objects[MEMTX_TX_OBJECT_POINT_HOLE_ITEM].total,
+	       s.objects[MEMTX_TX_OBJECT_GAP_ITEM].total,
+	       s.stories[MEMTX_TX_STORY_READ_VIEW].total,
+	       s.stories[MEMTX_TX_STORY_TRACK_GAP].total,
+	       s.total);
+}
+
+static size_t
+mvcc_total()
+{
+	struct memtx_tx_statistics s;
+	memtx_tx_statistics_collect(&s);
+	return s.total;
+}
+
+static void
+run(const struct config *config, uint32_t reader_count)
+{
+	struct memtx_space *space = memtx_space_new(2);
+	perf_fiber writer;
+	std::vector<perf_fiber> readers(reader_count);
+	uint64_t n = 0;
+	writer.enter();
+	for (uint32_t key = 0; key < config->key_count; key++) {
+		box_txn_begin();
+		perf_insert(space, {(int)key, (int)(COLD_KEY_BASE * 2 + key), 0});
+		box_txn_commit();
+	}
+
+	/*
+	 * Разогрев: максимум памяти при той же нагрузке без читателей -
+	 * уровень, к которому надо вернуться.
+	 */
+	double start = perf_now();
+	double next_sample = start;
+	size_t baseline = 0;
+	while (perf_now() < start + config->sample_interval * 5) {
+		write_one(space, config->key_count, n++);
+		baseline = std::max(baseline, mvcc_total());
+	}
+
+	/* Читатели открываются равномерно в первой половине hold. */
+	start = perf_now();
+	uint32_t opened = 0;
+	size_t peak = 0;
+	while (true) {
+		double now = perf_now();
+		if (now >= start + config->hold)
+			break;
+		if (opened < reader_count &&
+		    now >= start + config->hold / 2 * opened / reader_count) {
+			readers[opened].enter();
+			box_txn_begin();
+			struct tuple *result;
+			for (uint32_t key = 0; key < config->key_count; key++)
+				perf_get(space, 0, key, &result);
+			for (int key = 0; key < COLD_KEYS; key += 4)
+				perf_get(space, 0, COLD_KEY_BASE + key, &result);
+			opened++;
+			writer.enter();
+		}
+		write_one(space, config->key_count, n++);
+		if (now >= next_sample) {
+			sample(now - start, "hold", reader_count);
+			next_sample = now + config->sample_interval;
+		}
+		peak = std::max(peak, mvcc_total());
+	}
+
+	for (auto &reader : readers) {
+		reader.enter();
+		box_txn_commit();
+	}
+	writer.enter();
+	double closed = perf_now();
+	double reclaim = -1;
+	while (perf_now() < closed + RECLAIM_TIMEOUT) {
+		write_one(space, config->key_count, n++);
+		double now = perf_now();
+		if (now >= next_sample) {
+			sample(now - start, "drain", reader_count);
+			next_sample = now + config->sample_interval;
+		}
+		if (mvcc_total() <= baseline) {
+			reclaim = now - closed;
+			break;
+		}
+	}
+	size_t before_idle = mvcc_total();
+	double idle_start = perf_now();
+	memtx_tx_story_gc_idle(TXN_TIMEOUT_INFINITY);
+	double idle = perf_now() - idle_start;
+	sample(perf_now() - start, "idle", reader_count);
+	printf("# readers=%u baseline=%zu peak=%zu reclaim=%.3fs idle_gc_freed=%zu idle_gc=%.6fs\n",
+	       reader_count, baseline, peak, reclaim, before_idle - mvcc_total(), idle);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct config config;
+	config.key_count = 64;
+	config.sample_interval = 0.02;
+	config.hold = 1;
+	uint32_t reader_count = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:k:s:t:")) != -1) {
+		switch (opt) {
+		case 'r':
+			reader_count = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			config.key_count = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			config.sample_interval = strtod(optarg, NULL) / 1000;
+			break;
+		case 't':
+			config.hold = strtod(optarg, NULL);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-r readers] [-k hot keys] [-s sample ms] [-t hold s]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	memtx_tx_manager_init();
+	printf("readers,time,phase,stories,story_bytes,link_bytes,tracker_bytes,"
+	       "point_hole_bytes,gap_item_bytes,read_view_story_bytes,"
+	       "track_gap_story_bytes,total_bytes\n");
+	if (reader_count != 0) {
+		run(&config, reader_count);
+	} else {
+		for (uint32_t count : {1, 4, 16})
+			run(&config, count);
+	}
+	memtx_tx_manager_free();
+	return 0;
+}
@@ -0,0 +1,285 @@
+#pragma once
+/*
+ * Общие хелперы бенчмарков: часы, аппаратные счетчики, таплы из целых
+ * полей и "файберы" для транзакций.
+ *
+ * Транзакция привязана к текущему файберу (in_txn() == fiber()->txn), а
+ * файбер - это промис корутины Task. Чтобы держать несколько открытых
+ * транзакций в одном потоке, не обязательно крутить корутины: достаточно
+ * создать несколько Task и переключать между ними current_task.
+ */
+#include <chrono>
+#include <cerrno>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <unistd.h>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "box.h"
+#include "fiber.h"
+#include "msgpack.h"
+
+static inline double
+perf_now()
+{
+	using namespace std::chrono;
+	return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+/** Тапл из целых полей в MsgPack - в таком виде его присылает клиент. */
+struct perf_tuple {
+	std::vector<char> data;
+
+	perf_tuple(std::initializer_list<int64_t> fields)
+	{
+		encode(fields.begin(), fields.size());
+	}
+	explicit perf_tuple(const std::vector<int64_t> &fields)
+	{
+		encode(fields.data(), fields.size());
+	}
+	const char *begin() const { return data.data(); }
+	const char *end() const { return data.data() + data.size(); }
+
+private:
+	void encode(const int64_t *fields, size_t count)
+	{
+		data.resize(mp_sizeof_array(count) + count * 9);
+		char *pos = mp_encode_array(data.data(), count);
+		for (size_t i = 0; i < count; i++) {
+			if (fields[i] >= 0)
+				pos = mp_encode_uint(pos, fields[i]);
+			else
+				pos = mp_encode_int(pos, fields[i]);
+		}
+		data.resize(pos - data.data());
+	}
+};
+
+static inline int
+perf_insert(struct memtx_space *space, const perf_tuple &tuple)
+{
+	return box_insert(space, tuple.begin(), tuple.end());
+}
+
+static inline int
+perf_replace(struct memtx_space *space, const perf_tuple &tuple)
+{
+	return box_replace(space, tuple.begin(), tuple.end());
+}
+
+/** Ключ из одного целого в MsgPack - в таком виде его присылает клиент. */
+struct perf_key {
+	char data[16];
+	const char *data_end;
+
+	explicit perf_key(int64_t value)
+	{
+		char *pos = mp_encode_array(data, 1);
+		if (value >= 0)
+			pos = mp_encode_uint(pos, value);
+		else
+			pos = mp_encode_int(pos, value);
+		data_end = pos;
+	}
+	const char *begin() const { return data; }
+	const char *end() const { return data_end; }
+};
+
+static inline int
+perf_get(struct memtx_space *space, uint32_t index_id, int64_t key, struct tuple **result)
+{
+	perf_key k(key);
+	return box_get(space, index_id, k.begin(), k.end(), result);
+}
+
+static inline int
+perf_delete(struct memtx_space *space, uint32_t index_id, int64_t key)
+{
+	perf_key k(key);
+	return box_delete(space, index_id, k.begin(), k.end());
+}
+
+/** Целое поле @a fieldno тапла, например, полученного из box_get. */
+static inline int64_t
+perf_field(struct tuple *tuple, uint32_t fieldno)
+{
+	const char *field = tuple_field(tuple, fieldno);
+	if (mp_typeof(*field) == MP_UINT)
+		return mp_decode_uint(&field);
+	return mp_decode_int(&field);
+}
+
+/** Корутина, которая никогда не запускается - только носитель struct fiber. */
+static inline Task
+perf_fiber_body()
+{
+	co_return;
+}
+
+struct perf_fiber {
+	Task task;
+
+	perf_fiber() : task(perf_fiber_body()) {}
+	~perf_fiber()
+	{
+		if (current_task == &task)
+			current_task = nullptr;
+		std::coroutine_handle<Task::promise_type>::from_promise(*task.promise).destroy();
+	}
+	perf_fiber(const perf_fiber &) = delete;
+	perf_fiber &operator=(const perf_fiber &) = delete;
+
+	/** Сделать файбер текущим: box_* будут работать с его транзакцией. */
+	void enter() { current_task = &task; }
+};
+
+/** Аппаратные счетчики, которые снимаются вокруг фазы бенчмарка. */
+enum perf_counter {
+	PERF_COUNTER_CYCLES,
+	PERF_COUNTER_INSTRUCTIONS,
+	PERF_COUNTER_L1D_MISSES,
+	PERF_COUNTER_LLC_MISSES,
+	PERF_COUNTER_BRANCH_MISSES,
+	perf_counter_MAX,
+};
+
+static const char *const perf_counter_strs[perf_counter_MAX] = {
+	"cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses",
+};
+
+/**
+ * Счетчики perf_event_open текущего потока. Недоступный счетчик (нет прав,
+ * нет PMU в виртуалке, не Linux) имеет fd == -1 и просто не печатается,
+ * так что бенчмарки работают и без них.
+ */
+struct perf_counters {
+	int fd[perf_counter_MAX];
+	/** Значения за последнюю фазу, с поправкой на мультиплексирование. */
+	double value[perf_counter_MAX];
+
+	perf_counters();
+	~perf_counters();
+	perf_counters(const perf_counters &) = delete;
+	perf_counters &operator=(const perf_counters &) = delete;
+
+	bool is_available(enum perf_counter counter) const { return fd[counter] >= 0; }
+	/** Обнулить и запустить все доступные счетчики. */
+	void start();
+	/** Остановить счетчики и прочитать value. */
+	void stop();
+};
+
+#ifdef __linux__
+
+static inline int
+perf_counter_open(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+			   PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+inline
+perf_counters::perf_counters()
+{
+	const uint64_t l1d_miss = PERF_COUNT_HW_CACHE_L1D |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	fd[PERF_COUNTER_CYCLES] =
+		perf_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	fd[PERF_COUNTER_INSTRUCTIONS] =
+		perf_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	fd[PERF_COUNTER_L1D_MISSES] =
+		perf_counter_open(PERF_TYPE_HW_CACHE, l1d_miss);
+	fd[PERF_COUNTER_LLC_MISSES] =
+		perf_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	fd[PERF_COUNTER_BRANCH_MISSES] =
+		perf_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+	int available = 0;
+	for (int i = 0; i < perf_counter_MAX; i++) {
+		value[i] = 0;
+		available += fd[i] >= 0;
+	}
+	if (available < perf_counter_MAX)
+		fprintf(stderr, "perf events: %d of %d counters available (%s), "
+			"the rest are not reported\n",
+			available, (int)perf_counter_MAX, strerror(errno));
+}
+
+inline
+perf_counters::~perf_counters()
+{
+	for (int i = 0; i < perf_counter_MAX; i++) {
+		if (fd[i] >= 0)
+			close(fd[i]);
+	}
+}
+
+inline void
+perf_counters::start()
+{
+	for (int i = 0; i < perf_counter_MAX; i++) {
+		if (fd[i] < 0)
+			continue;
+		ioctl(fd[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+inline void
+perf_counters::stop()
+{
+	for (int i = 0; i < perf_counter_MAX; i++) {
+		if (fd[i] < 0)
+			continue;
+		ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+	}
+	for (int i = 0; i < perf_counter_MAX; i++) {
+		value[i] = 0;
+		/* value, time_enabled, time_running. */
+		uint64_t data[3];
+		if (fd[i] < 0 || read(fd[i], data, sizeof(data)) != sizeof(data))
+			continue;
+		/*
+		 * Если счетчиков больше, чем PMU умеет одновременно, ядро их
+		 * мультиплексирует: экстраполируем на все время фазы.
+		 */
+		if (data[2] != 0)
+			value[i] = (double)data[0] * data[1] / data[2];
+	}
+}
+
+#else /* __linux__ */
+
+inline
+perf_counters::perf_counters()
+{
+	for (int i = 0; i < perf_counter_MAX; i++) {
+		fd[i] = -1;
+		value[i] = 0;
+	}
+	fprintf(stderr, "perf events: not supported on this platform\n");
+}
+
+inline perf_counters::~perf_counters() {}
+inline void perf_counters::start() {}
+inline void perf_counters::stop() {}
+
+#endif /* __linux__ */
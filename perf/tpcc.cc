@@ -0,0 +1,408 @@
+/*
+ * TPC-C-lite: new-order, payment и order-status поверх нескольких
+ * спейсов с уникальными вторичными индексами.
+ *
+ *   memtx_tx_tpcc [-w warehouses (1..4)] [-c clients (10 * warehouses)] [-d seconds]
+ *
+ * В отличие от TPC-C все индексы уникальные, а ключи - int, поэтому
+ * составные ключи упакованы в одно число, а "имя" клиента и код товара -
+ * биекции первичного ключа. Спейсы и индексы (поле i - ключ индекса i):
+ *
+ *   warehouse  {w_id, ytd}
+ *   district   {d_key, next_o_id, ytd}
+ *   customer   {c_key, login, phone, email, balance, ytd_payment,
+ *               payment_cnt, order_cnt}                      4 индекса
+ *   item       {i_id, price}
+ *   stock      {s_key, s_code, quantity, ytd, order_cnt}     2 индекса
+ *   orders     {o_key, o_cust, c_key, ol_cnt}                2 индекса
+ *   new_order  {o_key}
+ *   order_line {ol_key, i_id, quantity, amount}
+ *   history    {h_key, h_cust, c_key, amount}                2 индекса
+ *
+ * Вставки в orders и history проходят check_dup по вторичным индексам,
+ * апдейты customer и stock строят цепочки stories во вторичных индексах,
+ * а GC эти цепочки потом собирает. Смесь: 45% new-order, 43% payment,
+ * 12% order-status (delivery и stock-level не реализованы). Как в
+ * TPC-C, 1% new-order заказывает несуществующий товар и откатывается.
+ *
+ * Клиенты - корутины, отдающие управление после каждого стейтмента;
+ * сконфликтовавшая транзакция перезапускается. Выводится tpmC, доля
+ * абортов по типам транзакций и байты метаданных MVCC (см.
+ * memtx_tx_statistics::allocated), выделенные на одну закоммиченную
+ * транзакцию, с учетом неудачных попыток.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <vector>
+
+#include "box.h"
+#include "memtx_tx.h"
+#include "perf_util.h"
+
+enum {
+	WAREHOUSES_MAX = 4,
+	DISTRICTS = 10,
+	CUSTOMERS = 300,
+	ITEMS = 10000,
+	/** Номер заказа в районе - младшие биты o_key. */
+	ORDERS_MAX = 1 << 20,
+	/** Заказов (и платежей) одного клиента - младшие разряды o_cust/h_cust. */
+	CUSTOMER_SEQ_MAX = 100000,
+	ORDER_LINES_MAX = 15,
+};
+
+enum tpcc_txn_type {
+	TPCC_NEW_ORDER,
+	TPCC_PAYMENT,
+	TPCC_ORDER_STATUS,
+	TPCC_TXN_TYPE_MAX,
+};
+
+static const char *txn_type_names[] = {"new_order", "payment", "order_status"};
+
+struct tpcc_stat {
+	uint64_t attempts;
+	uint64_t commits;
+	/** Откаты из-за конфликта. */
+	uint64_t conflicts;
+	/** Откаты по логике транзакции (несуществующий товар). */
+	uint64_t rollbacks;
+	/** Байт метаданных MVCC, выделенных стейтментами этого типа. */
+	uint64_t mvcc_bytes;
+};
+
+struct tpcc {
+	uint32_t warehouse_count;
+	struct memtx_space *warehouse;
+	struct memtx_space *district;
+	struct memtx_space *customer;
+	struct memtx_space *item;
+	struct memtx_space *stock;
+	struct memtx_space *orders;
+	struct memtx_space *new_order;
+	struct memtx_space *order_line;
+	struct memtx_space *history;
+	int next_h_key;
+	double deadline;
+	struct tpcc_stat stats[TPCC_TXN_TYPE_MAX];
+};
+
+/** Биекция на [0, 2^31): умножение на нечетное по модулю 2^31. */
+static int
+scramble(int key, uint32_t multiplier)
+{
+	return (int)(((uint32_t)key * multiplier) & 0x7fffffff);
+}
+
+static int
+district_key(int w, int d)
+{
+	return w * DISTRICTS + d;
+}
+
+static int
+customer_key(int d_key, int c)
+{
+	return d_key * CUSTOMERS + c;
+}
+
+static int
+customer_login(int c_key)
+{
+	return scramble(c_key, 2654435761u);
+}
+
+static perf_tuple
+customer_new(int c_key, int balance, int ytd_payment, int payment_cnt, int order_cnt)
+{
+	return perf_tuple{c_key, customer_login(c_key), scramble(c_key, 40503u),
+			     scramble(c_key, 2246822519u), balance, ytd_payment,
+			     payment_cnt, order_cnt};
+}
+
+static int
+stock_key(int w, int i)
+{
+	return w * ITEMS + i;
+}
+
+static perf_tuple
+stock_new(int s_key, int quantity, int ytd, int order_cnt)
+{
+	return perf_tuple{s_key, scramble(s_key, 3266489917u), quantity, ytd, order_cnt};
+}
+
+static int
+order_key(int d_key, int o_id)
+{
+	return d_key * ORDERS_MAX + o_id;
+}
+
+static int
+random_int(int max)
+{
+	return rand() % max;
+}
+
+static uint64_t
+mvcc_allocated()
+{
+	struct memtx_tx_statistics stats;
+	memtx_tx_statistics_collect(&stats);
+	return stats.allocated;
+}
+
+/**
+ * Шаг транзакции: выполняется, только если предыдущие прошли успешно,
+ * после чего клиент отдает управление. Выделенная под MVCC память
+ * записывается на тип транзакции.
+ */
+#define TPCC_STEP(stat, call) do {					\
+	if (ok) {							\
+		uint64_t allocated = mvcc_allocated();			\
+		ok = (call) == 0;					\
+		(stat)->mvcc_bytes += mvcc_allocated() - allocated;	\
+		co_await std::suspend_always{};				\
+	}								\
+} while (0)
+
+/** Прочитанный тапл должен существовать, иначе транзакция проваливается. */
+#define TPCC_GET(stat, space, index_id, key, result) do {		\
+	TPCC_STEP(stat, perf_get(space, index_id, key, &result));	\
+	ok = ok && result != NULL;					\
+} while (0)
+
+static Task
+client_body(struct tpcc *t)
+{
+	while (perf_now() < t->deadline) {
+		int dice = random_int(100);
+		enum tpcc_txn_type type = dice < 45 ? TPCC_NEW_ORDER :
+					  dice < 88 ? TPCC_PAYMENT :
+					  TPCC_ORDER_STATUS;
+		struct tpcc_stat *stat = &t->stats[type];
+		int w = random_int(t->warehouse_count);
+		int d_key = district_key(w, random_int(DISTRICTS));
+		int c_key = customer_key(d_key, random_int(CUSTOMERS));
+		int line_count = 5 + random_int(ORDER_LINES_MAX - 5 + 1);
+		bool is_invalid = type == TPCC_NEW_ORDER && random_int(100) == 0;
+		bool by_login = random_int(100) < 60;
+		int amount = 1 + random_int(5000);
+		while (true) {
+			struct tuple *wh = NULL, *dist = NULL, *cust = NULL;
+			struct tuple *order = NULL, *ol = NULL;
+			bool ok = true;
+			stat->attempts++;
+			box_txn_begin();
+			switch (type) {
+			case TPCC_NEW_ORDER: {
+				TPCC_GET(stat, t->warehouse, 0, w, wh);
+				TPCC_GET(stat, t->district, 0, d_key, dist);
+				int o_id = ok ? perf_field(dist, 1) : 0;
+				TPCC_STEP(stat, perf_replace(t->district, {d_key, o_id + 1, ok ? perf_field(dist, 2) : 0}));
+				TPCC_GET(stat, t->customer, 0, c_key, cust);
+				int seq = ok ? perf_field(cust, 7) : 0;
+				if (ok)
+					TPCC_STEP(stat, perf_replace(t->customer, customer_new(c_key, perf_field(cust, 4), perf_field(cust, 5), perf_field(cust, 6), seq + 1)));
+				int o_key = order_key(d_key, o_id);
+				TPCC_STEP(stat, perf_insert(t->orders, {o_key, c_key * CUSTOMER_SEQ_MAX + seq, c_key, line_count}));
+				TPCC_STEP(stat, perf_insert(t->new_order, {o_key}));
+				for (int line = 0; line < line_count && ok; line++) {
+					int i = random_int(ITEMS);
+					if (is_invalid && line == line_count - 1)
+						i = ITEMS;
+					struct tuple *it = NULL, *stock = NULL;
+					TPCC_STEP(stat, perf_get(t->item, 0, i, &it));
+					if (ok && it == NULL)
+						break;
+					int s_key = stock_key(w, i);
+					TPCC_GET(stat, t->stock, 0, s_key, stock);
+					int quantity = 1 + random_int(10);
+					if (ok) {
+						int left = perf_field(stock, 2) - quantity;
+						if (left < 10)
+							left += 91;
+						TPCC_STEP(stat, perf_replace(t->stock, stock_new(s_key, left, perf_field(stock, 3) + quantity, perf_field(stock, 4) + 1)));
+					}
+					if (ok)
+						TPCC_STEP(stat, perf_insert(t->order_line, {o_key * 16 + line, i, quantity, quantity * perf_field(it, 1)}));
+				}
+				break;
+			}
+			case TPCC_PAYMENT: {
+				TPCC_GET(stat, t->warehouse, 0, w, wh);
+				if (ok)
+					TPCC_STEP(stat, perf_replace(t->warehouse, {w, perf_field(wh, 1) + amount}));
+				TPCC_GET(stat, t->district, 0, d_key, dist);
+				if (ok)
+					TPCC_STEP(stat, perf_replace(t->district, {d_key, perf_field(dist, 1), perf_field(dist, 2) + amount}));
+				if (by_login)
+					TPCC_GET(stat, t->customer, 1, customer_login(c_key), cust);
+				else
+					TPCC_GET(stat, t->customer, 0, c_key, cust);
+				int seq = ok ? perf_field(cust, 6) : 0;
+				if (ok)
+					TPCC_STEP(stat, perf_replace(t->customer, customer_new(c_key, perf_field(cust, 4) - amount, perf_field(cust, 5) + amount, seq + 1, perf_field(cust, 7))));
+				TPCC_STEP(stat, perf_insert(t->history, {t->next_h_key++, c_key * CUSTOMER_SEQ_MAX + seq, c_key, amount}));
+				break;
+			}
+			case TPCC_ORDER_STATUS:
+			default: {
+				if (by_login)
+					TPCC_GET(stat, t->customer, 1, customer_login(c_key), cust);
+				else
+					TPCC_GET(stat, t->customer, 0, c_key, cust);
+				if (!ok || perf_field(cust, 7) == 0)
+					break;
+				int seq = perf_field(cust, 7) - 1;
+				TPCC_GET(stat, t->orders, 1, c_key * CUSTOMER_SEQ_MAX + seq, order);
+				for (int i = 0; ok && i < perf_field(order, 3); i++)
+					TPCC_GET(stat, t->order_line, 0, perf_field(order, 0) * 16 + i, ol);
+				break;
+			}
+			}
+			struct txn *txn = in_txn();
+			bool is_conflicted = txn_has_flag(txn, TXN_IS_CONFLICTED);
+			if (ok && is_invalid) {
+				/* Несуществующий товар - откат по логике, а не конфликт. */
+				box_txn_rollback();
+				stat->rollbacks++;
+				break;
+			}
+			uint64_t allocated = mvcc_allocated();
+			int rc = ok && !is_conflicted ? box_txn_commit() : -1;
+			stat->mvcc_bytes += mvcc_allocated() - allocated;
+			if (rc == 0) {
+				stat->commits++;
+				break;
+			}
+			if (in_txn() != NULL)
+				box_txn_rollback();
+			stat->conflicts++;
+		}
+	}
+}
+
+static struct memtx_space *
+load(uint32_t index_count, int count, perf_tuple (*make)(int, void *), void *arg)
+{
+	struct memtx_space *space = memtx_space_new(index_count);
+	for (int i = 0; i < count; i += 1000) {
+		box_txn_begin();
+		for (int j = i; j < i + 1000 && j < count; j++)
+			perf_insert(space, make(j, arg));
+		box_txn_commit();
+	}
+	return space;
+}
+
+static void
+tpcc_load(struct tpcc *t)
+{
+	int w_count = t->warehouse_count;
+	t->warehouse = load(1, w_count, [](int w, void *) {
+		return perf_tuple{w, 0};
+	}, NULL);
+	t->district = load(1, w_count * DISTRICTS, [](int d_key, void *) {
+		return perf_tuple{d_key, 0, 0};
+	}, NULL);
+	t->customer = load(4, w_count * DISTRICTS * CUSTOMERS, [](int c_key, void *) {
+		return customer_new(c_key, 0, 0, 0, 0);
+	}, NULL);
+	t->item = load(1, ITEMS, [](int i, void *) {
+		return perf_tuple{i, 1 + i % 100};
+	}, NULL);
+	t->stock = load(2, w_count * ITEMS, [](int s_key, void *) {
+		return stock_new(s_key, 10 + s_key % 91, 0, 0);
+	}, NULL);
+	t->orders = memtx_space_new(2);
+	t->new_order = memtx_space_new(1);
+	t->order_line = memtx_space_new(1);
+	t->history = memtx_space_new(2);
+	memtx_tx_story_gc_idle(TXN_TIMEOUT_INFINITY);
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct tpcc t;
+	t.warehouse_count = 1;
+	/* Как в TPC-C, по умолчанию 10 терминалов на склад. */
+	uint32_t client_count = 0;
+	double duration = 5;
+	int opt;
+	while ((opt = getopt(argc, argv, "w:c:d:")) != -1) {
+		switch (opt) {
+		case 'w':
+			t.warehouse_count = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			client_count = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			duration = strtod(optarg, NULL);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-w warehouses] [-c clients] [-d seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (t.warehouse_count < 1 || t.warehouse_count > WAREHOUSES_MAX) {
+		fprintf(stderr, "Warehouse count must be in 1..%d\n", WAREHOUSES_MAX);
+		return 1;
+	}
+
+	if (client_count == 0)
+		client_count = 10 * t.warehouse_count;
+
+	memtx_tx_manager_init();
+	{
+		perf_fiber loader;
+		loader.enter();
+		tpcc_load(&t);
+	}
+
+	std::vector<Task> tasks;
+	for (uint32_t i = 0; i < client_count; i++)
+		tasks.push_back(client_body(&t));
+	double start = perf_now();
+	t.deadline = start + duration;
+	uint32_t alive = client_count;
+	while (alive > 0) {
+		alive = 0;
+		for (auto &task : tasks) {
+			auto handle = std::coroutine_handle<Task::promise_type>::from_promise(*task.promise);
+			if (handle.done())
+				continue;
+			alive++;
+			current_task = &task;
+			handle.resume();
+			current_task = nullptr;
+		}
+	}
+	double elapsed = perf_now() - start;
+
+	struct memtx_tx_statistics stats;
+	memtx_tx_statistics_collect(&stats);
+	uint64_t commits = 0, mvcc_bytes = 0;
+	printf("warehouses=%u clients=%u seconds=%.1f\n", t.warehouse_count, client_count, elapsed);
+	for (int i = 0; i < TPCC_TXN_TYPE_MAX; i++) {
+		struct tpcc_stat *s = &t.stats[i];
+		commits += s->commits;
+		mvcc_bytes += s->mvcc_bytes;
+		printf("%-13s commits=%-8llu abort_rate=%.4f rollbacks=%-6llu mvcc_bytes/commit=%.0f\n",
+		       txn_type_names[i], (unsigned long long)s->commits,
+		       s->attempts == 0 ? 0 : (double)s->conflicts / s->attempts,
+		       (unsigned long long)s->rollbacks,
+		       s->commits == 0 ? 0 : (double)s->mvcc_bytes / s->commits);
+	}
+	printf("tpmC=%.0f txn/s=%.0f mvcc_bytes/commit=%.0f mvcc_bytes_live=%zu\n",
+	       t.stats[TPCC_NEW_ORDER].commits * 60 / elapsed, commits / elapsed,
+	       commits == 0 ? 0 : (double)mvcc_bytes / commits, stats.total);
+
+	for (auto &task : tasks)
+		std::coroutine_handle<Task::promise_type>::from_promise(*task.promise).destroy();
+	memtx_tx_manager_free();
+	return 0;
+}
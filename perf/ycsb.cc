@@ -0,0 +1,425 @@
+/*
+ * YCSB-подобная нагрузка поверх box API.
+ *
+ *   memtx_tx_ycsb [-w A..F] [-d uniform|zipfian|latest] [-c clients]
+ *                 [-t ops per txn] [-r txn/s] [-n records] [-o txns]
+ *
+ * Без -w прогоняются все смеси A-F. Смеси как в YCSB:
+ *   A - 50% read, 50% update;       B - 95% read, 5% update;
+ *   C - 100% read;                  D - 95% read latest, 5% insert;
+ *   E - 95% scan, 5% insert;        F - 50% read, 50% read-modify-write.
+ * Индекс здесь хешовый, поэтому scan - это чтение подряд идущих ключей
+ * точечными get'ами (1..SCAN_LENGTH_MAX штук).
+ *
+ * Нагрузка open-loop: транзакции приходят пуассоновским потоком с
+ * интенсивностью -r независимо от того, успевают ли клиенты, а задержка
+ * считается от запланированного момента прихода. Иначе (closed-loop)
+ * медленная транзакция задерживает и следующие, которые в замер не
+ * попадают (coordinated omission). -r 0 - closed-loop, для оценки
+ * предельной пропускной способности.
+ *
+ * Клиенты - корутины, отдающие управление после каждой операции, так что
+ * транзакции пересекаются. Сконфликтовавшая транзакция сразу
+ * перезапускается, её задержка включает все попытки.
+ */
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <vector>
+
+#include "box.h"
+#include "memtx_tx.h"
+#include "tx_profile.h"
+#include "perf_util.h"
+
+enum {
+	SCAN_LENGTH_MAX = 100,
+};
+
+enum ycsb_op {
+	YCSB_READ,
+	YCSB_UPDATE,
+	YCSB_INSERT,
+	YCSB_SCAN,
+	YCSB_READ_MODIFY_WRITE,
+	YCSB_OP_MAX,
+};
+
+enum ycsb_distribution {
+	YCSB_UNIFORM,
+	YCSB_ZIPFIAN,
+	YCSB_LATEST,
+};
+
+static const char *distribution_names[] = {"uniform", "zipfian", "latest"};
+
+struct ycsb_workload {
+	char name;
+	/** Доли операций в процентах, в сумме 100. */
+	int mix[YCSB_OP_MAX];
+	/** Распределение, которым выбираются ключи по умолчанию. */
+	enum ycsb_distribution distribution;
+};
+
+static const struct ycsb_workload workloads[] = {
+	{'A', {50, 50, 0, 0, 0}, YCSB_ZIPFIAN},
+	{'B', {95, 5, 0, 0, 0}, YCSB_ZIPFIAN},
+	{'C', {100, 0, 0, 0, 0}, YCSB_ZIPFIAN},
+	{'D', {95, 0, 5, 0, 0}, YCSB_LATEST},
+	{'E', {0, 0, 5, 95, 0}, YCSB_ZIPFIAN},
+	{'F', {50, 0, 0, 0, 50}, YCSB_ZIPFIAN},
+};
+
+/** xorshift64*: быстрее и проще std::mt19937 и вполне достаточен. */
+static uint64_t
+random_u64()
+{
+	static uint64_t state = 0x9e3779b97f4a7c15ull;
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545f4914f6cdd1dull;
+}
+
+/** Равномерно из [0, 1). */
+static double
+random_double()
+{
+	return (random_u64() >> 11) * (1.0 / (1ull << 53));
+}
+
+/**
+ * Генератор Zipf (Gray et al., "Quickly generating billion-record
+ * synthetic databases"), как в YCSB. Ранг 0 - самый популярный.
+ */
+struct zipfian {
+	uint64_t items;
+	double theta;
+	double alpha;
+	double zetan;
+	double eta;
+};
+
+static double
+zeta(uint64_t n, double theta)
+{
+	double sum = 0;
+	for (uint64_t i = 1; i <= n; i++)
+		sum += 1 / pow(i, theta);
+	return sum;
+}
+
+static void
+zipfian_create(struct zipfian *z, uint64_t items, double theta)
+{
+	z->items = items;
+	z->theta = theta;
+	z->alpha = 1 / (1 - theta);
+	z->zetan = zeta(items, theta);
+	double zeta2 = zeta(2, theta);
+	z->eta = (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+static uint64_t
+zipfian_next(const struct zipfian *z)
+{
+	double u = random_double();
+	double uz = u * z->zetan;
+	if (uz < 1)
+		return 0;
+	if (uz < 1 + pow(0.5, z->theta))
+		return 1;
+	uint64_t rank = z->items * pow(z->eta * u - z->eta + 1, z->alpha);
+	return rank < z->items ? rank : z->items - 1;
+}
+
+/** Раскидать популярные ранги по всему пространству ключей (FNV-1a). */
+static uint64_t
+scramble(uint64_t rank)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (int i = 0; i < 8; i++) {
+		hash ^= (rank >> (i * 8)) & 0xff;
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+struct ycsb_config {
+	const struct ycsb_workload *workload;
+	enum ycsb_distribution distribution;
+	uint32_t client_count;
+	uint32_t txn_size;
+	/** Интенсивность прихода транзакций в секунду, 0 - closed-loop. */
+	double rate;
+	uint64_t record_count;
+	uint64_t txn_count;
+};
+
+struct ycsb_driver {
+	const struct ycsb_config *config;
+	struct memtx_space *space;
+	struct zipfian zipfian;
+	/** Ключ следующей вставки; все ключи меньше него уже вставлены. */
+	uint64_t insert_key;
+	/** Запланированный момент прихода следующей транзакции. */
+	double next_arrival;
+	uint64_t issued;
+	uint64_t commits;
+	uint64_t aborts;
+	/** Сколько клиентов остановилось на ошибке, отличной от конфликта. */
+	uint64_t errors;
+	uint64_t ops;
+	/** Задержки транзакций в наносекундах. */
+	struct tx_profile_histogram latency;
+};
+
+static int
+ycsb_next_key(struct ycsb_driver *d)
+{
+	switch (d->config->distribution) {
+	case YCSB_UNIFORM:
+		return random_u64() % d->insert_key;
+	case YCSB_ZIPFIAN:
+		return scramble(zipfian_next(&d->zipfian)) % d->insert_key;
+	case YCSB_LATEST:
+	default:
+		return d->insert_key - 1 - zipfian_next(&d->zipfian) % d->insert_key;
+	}
+}
+
+static enum ycsb_op
+ycsb_next_op(struct ycsb_driver *d)
+{
+	int dice = random_u64() % 100;
+	for (int op = 0; op < YCSB_OP_MAX; op++) {
+		dice -= d->config->workload->mix[op];
+		if (dice < 0)
+			return (enum ycsb_op)op;
+	}
+	return YCSB_READ;
+}
+
+/** Выполнить одну операцию в текущей транзакции. */
+static int
+ycsb_execute(struct ycsb_driver *d, enum ycsb_op op)
+{
+	struct tuple *result;
+	int key;
+	switch (op) {
+	case YCSB_READ:
+		return perf_get(d->space, 0, ycsb_next_key(d), &result);
+	case YCSB_UPDATE:
+		key = ycsb_next_key(d);
+		return perf_replace(d->space, {key, (int)random_u64()});
+	case YCSB_INSERT:
+		key = d->insert_key++;
+		return perf_insert(d->space, {key, 0});
+	case YCSB_SCAN: {
+		key = ycsb_next_key(d);
+		int length = 1 + random_u64() % SCAN_LENGTH_MAX;
+		for (int i = 0; i < length; i++) {
+			if (perf_get(d->space, 0, key + i, &result) != 0)
+				return -1;
+		}
+		return 0;
+	}
+	case YCSB_READ_MODIFY_WRITE:
+	default:
+		key = ycsb_next_key(d);
+		if (perf_get(d->space, 0, key, &result) != 0)
+			return -1;
+		return perf_replace(d->space, {key, result == NULL ? 0 : perf_field(result, 1) + 1});
+	}
+}
+
+/** Экспоненциальный интервал до следующего прихода. */
+static double
+ycsb_interarrival(double rate)
+{
+	if (rate == 0)
+		return 0;
+	return -log(1 - random_double()) / rate;
+}
+
+static Task
+client_body(struct ycsb_driver *d)
+{
+	const struct ycsb_config *config = d->config;
+	while (true) {
+		while (d->issued < config->txn_count && perf_now() < d->next_arrival)
+			co_await std::suspend_always{};
+		if (d->issued >= config->txn_count)
+			co_return;
+		/* В closed-loop транзакция "приходит", когда клиент освободился. */
+		double arrival = config->rate == 0 ? perf_now() : d->next_arrival;
+		d->issued++;
+		d->next_arrival = arrival + ycsb_interarrival(config->rate);
+
+		int rc;
+		while (true) {
+			box_txn_begin();
+			rc = 0;
+			for (uint32_t i = 0; i < config->txn_size && rc == 0; i++) {
+				rc = ycsb_execute(d, ycsb_next_op(d));
+				d->ops++;
+				co_await std::suspend_always{};
+			}
+			struct txn *txn = in_txn();
+			bool is_conflicted = txn_has_flag(txn, TXN_IS_CONFLICTED);
+			/*
+			 * Конфликт, который случится до коммита, выставит флаг,
+			 * поэтому ошибка самого коммита - уже не конфликт.
+			 */
+			if (rc == 0 && !is_conflicted) {
+				rc = box_txn_commit();
+				break;
+			}
+			box_txn_rollback();
+			if (!is_conflicted)
+				break;
+			d->aborts++;
+		}
+		if (rc != 0) {
+			/* Перезапускаются только конфликты, на ошибке клиент встает. */
+			fprintf(stderr, "\n");
+			d->errors++;
+			co_return;
+		}
+		d->commits++;
+		tx_profile_histogram_add(&d->latency, (perf_now() - arrival) * 1e9);
+	}
+}
+
+static void
+load(struct ycsb_driver *d)
+{
+	perf_fiber loader;
+	loader.enter();
+	for (uint64_t i = 0; i < d->config->record_count; i++) {
+		box_txn_begin();
+		perf_insert(d->space, {(int)i, 0});
+		box_txn_commit();
+	}
+	d->insert_key = d->config->record_count;
+	memtx_tx_story_gc_idle(TXN_TIMEOUT_INFINITY);
+}
+
+static void
+run(const struct ycsb_config *config)
+{
+	static struct ycsb_driver d;
+	memset(&d, 0, sizeof(d));
+	d.config = config;
+	d.space = memtx_space_new(1);
+	zipfian_create(&d.zipfian, config->record_count, 0.99);
+	load(&d);
+
+	std::vector<Task> tasks;
+	for (uint32_t i = 0; i < config->client_count; i++)
+		tasks.push_back(client_body(&d));
+	double start = perf_now();
+	d.next_arrival = start;
+	uint32_t alive = config->client_count;
+	while (alive > 0) {
+		alive = 0;
+		for (auto &task : tasks) {
+			auto handle = std::coroutine_handle<Task::promise_type>::from_promise(*task.promise);
+			if (handle.done())
+				continue;
+			alive++;
+			current_task = &task;
+			handle.resume();
+			current_task = nullptr;
+		}
+	}
+	double elapsed = perf_now() - start;
+
+	printf("workload=%c dist=%s clients=%u txn_size=%u rate=%.0f "
+	       "txn/s=%.0f ops/s=%.0f abort_rate=%.4f errors=%llu "
+	       "p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+	       config->workload->name, distribution_names[config->distribution],
+	       config->client_count, config->txn_size, config->rate,
+	       d.commits / elapsed, d.ops / elapsed,
+	       (double)d.aborts / (d.commits + d.aborts),
+	       (unsigned long long)d.errors,
+	       tx_profile_histogram_quantile(&d.latency, 0.5) / 1e3,
+	       tx_profile_histogram_quantile(&d.latency, 0.99) / 1e3,
+	       tx_profile_histogram_quantile(&d.latency, 0.999) / 1e3,
+	       d.latency.max / 1e3);
+	for (auto &task : tasks)
+		std::coroutine_handle<Task::promise_type>::from_promise(*task.promise).destroy();
+}
+
+int
+main(int argc, char **argv)
+{
+	struct ycsb_config config;
+	config.workload = NULL;
+	config.client_count = 16;
+	config.txn_size = 1;
+	config.rate = 100000;
+	config.record_count = 100000;
+	config.txn_count = 100000;
+	int distribution = -1;
+	int opt;
+	while ((opt = getopt(argc, argv, "w:d:c:t:r:n:o:")) != -1) {
+		switch (opt) {
+		case 'w':
+			for (auto &w : workloads) {
+				if (w.name == optarg[0])
+					config.workload = &w;
+			}
+			if (config.workload == NULL) {
+				fprintf(stderr, "Unknown workload %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'd':
+			for (int i = 0; i <= YCSB_LATEST; i++) {
+				if (strcmp(optarg, distribution_names[i]) == 0)
+					distribution = i;
+			}
+			if (distribution < 0) {
+				fprintf(stderr, "Unknown distribution %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'c':
+			config.client_count = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			config.txn_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			config.rate = strtod(optarg, NULL);
+			break;
+		case 'n':
+			config.record_count = strtoull(optarg, NULL, 10);
+			break;
+		case 'o':
+			config.txn_count = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-w A..F] [-d uniform|zipfian|latest] "
+				"[-c clients] [-t ops per txn] [-r txn/s] [-n records] [-o txns]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	memtx_tx_manager_init();
+	for (auto &w : workloads) {
+		if (config.workload != NULL && config.workload != &w)
+			continue;
+		struct ycsb_config c = config;
+		c.workload = &w;
+		c.distribution = distribution < 0 ? w.distribution :
+				 (enum ycsb_distribution)distribution;
+		run(&c);
+	}
+	memtx_tx_manager_free();
+	return 0;
+}
@@ -3,7 +3,12 @@
 #include "memtx_engine.h"
 #include "memtx_space.h"
 #include "index.h"
+#include "memtx_tx.h"
 #include "txn.h"
+#include "tuple_update.h"
+#include "clock.h"
+#include "stdlib.h"
+#include "time.h"
 
 int
 box_txn_begin(void)
@@ -41,45 +46,559 @@ box_txn_rollback(void)
 }
 
 int
-box_insert(struct memtx_space *space, struct tuple *new_tuple)
+box_txn_set_timeout(double timeout)
+{
+	if (timeout <= 0) {
+		fprintf(stderr, "Timeout must be a number greater than 0");
+		return -1;
+	}
+	struct txn *txn = in_txn();
+	if (txn == NULL) {
+		fprintf(stderr, "Operation is not permitted when there is no active transaction");
+		return -1;
+	}
+	if (txn->status == TXN_ABORTED) {
+		fprintf(stderr, "%s", txn_flags_to_error_message(txn));
+		return -1;
+	}
+	txn_set_timeout(txn, timeout);
+	return 0;
+}
+
+int
+box_txn_set_default_timeout(double timeout)
+{
+	if (timeout <= 0) {
+		fprintf(stderr, "Timeout must be a number greater than 0");
+		return -1;
+	}
+	txn_timeout_default = timeout;
+	return 0;
+}
+
+void
+box_idle(double budget)
+{
+	double deadline = clock_monotonic() + budget;
+	txn_process_timeouts();
+	/* Построениям не больше половины: GC освобождает память, которую они занимают. */
+	memtx_space_build_index_idle(budget / 2);
+	memtx_tx_story_gc_idle(MAX(deadline - clock_monotonic(), 0.0));
+}
+
+void
+box_txn_run_opts_create(struct box_txn_run_opts *opts)
+{
+	opts->max_retries = 10;
+	opts->backoff_base = 0.0001;
+	opts->backoff_max = 0.05;
+	opts->sleep = NULL;
+}
+
+double
+box_txn_backoff(const struct box_txn_run_opts *opts, uint32_t attempt)
+{
+	double cap = opts->backoff_base;
+	for (uint32_t i = 0; i < attempt && cap < opts->backoff_max; i++)
+		cap *= 2;
+	if (cap > opts->backoff_max)
+		cap = opts->backoff_max;
+	return cap * ((double)rand() / RAND_MAX);
+}
+
+static void
+box_txn_sleep(double delay)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)delay;
+	ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+	nanosleep(&ts, NULL);
+}
+
+int
+box_txn_run(box_txn_fn fn, void *arg, const struct box_txn_run_opts *opts)
+{
+	struct box_txn_run_opts default_opts;
+	if (opts == NULL) {
+		box_txn_run_opts_create(&default_opts);
+		opts = &default_opts;
+	}
+	for (uint32_t attempt = 0; ; attempt++) {
+		if (box_txn_begin() != 0)
+			return -1;
+		int rc = fn(arg);
+		struct txn *txn = in_txn();
+		/* Тело само завершило транзакцию. */
+		if (txn == NULL)
+			return rc;
+		bool is_conflicted = txn_has_flag(txn, TXN_IS_CONFLICTED);
+		if (rc == 0 && !is_conflicted)
+			return box_txn_commit();
+		box_txn_rollback();
+		if (!is_conflicted)
+			return -1;
+		if (attempt >= opts->max_retries) {
+			fprintf(stderr, "Transaction has been aborted by conflict %u times", attempt + 1);
+			return -1;
+		}
+		double delay = box_txn_backoff(opts, attempt);
+		if (opts->sleep != NULL)
+			opts->sleep(delay);
+		else
+			box_txn_sleep(delay);
+	}
+}
+
+void
+box_tuple_ref(struct tuple *tuple)
+{
+	tuple_ref(tuple);
+}
+
+void
+box_tuple_unref(struct tuple *tuple)
+{
+	tuple_unref(tuple);
+}
+
+struct memtx_space *
+box_ephemeral_space_new(const key_def *key_defs, uint32_t index_count)
+{
+	struct txn *txn = in_txn();
+	if (txn == NULL) {
+		fprintf(stderr, "Operation is not permitted when there is no active transaction");
+		return NULL;
+	}
+	return memtx_space_new_ephemeral(txn, key_defs, index_count);
+}
+
+/** Ephemeral спейс доступен только транзакции, которая его создала. */
+static int
+box_check_ephemeral_owner(struct memtx_space *space)
+{
+	if (space->is_ephemeral && space->txn != in_txn()) {
+		fprintf(stderr, "Ephemeral space %u is not accessible outside of its transaction", space->id);
+		return -1;
+	}
+	return 0;
+}
+
+int
+box_ephemeral_space_delete(struct memtx_space *space)
+{
+	if (!space->is_ephemeral) {
+		fprintf(stderr, "Space %u is not ephemeral", space->id);
+		return -1;
+	}
+	if (box_check_ephemeral_owner(space) != 0)
+		return -1;
+	memtx_space_delete_ephemeral(space);
+	return 0;
+}
+
+/**
+ * Запись в ephemeral спейс идет мимо стейтментов: транзакция не
+ * становится пишущей, а откатывать изменения не нужно, спейс умрет
+ * вместе с ней.
+ */
+static int
+box_ephemeral_check_write(struct memtx_space *space)
+{
+	if (box_check_ephemeral_owner(space) != 0)
+		return -1;
+	return txn_check_can_continue(space->txn);
+}
+
+static int
+box_ephemeral_replace(struct memtx_space *space, const char *tuple_data, const char *tuple_end, enum dup_replace_mode mode)
+{
+	if (box_ephemeral_check_write(space) != 0)
+		return -1;
+	struct tuple *new_tuple = tuple_new(space->format, tuple_data, tuple_end);
+	if (new_tuple == NULL)
+		return -1;
+	/* Если замена не удастся, тапл уйдет в мусор вместе с этой ссылкой. */
+	tuple_ref(new_tuple);
+	int rc = memtx_space_ephemeral_replace(space, NULL, new_tuple, mode);
+	tuple_unref(new_tuple);
+	return rc;
+}
+
+static int
+box_ephemeral_upsert(struct memtx_space *space, const char *tuple_data, const char *tuple_end, const char *ops, const char *ops_end)
+{
+	if (box_ephemeral_check_write(space) != 0)
+		return -1;
+	struct tuple *new_tuple = tuple_new(space->format, tuple_data, tuple_end);
+	if (new_tuple == NULL)
+		return -1;
+	tuple_ref(new_tuple);
+	int rc = memtx_space_ephemeral_upsert(space, new_tuple, ops, ops_end);
+	tuple_unref(new_tuple);
+	return rc;
+}
+
+int
+box_get(struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end, struct tuple **result)
+{
+	struct txn *txn = in_txn();
+	if (box_check_ephemeral_owner(space) != 0)
+		return -1;
+	if (index_id >= space->index_count) {
+		fprintf(stderr, "No index #%u is defined in space %u", index_id, space->id);
+		return -1;
+	}
+	key = key_validate(&space->index[index_id]->_key_def, key, key_end);
+	if (key == NULL)
+		return -1;
+	if (!space->index[index_id]->_key_def.is_unique) {
+		fprintf(stderr, "Get() doesn't support partial keys and non-unique indexes");
+		return -1;
+	}
+	if (txn != NULL && txn_check_can_continue(txn) != 0)
+		return -1;
+	if (txn_flush_deltas(txn, space) != 0)
+		return -1;
+	return memtx_space_get(space, txn, index_id, key, result);
+}
+
+int
+box_select(struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end, struct tuple **result, uint32_t limit, uint32_t *count)
+{
+	struct txn *txn = in_txn();
+	if (box_check_ephemeral_owner(space) != 0)
+		return -1;
+	if (index_id >= space->index_count) {
+		fprintf(stderr, "No index #%u is defined in space %u", index_id, space->id);
+		return -1;
+	}
+	key = key_validate(&space->index[index_id]->_key_def, key, key_end);
+	if (key == NULL)
+		return -1;
+	if (txn != NULL && txn_check_can_continue(txn) != 0)
+		return -1;
+	if (txn_flush_deltas(txn, space) != 0)
+		return -1;
+	*count = memtx_space_select(space, txn, index_id, key, result, limit);
+	return 0;
+}
+
+int
+box_index_count(struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end, size_t *count)
+{
+	struct txn *txn = in_txn();
+	if (box_check_ephemeral_owner(space) != 0)
+		return -1;
+	if (index_id >= space->index_count) {
+		fprintf(stderr, "No index #%u is defined in space %u", index_id, space->id);
+		return -1;
+	}
+	if (key != NULL) {
+		key = key_validate(&space->index[index_id]->_key_def, key, key_end);
+		if (key == NULL)
+			return -1;
+	}
+	if (txn != NULL && txn_check_can_continue(txn) != 0)
+		return -1;
+	if (txn_flush_deltas(txn, space) != 0)
+		return -1;
+	if (key == NULL) {
+		*count = memtx_space_count(space, txn, index_id);
+		return 0;
+	}
+	*count = memtx_space_select(space, txn, index_id, key, NULL, UINT32_MAX);
+	return 0;
+}
+
+/**
+ * Проверить индекс перед чтением по порядку ключей: min, max и отрезки
+ * ключей есть только у неуникальных индексов, уникальные - хеш таблицы.
+ */
+static int
+box_check_ordered_index(struct memtx_space *space, uint32_t index_id, const char *what)
+{
+	if (box_check_ephemeral_owner(space) != 0)
+		return -1;
+	if (index_id >= space->index_count) {
+		fprintf(stderr, "No index #%u is defined in space %u", index_id, space->id);
+		return -1;
+	}
+	if (space->index[index_id]->_key_def.is_unique) {
+		fprintf(stderr, "Index #%u of space %u is unordered and does not support %s",
+			index_id, space->id, what);
+		return -1;
+	}
+	return 0;
+}
+
+int
+box_index_count_range(struct memtx_space *space, uint32_t index_id, const char *from, const char *from_end, const char *to, const char *to_end, size_t *count)
+{
+	struct txn *txn = in_txn();
+	if (box_check_ordered_index(space, index_id, "count by range") != 0)
+		return -1;
+	key_def *def = &space->index[index_id]->_key_def;
+	if (from != NULL && (from = key_validate(def, from, from_end)) == NULL)
+		return -1;
+	if (to != NULL && (to = key_validate(def, to, to_end)) == NULL)
+		return -1;
+	if (txn != NULL && txn_check_can_continue(txn) != 0)
+		return -1;
+	if (txn_flush_deltas(txn, space) != 0)
+		return -1;
+	*count = memtx_space_count_range(space, txn, index_id, from, to);
+	return 0;
+}
+
+int
+box_index_min(struct memtx_space *space, uint32_t index_id, struct tuple **result)
+{
+	struct txn *txn = in_txn();
+	if (box_check_ordered_index(space, index_id, "min()") != 0)
+		return -1;
+	if (txn != NULL && txn_check_can_continue(txn) != 0)
+		return -1;
+	if (txn_flush_deltas(txn, space) != 0)
+		return -1;
+	*result = memtx_space_min_max(space, txn, index_id, false);
+	return 0;
+}
+
+int
+box_index_max(struct memtx_space *space, uint32_t index_id, struct tuple **result)
+{
+	struct txn *txn = in_txn();
+	if (box_check_ordered_index(space, index_id, "max()") != 0)
+		return -1;
+	if (txn != NULL && txn_check_can_continue(txn) != 0)
+		return -1;
+	if (txn_flush_deltas(txn, space) != 0)
+		return -1;
+	*result = memtx_space_min_max(space, txn, index_id, true);
+	return 0;
+}
+
+int
+box_insert(struct memtx_space *space, const char *tuple_data, const char *tuple_end)
 {
 	struct tuple *tuple = NULL;
 	struct txn *txn = in_txn();
     if (txn == NULL)
         return -1;
-	if (txn_begin_stmt(txn, space) != 0)
-        return -1;
-	if (memtx_space_execute_replace(space, txn, new_tuple, DUP_INSERT, &tuple) != 0) {
+	if (space->is_ephemeral)
+		return box_ephemeral_replace(space, tuple_data, tuple_end, DUP_INSERT);
+	struct tuple *new_tuple = tuple_new(space->format, tuple_data, tuple_end);
+	if (new_tuple == NULL)
+		return -1;
+	if (txn_flush_deltas(txn, space) != 0 || txn_begin_stmt(txn, space) != 0) {
+		tuple_delete(new_tuple);
+		return -1;
+	}
+	/* Если стейтмент не удастся, тапл уйдет в мусор вместе с этой ссылкой. */
+	tuple_ref(new_tuple);
+	int rc = memtx_space_execute_replace(space, txn, new_tuple, DUP_INSERT, &tuple);
+	if (rc != 0)
 		txn_rollback_stmt(txn);
+	tuple_unref(new_tuple);
+	return rc;
+}
+
+/** box_insert_batch в пустой спейс, который никто не видит. */
+static int
+box_insert_batch_load(struct memtx_space *space, const struct box_tuple_data *tuples, uint32_t count)
+{
+	if (memtx_tx_check_load() != 0)
 		return -1;
+	struct tuple **loaded = xmalloc(count * sizeof(*loaded));
+	int rc = 0;
+	uint32_t created = 0;
+	for (; created < count; created++) {
+		loaded[created] = tuple_new(space->format, tuples[created].data, tuples[created].data_end);
+		if (loaded[created] == NULL) {
+			rc = -1;
+			break;
+		}
+		/* Если загрузка не удастся, таплы уйдут в мусор вместе с этой ссылкой. */
+		tuple_ref(loaded[created]);
 	}
-    return 0;
+	if (rc == 0)
+		rc = memtx_space_load(space, loaded, count);
+	for (uint32_t i = 0; i < created; i++)
+		tuple_unref(loaded[i]);
+	free(loaded);
+	return rc;
 }
 
 int
-box_replace(struct memtx_space *space, struct tuple *new_tuple)
+box_insert_batch(struct memtx_space *space, const struct box_tuple_data *tuples, uint32_t count)
+{
+	if (count == 0)
+		return 0;
+	if (box_check_ephemeral_owner(space) != 0)
+		return -1;
+	struct txn *txn = in_txn();
+	if (txn == NULL && memtx_tx_space_is_unobserved(space))
+		return box_insert_batch_load(space, tuples, count);
+	bool own_txn = txn == NULL;
+	if (own_txn && box_txn_begin() != 0)
+		return -1;
+	for (uint32_t i = 0; i < count; i++) {
+		if (box_insert(space, tuples[i].data, tuples[i].data_end) != 0) {
+			if (own_txn)
+				box_txn_rollback();
+			return -1;
+		}
+	}
+	return own_txn ? box_txn_commit() : 0;
+}
+
+int
+box_replace(struct memtx_space *space, const char *tuple_data, const char *tuple_end)
 {
 	struct tuple *tuple = NULL;
 	struct txn *txn = in_txn();
     if (txn == NULL)
         return -1;
-	if (txn_begin_stmt(txn, space) != 0)
-        return -1;
-	if (memtx_space_execute_replace(space, txn, new_tuple, DUP_REPLACE_OR_INSERT, &tuple) != 0) {
+	if (space->is_ephemeral)
+		return box_ephemeral_replace(space, tuple_data, tuple_end, DUP_REPLACE_OR_INSERT);
+	struct tuple *new_tuple = tuple_new(space->format, tuple_data, tuple_end);
+	if (new_tuple == NULL)
+		return -1;
+	if (txn_flush_deltas(txn, space) != 0 || txn_begin_stmt(txn, space) != 0) {
+		tuple_delete(new_tuple);
+		return -1;
+	}
+	/* Если стейтмент не удастся, тапл уйдет в мусор вместе с этой ссылкой. */
+	tuple_ref(new_tuple);
+	int rc = memtx_space_execute_replace(space, txn, new_tuple, DUP_REPLACE_OR_INSERT, &tuple);
+	if (rc != 0)
+		txn_rollback_stmt(txn);
+	tuple_unref(new_tuple);
+	return rc;
+}
+
+int
+box_update(struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end, const char *ops, const char *ops_end)
+{
+	struct tuple *tuple = NULL;
+	struct txn *txn = in_txn();
+	if (txn == NULL)
+		return -1;
+	if (index_id >= space->index_count) {
+		fprintf(stderr, "No index #%u is defined in space %u", index_id, space->id);
+		return -1;
+	}
+	key = key_validate(&space->index[index_id]->_key_def, key, key_end);
+	if (key == NULL)
+		return -1;
+	if (!space->index[index_id]->_key_def.is_unique) {
+		fprintf(stderr, "Update() doesn't support partial keys and non-unique indexes");
+		return -1;
+	}
+	if (tuple_update_check_ops(ops, ops_end) != 0)
+		return -1;
+	if (space->is_ephemeral) {
+		if (box_ephemeral_check_write(space) != 0)
+			return -1;
+		return memtx_space_ephemeral_update(space, index_id, key, ops, ops_end);
+	}
+	if (txn_flush_deltas(txn, space) != 0 || txn_begin_stmt(txn, space) != 0)
+		return -1;
+	if (memtx_space_execute_update(space, txn, index_id, key, ops, ops_end, &tuple) != 0) {
 		txn_rollback_stmt(txn);
 		return -1;
 	}
-    return 0;
+	return 0;
+}
+
+int
+box_upsert(struct memtx_space *space, const char *tuple_data, const char *tuple_end, const char *ops, const char *ops_end)
+{
+	struct txn *txn = in_txn();
+	if (txn == NULL)
+		return -1;
+	if (tuple_update_check_ops(ops, ops_end) != 0)
+		return -1;
+	if (space->is_ephemeral)
+		return box_ephemeral_upsert(space, tuple_data, tuple_end, ops, ops_end);
+	struct tuple *new_tuple = tuple_new(space->format, tuple_data, tuple_end);
+	if (new_tuple == NULL)
+		return -1;
+	if (txn_flush_deltas(txn, space) != 0) {
+		tuple_delete(new_tuple);
+		return -1;
+	}
+	/* Если стейтмент не удастся, тапл уйдет в мусор вместе с этой ссылкой. */
+	tuple_ref(new_tuple);
+	bool is_blind;
+	int rc = memtx_space_upsert_is_blind(space, txn, new_tuple, &is_blind);
+	if (rc == 0 && is_blind) {
+		/*
+		 * Ключа нет: upsert ничего не читает, поэтому откладывается до
+		 * prepare, как box_update_delta, и не трекает отсутствие ключа.
+		 */
+		rc = txn_add_upsert(txn, space, new_tuple, ops, ops_end);
+	} else if (rc == 0 && (rc = txn_begin_stmt(txn, space)) == 0) {
+		rc = memtx_space_execute_upsert(space, txn, new_tuple, ops, ops_end, true);
+		if (rc != 0)
+			txn_rollback_stmt(txn);
+	}
+	tuple_unref(new_tuple);
+	return rc;
 }
 
 int
-box_delete(struct memtx_space *space, uint32_t index_id, int key)
+box_update_delta(struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end, const char *ops, const char *ops_end)
+{
+	struct txn *txn = in_txn();
+	if (txn == NULL)
+		return -1;
+	if (index_id >= space->index_count) {
+		fprintf(stderr, "No index #%u is defined in space %u", index_id, space->id);
+		return -1;
+	}
+	const char *key_value = key_validate(&space->index[index_id]->_key_def, key, key_end);
+	if (key_value == NULL)
+		return -1;
+	if (!space->index[index_id]->_key_def.is_unique) {
+		fprintf(stderr, "UpdateDelta() doesn't support partial keys and non-unique indexes");
+		return -1;
+	}
+	if (tuple_update_check_delta_ops(ops, ops_end) != 0)
+		return -1;
+	if (space->is_ephemeral) {
+		/* Спейс не видит никто, кроме транзакции: откладывать незачем. */
+		if (box_ephemeral_check_write(space) != 0)
+			return -1;
+		return memtx_space_ephemeral_update(space, index_id, key_value, ops, ops_end);
+	}
+	return txn_add_delta(txn, space, index_id, key_value, key_end, ops, ops_end);
+}
+
+int
+box_delete(struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end)
 {
 	struct tuple *tuple = NULL;
 	struct txn *txn = in_txn();
     if (txn == NULL)
         return -1;
-	if (txn_begin_stmt(txn, space) != 0)
+	if (index_id >= space->index_count) {
+		fprintf(stderr, "No index #%u is defined in space %u", index_id, space->id);
+		return -1;
+	}
+	key = key_validate(&space->index[index_id]->_key_def, key, key_end);
+	if (key == NULL)
+		return -1;
+	if (!space->index[index_id]->_key_def.is_unique) {
+		fprintf(stderr, "Delete() doesn't support partial keys and non-unique indexes");
+		return -1;
+	}
+	if (space->is_ephemeral) {
+		if (box_ephemeral_check_write(space) != 0)
+			return -1;
+		return memtx_space_ephemeral_delete(space, index_id, key);
+	}
+	if (txn_flush_deltas(txn, space) != 0 || txn_begin_stmt(txn, space) != 0)
         return -1;
 	if (memtx_space_execute_delete(space, txn, index_id, key, &tuple) != 0) {
 		txn_rollback_stmt(txn);
@@ -87,3 +606,84 @@ box_delete(struct memtx_space *space, uint32_t index_id, int key)
 	}
     return 0;
 }
+
+struct box_export_ctx {
+	struct txn *txn;
+	struct index *pk;
+	struct column *columns;
+	uint32_t column_count;
+};
+
+static int
+box_export_tuple(struct index_entry entry, void *arg)
+{
+	struct box_export_ctx *ctx = arg;
+	struct tuple *tuple = memtx_tx_tuple_clarify_untracked(ctx->txn, entry.tuple, ctx->pk, entry.mk_index);
+	if (tuple == NULL)
+		return 0;
+	for (uint32_t i = 0; i < ctx->column_count; i++) {
+		struct column *column = &ctx->columns[i];
+		if (column_append(column, tuple_field(tuple, column->fieldno)) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+int
+box_space_export_columns(struct memtx_space *space, struct column *columns, uint32_t column_count, int64_t *rv_psn)
+{
+	if (box_check_ephemeral_owner(space) != 0)
+		return -1;
+	struct txn *txn = in_txn();
+	int64_t psn = txn_next_psn;
+	if (txn != NULL) {
+		if (txn_check_can_continue(txn) != 0)
+			return -1;
+		if (txn_has_writes(txn)) {
+			fprintf(stderr, "Column export is not permitted in a read-write transaction");
+			return -1;
+		}
+		/* Отсюда и до конца транзакция видит срез на момент экспорта. */
+		txn_send_to_read_view(txn, psn);
+		psn = txn->rv_psn;
+	}
+	for (uint32_t i = 0; i < column_count; i++)
+		column_reset(&columns[i]);
+	/* Первичный индекс покрывает все таплы, и у каждого в нем один ключ. */
+	struct box_export_ctx ctx = {txn, space->index[0], columns, column_count};
+	if (index_foreach(space->index[0], box_export_tuple, &ctx) != 0) {
+		for (uint32_t i = 0; i < column_count; i++)
+			column_reset(&columns[i]);
+		return -1;
+	}
+	if (rv_psn != NULL)
+		*rv_psn = psn;
+	return 0;
+}
+
+int
+box_index_build(struct memtx_space *space, const key_def *def, uint32_t *index_id)
+{
+	if (in_txn() != NULL) {
+		fprintf(stderr, "Operation is not permitted when there is an active transaction");
+		return -1;
+	}
+	if (memtx_space_build_index_begin(space, def) != 0)
+		return -1;
+	*index_id = space->index_count;
+	return 0;
+}
+
+int
+box_index_build_step(struct memtx_space *space, double budget)
+{
+	if (in_txn() != NULL) {
+		fprintf(stderr, "Operation is not permitted when there is an active transaction");
+		return -1;
+	}
+	if (!memtx_space_build_index_is_active(space)) {
+		fprintf(stderr, "No index is being built in space %u", space->id);
+		return -1;
+	}
+	return memtx_space_build_index_step(space, budget);
+}
@@ -1,9 +1,14 @@
 #pragma once
 
 #include "stdint.h"
+#include "column.h"
 #include "memtx_space.h"
 #include "tuple.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 int
 box_txn_begin(void);
 
@@ -13,11 +18,292 @@ box_txn_commit(void);
 int
 box_txn_rollback(void);
 
+/**
+ * Выставить таймаут @a timeout (в секундах) текущей транзакции.
+ * По истечении таймаута транзакция абортится и её изменения откатываются.
+ */
+int
+box_txn_set_timeout(double timeout);
+
+/** Выставить таймаут, с которым стартуют все новые транзакции. */
+int
+box_txn_set_default_timeout(double timeout);
+
+/**
+ * Хук простоя: абортит транзакции с истекшим таймаутом, продвигает
+ * построения индексов (box_index_build) и собирает мусор TX менеджера в
+ * течение не более чем @a budget секунд.
+ */
+void
+box_idle(double budget);
+
+/**
+ * Тело транзакции для box_txn_run.
+ * @retval 0 успех, транзакцию можно коммитить.
+ * @retval -1 ошибка, транзакция будет откачена.
+ */
+typedef int (*box_txn_fn)(void *arg);
+
+/** Параметры перезапуска транзакции в box_txn_run. */
+struct box_txn_run_opts {
+	/** Сколько раз можно перезапустить тело после конфликта. */
+	uint32_t max_retries;
+	/** Задержка перед первым перезапуском, в секундах. */
+	double backoff_base;
+	/** Верхняя граница задержки, в секундах. */
+	double backoff_max;
+	/**
+	 * Как ждать задержку. NULL - заблокировать поток. Планировщик
+	 * корутин может подставить свой sleep, отдающий управление другим.
+	 */
+	void (*sleep)(double delay);
+};
+
+/** Заполнить @a opts значениями по умолчанию. */
+void
+box_txn_run_opts_create(struct box_txn_run_opts *opts);
+
+/**
+ * Задержка перед перезапуском номер @a attempt (с нуля): случайная
+ * величина из [0, min(backoff_max, backoff_base * 2^attempt)] (full jitter),
+ * чтобы сконфликтовавшие клиенты не перезапускались синхронно.
+ */
+double
+box_txn_backoff(const struct box_txn_run_opts *opts, uint32_t attempt);
+
+/**
+ * Выполнить @a fn в транзакции и закоммитить её. Если транзакция
+ * сконфликтовала (TXN_IS_CONFLICTED), она откатывается и тело
+ * перезапускается после box_txn_backoff, но не больше opts->max_retries раз.
+ * Остальные ошибки не перезапускаются. @a opts может быть NULL.
+ */
+int
+box_txn_run(box_txn_fn fn, void *arg, const struct box_txn_run_opts *opts);
+
+/**
+ * Взять ссылку на тапл: он не будет освобожден до box_tuple_unref,
+ * даже если его удалят из спейса.
+ */
+void
+box_tuple_ref(struct tuple *tuple);
+
+void
+box_tuple_unref(struct tuple *tuple);
+
+/**
+ * Создать в текущей транзакции ephemeral спейс с индексами по ключам
+ * @a key_defs (см. memtx_space_new_ephemeral): временный спейс для
+ * сортировки, дедупликации и т.п., который видит только она. Обычные
+ * box_* функции работают с ним в обход TX менеджера: записи сразу
+ * ложатся в индексы, ничего не трекается и не откатывается, и транзакция
+ * от них не становится пишущей. Прочитанный тапл живет до следующей
+ * записи в спейс.
+ *
+ * Спейс удаляется вместе со всеми таплами, когда транзакция завершается,
+ * после этого указатель на него недействителен.
+ */
+struct memtx_space *
+box_ephemeral_space_new(const key_def *key_defs, uint32_t index_count);
+
+/** Удалить ephemeral спейс @a space, не дожидаясь конца транзакции. */
+int
+box_ephemeral_space_delete(struct memtx_space *space);
+
+/**
+ * Найти тапл по ключу [@a key, @a key_end) в уникальном индексе
+ * @a index_id, видимый текущей транзакции. Ключ - MsgPack массив из
+ * одного значения того же типа, что и ключевое поле индекса. Если тапла нет, *result == NULL. Тапл, прочитанный в
+ * транзакции, живет до ее конца; вне транзакции - до следующей записи.
+ * Чтобы держать его дольше, нужен box_tuple_ref.
+ */
+int
+box_get(struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end, struct tuple **result);
+
+/**
+ * Записать в @a result до @a limit таплов с ключом [@a key, @a key_end)
+ * (см. box_get) в индексе @a index_id, видимых текущей транзакции, их число
+ * - в *@a count. Для неуникального индекса, где box_get не работает;
+ * таплы идут по возрастанию первичного ключа.
+ *
+ * Читается вся группа ключа: если до коммита транзакции подготовится
+ * чужая вставка таплов с этим ключом, транзакция уйдет в read view или
+ * будет зааборчена, даже если тапл встал бы после первых @a limit.
+ */
+int
+box_select(struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end, struct tuple **result, uint32_t limit, uint32_t *count);
+
+/**
+ * Число таплов в индексе @a index_id, видимых текущей транзакции, в
+ * *@a count. Если задан ключ [@a key, @a key_end) (см. box_get), считаются
+ * только таплы с этим ключом, иначе - все (в multikey индексе - все
+ * элементы). Число всех элементов стоит O(1) плюс число собственных
+ * записей транзакции (в read view - записей, подготовленных после него).
+ *
+ * Число читается, как тапл: если до коммита транзакции подготовится
+ * чужая запись, которая его меняет, транзакция уйдет в read view или
+ * будет зааборчена. Замены таплов без изменения числа ей не мешают.
+ */
+int
+box_index_count(struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end, size_t *count);
+
+/*
+ * Чтение по порядку ключей (box_index_count_range, box_index_min,
+ * box_index_max) есть только у неуникальных вторичных индексов: уникальные,
+ * включая первичный, - хеш таблицы без порядка, и для них эти вызовы
+ * возвращают ошибку. Индексы не построены на bps_tree, поэтому смещений
+ * в дереве нет: число в отрезке считается проходом по нему, а не за
+ * O(log n).
+ */
+
+/**
+ * Число таплов, видимых текущей транзакции, с ключами от [@a from,
+ * @a from_end) до [@a to, @a to_end) включительно (см. box_get; NULL - без
+ * границы) в неуникальном индексе @a index_id, в *@a count. Стоит
+ * пропорционально числу элементов в отрезке, видимых и невидимых.
+ *
+ * Читается весь отрезок: если до коммита транзакции подготовится чужая
+ * запись тапла с ключом из него, транзакция уйдет в read view или будет
+ * зааборчена.
+ */
+int
+box_index_count_range(struct memtx_space *space, uint32_t index_id, const char *from, const char *from_end, const char *to, const char *to_end, size_t *count);
+
+/**
+ * Тапл с наименьшим ключом в неуникальном индексе @a index_id, видимый
+ * текущей транзакции, или NULL (см. box_get). Невидимые элементы у края
+ * индекса пропускаются, так что стоит пропорционально их числу. Читается
+ * отрезок от края до найденного ключа: вставка левее него или его
+ * удаление - конфликт, как в box_select.
+ */
+int
+box_index_min(struct memtx_space *space, uint32_t index_id, struct tuple **result);
+
+/** То же, что box_index_min, но тапл с наибольшим ключом. */
+int
+box_index_max(struct memtx_space *space, uint32_t index_id, struct tuple **result);
+
+/**
+ * Вставить тапл, переданный MsgPack массивом [@a tuple, @a tuple_end).
+ * Данные копируются в тапл без перекодирования, прочитать их обратно
+ * можно через tuple_data_range тапла из box_get.
+ */
+int
+box_insert(struct memtx_space *space, const char *tuple, const char *tuple_end);
+
+/** То же, что box_insert, но заменяет тапл с тем же первичным ключом. */
 int
-box_insert(struct memtx_space *space, struct tuple *new_tuple);
+box_replace(struct memtx_space *space, const char *tuple, const char *tuple_end);
 
+/**
+ * Применить к таплу, найденному по ключу [@a key, @a key_end) в индексе
+ * @a index_id (см. box_get), операции [@a ops, @a ops_end), описанные в
+ * tuple_update.h. Новый тапл собирается из старого на сервере, без
+ * чтения клиентом и копирования целиком. Если тапла нет, ничего не
+ * происходит.
+ */
 int
-box_replace(struct memtx_space *space, struct tuple *new_tuple);
+box_update(struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end, const char *ops, const char *ops_end);
 
+/**
+ * Вставить тапл [@a tuple, @a tuple_end) или, если тапл с тем же первичным
+ * ключом есть, применить к нему операции [@a ops, @a ops_end), как
+ * box_update. Прочитанная версия тапла трекается, как любое чтение.
+ *
+ * Если транзакция не видит ключа, upsert откладывается до коммита, как
+ * box_update_delta, и не оставляет трекера чтения: при prepare он
+ * вставляет тапл или, если ключ успели вставить другие, применяет
+ * операции к самой новой версии. Ошибки такой вставки (дубликат во
+ * вторичном индексе, тип поля) возвращает коммит.
+ */
 int
-box_delete(struct memtx_space *space, uint32_t index_id, int key);
+box_upsert(struct memtx_space *space, const char *tuple, const char *tuple_end, const char *ops, const char *ops_end);
+
+/**
+ * Отложить до коммита изменение тапла, найденного по ключу [@a key,
+ * @a key_end) в индексе @a index_id, операциями "+" и "-" [@a ops, @a ops_end)
+ * (см. tuple_update.h), например, инкремент счетчика.
+ *
+ * Такие операции коммутируют, поэтому транзакция не читает тапл: операции
+ * применяются при prepare к самой новой его версии, не оставляя трекера
+ * чтения, и конкурентные изменения одного тапла коммитятся без конфликтов.
+ * Если тапла к этому моменту нет, ничего не происходит. Ошибки операций
+ * (переполнение, тип поля) возвращает коммит.
+ *
+ * Если транзакция обращается к спейсу до коммита, ее отложенные изменения
+ * в нем сначала применяются как обычный box_update: так она видит свои
+ * записи, а прочитанная версия трекается, как любое чтение.
+ */
+int
+box_update_delta(struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end, const char *ops, const char *ops_end);
+
+/** MsgPack массив тапла [data, data_end). */
+struct box_tuple_data {
+	const char *data;
+	const char *data_end;
+};
+
+/**
+ * Вставить @a count таплов, как box_insert каждый.
+ *
+ * Вне транзакции вставка атомарна: при ошибке не вставляется ничего. Если
+ * спейс пуст и его не наблюдает ни одна транзакция (начальная загрузка),
+ * таплы кладутся прямо в индексы, заранее подготовленные под @a count
+ * элементов, без историй и GC TX менеджера. Лимит памяти TX менеджера
+ * (memtx_tx_set_memory_limit) такая загрузка соблюдает, как новая
+ * пишущая транзакция: при превышении она отклоняется. Иначе все таплы
+ * вставляются одной транзакцией.
+ *
+ * В транзакции таплы вставляются в нее, и после ошибки вставленные
+ * до нее остаются в транзакции.
+ */
+int
+box_insert_batch(struct memtx_space *space, const struct box_tuple_data *tuples, uint32_t count);
+
+/** Удалить тапл по ключу [@a key, @a key_end), см. box_get. */
+int
+box_delete(struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end);
+
+/**
+ * Выгрузить поля таплов спейса в колонки для аналитики: в каждую колонку
+ * columns[i] (см. column_create) попадает поле columns[i].fieldno всех
+ * таплов, видимых текущей транзакции, строка j всех колонок - один и тот
+ * же тапл. Прежнее содержимое колонок стирается, после ошибки они пусты.
+ *
+ * Транзакция должна быть read only. Экспорт отправляет ее в read view на
+ * текущем PSN, если она еще не там: она продолжает видеть этот срез, а
+ * пишущие транзакции коммитятся как обычно, и версии, нужные read view,
+ * держит сборщик историй. Поэтому отдельные чтения не трекаются. Запись
+ * в такой транзакции, как в любом read view, абортит ее. Вне транзакции
+ * выгружается текущее состояние.
+ *
+ * @param[out] rv_psn PSN среза: видны изменения транзакций с PSN меньше
+ *             него. Может быть NULL.
+ */
+int
+box_space_export_columns(struct memtx_space *space, struct column *columns, uint32_t column_count, int64_t *rv_psn);
+
+/**
+ * Начать построение индекса по ключу @a def в спейсе @a space, не
+ * останавливая запись в него (см. memtx_space_build_index_begin). Индекс
+ * строится шагами box_index_build_step или в box_idle и до конца
+ * построения недоступен.
+ *
+ * @param[out] index_id номер, который индекс получит.
+ */
+int
+box_index_build(struct memtx_space *space, const key_def *def, uint32_t *index_id);
+
+/**
+ * Продвинуть построение индекса в спейсе @a space в течение не более чем
+ * @a budget секунд. Готовый индекс сразу доступен; транзакции, которые
+ * работали со спейсом, при этом абортятся, как при DDL.
+ *
+ * @retval 1 индекс готов, 0 построение продолжается, -1 ошибка, тогда
+ *         построение отменено.
+ */
+int
+box_index_build_step(struct memtx_space *space, double budget);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "time.h"
+#include "stdint.h"
+
+/** Монотонное время в секундах. */
+static inline double
+clock_monotonic(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
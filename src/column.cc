@@ -0,0 +1,352 @@
+#include "column.h"
+#include "msgpack.h"
+#include "trivia/util.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <limits>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Внутренние циклы ядер идут по блоку из COLUMN_BLOCK значений в
+ * COLUMN_LANES независимых аккумуляторов: так у сложения нет цепочки
+ * зависимостей, и компилятор складывает векторами даже double, не
+ * переставляя операции (порядок сложения фиксирован и не зависит от -m
+ * флагов).
+ */
+enum { COLUMN_LANES = 8 };
+
+int
+column_create(struct column *column, uint32_t fieldno, enum field_type type)
+{
+	if (type != FIELD_TYPE_UNSIGNED && type != FIELD_TYPE_INTEGER &&
+	    type != FIELD_TYPE_DOUBLE) {
+		fprintf(stderr, "Column of type %s is not supported", field_type_strs[type]);
+		return -1;
+	}
+	column->fieldno = fieldno;
+	column->type = type;
+	column->count = 0;
+	column->capacity = 0;
+	column->u64 = NULL;
+	column->valid = NULL;
+	return 0;
+}
+
+void
+column_destroy(struct column *column)
+{
+	free(column->u64);
+	free(column->valid);
+	column->u64 = NULL;
+	column->valid = NULL;
+	column->count = column->capacity = 0;
+}
+
+void
+column_reset(struct column *column)
+{
+	if (column->count == 0)
+		return;
+	memset(column->u64, 0, column->count * sizeof(*column->u64));
+	memset(column->valid, 0, column_mask_size(column->count) * sizeof(*column->valid));
+	column->count = 0;
+}
+
+/** Расширить колонку, сохранив нули во всех новых строках. */
+static void
+column_grow(struct column *column)
+{
+	uint32_t capacity = column->capacity == 0 ? COLUMN_BLOCK : column->capacity * 2;
+	column->u64 = (uint64_t *)xrealloc(column->u64, capacity * sizeof(*column->u64));
+	column->valid = (uint64_t *)xrealloc(column->valid, capacity / COLUMN_BLOCK * sizeof(*column->valid));
+	memset(column->u64 + column->capacity, 0,
+	       (capacity - column->capacity) * sizeof(*column->u64));
+	memset(column->valid + column->capacity / COLUMN_BLOCK, 0,
+	       (capacity - column->capacity) / COLUMN_BLOCK * sizeof(*column->valid));
+	column->capacity = capacity;
+}
+
+int
+column_append(struct column *column, const char *field)
+{
+	if (column->count == column->capacity)
+		column_grow(column);
+	uint32_t row = column->count;
+	if (field == NULL || mp_typeof(*field) == MP_NIL) {
+		column->count++;
+		return 0;
+	}
+	enum mp_type mp_type = mp_typeof(*field);
+	if (!field_mp_type_is_compatible(column->type, mp_type)) {
+		fprintf(stderr, "Tuple field %u type does not match one required by operation: expected %s",
+			column->fieldno + 1, field_type_strs[column->type]);
+		return -1;
+	}
+	switch (column->type) {
+	case FIELD_TYPE_UNSIGNED:
+		column->u64[row] = mp_decode_uint(&field);
+		break;
+	case FIELD_TYPE_INTEGER:
+		if (mp_type == MP_INT) {
+			column->i64[row] = mp_decode_int(&field);
+			break;
+		}
+		column->u64[row] = mp_decode_uint(&field);
+		if (column->u64[row] > INT64_MAX) {
+			column->u64[row] = 0;
+			fprintf(stderr, "Tuple field %u value does not fit into a column of type %s",
+				column->fieldno + 1, field_type_strs[column->type]);
+			return -1;
+		}
+		break;
+	case FIELD_TYPE_DOUBLE:
+		if (mp_type == MP_FLOAT)
+			column->f64[row] = mp_decode_float(&field);
+		else
+			column->f64[row] = mp_decode_double(&field);
+		break;
+	default:
+		unreachable();
+	}
+	column->valid[row / COLUMN_BLOCK] |= 1ULL << (row % COLUMN_BLOCK);
+	column->count++;
+	return 0;
+}
+
+/** Значения колонки как массив T. */
+template <class T>
+static inline const T *
+column_values(const struct column *column)
+{
+	return (const T *)column->u64;
+}
+
+/** Маска выбранных строк со значением в блоке @a block. */
+static inline uint64_t
+column_block_mask(const struct column *column, const uint64_t *sel, size_t block)
+{
+	uint64_t mask = column->valid[block];
+	if (sel != NULL)
+		mask &= sel[block];
+	return mask;
+}
+
+template <class T>
+static inline bool
+column_is_nan(T value)
+{
+	if constexpr (std::is_floating_point_v<T>)
+		return isnan(value);
+	else
+		return false;
+}
+
+uint32_t
+column_count(const struct column *column, const uint64_t *sel)
+{
+	uint32_t count = 0;
+	size_t blocks = column_mask_size(column->count);
+	for (size_t i = 0; i < blocks; i++)
+		count += __builtin_popcountll(column_block_mask(column, sel, i));
+	return count;
+}
+
+/**
+ * Целые складываются как uint64_t: переполнение знакового сложения -
+ * UB, а по модулю 2^64 результат тот же.
+ */
+template <class T, class Acc>
+static Acc
+column_sum_tpl(const struct column *column, const uint64_t *sel)
+{
+	const T *values = column_values<T>(column);
+	Acc acc[COLUMN_LANES] = {};
+	size_t blocks = column_mask_size(column->count);
+	for (size_t i = 0; i < blocks; i++) {
+		const T *block = values + i * COLUMN_BLOCK;
+		/* Без выборки блок складывается целиком: у строк без значения 0. */
+		uint64_t mask = sel == NULL ? UINT64_MAX : column_block_mask(column, sel, i);
+		if (mask == UINT64_MAX) {
+			for (size_t j = 0; j < COLUMN_BLOCK; j += COLUMN_LANES) {
+				for (size_t k = 0; k < COLUMN_LANES; k++)
+					acc[k] += (Acc)block[j + k];
+			}
+			continue;
+		}
+		for (; mask != 0; mask &= mask - 1)
+			acc[0] += (Acc)block[__builtin_ctzll(mask)];
+	}
+	Acc sum = 0;
+	for (size_t k = 0; k < COLUMN_LANES; k++)
+		sum += acc[k];
+	return sum;
+}
+
+union column_value
+column_sum(const struct column *column, const uint64_t *sel)
+{
+	union column_value result;
+	if (column->type == FIELD_TYPE_DOUBLE)
+		result.f64 = column_sum_tpl<double, double>(column, sel);
+	else
+		result.u64 = column_sum_tpl<uint64_t, uint64_t>(column, sel);
+	return result;
+}
+
+/**
+ * Минимум (@a is_min) или максимум. NaN не сравнивается ни с чем,
+ * поэтому основной проход его пропускает, а наличие NaN и чисел
+ * считается отдельно: NaN - минимум, если он есть, и максимум, если
+ * кроме него ничего нет.
+ */
+template <class T, bool is_min>
+static bool
+column_min_max_tpl(const struct column *column, const uint64_t *sel, T *result)
+{
+	const T *values = column_values<T>(column);
+	T init = is_min ? std::numeric_limits<T>::max() : std::numeric_limits<T>::lowest();
+	if constexpr (std::is_floating_point_v<T>)
+		init = is_min ? INFINITY : -INFINITY;
+	T acc[COLUMN_LANES];
+	bool has_nan[COLUMN_LANES] = {};
+	bool has_number[COLUMN_LANES] = {};
+	for (size_t k = 0; k < COLUMN_LANES; k++)
+		acc[k] = init;
+	bool found = false;
+	size_t blocks = column_mask_size(column->count);
+	for (size_t i = 0; i < blocks; i++) {
+		const T *block = values + i * COLUMN_BLOCK;
+		uint64_t mask = column_block_mask(column, sel, i);
+		if (mask == 0)
+			continue;
+		found = true;
+		if (mask == UINT64_MAX) {
+			for (size_t j = 0; j < COLUMN_BLOCK; j += COLUMN_LANES) {
+				for (size_t k = 0; k < COLUMN_LANES; k++) {
+					T value = block[j + k];
+					bool better = is_min ? value < acc[k] : value > acc[k];
+					acc[k] = better ? value : acc[k];
+					has_nan[k] |= column_is_nan(value);
+					has_number[k] |= !column_is_nan(value);
+				}
+			}
+			continue;
+		}
+		for (; mask != 0; mask &= mask - 1) {
+			T value = block[__builtin_ctzll(mask)];
+			bool better = is_min ? value < acc[0] : value > acc[0];
+			acc[0] = better ? value : acc[0];
+			has_nan[0] |= column_is_nan(value);
+			has_number[0] |= !column_is_nan(value);
+		}
+	}
+	if (!found)
+		return false;
+	T best = acc[0];
+	bool any_nan = has_nan[0];
+	bool any_number = has_number[0];
+	for (size_t k = 1; k < COLUMN_LANES; k++) {
+		best = (is_min ? acc[k] < best : acc[k] > best) ? acc[k] : best;
+		any_nan |= has_nan[k];
+		any_number |= has_number[k];
+	}
+	if constexpr (std::is_floating_point_v<T>) {
+		if (is_min ? any_nan : !any_number)
+			best = NAN;
+	}
+	*result = best;
+	return true;
+}
+
+template <bool is_min>
+static bool
+column_min_max(const struct column *column, const uint64_t *sel, union column_value *result)
+{
+	switch (column->type) {
+	case FIELD_TYPE_UNSIGNED:
+		return column_min_max_tpl<uint64_t, is_min>(column, sel, &result->u64);
+	case FIELD_TYPE_INTEGER:
+		return column_min_max_tpl<int64_t, is_min>(column, sel, &result->i64);
+	case FIELD_TYPE_DOUBLE:
+		return column_min_max_tpl<double, is_min>(column, sel, &result->f64);
+	default:
+		unreachable();
+	}
+	return false;
+}
+
+bool
+column_min(const struct column *column, const uint64_t *sel, union column_value *result)
+{
+	return column_min_max<true>(column, sel, result);
+}
+
+bool
+column_max(const struct column *column, const uint64_t *sel, union column_value *result)
+{
+	return column_min_max<false>(column, sel, result);
+}
+
+/** Собрать COLUMN_BLOCK байт 0/1 в слово маски. */
+static inline uint64_t
+column_pack_mask(const uint8_t *bytes)
+{
+	uint64_t mask = 0;
+#if defined(__SSE2__)
+	for (size_t i = 0; i < COLUMN_BLOCK; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(bytes + i));
+		/* Бит 0 каждого байта в старший бит байта. */
+		v = _mm_slli_epi16(v, 7);
+		mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(v) << i;
+	}
+#else
+	for (size_t i = 0; i < COLUMN_BLOCK; i++)
+		mask |= (uint64_t)bytes[i] << i;
+#endif
+	return mask;
+}
+
+template <class T>
+static void
+column_filter_range_tpl(const struct column *column, const uint64_t *sel, T min, T max, uint64_t *result)
+{
+	const T *values = column_values<T>(column);
+	size_t blocks = column_mask_size(column->count);
+	for (size_t i = 0; i < blocks; i++) {
+		uint64_t mask = column_block_mask(column, sel, i);
+		if (mask == 0) {
+			result[i] = 0;
+			continue;
+		}
+		const T *block = values + i * COLUMN_BLOCK;
+		uint8_t hits[COLUMN_BLOCK];
+		for (size_t j = 0; j < COLUMN_BLOCK; j++)
+			hits[j] = (block[j] >= min) & (block[j] <= max);
+		result[i] = column_pack_mask(hits) & mask;
+	}
+}
+
+void
+column_filter_range(const struct column *column, const uint64_t *sel, union column_value min, union column_value max, uint64_t *result)
+{
+	switch (column->type) {
+	case FIELD_TYPE_UNSIGNED:
+		column_filter_range_tpl<uint64_t>(column, sel, min.u64, max.u64, result);
+		break;
+	case FIELD_TYPE_INTEGER:
+		column_filter_range_tpl<int64_t>(column, sel, min.i64, max.i64, result);
+		break;
+	case FIELD_TYPE_DOUBLE:
+		column_filter_range_tpl<double>(column, sel, min.f64, max.f64, result);
+		break;
+	default:
+		unreachable();
+	}
+}
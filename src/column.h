@@ -0,0 +1,119 @@
+#pragma once
+/*
+ * Колоночное представление данных спейса для аналитики. Выбранное поле
+ * всех таплов лежит в плотном типизированном массиве, и агрегаты (сумма,
+ * минимум/максимум, счетчик) и фильтры считаются по нему без декодирования
+ * MsgPack и без MVCC на каждую строку. Заполняет колонки
+ * box_space_export_columns.
+ *
+ * Наличие значения и выборки строк - битовые маски, по биту на строку,
+ * словами по COLUMN_BLOCK строк. Ядра работают блоками по COLUMN_BLOCK
+ * значений, внутренние циклы у них без ветвлений и с постоянным числом
+ * итераций, поэтому компилятор векторизует их под те -m флаги, с
+ * которыми собран проект.
+ */
+#include "field_def.h"
+#include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Строк на слово битовой маски. */
+#define COLUMN_BLOCK 64
+
+/** Значение колонки, поле объединения выбирается по типу колонки. */
+union column_value {
+	uint64_t u64;
+	int64_t i64;
+	double f64;
+};
+
+/**
+ * Колонка: значения поля @a fieldno, по одному на строку. Массивы выделены
+ * целыми блоками, а строки без значения и хвост последнего блока
+ * заполнены нулями, так что ядрам не нужен отдельный хвостовой цикл.
+ */
+struct column {
+	/** Номер поля в тапле. */
+	uint32_t fieldno;
+	/** FIELD_TYPE_UNSIGNED, FIELD_TYPE_INTEGER или FIELD_TYPE_DOUBLE. */
+	enum field_type type;
+	/** Число строк. */
+	uint32_t count;
+	/** Сколько строк влезает в массивы, кратно COLUMN_BLOCK. */
+	uint32_t capacity;
+	/** Значения, 0 у строк без значения. */
+	union {
+		uint64_t *u64;
+		int64_t *i64;
+		double *f64;
+	};
+	/** Маска строк со значением: бит сброшен, если поля нет или оно nil. */
+	uint64_t *valid;
+};
+
+/**
+ * Описать пустую колонку по полю @a fieldno. Поддерживаются только
+ * числовые типы, иначе -1.
+ */
+int
+column_create(struct column *column, uint32_t fieldno, enum field_type type);
+
+void
+column_destroy(struct column *column);
+
+/** Удалить все строки, память остается за колонкой. */
+void
+column_reset(struct column *column);
+
+/**
+ * Добавить строку со значением MsgPack поля @a field или без значения,
+ * если @a field == NULL либо nil. Тип значения проверяется по типу колонки.
+ */
+int
+column_append(struct column *column, const char *field);
+
+/** Сколько слов в маске на @a count строк. */
+static inline size_t
+column_mask_size(uint32_t count)
+{
+	return (count + COLUMN_BLOCK - 1) / COLUMN_BLOCK;
+}
+
+/*
+ * Ядра. @a sel - маска выбранных строк (column_mask_size(count) слов)
+ * или NULL, если выбраны все. Строки без значения не участвуют нигде.
+ */
+
+/** Число выбранных строк со значением. */
+uint32_t
+column_count(const struct column *column, const uint64_t *sel);
+
+/** Сумма выбранных значений. Целые складываются по модулю 2^64. */
+union column_value
+column_sum(const struct column *column, const uint64_t *sel);
+
+/**
+ * Минимум и максимум выбранных значений. NaN, как и в индексе, меньше
+ * всех чисел. false, если значений нет.
+ */
+bool
+column_min(const struct column *column, const uint64_t *sel, union column_value *result);
+
+bool
+column_max(const struct column *column, const uint64_t *sel, union column_value *result);
+
+/**
+ * Фильтр: записать в @a result маску выбранных строк со значением из
+ * [@a min, @a max]. NaN не попадает ни в какой диапазон. @a result может
+ * совпадать с @a sel, тогда фильтры применяются по цепочке.
+ */
+void
+column_filter_range(const struct column *column, const uint64_t *sel, union column_value min, union column_value max, uint64_t *result);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,19 @@
+#include "field_def.h"
+
+const char *field_type_strs[] = {
+	/* [FIELD_TYPE_ANY]       = */ "any",
+	/* [FIELD_TYPE_UNSIGNED]  = */ "unsigned",
+	/* [FIELD_TYPE_INTEGER]   = */ "integer",
+	/* [FIELD_TYPE_DOUBLE]    = */ "double",
+	/* [FIELD_TYPE_STRING]    = */ "string",
+	/* [FIELD_TYPE_VARBINARY] = */ "varbinary",
+};
+
+const uint32_t field_mp_type[] = {
+	/* [FIELD_TYPE_ANY]       = */ UINT32_MAX,
+	/* [FIELD_TYPE_UNSIGNED]  = */ 1U << MP_UINT,
+	/* [FIELD_TYPE_INTEGER]   = */ (1U << MP_UINT) | (1U << MP_INT),
+	/* [FIELD_TYPE_DOUBLE]    = */ (1U << MP_DOUBLE) | (1U << MP_FLOAT),
+	/* [FIELD_TYPE_STRING]    = */ 1U << MP_STR,
+	/* [FIELD_TYPE_VARBINARY] = */ 1U << MP_BIN,
+};
@@ -0,0 +1,43 @@
+#pragma once
+/*
+ * Типы полей, на которых строятся индексы. Как и в tarantool, тип
+ * задает, какие MsgPack значения допустимы в поле и как они
+ * сравниваются: например, FIELD_TYPE_INTEGER принимает и MP_UINT, и
+ * MP_INT, а 1 в любой из кодировок - это один и тот же ключ.
+ */
+#include "msgpack.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum field_type {
+	/** Поле не индексировано, подходит любое значение. */
+	FIELD_TYPE_ANY = 0,
+	/** Целое от 0 до UINT64_MAX. */
+	FIELD_TYPE_UNSIGNED,
+	/** Целое от INT64_MIN до UINT64_MAX. */
+	FIELD_TYPE_INTEGER,
+	/** MP_DOUBLE или MP_FLOAT. */
+	FIELD_TYPE_DOUBLE,
+	/** MP_STR, сравнивается побайтно. */
+	FIELD_TYPE_STRING,
+	/** MP_BIN, сравнивается побайтно. */
+	FIELD_TYPE_VARBINARY,
+	field_type_MAX
+};
+
+extern const char *field_type_strs[];
+
+/** Какие MsgPack типы допустимы в поле каждого типа (битовая маска). */
+extern const uint32_t field_mp_type[];
+
+static inline bool
+field_mp_type_is_compatible(enum field_type type, enum mp_type mp_type)
+{
+	return (field_mp_type[type] & (1U << mp_type)) != 0;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -2,6 +2,119 @@
 #include "txn.h"
 #include "stdbool.h"
 
+#include <set>
+#include <unordered_set>
+
+/** Ключ поиска: MsgPack значение ключевого поля и его хеш. */
+struct index_key {
+	const char *data;
+	uint32_t hash;
+};
+
+/*
+ * Элемент хеш таблицы. Ключ берется из тапла через field map, а хеш
+ * ключа хранится в элементе, в выравнивании после mk_index: так пробы
+ * отсеивают чужие элементы, не трогая таплы, а сам элемент не больше,
+ * чем указатель на тапл с хешем, который иначе кешировала бы таблица.
+ * При замене элемента на тапл с тем же ключом хеш не меняется, поэтому
+ * тапл и mk_index можно менять на месте.
+ */
+struct index_node {
+	mutable struct tuple *tuple;
+	mutable uint32_t mk_index;
+	uint32_t hash;
+};
+
+static inline const char *
+index_node_key(const index_node &node, key_def *def)
+{
+	return tuple_extract_multikey(node.tuple, def, node.mk_index);
+}
+
+/*
+ * Хеш и сравнение элементов по key_def индекса. Оба прозрачные, чтобы
+ * искать прямо по MsgPack ключу. Хеш noexcept и дешевый, поэтому
+ * таблица не хранит его второй раз.
+ */
+struct index_node_hash {
+	using is_transparent = void;
+
+	size_t operator()(const index_node &node) const noexcept
+	{
+		return node.hash;
+	}
+	size_t operator()(const index_key &key) const noexcept
+	{
+		return key.hash;
+	}
+};
+
+struct index_node_equal {
+	using is_transparent = void;
+	key_def *def;
+
+	bool operator()(const index_node &a, const index_node &b) const
+	{
+		return a.hash == b.hash &&
+		       key_compare(index_node_key(a, def), index_node_key(b, def), def) == 0;
+	}
+	bool operator()(const index_key &key, const index_node &node) const
+	{
+		return key.hash == node.hash &&
+		       key_compare(key.data, index_node_key(node, def), def) == 0;
+	}
+	bool operator()(const index_node &node, const index_key &key) const
+	{
+		return (*this)(key, node);
+	}
+};
+
+/*
+ * Порядок элементов неуникального индекса: по ключу, а при равных
+ * ключах - по первичному ключу тапла. Ключ поиска сравнивается только
+ * с ключом элемента, поэтому все элементы с этим ключом - один отрезок.
+ */
+struct index_node_less {
+	using is_transparent = void;
+	struct index *index;
+
+	bool operator()(const index_node &a, const index_node &b) const
+	{
+		key_def *def = &index->_key_def;
+		int rc = key_compare(index_node_key(a, def), index_node_key(b, def), def);
+		if (rc != 0)
+			return rc < 0;
+		key_def *pk_def = index->pk_def;
+		return key_compare(tuple_extract_key(a.tuple, pk_def),
+				   tuple_extract_key(b.tuple, pk_def), pk_def) < 0;
+	}
+	bool operator()(const index_key &key, const index_node &node) const
+	{
+		key_def *def = &index->_key_def;
+		return key_compare(key.data, index_node_key(node, def), def) < 0;
+	}
+	bool operator()(const index_node &node, const index_key &key) const
+	{
+		key_def *def = &index->_key_def;
+		return key_compare(index_node_key(node, def), key.data, def) < 0;
+	}
+};
+
+/*
+ * Уникальный индекс - хеш таблица по ключу. Неуникальному нужны все
+ * элементы с данным ключом, и в хеш таблице они попали бы в одну
+ * цепочку, которую пришлось бы проходить на каждой вставке, поэтому он -
+ * дерево. Используется один из контейнеров, другой пуст.
+ */
+struct index_tree {
+	std::unordered_set<index_node, index_node_hash, index_node_equal> set;
+	std::set<index_node, index_node_less> tree;
+
+	explicit index_tree(struct index *index)
+		: set(0, index_node_hash{}, index_node_equal{&index->_key_def}),
+		  tree(index_node_less{index}) {}
+};
+
 int
 index_check_dup(struct index *index, struct tuple *old_tuple, struct tuple *new_tuple, struct tuple *dup_tuple, enum dup_replace_mode mode)
 {
@@ -41,15 +154,248 @@ fail:
 }
 
 int
-index_get_internal(struct index *index, int key, struct tuple **result)
+index_get_internal(struct index *index, const char *key, struct tuple **result, uint32_t *mk_index)
 {
+	/*
+	 * Возвращает тапл, физически лежащий в индексе (он может быть DIRTY).
+	 * В отличие от tarantool здесь нет space_by_id, поэтому clarify и
+	 * трекинг чтения делаются уровнем выше, в memtx_space_get.
+	 */
+	key_def *def = &index->_key_def;
+	assert(def->is_unique);
+	auto it = index->tree->set.find(index_key{key, key_hash(key, def)});
+	if (it == index->tree->set.end()) {
+		*result = NULL;
+		*mk_index = 0;
+		return 0;
+	}
+	*result = it->tuple;
+	*mk_index = it->mk_index;
+	return 0;
+}
+
+/** index_replace_entry в неуникальном индексе. */
+static int
+index_replace_tree_entry(struct index *index, struct index_entry old_entry, struct index_entry new_entry, struct index_entry *result)
+{
+	auto &tree = index->tree->tree;
+	if (new_entry.tuple != NULL) {
+		/* Тот же ключ и тот же первичный ключ - та же позиция в дереве. */
+		auto [it, inserted] = tree.insert(index_node{new_entry.tuple, new_entry.mk_index, 0});
+		tuple_ref(new_entry.tuple);
+		if (!inserted) {
+			result->tuple = it->tuple;
+			result->mk_index = it->mk_index;
+			it->tuple = new_entry.tuple;
+			it->mk_index = new_entry.mk_index;
+			tuple_unref(result->tuple);
+		}
+		return 0;
+	}
+	if (old_entry.tuple != NULL) {
+		auto it = tree.find(index_node{old_entry.tuple, old_entry.mk_index, 0});
+		if (it != tree.end() && it->tuple == old_entry.tuple) {
+			*result = old_entry;
+			tree.erase(it);
+			tuple_unref(old_entry.tuple);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Повторить в строящемся индексе @a mirror физическую замену тапла
+ * @a old_tuple на @a new_tuple в первичном. Таплы, не подходящие под
+ * ключ индекса (созданные до начала построения), не индексируются:
+ * построение все равно не закончится, пока такой тапл есть в спейсе.
+ */
+static void
+index_mirror_replace(struct index *mirror, struct tuple *old_tuple, struct tuple *new_tuple)
+{
+	if (old_tuple != NULL && !tuple_key_is_valid(old_tuple, &mirror->_key_def))
+		old_tuple = NULL;
+	if (new_tuple != NULL && !tuple_key_is_valid(new_tuple, &mirror->_key_def))
+		new_tuple = NULL;
+	struct tuple *unused;
+	index_replace(mirror, old_tuple, new_tuple, DUP_REPLACE_OR_INSERT, &unused);
+}
+
+int
+index_replace_entry(struct index *index, struct index_entry old_entry, struct index_entry new_entry, struct index_entry *result)
+{
+	/*
+	 * Проверки уникальности делает TX менеджер (check_dup), поэтому
+	 * здесь только физическая замена.
+	 *
+	 * Индекс держит ссылку на тапл за каждый его элемент. Вытесненный
+	 * тапл отпускается, но освобождается не раньше tuple_collect_garbage,
+	 * так что result->tuple можно читать.
+	 */
+	result->tuple = NULL;
+	result->mk_index = 0;
+	if (!index->_key_def.is_unique)
+		return index_replace_tree_entry(index, old_entry, new_entry, result);
+	auto &set = index->tree->set;
+	key_def *def = &index->_key_def;
+	if (new_entry.tuple != NULL) {
+		const char *key = tuple_extract_multikey(new_entry.tuple, def, new_entry.mk_index);
+		uint32_t hash = key_hash(key, def);
+		auto [it, inserted] = set.insert(index_node{new_entry.tuple, new_entry.mk_index, hash});
+		tuple_ref(new_entry.tuple);
+		if (!inserted) {
+			result->tuple = it->tuple;
+			result->mk_index = it->mk_index;
+			it->tuple = new_entry.tuple;
+			it->mk_index = new_entry.mk_index;
+			tuple_unref(result->tuple);
+		}
+		if (unlikely(index->mirror != NULL))
+			index_mirror_replace(index->mirror, result->tuple, new_entry.tuple);
+		return 0;
+	}
+	if (old_entry.tuple != NULL) {
+		const char *key = tuple_extract_multikey(old_entry.tuple, def, old_entry.mk_index);
+		auto it = set.find(index_key{key, key_hash(key, def)});
+		if (it != set.end() && it->tuple == old_entry.tuple) {
+			*result = old_entry;
+			set.erase(it);
+			tuple_unref(old_entry.tuple);
+			if (unlikely(index->mirror != NULL))
+				index_mirror_replace(index->mirror, old_entry.tuple, NULL);
+		}
+	}
 	return 0;
 }
 
 int
 index_replace(struct index *index, struct tuple *old_tuple, struct tuple *new_tuple, enum dup_replace_mode mode, struct tuple **result/*, struct tuple **successor*/)
 {
+	(void)mode;
+	*result = NULL;
+	struct index_entry none = {NULL, 0};
+	struct index_entry replaced;
+	struct tuple_key_iterator it;
+	uint32_t mk_index;
+	bool is_old_removed = false;
+	if (old_tuple != NULL) {
+		tuple_key_iterator_create(&it, old_tuple, &index->_key_def);
+		while (tuple_key_iterator_next(&it, &mk_index) != NULL) {
+			struct index_entry old_entry = {old_tuple, mk_index};
+			index_replace_entry(index, old_entry, none, &replaced);
+			is_old_removed |= replaced.tuple != NULL;
+		}
+	}
+	if (new_tuple != NULL) {
+		tuple_key_iterator_create(&it, new_tuple, &index->_key_def);
+		while (tuple_key_iterator_next(&it, &mk_index) != NULL) {
+			struct index_entry new_entry = {new_tuple, mk_index};
+			index_replace_entry(index, none, new_entry, &replaced);
+			if (*result == NULL)
+				*result = replaced.tuple;
+		}
+	}
+	if (*result == NULL && is_old_removed)
+		*result = old_tuple;
+	return 0;
+}
+
+size_t
+index_size(struct index *index)
+{
+	return index->tree->set.size() + index->tree->tree.size();
+}
+
+void
+index_reserve(struct index *index, size_t count)
+{
+	if (!index->_key_def.is_unique)
+		return;
+	auto &set = index->tree->set;
+	set.reserve(set.size() + count);
+}
 
+/** Вызвать @a cb для элементов [@a begin, @a end). */
+template <class Iterator>
+static int
+index_foreach_range(Iterator begin, Iterator end, index_foreach_f cb, void *arg)
+{
+	for (Iterator it = begin; it != end; ++it) {
+		int rc = cb(index_entry{it->tuple, it->mk_index}, arg);
+		if (rc != 0)
+			return rc;
+	}
+	return 0;
+}
+
+int
+index_foreach(struct index *index, index_foreach_f cb, void *arg)
+{
+	if (!index->_key_def.is_unique)
+		return index_foreach_range(index->tree->tree.begin(), index->tree->tree.end(), cb, arg);
+	return index_foreach_range(index->tree->set.begin(), index->tree->set.end(), cb, arg);
+}
+
+int
+index_foreach_key(struct index *index, const char *key, index_foreach_f cb, void *arg)
+{
+	key_def *def = &index->_key_def;
+	if (!def->is_unique) {
+		auto [begin, end] = index->tree->tree.equal_range(index_key{key, 0});
+		return index_foreach_range(begin, end, cb, arg);
+	}
+	auto it = index->tree->set.find(index_key{key, key_hash(key, def)});
+	if (it == index->tree->set.end())
+		return 0;
+	return cb(index_entry{it->tuple, it->mk_index}, arg);
+}
+
+int
+index_foreach_between(struct index *index, const char *from, const char *to, index_foreach_f cb, void *arg)
+{
+	key_def *def = &index->_key_def;
+	assert(!def->is_unique);
+	/* Пустой отрезок: lower_bound оказался бы правее upper_bound. */
+	if (from != NULL && to != NULL && key_compare(from, to, def) > 0)
+		return 0;
+	auto &tree = index->tree->tree;
+	auto begin = from == NULL ? tree.begin() : tree.lower_bound(index_key{from, 0});
+	auto end = to == NULL ? tree.end() : tree.upper_bound(index_key{to, 0});
+	return index_foreach_range(begin, end, cb, arg);
+}
+
+int
+index_foreach_reverse(struct index *index, index_foreach_f cb, void *arg)
+{
+	assert(!index->_key_def.is_unique);
+	return index_foreach_range(index->tree->tree.rbegin(), index->tree->tree.rend(), cb, arg);
+}
+
+int
+index_make_unique(struct index *index)
+{
+	assert(!index->_key_def.is_unique);
+	key_def *def = &index->_key_def;
+	auto &tree = index->tree->tree;
+	/* Одинаковые ключи в дереве стоят рядом. */
+	const char *prev = NULL;
+	for (const index_node &node : tree) {
+		const char *key = index_node_key(node, def);
+		if (prev != NULL && key_compare(prev, key, def) == 0) {
+			fprintf(stderr, "Duplicate key exists in unique index %u in space %u",
+				index->dense_id, index->space_id);
+			return -1;
+		}
+		prev = key;
+	}
+	/* Ссылки на таплы переходят из дерева в таблицу как есть. */
+	auto &set = index->tree->set;
+	set.reserve(tree.size());
+	for (const index_node &node : tree) {
+		uint32_t hash = key_hash(index_node_key(node, def), def);
+		set.insert(index_node{node.tuple, node.mk_index, hash});
+	}
+	tree.clear();
+	def->is_unique = true;
 	return 0;
 }
 
@@ -61,4 +407,22 @@ index_create(struct index *index)
 	/* Unusable until set to proper value during space creation. */
 	index->dense_id = UINT32_MAX;
 	rlist_create(&index->read_gaps);
+	index->point_hole_count = 0;
+	index->invisible_count = 0;
+	index->pk_def = &index->_key_def;
+	index->tree = new index_tree(index);
+	index->mirror = NULL;
+	return 0;
+}
+
+void
+index_destroy(struct index *index)
+{
+	assert(rlist_empty(&index->read_gaps));
+	for (const index_node &node : index->tree->set)
+		tuple_unref(node.tuple);
+	for (const index_node &node : index->tree->tree)
+		tuple_unref(node.tuple);
+	delete index->tree;
+	index->tree = NULL;
 }
@@ -4,10 +4,6 @@
 #include "small/rlist.h"
 #include "stdint.h"
 
-#ifdef __cplusplus
-#include <unordered_map>
-#endif
-
 enum dup_replace_mode {
 	DUP_REPLACE_OR_INSERT,
 	DUP_INSERT,
@@ -16,12 +12,30 @@ enum dup_replace_mode {
 
 struct tuple;
 
+/**
+ * Элемент индекса. У обычного индекса у тапла один элемент, у multikey -
+ * по одному на каждый (различный) элемент массива.
+ */
+struct index_entry {
+	struct tuple *tuple;
+	/** Номер ключа тапла, см. tuple_key_iterator; 0 в обычном индексе. */
+	uint32_t mk_index;
+};
+
+/** Физическое хранилище индекса, определено в index.cc. */
+struct index_tree;
+
 //typedef struct index index;
 struct index {
 	/** Space id. */
 	uint32_t space_id;
 	/** Index key definition. */
 	key_def _key_def;
+	/**
+	 * Первичный ключ спейса: им неуникальный индекс различает элементы
+	 * с одинаковым ключом.
+	 */
+	key_def *pk_def;
 	/** Globally unique ID. */
 	uint32_t unique_id;
 	/** Compact ID - index in space->index array. */
@@ -31,9 +45,28 @@ struct index {
 	 * элемент был самым правым в индексе в момент вставки.
 	 */
 	struct rlist read_gaps;
-#ifdef __cplusplus
-	std::unordered_map<int, tuple *> tree;
-#endif
+	/**
+	 * Сколько point holes TX менеджера ищут ключ в этом индексе: сами
+	 * они лежат в одной таблице на все индексы.
+	 */
+	size_t point_hole_count;
+	/**
+	 * Сколько элементов индекса (верхушек цепочек TX менеджера) не
+	 * видно транзакции без своих изменений и без read view: ни одна
+	 * подготовленная или закоммиченная версия ключа не видна.
+	 */
+	size_t invisible_count;
+	/*
+	 * Указатель, а не сам контейнер, чтобы struct index имела одинаковый
+	 * размер в C и C++: спейс с массивом индексов аллоцируется в C.
+	 */
+	struct index_tree *tree;
+	/*
+	 * Строящийся индекс спейса, если этот индекс первичный: каждая
+	 * физическая замена в нем повторяется и в mirror, см.
+	 * memtx_space_build_index_begin. Иначе NULL.
+	 */
+	struct index *mirror;
 };
 
 #ifdef __cplusplus
@@ -43,15 +76,83 @@ extern "C" {
 int
 index_check_dup(struct index *index, struct tuple *old_tuple, struct tuple *new_tuple, struct tuple *dup_tuple, enum dup_replace_mode mode);
 
+/**
+ * Найти элемент по ключу @a key в уникальном индексе. Возвращает тапл,
+ * физически лежащий в индексе, и @a mk_index - какой из его ключей совпал.
+ */
 int
-index_get_internal(struct index *index, int key, struct tuple **result);
+index_get_internal(struct index *index, const char *key, struct tuple **result, uint32_t *mk_index);
 
+/**
+ * Заменить все элементы тапла @a old_tuple на элементы @a new_tuple.
+ * *result - тапл, вытесненный новым, либо удаленный old_tuple.
+ * В multikey индексе ключи таплов могут не совпадать, поэтому сначала
+ * удаляются элементы old_tuple, а затем вставляются элементы new_tuple.
+ */
 int
 index_replace(struct index *index, struct tuple *old_tuple, struct tuple *new_tuple, enum dup_replace_mode mode, struct tuple **result/*, struct tuple **successor*/);
 
+/**
+ * Заменить один элемент: если new_entry.tuple != NULL, вставить его
+ * (*result - вытесненный элемент с тем же ключом), иначе удалить элемент
+ * old_entry, если он еще в индексе (*result - он сам).
+ */
+int
+index_replace_entry(struct index *index, struct index_entry old_entry, struct index_entry new_entry, struct index_entry *result);
+
+/** Число элементов индекса. */
+size_t
+index_size(struct index *index);
+
+/** Подготовить индекс к вставке еще @a count элементов без перестроек. */
+void
+index_reserve(struct index *index, size_t count);
+
+/** Обработчик элемента для index_foreach. */
+typedef int (*index_foreach_f)(struct index_entry entry, void *arg);
+
+/**
+ * Вызвать @a cb для каждого элемента индекса, в порядке хеш таблицы
+ * (неуникального индекса - по возрастанию ключа).
+ * Менять индекс во время обхода нельзя. Ненулевой код, возвращенный
+ * @a cb, прерывает обход и возвращается из index_foreach.
+ */
+int
+index_foreach(struct index *index, index_foreach_f cb, void *arg);
+
+/**
+ * То же, что index_foreach, но только для элементов с ключом @a key: в
+ * уникальном индексе такой элемент один, в неуникальном они идут по
+ * возрастанию первичного ключа.
+ */
+int
+index_foreach_key(struct index *index, const char *key, index_foreach_f cb, void *arg);
+
+/**
+ * То же, что index_foreach, но только для элементов неуникального индекса
+ * с ключами от @a from до @a to включительно (NULL - без границы).
+ */
+int
+index_foreach_between(struct index *index, const char *from, const char *to, index_foreach_f cb, void *arg);
+
+/** То же, что index_foreach для неуникального индекса, но по убыванию ключа. */
+int
+index_foreach_reverse(struct index *index, index_foreach_f cb, void *arg);
+
+/**
+ * Сделать неуникальный индекс уникальным: -1, если в нем есть
+ * одинаковые ключи (тогда индекс не меняется).
+ */
+int
+index_make_unique(struct index *index);
+
 int
 index_create(struct index *index);
 
+/** Отпустить все таплы индекса и освободить его память. */
+void
+index_destroy(struct index *index);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -1,14 +1,334 @@
 #include "key_def.h"
 #include "tuple.h"
 
-int
-tuple_compare_with_key(struct tuple *tuple, int key, key_def *key_def)
+#include <math.h>
+#include <stdio.h>
+
+/*
+ * Сравнения и хеши MsgPack значений каждого типа. Типы значений уже
+ * проверены (в tuple_new и key_validate), поэтому здесь они только
+ * декодируются.
+ */
+
+/**
+ * Хеш числа - просто свертка до 32 бит: таблицы индекса и point holes
+ * берут хеш по модулю простого числа, а последовательные ключи тогда
+ * попадают в соседние бакеты, что заметно дешевле по кешу.
+ */
+static inline uint32_t
+key_fold(uint64_t value)
+{
+	return (uint32_t)(value ^ (value >> 32));
+}
+
+/** Финализатор MurmurHash3: перемешивает все биты слова. */
+static inline uint64_t
+key_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint32_t
+key_hash_bytes(const char *data, uint32_t len)
+{
+	uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+	for (; len >= 8; data += 8, len -= 8) {
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		h = key_mix(h ^ word);
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, data, len);
+	return key_mix(h ^ tail);
+}
+
+static inline int
+mp_compare_uint(const char *a, const char *b)
+{
+	uint64_t va = mp_decode_uint(&a);
+	uint64_t vb = mp_decode_uint(&b);
+	return va < vb ? -1 : va > vb;
+}
+
+static inline uint32_t
+mp_hash_uint(const char *data)
+{
+	return key_fold(mp_decode_uint(&data));
+}
+
+/**
+ * Целое может прийти и как MP_UINT, и как MP_INT (отрицательные всегда
+ * MP_INT, неотрицательные обычно MP_UINT). Значения, не влезающие в
+ * int64_t, бывают только MP_UINT.
+ */
+static inline int
+mp_compare_integer(const char *a, const char *b)
+{
+	bool a_is_uint = mp_typeof(*a) == MP_UINT;
+	bool b_is_uint = mp_typeof(*b) == MP_UINT;
+	if (a_is_uint && b_is_uint)
+		return mp_compare_uint(a, b);
+	if (!a_is_uint && !b_is_uint) {
+		int64_t va = mp_decode_int(&a);
+		int64_t vb = mp_decode_int(&b);
+		return va < vb ? -1 : va > vb;
+	}
+	if (a_is_uint) {
+		int64_t vb = mp_decode_int(&b);
+		if (vb < 0)
+			return 1;
+		uint64_t va = mp_decode_uint(&a);
+		return va < (uint64_t)vb ? -1 : va > (uint64_t)vb;
+	}
+	return -mp_compare_integer(b, a);
+}
+
+static inline uint32_t
+mp_hash_integer(const char *data)
+{
+	/* Одинаковые значения в обеих кодировках дают одни и те же биты. */
+	if (mp_typeof(*data) == MP_UINT)
+		return key_fold(mp_decode_uint(&data));
+	return key_fold((uint64_t)mp_decode_int(&data));
+}
+
+static inline double
+mp_read_double(const char *data)
+{
+	if (mp_typeof(*data) == MP_FLOAT)
+		return mp_decode_float(&data);
+	return mp_decode_double(&data);
+}
+
+/**
+ * NaN меньше всех чисел и равен сам себе, иначе хеш таблица индекса
+ * не нашла бы его никогда. -0.0 равен 0.0.
+ */
+static inline int
+mp_compare_double(const char *a, const char *b)
+{
+	double va = mp_read_double(a);
+	double vb = mp_read_double(b);
+	if (isnan(va) || isnan(vb))
+		return isnan(vb) - isnan(va);
+	return va < vb ? -1 : va > vb;
+}
+
+static inline uint32_t
+mp_hash_double(const char *data)
+{
+	double value = mp_read_double(data);
+	if (value == 0)
+		value = 0;
+	else if (isnan(value))
+		value = NAN;
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return key_fold(bits);
+}
+
+/** Побайтное сравнение, короткая строка меньше своего продолжения. */
+static inline int
+key_compare_bytes(const char *a, uint32_t len_a, const char *b, uint32_t len_b)
+{
+	int rc = memcmp(a, b, MIN(len_a, len_b));
+	if (rc != 0)
+		return rc;
+	return len_a < len_b ? -1 : len_a > len_b;
+}
+
+static inline int
+mp_compare_str(const char *a, const char *b)
+{
+	uint32_t len_a, len_b;
+	a = mp_decode_str(&a, &len_a);
+	b = mp_decode_str(&b, &len_b);
+	return key_compare_bytes(a, len_a, b, len_b);
+}
+
+static inline uint32_t
+mp_hash_str(const char *data)
+{
+	uint32_t len;
+	data = mp_decode_str(&data, &len);
+	return key_hash_bytes(data, len);
+}
+
+static inline int
+mp_compare_bin(const char *a, const char *b)
+{
+	uint32_t len_a, len_b;
+	a = mp_decode_bin(&a, &len_a);
+	b = mp_decode_bin(&b, &len_b);
+	return key_compare_bytes(a, len_a, b, len_b);
+}
+
+static inline uint32_t
+mp_hash_bin(const char *data)
+{
+	uint32_t len;
+	data = mp_decode_bin(&data, &len);
+	return key_hash_bytes(data, len);
+}
+
+template <int (*compare)(const char *, const char *)>
+static int
+tuple_compare_with_key_tpl(struct tuple *tuple, const char *key, key_def *def)
+{
+	return compare(tuple_extract_key(tuple, def), key);
+}
+
+template <int (*compare)(const char *, const char *)>
+static int
+key_compare_tpl(const char *key_a, const char *key_b, key_def *def)
+{
+	(void)def;
+	return compare(key_a, key_b);
+}
+
+template <uint32_t (*hash)(const char *)>
+static uint32_t
+tuple_hash_tpl(struct tuple *tuple, key_def *def)
+{
+	return hash(tuple_extract_key(tuple, def));
+}
+
+template <uint32_t (*hash)(const char *)>
+static uint32_t
+key_hash_tpl(const char *key, key_def *def)
+{
+	(void)def;
+	return hash(key);
+}
+
+struct key_def_funcs {
+	tuple_compare_with_key_t tuple_compare_with_key;
+	key_compare_t key_compare;
+	tuple_hash_t tuple_hash;
+	key_hash_t key_hash;
+};
+
+#define KEY_DEF_FUNCS(compare, hash) {			\
+	tuple_compare_with_key_tpl<compare>,		\
+	key_compare_tpl<compare>,			\
+	tuple_hash_tpl<hash>,				\
+	key_hash_tpl<hash>,				\
+}
+
+static const struct key_def_funcs key_def_funcs[] = {
+	/* [FIELD_TYPE_ANY]       = */ {NULL, NULL, NULL, NULL},
+	/* [FIELD_TYPE_UNSIGNED]  = */ KEY_DEF_FUNCS(mp_compare_uint, mp_hash_uint),
+	/* [FIELD_TYPE_INTEGER]   = */ KEY_DEF_FUNCS(mp_compare_integer, mp_hash_integer),
+	/* [FIELD_TYPE_DOUBLE]    = */ KEY_DEF_FUNCS(mp_compare_double, mp_hash_double),
+	/* [FIELD_TYPE_STRING]    = */ KEY_DEF_FUNCS(mp_compare_str, mp_hash_str),
+	/* [FIELD_TYPE_VARBINARY] = */ KEY_DEF_FUNCS(mp_compare_bin, mp_hash_bin),
+};
+
+#undef KEY_DEF_FUNCS
+
+void
+key_def_create(key_def *def, uint32_t fieldno, enum field_type type)
+{
+	assert(type != FIELD_TYPE_ANY && type < field_type_MAX);
+	const struct key_def_funcs *funcs = &key_def_funcs[type];
+	def->tuple_compare_with_key = funcs->tuple_compare_with_key;
+	def->key_compare = funcs->key_compare;
+	def->tuple_hash = funcs->tuple_hash;
+	def->key_hash = funcs->key_hash;
+	def->fieldno = fieldno;
+	def->type = type;
+	def->is_unique = true;
+	def->is_multikey = false;
+	def->for_func_index = false;
+	def->exclude_null = false;
+	def->func = NULL;
+	def->filter = NULL;
+	def->filter_bit = 0;
+	def->offset_slot = TUPLE_OFFSET_SLOT_NIL;
+}
+
+void
+key_def_create_multikey(key_def *def, uint32_t fieldno, enum field_type type)
+{
+	key_def_create(def, fieldno, type);
+	def->is_multikey = true;
+}
+
+void
+key_def_create_func(key_def *def, key_func_t func, enum field_type type)
+{
+	assert(func != NULL);
+	key_def_create(def, 0, type);
+	def->for_func_index = true;
+	def->func = func;
+}
+
+void
+key_def_set_exclude_null(key_def *def)
+{
+	def->exclude_null = true;
+}
+
+void
+key_def_set_filter(key_def *def, key_filter_t filter)
+{
+	assert(filter != NULL);
+	def->filter = filter;
+}
+
+void
+key_def_set_non_unique(key_def *def)
+{
+	def->is_unique = false;
+}
+
+const char *
+key_validate(key_def *def, const char *key, const char *key_end)
 {
-	return tuple->data[*key_def] - key;
+	const char *pos = key;
+	if (key == NULL || mp_check(&pos, key_end) != 0 || pos != key_end) {
+		fprintf(stderr, "Invalid MsgPack - packet body");
+		return NULL;
+	}
+	if (mp_typeof(*key) != MP_ARRAY) {
+		fprintf(stderr, "Invalid MsgPack - key must be an array");
+		return NULL;
+	}
+	uint32_t part_count = mp_decode_array(&key);
+	if (part_count != 1) {
+		fprintf(stderr, "Invalid key part count in an exact match (expected 1, got %u)",
+			part_count);
+		return NULL;
+	}
+	if (!field_mp_type_is_compatible(def->type, mp_typeof(*key))) {
+		fprintf(stderr, "Supplied key type of part 0 does not match index part type: expected %s",
+			field_type_strs[def->type]);
+		return NULL;
+	}
+	return key;
 }
 
-uint32_t
-tuple_hash(struct tuple *tuple, key_def *key_def)
+bool
+tuple_key_is_valid(struct tuple *tuple, key_def *def)
 {
-    return tuple->data[*key_def];
+	assert(!def->for_func_index && def->filter == NULL);
+	const char *field = tuple_field(tuple, def->fieldno);
+	if (field == NULL || mp_typeof(*field) == MP_NIL)
+		return def->exclude_null;
+	if (!def->is_multikey)
+		return field_mp_type_is_compatible(def->type, mp_typeof(*field));
+	if (mp_typeof(*field) != MP_ARRAY)
+		return false;
+	uint32_t count = mp_decode_array(&field);
+	for (uint32_t i = 0; i < count; i++) {
+		if (!field_mp_type_is_compatible(def->type, mp_typeof(*field)))
+			return false;
+		mp_next(&field);
+	}
+	return true;
 }
@@ -1,33 +1,312 @@
 #pragma once
 
+#include "field_def.h"
 #include "tuple.h"
 #include "stdint.h"
 
+struct key_def;
+
+/*
+ * Функции сравнения и хеширования выбираются в key_def_create по типу
+ * поля, поэтому на горячем пути нет ни switch по типу, ни проверок
+ * MsgPack типов: они сделаны при создании тапла и в key_validate.
+ * Ключ (const char *key) - это MsgPack значение ключевого поля без
+ * заголовка массива.
+ */
+typedef int
+(*tuple_compare_with_key_t)(struct tuple *tuple, const char *key, struct key_def *def);
+typedef int
+(*key_compare_t)(const char *key_a, const char *key_b, struct key_def *def);
+typedef uint32_t
+(*tuple_hash_t)(struct tuple *tuple, struct key_def *def);
+typedef uint32_t
+(*key_hash_t)(const char *key, struct key_def *def);
+
+/**
+ * Функция ключа функционального индекса. По MsgPack данным тапла
+ * [@a data, @a data_end) пишет в @a buf MsgPack значение ключа. Как
+ * snprintf, пишет не больше @a size байт, а возвращает полный размер
+ * ключа: если он больше @a size, функция будет вызвана еще раз с буфером
+ * побольше. -1 - ключ построить нельзя, тапл тогда не создается.
+ * Функция должна быть чистой: ключ вычисляется один раз при создании
+ * тапла и хранится вместе с ним.
+ */
+typedef ssize_t
+(*key_func_t)(const char *data, const char *data_end, char *buf, size_t size);
+
+/**
+ * Фильтр частичного индекса: true, если тапл с MsgPack данными
+ * [@a data, @a data_end) должен быть в индексе. Как и функция ключа,
+ * вызывается один раз при создании тапла.
+ */
+typedef bool
+(*key_filter_t)(const char *data, const char *data_end);
+
 /*
  * Для простоты у нас не будет составных ключей. Один ключ соответствует
- * одному полю. Соответственно key_def - это номер поля.
+ * одному полю. Соответственно key_def - это номер поля и его тип.
+ *
+ * В multikey индексе поле - массив, и у тапла по ключу на каждый его
+ * элемент (как путь "[*]" в tarantool); type - тип элементов.
+ *
+ * Ключ функционального индекса - не поле, а результат функции func от
+ * тапла. Он вычисляется в tuple_new и лежит в тапле после данных, а его
+ * смещение, как и смещения ключевых полей, - в field map.
+ *
+ * Индекс может покрывать не все таплы спейса: sparse индекс (exclude_null)
+ * пропускает таплы без ключевого поля или с nil в нем, частичный (filter) -
+ * таплы, не прошедшие фильтр. Такие таплы не вставляются в индекс, и у их
+ * stories нет ссылок в нем, см. tuple_key_is_excluded.
+ *
+ * Вторичный индекс может быть неуникальным: тогда элемент индекса -
+ * пара (ключ, первичный ключ тапла), и одинаковые ключи у разных таплов
+ * не конфликтуют.
  */
-typedef uint32_t key_def;
+typedef struct key_def {
+	tuple_compare_with_key_t tuple_compare_with_key;
+	key_compare_t key_compare;
+	tuple_hash_t tuple_hash;
+	key_hash_t key_hash;
+	/** Номер ключевого поля в тапле. */
+	uint32_t fieldno;
+	enum field_type type;
+	/**
+	 * Ключ уникален. Элементы неуникального индекса различаются ключом
+	 * вместе с первичным ключом тапла.
+	 */
+	bool is_unique;
+	bool is_multikey;
+	bool for_func_index;
+	/** Ключевое поле может отсутствовать или быть nil, такие таплы не в индексе. */
+	bool exclude_null;
+	/** Функция ключа функционального индекса. */
+	key_func_t func;
+	/** Фильтр частичного индекса или NULL. */
+	key_filter_t filter;
+	/** Бит фильтра в tuple_filter_mask, выставляется при создании спейса. */
+	uint32_t filter_bit;
+	/**
+	 * Слот field map со смещением ключа в таплах спейса или
+	 * TUPLE_OFFSET_SLOT_NIL, если ключ - поле 0. Выставляется при
+	 * создании спейса: ключ достается из тапла, не заглядывая в формат.
+	 * У индекса, построенного позже, слот поля может отличаться в
+	 * форматах старых и новых таплов, тогда он TUPLE_OFFSET_SLOT_FORMAT.
+	 */
+	int32_t offset_slot;
+} key_def;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/** Описать ключ по полю @a fieldno типа @a type. */
+void
+key_def_create(key_def *def, uint32_t fieldno, enum field_type type);
+
+/** Описать multikey ключ по элементам типа @a type массива в поле @a fieldno. */
+void
+key_def_create_multikey(key_def *def, uint32_t fieldno, enum field_type type);
+
+/** Описать ключ функционального индекса: значение типа @a type, которое строит @a func. */
+void
+key_def_create_func(key_def *def, key_func_t func, enum field_type type);
+
+/** Сделать индекс sparse: не индексировать таплы, где ключа нет или он nil. */
+void
+key_def_set_exclude_null(key_def *def);
+
+/** Сделать индекс частичным: индексировать только таплы, прошедшие @a filter. */
+void
+key_def_set_filter(key_def *def, key_filter_t filter);
+
+/** Сделать индекс неуникальным. Первичный индекс всегда уникален. */
+void
+key_def_set_non_unique(key_def *def);
+
+/**
+ * Проверить ключ поиска [@a key, @a key_end): MsgPack массив из одного
+ * значения, совместимого с типом @a def.
+ * @return само значение или NULL (ошибка уже напечатана).
+ */
+const char *
+key_validate(key_def *def, const char *key, const char *key_end);
+
+/**
+ * Тапл, созданный без индекса @a def, подходит для него: ключевое поле
+ * есть и совпадает по типу (или его нет либо оно nil у sparse индекса).
+ * Ошибки не печатает.
+ */
+bool
+tuple_key_is_valid(struct tuple *tuple, key_def *def);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
 /**
  * Сравнить тапл с ключом, используя key definition.
  * @param tuple tuple
- * @param key integer key
+ * @param key MsgPack value of the key part
  * @param key_def key definition
  * @retval 0  if key_fields(tuple) == parts(key)
  * @retval <0 if key_fields(tuple) < parts(key)
  * @retval >0 if key_fields(tuple) > parts(key)
  */
-int
-tuple_compare_with_key(struct tuple *tuple, int key, key_def *key_def);
+static inline int
+tuple_compare_with_key(struct tuple *tuple, const char *key, key_def *key_def)
+{
+	return key_def->tuple_compare_with_key(tuple, key, key_def);
+}
 
-uint32_t
-tuple_hash(struct tuple *tuple, key_def *key_def);
+/** Сравнить два ключа, как tuple_compare_with_key. */
+static inline int
+key_compare(const char *key_a, const char *key_b, key_def *key_def)
+{
+	return key_def->key_compare(key_a, key_b, key_def);
+}
 
-#ifdef __cplusplus
-} // extern "C"
-#endif
+static inline uint32_t
+tuple_hash(struct tuple *tuple, key_def *key_def)
+{
+	return key_def->tuple_hash(tuple, key_def);
+}
+
+/** Хеш ключа, совпадающий с tuple_hash тапла с таким ключом. */
+static inline uint32_t
+key_hash(const char *key, key_def *key_def)
+{
+	return key_def->key_hash(key, key_def);
+}
+
+/**
+ * Достать из тапла ключ, описанный @a key_def: указатель на MsgPack
+ * значение поля внутри данных тапла или на функциональный ключ, который
+ * хранится сразу за ними. У multikey ключа это весь массив, сами ключи
+ * достает tuple_extract_multikey.
+ */
+static inline const char *
+tuple_extract_key(struct tuple *tuple, key_def *key_def)
+{
+	const char *data = tuple_data(tuple);
+	if (key_def->offset_slot == TUPLE_OFFSET_SLOT_NIL) {
+		/* Поле 0 лежит сразу за заголовком массива. */
+		mp_decode_array(&data);
+		return data;
+	}
+	if (unlikely(key_def->offset_slot == TUPLE_OFFSET_SLOT_FORMAT))
+		return tuple_field(tuple, key_def->fieldno);
+	return data + tuple_field_map(tuple)[key_def->offset_slot];
+}
+
+/**
+ * Ключ тапла с номером @a multikey_idx: элемент массива multikey поля
+ * или, если ключ обычный, само поле (@a multikey_idx тогда 0).
+ */
+static inline const char *
+tuple_extract_multikey(struct tuple *tuple, key_def *key_def, uint32_t multikey_idx)
+{
+	const char *field = tuple_extract_key(tuple, key_def);
+	if (!key_def->is_multikey) {
+		assert(multikey_idx == 0);
+		return field;
+	}
+	uint32_t count = mp_decode_array(&field);
+	assert(multikey_idx < count);
+	(void)count;
+	for (uint32_t i = 0; i < multikey_idx; i++)
+		mp_next(&field);
+	return field;
+}
+
+/**
+ * Тапл не представлен в индексе @a key_def: не прошел фильтр частичного
+ * индекса, ключа sparse индекса нет или он nil, либо массив multikey
+ * поля пуст. У такого тапла нет ни одного ключа в индексе.
+ */
+static inline bool
+tuple_key_is_excluded(struct tuple *tuple, key_def *key_def)
+{
+	if (likely(!key_def->is_multikey && !key_def->exclude_null &&
+		   key_def->filter == NULL))
+		return false;
+	if (key_def->filter != NULL &&
+	    (tuple_filter_mask(tuple) & (1U << key_def->filter_bit)) != 0)
+		return true;
+	const char *key = tuple_data(tuple);
+	if (key_def->offset_slot == TUPLE_OFFSET_SLOT_NIL) {
+		mp_decode_array(&key);
+	} else if (unlikely(key_def->offset_slot == TUPLE_OFFSET_SLOT_FORMAT)) {
+		key = tuple_field(tuple, key_def->fieldno);
+		if (key == NULL)
+			return true;
+	} else {
+		uint32_t offset = tuple_field_map(tuple)[key_def->offset_slot];
+		/* Необязательного поля нет в тапле. */
+		if (offset == 0)
+			return true;
+		key += offset;
+	}
+	if (mp_typeof(*key) == MP_NIL)
+		return true;
+	return key_def->is_multikey && mp_decode_array(&key) == 0;
+}
+
+/**
+ * Перебор ключей тапла в индексе: один ключ или по ключу на элемент
+ * multikey массива. Одинаковые элементы - это один ключ индекса, поэтому
+ * повторы пропускаются, и номер ключа (multikey_idx) - позиция первого
+ * вхождения. У тапла, исключенного из индекса, ключей нет.
+ *
+ * Массивы multikey полей короткие, так что поиск повторов простым
+ * проходом дешевле любой хеш таблицы.
+ */
+struct tuple_key_iterator {
+	key_def *def;
+	/** Первый элемент массива (или само поле). */
+	const char *first;
+	/** Следующий элемент. */
+	const char *pos;
+	/** Число элементов. */
+	uint32_t count;
+	/** Номер следующего элемента. */
+	uint32_t next_idx;
+};
+
+static inline void
+tuple_key_iterator_create(struct tuple_key_iterator *it, struct tuple *tuple, key_def *key_def)
+{
+	it->def = key_def;
+	it->next_idx = 0;
+	if (tuple_key_is_excluded(tuple, key_def)) {
+		it->first = it->pos = NULL;
+		it->count = 0;
+		return;
+	}
+	it->first = tuple_extract_key(tuple, key_def);
+	it->count = 1;
+	if (key_def->is_multikey)
+		it->count = mp_decode_array(&it->first);
+	it->pos = it->first;
+}
+
+/**
+ * Следующий ключ или NULL, если ключи кончились.
+ * @param[out] multikey_idx номер ключа.
+ */
+static inline const char *
+tuple_key_iterator_next(struct tuple_key_iterator *it, uint32_t *multikey_idx)
+{
+	while (it->next_idx < it->count) {
+		const char *key = it->pos;
+		uint32_t idx = it->next_idx++;
+		mp_next(&it->pos);
+		const char *prev = it->first;
+		while (prev != key && key_compare(prev, key, it->def) != 0)
+			mp_next(&prev);
+		if (prev != key)
+			continue;
+		*multikey_idx = idx;
+		return key;
+	}
+	return NULL;
+}
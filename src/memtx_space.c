@@ -1,22 +1,23 @@
 #include "memtx_space.h"
+#include "memtx_tx.h"
+#include "tuple_update.h"
+#include "clock.h"
 #include "assert.h"
 
 int
 memtx_space_replace/*_all_keys*/(struct memtx_space *space, struct tuple *old_tuple, struct tuple *new_tuple, enum dup_replace_mode mode, struct tuple **result)
 {
 	assert(space->index_count > 0);
-	struct index *pk = &space->index[0];
-	/* Для простоты у нас все индексы будут уникальными. */
-	//assert(pk->def->opts.is_unique);
+	struct index *pk = space->index[0];
+	/* Первичный индекс уникален, вторичные могут быть и нет. */
+	assert(pk->_key_def.is_unique);
 
+	/* Ephemeral спейс пишется мимо стейтментов, см. memtx_space_ephemeral_replace. */
+	assert(!space->is_ephemeral);
 	/* Реплейсы должны происходить внутри транзакции. */
-	assert(/*space->def->opts.is_ephemeral ||*/
-	       (in_txn() != NULL && txn_current_stmt(in_txn()) != NULL));
-	/* ephemeral поддерживать не будем. */
-	//if (memtx_tx_manager_use_mvcc_engine && !space->def->opts.is_ephemeral) {
-		struct txn_stmt *stmt = txn_current_stmt(in_txn());
-		return memtx_tx_history_add_stmt(stmt, old_tuple, new_tuple, mode, result);
-	//}
+	assert(in_txn() != NULL && txn_current_stmt(in_txn()) != NULL);
+	struct txn_stmt *stmt = txn_current_stmt(in_txn());
+	return memtx_tx_history_add_stmt(stmt, old_tuple, new_tuple, mode, result);
 }
 
 static inline int
@@ -28,6 +29,9 @@ memtx_space_replace_tuple(struct memtx_space *space, struct txn_stmt *stmt, stru
 	if (rc != 0)
 		return rc;
 	txn_stmt_prepare_rollback_info(stmt, result, new_tuple);
+	/* result уже referenced в memtx_tx_history_add_stmt. */
+	if (new_tuple != NULL)
+		tuple_ref(new_tuple);
 	stmt->new_tuple = new_tuple;
 	stmt->old_tuple = result;
 	return 0;
@@ -47,16 +51,158 @@ memtx_space_execute_replace(struct memtx_space *space, struct txn *txn, struct t
 }
 
 int
-memtx_space_execute_delete(struct memtx_space *space, struct txn *txn, uint32_t index_id, int key, struct tuple **result)
+memtx_space_get(struct memtx_space *space, struct txn *txn, uint32_t index_id, const char *key, struct tuple **result)
+{
+	assert(index_id < space->index_count);
+	struct index *index = space->index[index_id];
+	struct tuple *tuple;
+	uint32_t mk_index;
+	if (index_get_internal(index, key, &tuple, &mk_index) != 0)
+		return -1;
+	if (tuple == NULL) {
+		/* Ничего не нашли - запоминаем, что прочитали пустоту. */
+		memtx_tx_track_point(txn, space, index, key);
+		*result = NULL;
+		return 0;
+	}
+	/* Выбираем версию, видимую транзакции, и трекаем чтение. */
+	*result = memtx_tx_tuple_clarify(txn, space, tuple, index, mk_index);
+	return 0;
+}
+
+struct memtx_space_select_ctx {
+	struct txn *txn;
+	struct memtx_space *space;
+	struct index *index;
+	struct tuple **result;
+	uint32_t limit;
+	uint32_t count;
+	/** В индексе нашелся хотя бы один элемент, пусть и невидимый. */
+	bool has_entries;
+};
+
+static int
+memtx_space_select_entry(struct index_entry entry, void *arg)
+{
+	struct memtx_space_select_ctx *ctx = (struct memtx_space_select_ctx *)arg;
+	ctx->has_entries = true;
+	struct tuple *tuple = memtx_tx_tuple_clarify(ctx->txn, ctx->space, entry.tuple, ctx->index, entry.mk_index);
+	if (tuple == NULL)
+		return 0;
+	if (ctx->result != NULL)
+		ctx->result[ctx->count] = tuple;
+	return ++ctx->count == ctx->limit;
+}
+
+uint32_t
+memtx_space_select(struct memtx_space *space, struct txn *txn, uint32_t index_id, const char *key, struct tuple **result, uint32_t limit)
+{
+	assert(index_id < space->index_count);
+	struct index *index = space->index[index_id];
+	struct memtx_space_select_ctx ctx = {txn, space, index, result, limit, 0, false};
+	if (limit == 0)
+		return 0;
+	index_foreach_key(index, key, memtx_space_select_entry, &ctx);
+	/*
+	 * Элементы трекает clarify. В неуникальном индексе новый элемент
+	 * группы может встать и перед прочитанными, поэтому point hole
+	 * ставится всегда, а в уникальном - как в memtx_space_get.
+	 */
+	if (!index->_key_def.is_unique || !ctx.has_entries)
+		memtx_tx_track_point(txn, space, index, key);
+	return ctx.count;
+}
+
+size_t
+memtx_space_count(struct memtx_space *space, struct txn *txn, uint32_t index_id)
+{
+	assert(index_id < space->index_count);
+	struct index *index = space->index[index_id];
+	/* В ephemeral спейсе нет ни историй, ни чужих читателей. */
+	if (space->is_ephemeral)
+		return index_size(index);
+	memtx_tx_track_count(txn, index);
+	return index_size(index) - memtx_tx_index_invisible_count(txn, index);
+}
+
+struct memtx_space_range_ctx {
+	struct txn *txn;
+	struct index *index;
+	size_t count;
+	/** Элемент с первым видимым таплом, если нужен только он. */
+	struct index_entry first;
+	bool is_first_only;
+};
+
+static int
+memtx_space_range_entry(struct index_entry entry, void *arg)
+{
+	struct memtx_space_range_ctx *ctx = (struct memtx_space_range_ctx *)arg;
+	/* Чтение всего отрезка трекает memtx_tx_track_range. */
+	struct tuple *tuple = memtx_tx_tuple_clarify_untracked(ctx->txn, entry.tuple, ctx->index, entry.mk_index);
+	if (tuple == NULL)
+		return 0;
+	ctx->count++;
+	if (!ctx->is_first_only)
+		return 0;
+	ctx->first = entry;
+	return 1;
+}
+
+size_t
+memtx_space_count_range(struct memtx_space *space, struct txn *txn, uint32_t index_id, const char *from, const char *to)
+{
+	assert(index_id < space->index_count);
+	struct index *index = space->index[index_id];
+	assert(!index->_key_def.is_unique);
+	struct memtx_space_range_ctx ctx = {txn, index, 0, {NULL, 0}, false};
+	if (!space->is_ephemeral)
+		memtx_tx_track_range(txn, index, from, to);
+	index_foreach_between(index, from, to, memtx_space_range_entry, &ctx);
+	return ctx.count;
+}
+
+struct tuple *
+memtx_space_min_max(struct memtx_space *space, struct txn *txn, uint32_t index_id, bool is_max)
+{
+	assert(index_id < space->index_count);
+	struct index *index = space->index[index_id];
+	assert(!index->_key_def.is_unique);
+	struct memtx_space_range_ctx ctx = {txn, index, 0, {NULL, 0}, true};
+	if (is_max)
+		index_foreach_reverse(index, memtx_space_range_entry, &ctx);
+	else
+		index_foreach(index, memtx_space_range_entry, &ctx);
+	if (ctx.first.tuple == NULL) {
+		if (!space->is_ephemeral)
+			memtx_tx_track_range(txn, index, NULL, NULL);
+		return NULL;
+	}
+	/*
+	 * Видимость ключей у края проверена вся, поэтому трекается отрезок
+	 * от края до найденного ключа: вставка левее минимума или удаление
+	 * его самого - конфликт. Версии в цепочке элемента стоят с тем же
+	 * ключом. Сам тапл читается с трекером, как в memtx_space_get, чтобы
+	 * жить до конца транзакции.
+	 */
+	if (!space->is_ephemeral) {
+		const char *key = tuple_extract_multikey(ctx.first.tuple, &index->_key_def, ctx.first.mk_index);
+		if (is_max)
+			memtx_tx_track_range(txn, index, key, NULL);
+		else
+			memtx_tx_track_range(txn, index, NULL, key);
+	}
+	return memtx_tx_tuple_clarify(txn, space, ctx.first.tuple, index, ctx.first.mk_index);
+}
+
+int
+memtx_space_execute_delete(struct memtx_space *space, struct txn *txn, uint32_t index_id, const char *key, struct tuple **result)
 {
 	struct txn_stmt *stmt = txn_current_stmt(txn);
 	/* Try to find the tuple by unique key. */
 	assert(index_id < space->index_count);
-	struct index *pk = &space->index[index_id];//index_find(space, index_id);
-	if (pk == NULL)
-		return -1;
 	struct tuple *old_tuple;
-	if (index_get_internal(pk, key, &old_tuple) != 0)
+	if (memtx_space_get(space, txn, index_id, key, &old_tuple) != 0)
 		return -1;
 	if (old_tuple == NULL) {
 		*result = NULL;
@@ -68,22 +214,625 @@ memtx_space_execute_delete(struct memtx_space *space, struct txn *txn, uint32_t
 	return 0;
 }
 
+/**
+ * Построить тапл, полученный из @a old_tuple операциями [@a ops, @a ops_end).
+ * Первичный ключ операции менять не могут.
+ */
+static struct tuple *
+memtx_space_update_tuple(struct memtx_space *space, struct tuple *old_tuple, const char *ops, const char *ops_end)
+{
+	uint32_t bsize;
+	const char *data = tuple_data(old_tuple);
+	char *new_data = tuple_update_execute(ops, ops_end, data, data + old_tuple->bsize, &bsize);
+	if (new_data == NULL)
+		return NULL;
+	struct tuple *new_tuple = tuple_new(space->format, new_data, new_data + bsize);
+	free(new_data);
+	if (new_tuple == NULL)
+		return NULL;
+	key_def *pk_def = &space->index[0]->_key_def;
+	if (key_compare(tuple_extract_key(old_tuple, pk_def), tuple_extract_key(new_tuple, pk_def), pk_def) != 0) {
+		fprintf(stderr, "Attempt to modify a tuple field which is part of primary index in space %u",
+			space->id);
+		tuple_delete(new_tuple);
+		return NULL;
+	}
+	return new_tuple;
+}
+
+/** Заменить видимый транзакции @a old_tuple его обновлением. */
+static int
+memtx_space_replace_updated(struct memtx_space *space, struct txn_stmt *stmt, struct tuple *old_tuple, const char *ops, const char *ops_end)
+{
+	struct tuple *new_tuple = memtx_space_update_tuple(space, old_tuple, ops, ops_end);
+	if (new_tuple == NULL)
+		return -1;
+	/* Если замена не удастся, тапл уйдет в мусор вместе с этой ссылкой. */
+	tuple_ref(new_tuple);
+	int rc = memtx_space_replace_tuple(space, stmt, old_tuple, new_tuple, DUP_REPLACE);
+	tuple_unref(new_tuple);
+	return rc;
+}
+
+int
+memtx_space_execute_update(struct memtx_space *space, struct txn *txn, uint32_t index_id, const char *key, const char *ops, const char *ops_end, struct tuple **result)
+{
+	struct txn_stmt *stmt = txn_current_stmt(txn);
+	struct tuple *old_tuple;
+	if (memtx_space_get(space, txn, index_id, key, &old_tuple) != 0)
+		return -1;
+	if (old_tuple == NULL) {
+		*result = NULL;
+		return 0;
+	}
+	if (memtx_space_replace_updated(space, stmt, old_tuple, ops, ops_end) != 0)
+		return -1;
+	*result = stmt->new_tuple;
+	return 0;
+}
+
+/**
+ * Найти в первичном индексе тапл с ключом @a new_tuple, видимый @a txn,
+ * без трекера чтения: в *@a tuple - тапл, физически лежащий в индексе,
+ * в *@a old_tuple - видимая версия или NULL.
+ */
+static int
+memtx_space_upsert_lookup(struct memtx_space *space, struct txn *txn, struct tuple *new_tuple, struct tuple **tuple, uint32_t *mk_index, struct tuple **old_tuple)
+{
+	struct index *pk = space->index[0];
+	const char *key = tuple_extract_key(new_tuple, &pk->_key_def);
+	if (index_get_internal(pk, key, tuple, mk_index) != 0)
+		return -1;
+	*old_tuple = NULL;
+	if (*tuple != NULL)
+		*old_tuple = memtx_tx_tuple_clarify_untracked(txn, *tuple, pk, *mk_index);
+	return 0;
+}
+
+int
+memtx_space_upsert_is_blind(struct memtx_space *space, struct txn *txn, struct tuple *new_tuple, bool *is_blind)
+{
+	struct tuple *tuple, *old_tuple;
+	uint32_t mk_index;
+	if (memtx_space_upsert_lookup(space, txn, new_tuple, &tuple, &mk_index, &old_tuple) != 0)
+		return -1;
+	*is_blind = old_tuple == NULL;
+	return 0;
+}
+
+int
+memtx_space_execute_upsert(struct memtx_space *space, struct txn *txn, struct tuple *new_tuple, const char *ops, const char *ops_end, bool is_tracked)
+{
+	struct txn_stmt *stmt = txn_current_stmt(txn);
+	struct tuple *tuple, *old_tuple;
+	uint32_t mk_index;
+	if (memtx_space_upsert_lookup(space, txn, new_tuple, &tuple, &mk_index, &old_tuple) != 0)
+		return -1;
+	if (old_tuple == NULL) {
+		/*
+		 * DUP_INSERT трекает отсутствие ключа. При prepare трекать
+		 * нечего: это точка сериализации, и вставку ключа другими
+		 * транзакциями после нее сконфликтует сама эта запись.
+		 */
+		return memtx_space_replace_tuple(space, stmt, NULL, new_tuple,
+						 is_tracked ? DUP_INSERT : DUP_REPLACE_OR_INSERT);
+	}
+	if (is_tracked) {
+		/* Новый тапл зависит от старого: это чтение, его нужно трекать. */
+		old_tuple = memtx_tx_tuple_clarify(txn, space, tuple, space->index[0], mk_index);
+		assert(old_tuple != NULL);
+	}
+	return memtx_space_replace_updated(space, stmt, old_tuple, ops, ops_end);
+}
+
+int
+memtx_space_execute_delta(struct memtx_space *space, struct txn *txn, uint32_t index_id, const char *key, const char *ops, const char *ops_end)
+{
+	struct txn_stmt *stmt = txn_current_stmt(txn);
+	assert(index_id < space->index_count);
+	struct index *index = space->index[index_id];
+	struct tuple *tuple;
+	uint32_t mk_index;
+	if (index_get_internal(index, key, &tuple, &mk_index) != 0)
+		return -1;
+	if (tuple != NULL)
+		tuple = memtx_tx_tuple_clarify_untracked(txn, tuple, index, mk_index);
+	/* Ни версия, ни отсутствие ключа не трекаются: результат от них не читается. */
+	if (tuple == NULL)
+		return 0;
+	return memtx_space_replace_updated(space, stmt, tuple, ops, ops_end);
+}
+
+/**
+ * Проверить, что в уникальном индексе @a index_id ephemeral спейса ключи
+ * @a new_tuple не заняты никем, кроме заменяемого @a old_tuple.
+ */
+static int
+memtx_space_ephemeral_check_dup(struct memtx_space *space, uint32_t index_id, struct tuple *old_tuple, struct tuple *new_tuple)
+{
+	struct index *index = space->index[index_id];
+	struct tuple_key_iterator it;
+	const char *key;
+	uint32_t mk_index;
+	tuple_key_iterator_create(&it, new_tuple, &index->_key_def);
+	while ((key = tuple_key_iterator_next(&it, &mk_index)) != NULL) {
+		struct tuple *dup;
+		uint32_t dup_mk_index;
+		if (index_get_internal(index, key, &dup, &dup_mk_index) != 0)
+			return -1;
+		if (dup != NULL && dup != old_tuple) {
+			fprintf(stderr, "Duplicate key exists in unique index %u in space %u",
+				index_id, space->id);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+memtx_space_ephemeral_replace(struct memtx_space *space, struct tuple *old_tuple, struct tuple *new_tuple, enum dup_replace_mode mode)
+{
+	assert(space->is_ephemeral);
+	assert(old_tuple != NULL || new_tuple != NULL);
+	struct index *pk = space->index[0];
+	if (old_tuple == NULL) {
+		uint32_t mk_index;
+		const char *key = tuple_extract_key(new_tuple, &pk->_key_def);
+		if (index_get_internal(pk, key, &old_tuple, &mk_index) != 0)
+			return -1;
+		if (old_tuple != NULL && mode == DUP_INSERT) {
+			fprintf(stderr, "Duplicate key exists in unique index 0 in space %u", space->id);
+			return -1;
+		}
+		if (old_tuple == NULL && mode == DUP_REPLACE) {
+			fprintf(stderr, "Attempt to modify a tuple field which is part of primary index in space %u",
+				space->id);
+			return -1;
+		}
+	}
+	/* Все проверки до первой замены: при ошибке спейс не меняется. */
+	for (uint32_t i = 1; new_tuple != NULL && i < space->index_count; i++) {
+		if (space->index[i]->_key_def.is_unique &&
+		    memtx_space_ephemeral_check_dup(space, i, old_tuple, new_tuple) != 0)
+			return -1;
+	}
+	/* Вытесненный тапл уходит в мусор, когда его отпустит последний индекс. */
+	for (uint32_t i = 0; i < space->index_count; i++) {
+		struct tuple *unused;
+		index_replace(space->index[i], old_tuple, new_tuple, DUP_REPLACE_OR_INSERT, &unused);
+	}
+	return 0;
+}
+
+int
+memtx_space_ephemeral_delete(struct memtx_space *space, uint32_t index_id, const char *key)
+{
+	assert(space->is_ephemeral);
+	assert(index_id < space->index_count);
+	struct tuple *old_tuple;
+	uint32_t mk_index;
+	if (index_get_internal(space->index[index_id], key, &old_tuple, &mk_index) != 0)
+		return -1;
+	if (old_tuple == NULL)
+		return 0;
+	return memtx_space_ephemeral_replace(space, old_tuple, NULL, DUP_REPLACE_OR_INSERT);
+}
+
+/** Заменить тапл @a old_tuple ephemeral спейса его обновлением. */
+static int
+memtx_space_ephemeral_replace_updated(struct memtx_space *space, struct tuple *old_tuple, const char *ops, const char *ops_end)
+{
+	struct tuple *new_tuple = memtx_space_update_tuple(space, old_tuple, ops, ops_end);
+	if (new_tuple == NULL)
+		return -1;
+	tuple_ref(new_tuple);
+	int rc = memtx_space_ephemeral_replace(space, old_tuple, new_tuple, DUP_REPLACE);
+	tuple_unref(new_tuple);
+	return rc;
+}
+
+int
+memtx_space_ephemeral_update(struct memtx_space *space, uint32_t index_id, const char *key, const char *ops, const char *ops_end)
+{
+	assert(space->is_ephemeral);
+	assert(index_id < space->index_count);
+	struct tuple *old_tuple;
+	uint32_t mk_index;
+	if (index_get_internal(space->index[index_id], key, &old_tuple, &mk_index) != 0)
+		return -1;
+	if (old_tuple == NULL)
+		return 0;
+	return memtx_space_ephemeral_replace_updated(space, old_tuple, ops, ops_end);
+}
+
+int
+memtx_space_ephemeral_upsert(struct memtx_space *space, struct tuple *new_tuple, const char *ops, const char *ops_end)
+{
+	assert(space->is_ephemeral);
+	struct index *pk = space->index[0];
+	const char *key = tuple_extract_key(new_tuple, &pk->_key_def);
+	struct tuple *old_tuple;
+	uint32_t mk_index;
+	if (index_get_internal(pk, key, &old_tuple, &mk_index) != 0)
+		return -1;
+	if (old_tuple == NULL)
+		return memtx_space_ephemeral_replace(space, NULL, new_tuple, DUP_INSERT);
+	return memtx_space_ephemeral_replace_updated(space, old_tuple, ops, ops_end);
+}
+
+/** Убрать элементы таплов tuples[0..count) из всех индексов спейса. */
+static void
+memtx_space_unload(struct memtx_space *space, struct tuple **tuples, uint32_t count)
+{
+	struct tuple *unused;
+	for (uint32_t i = 0; i < count; i++) {
+		for (uint32_t j = 0; j < space->index_count; j++)
+			index_replace(space->index[j], tuples[i], NULL, DUP_REPLACE_OR_INSERT, &unused);
+	}
+}
+
+int
+memtx_space_load(struct memtx_space *space, struct tuple **tuples, uint32_t count)
+{
+	for (uint32_t j = 0; j < space->index_count; j++)
+		index_reserve(space->index[j], count);
+	struct index_entry none = {NULL, 0};
+	for (uint32_t i = 0; i < count; i++) {
+		for (uint32_t j = 0; j < space->index_count; j++) {
+			struct index *index = space->index[j];
+			struct tuple_key_iterator it;
+			uint32_t mk_index;
+			tuple_key_iterator_create(&it, tuples[i], &index->_key_def);
+			while (tuple_key_iterator_next(&it, &mk_index) != NULL) {
+				struct index_entry entry = {tuples[i], mk_index};
+				struct index_entry replaced;
+				index_replace_entry(index, none, entry, &replaced);
+				if (replaced.tuple == NULL)
+					continue;
+				/*
+				 * Вытесненный элемент уже отпущен, а остальные
+				 * элементы обоих таплов убирает откат.
+				 */
+				fprintf(stderr, "Duplicate key exists in unique index %u in space %u",
+					j, space->id);
+				memtx_space_unload(space, tuples, i + 1);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
 struct memtx_space *
-memtx_space_new(uint32_t index_count)
+memtx_space_new_with_key_defs(const key_def *key_defs, uint32_t index_count)
 {
-	struct memtx_space *memtx_space = malloc(sizeof(struct memtx_space) + sizeof(struct index) * index_count);
+	assert(index_count > 0);
+	if (index_count > MEMTX_SPACE_INDEX_MAX) {
+		fprintf(stderr, "Too many indexes: %u, maximum is %u",
+			index_count, (uint32_t)MEMTX_SPACE_INDEX_MAX);
+		return NULL;
+	}
+	if (key_defs[0].is_multikey) {
+		/* Первичный ключ должен однозначно определять тапл. */
+		fprintf(stderr, "Primary key cannot be multikey");
+		return NULL;
+	}
+	if (key_defs[0].for_func_index) {
+		fprintf(stderr, "Primary key cannot be functional");
+		return NULL;
+	}
+	if (!key_defs[0].is_unique) {
+		fprintf(stderr, "Primary key must be unique");
+		return NULL;
+	}
+	if (key_defs[0].exclude_null || key_defs[0].filter != NULL) {
+		/* Каждый тапл спейса должен быть в первичном ключе. */
+		fprintf(stderr, "Primary key cannot be partial or sparse");
+		return NULL;
+	}
+	struct tuple_format *format = tuple_format_new(key_defs, index_count);
+	if (format == NULL)
+		return NULL;
+	struct memtx_space *memtx_space = malloc(sizeof(struct memtx_space));
 	if (memtx_space == NULL) {
 		fprintf(stderr, "Failed to allocate %u bytes in %s for %s", sizeof(struct memtx_space), "malloc", "struct memtx_space");
+		tuple_format_delete(format);
 		return NULL;
 	}
 	static uint32_t space_id = 0;
 	memtx_space->id = space_id++;
+	uint32_t func_count = 0;
+	uint32_t filter_count = 0;
+	memtx_space->index = xmalloc(sizeof(struct index *) * index_count);
 	for (int i = 0; i < index_count; i++) {
-		index_create(&memtx_space->index[i]);
-		memtx_space->index[i].space_id = memtx_space->id;
-		memtx_space->index[i]._key_def = i;
-		memtx_space->index[i].dense_id = i;
+		struct index *index = xmalloc(sizeof(struct index));
+		memtx_space->index[i] = index;
+		index_create(index);
+		index->space_id = memtx_space->id;
+		index->_key_def = key_defs[i];
+		index->pk_def = &memtx_space->index[0]->_key_def;
+		index->dense_id = i;
+		/* Где в field map таплов спейса лежит ключ индекса. */
+		if (key_defs[i].for_func_index)
+			index->_key_def.offset_slot = format->funcs[func_count++].offset_slot;
+		else
+			index->_key_def.offset_slot = format->fields[key_defs[i].fieldno].offset_slot;
+		if (key_defs[i].filter != NULL)
+			index->_key_def.filter_bit = filter_count++;
 	}
 	memtx_space->index_count = index_count;
+	memtx_space->format = format;
+	tuple_format_ref(format);
+	memtx_space->is_ephemeral = false;
+	memtx_space->txn = NULL;
+	rlist_create(&memtx_space->in_ephemeral_spaces);
 	return memtx_space;
 }
+
+struct memtx_space *
+memtx_space_new_ephemeral(struct txn *txn, const key_def *key_defs, uint32_t index_count)
+{
+	assert(txn != NULL);
+	struct memtx_space *space = memtx_space_new_with_key_defs(key_defs, index_count);
+	if (space == NULL)
+		return NULL;
+	space->is_ephemeral = true;
+	space->txn = txn;
+	rlist_add_tail_entry(&txn->ephemeral_spaces, space, in_ephemeral_spaces);
+	return space;
+}
+
+void
+memtx_space_delete_ephemeral(struct memtx_space *space)
+{
+	assert(space->is_ephemeral);
+	rlist_del(&space->in_ephemeral_spaces);
+	/* Трекеров и stories у спейса нет, индексы просто отпускают таплы. */
+	for (uint32_t i = 0; i < space->index_count; i++) {
+		index_destroy(space->index[i]);
+		free(space->index[i]);
+	}
+	free(space->index);
+	/* Таплы, на которые остались ссылки (box_tuple_ref), держат формат. */
+	tuple_format_unref(space->format);
+	free(space);
+}
+
+/** Построение индекса на живом спейсе, см. memtx_space_build_index_begin. */
+struct memtx_index_build {
+	struct memtx_space *space;
+	/** Формат спейса до начала построения, на случай отмены. */
+	struct tuple_format *old_format;
+	/**
+	 * Таплы, которые были в спейсе к началу построения: элементы
+	 * первичного индекса и таплы всех stories, которые откат или read
+	 * view могут вернуть в индекс. Все держат ссылку.
+	 */
+	struct tuple **tuples;
+	uint32_t count;
+	/** Сколько из них уже перенесено. */
+	uint32_t pos;
+	/** Индекс должен стать уникальным, до конца построения он неуникальный. */
+	bool is_unique;
+	/** Ссылка в memtx_index_builds. */
+	struct rlist in_builds;
+};
+
+/** Все идущие построения индексов. */
+static RLIST_HEAD(memtx_index_builds);
+
+static struct memtx_index_build *
+memtx_space_build_index_find(struct memtx_space *space)
+{
+	struct memtx_index_build *build;
+	rlist_foreach_entry(build, &memtx_index_builds, in_builds) {
+		if (build->space == space)
+			return build;
+	}
+	return NULL;
+}
+
+bool
+memtx_space_build_index_is_active(struct memtx_space *space)
+{
+	return memtx_space_build_index_find(space) != NULL;
+}
+
+static void
+memtx_index_build_add_tuple(struct memtx_index_build *build, struct tuple *tuple)
+{
+	if ((build->count & (build->count - 1)) == 0) {
+		size_t capacity = build->count == 0 ? 16 : 2 * (size_t)build->count;
+		build->tuples = xrealloc(build->tuples, capacity * sizeof(*build->tuples));
+	}
+	tuple_ref(tuple);
+	build->tuples[build->count++] = tuple;
+}
+
+static int
+memtx_index_build_add_entry(struct index_entry entry, void *arg)
+{
+	memtx_index_build_add_tuple((struct memtx_index_build *)arg, entry.tuple);
+	return 0;
+}
+
+static void
+memtx_index_build_add_story_tuple(struct tuple *tuple, void *arg)
+{
+	memtx_index_build_add_tuple((struct memtx_index_build *)arg, tuple);
+}
+
+/** Освободить построение @a build; индекс уже готов или удален. */
+static void
+memtx_index_build_delete(struct memtx_index_build *build)
+{
+	build->space->index[0]->mirror = NULL;
+	for (uint32_t i = 0; i < build->count; i++)
+		tuple_unref(build->tuples[i]);
+	free(build->tuples);
+	rlist_del(&build->in_builds);
+	free(build);
+}
+
+int
+memtx_space_build_index_begin(struct memtx_space *space, const key_def *def)
+{
+	if (space->is_ephemeral) {
+		fprintf(stderr, "Index can't be built in ephemeral space %u", space->id);
+		return -1;
+	}
+	if (def->for_func_index || def->filter != NULL) {
+		fprintf(stderr, "Functional and partial indexes can't be built online");
+		return -1;
+	}
+	if (memtx_space_build_index_is_active(space)) {
+		fprintf(stderr, "Index of space %u is already being built", space->id);
+		return -1;
+	}
+	if (space->index_count == MEMTX_SPACE_INDEX_MAX) {
+		fprintf(stderr, "Too many indexes: %u, maximum is %u",
+			space->index_count + 1, (uint32_t)MEMTX_SPACE_INDEX_MAX);
+		return -1;
+	}
+	struct tuple_format *format = tuple_format_add_key(space->format, def);
+	if (format == NULL)
+		return -1;
+	struct memtx_index_build *build = xmalloc(sizeof(*build));
+	build->space = space;
+	build->old_format = space->format;
+	build->tuples = NULL;
+	build->count = 0;
+	build->pos = 0;
+	build->is_unique = def->is_unique;
+	rlist_add_tail_entry(&memtx_index_builds, build, in_builds);
+
+	/* Индексы не перемещаются, растет только массив указателей на них. */
+	space->index = xrealloc(space->index, sizeof(struct index *) * (space->index_count + 1));
+	struct index *pk = space->index[0];
+	struct index *index = xmalloc(sizeof(struct index));
+	space->index[space->index_count] = index;
+	index_create(index);
+	index->space_id = space->id;
+	index->_key_def = *def;
+	/* Пока таплы переносятся, ключи в индексе могут повторяться. */
+	index->_key_def.is_unique = false;
+	index->_key_def.offset_slot = tuple_format_key_slot(format, def->fieldno);
+	index->pk_def = &pk->_key_def;
+	index->dense_id = space->index_count;
+
+	index_foreach(pk, memtx_index_build_add_entry, build);
+	memtx_tx_space_foreach_tuple(space, memtx_index_build_add_story_tuple, build);
+	tuple_format_ref(format);
+	space->format = format;
+	pk->mirror = index;
+	return 0;
+}
+
+void
+memtx_space_build_index_abort(struct memtx_space *space)
+{
+	struct memtx_index_build *build = memtx_space_build_index_find(space);
+	if (build == NULL)
+		return;
+	/*
+	 * Таплы нового формата остаются валидными и со старым набором
+	 * индексов, они и держат новый формат, пока живы.
+	 */
+	tuple_format_unref(space->format);
+	space->format = build->old_format;
+	memtx_index_build_delete(build);
+	index_destroy(space->index[space->index_count]);
+	free(space->index[space->index_count]);
+}
+
+/**
+ * Перенести в индекс тапл @a tuple, существовавший до начала построения,
+ * если он все еще в спейсе. Изменения после начала построения в индексе
+ * уже есть, поэтому ключ сверяется с первичным индексом: тапл мог быть
+ * удален или заменен, тогда его в индексе быть не должно.
+ */
+static int
+memtx_index_build_apply(struct memtx_space *space, struct index *index, struct tuple *tuple)
+{
+	if (tuple->format != space->format && tuple_validate(space->format, tuple) != 0)
+		return -1;
+	struct index *pk = space->index[0];
+	struct tuple *found;
+	uint32_t mk_index;
+	if (index_get_internal(pk, tuple_extract_key(tuple, &pk->_key_def), &found, &mk_index) != 0)
+		return -1;
+	if (found != tuple)
+		return 0;
+	struct tuple *unused;
+	return index_replace(index, NULL, tuple, DUP_REPLACE_OR_INSERT, &unused);
+}
+
+/** Сделать построенный индекс доступным, см. memtx_space_build_index_step. */
+static int
+memtx_index_build_finish(struct memtx_index_build *build)
+{
+	struct memtx_space *space = build->space;
+	struct index *index = space->index[space->index_count];
+	/*
+	 * Ссылки stories рассчитаны на число индексов при их создании,
+	 * поэтому новый индекс можно добавить только в спейс без истории.
+	 */
+	if (memtx_tx_space_clear_history(space) != 0)
+		return -1;
+	if (build->is_unique && index_make_unique(index) != 0)
+		return -1;
+	/* Старый формат держат только таплы, созданные до начала построения. */
+	tuple_format_unref(build->old_format);
+	memtx_index_build_delete(build);
+	space->index_count++;
+	return 0;
+}
+
+int
+memtx_space_build_index_step(struct memtx_space *space, double budget)
+{
+	assert(in_txn() == NULL);
+	struct memtx_index_build *build = memtx_space_build_index_find(space);
+	assert(build != NULL);
+	struct index *index = space->index[space->index_count];
+	double deadline = clock_monotonic() + budget;
+	while (build->pos < build->count) {
+		uint32_t end = MIN(build->pos + MEMTX_INDEX_BUILD_BATCH, build->count);
+		for (; build->pos < end; build->pos++) {
+			if (memtx_index_build_apply(space, index, build->tuples[build->pos]) != 0) {
+				memtx_space_build_index_abort(space);
+				return -1;
+			}
+		}
+		if (build->pos < build->count && clock_monotonic() >= deadline)
+			return 0;
+	}
+	if (memtx_index_build_finish(build) != 0) {
+		memtx_space_build_index_abort(space);
+		return -1;
+	}
+	return 1;
+}
+
+void
+memtx_space_build_index_idle(double budget)
+{
+	if (rlist_empty(&memtx_index_builds) || in_txn() != NULL)
+		return;
+	uint32_t count = 0;
+	struct memtx_index_build *build, *tmp;
+	rlist_foreach_entry(build, &memtx_index_builds, in_builds)
+		count++;
+	/* Ошибку печатает сам шаг, неудачное построение он же и отменяет. */
+	rlist_foreach_entry_safe(build, &memtx_index_builds, in_builds, tmp)
+		memtx_space_build_index_step(build->space, budget / count);
+}
+
+struct memtx_space *
+memtx_space_new(uint32_t index_count)
+{
+	key_def key_defs[index_count];
+	for (uint32_t i = 0; i < index_count; i++)
+		key_def_create(&key_defs[i], i, FIELD_TYPE_INTEGER);
+	return memtx_space_new_with_key_defs(key_defs, index_count);
+}
@@ -4,17 +4,250 @@
 #include "tuple.h"
 #include "txn.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+	/**
+	 * Сколько индексов может быть в спейсе: у каждого частичного индекса
+	 * свой бит в 32-битной маске фильтров тапла.
+	 */
+	MEMTX_SPACE_INDEX_MAX = 32,
+	/** Сколько таплов за раз переносит в новый индекс шаг построения. */
+	MEMTX_INDEX_BUILD_BATCH = 1024,
+};
+
 struct memtx_space {
 	uint32_t id;
+	/**
+	 * Число готовых индексов. Строящийся индекс (см.
+	 * memtx_space_build_index_begin) лежит сразу за ними.
+	 */
 	uint32_t index_count;
-	struct index index[];
+	/** Формат таплов: по нему строится field map ключевых полей. */
+	struct tuple_format *format;
+	/**
+	 * Спейс виден только транзакции @a txn, которая его создала (см.
+	 * memtx_space_new_ephemeral): запись в него идет прямо в индексы,
+	 * без stories, трекеров и GC TX менеджера.
+	 */
+	bool is_ephemeral;
+	/** Транзакция-владелец ephemeral спейса, иначе NULL. */
+	struct txn *txn;
+	/** Ссылка в txn::ephemeral_spaces владельца. */
+	struct rlist in_ephemeral_spaces;
+	/**
+	 * Индексы, каждый аллоцирован отдельно: на них ссылаются stories,
+	 * point holes и gap'ы, поэтому они не перемещаются, даже когда
+	 * массив растет при построении нового индекса.
+	 */
+	struct index **index;
 };
 
 int
 memtx_space_execute_replace(struct memtx_space *space, struct txn *txn, struct tuple *new_tuple, enum dup_replace_mode mode, struct tuple **result);
 
+/**
+ * Найти тапл по ключу @a key в индексе @a index_id, видимый транзакции
+ * @a txn, и записать это чтение в TX менеджер. @a key - MsgPack значение
+ * ключевого поля, уже проверенное key_validate.
+ */
+int
+memtx_space_get(struct memtx_space *space, struct txn *txn, uint32_t index_id, const char *key, struct tuple **result);
+
+/**
+ * Записать в @a result до @a limit таплов с ключом @a key в индексе
+ * @a index_id, видимых транзакции @a txn, как memtx_space_get. В
+ * неуникальном индексе таплы идут по возрастанию первичного ключа. Чтение
+ * всей группы ключа трекается, так что вставка в нее другой транзакцией
+ * - конфликт. Если @a result == NULL, таплы только считаются.
+ *
+ * @return число найденных таплов.
+ */
+uint32_t
+memtx_space_select(struct memtx_space *space, struct txn *txn, uint32_t index_id, const char *key, struct tuple **result, uint32_t limit);
+
+/**
+ * Число элементов индекса @a index_id, видимых @a txn: размер индекса
+ * минус невидимые грязные элементы. Чтение числа трекается, см.
+ * memtx_tx_track_count.
+ */
+size_t
+memtx_space_count(struct memtx_space *space, struct txn *txn, uint32_t index_id);
+
+/**
+ * Число элементов неуникального индекса @a index_id с ключами от @a from
+ * до @a to включительно (NULL - без границы), видимых @a txn. Видимость
+ * проверяется для каждого элемента отрезка, чтение отрезка трекается, см.
+ * memtx_tx_track_range.
+ */
+size_t
+memtx_space_count_range(struct memtx_space *space, struct txn *txn, uint32_t index_id, const char *from, const char *to);
+
+/**
+ * Видимый @a txn тапл с наименьшим (@a is_max == false) или наибольшим
+ * ключом в неуникальном индексе @a index_id или NULL, если видимых нет.
+ * Трекается отрезок от края индекса до ключа найденного тапла.
+ */
+struct tuple *
+memtx_space_min_max(struct memtx_space *space, struct txn *txn, uint32_t index_id, bool is_max);
+
+int
+memtx_space_execute_delete(struct memtx_space *space, struct txn *txn, uint32_t index_id, const char *key, struct tuple **result);
+
+/**
+ * Применить операции [@a ops, @a ops_end) (см. tuple_update.h) к таплу,
+ * найденному по ключу @a key в индексе @a index_id, как memtx_space_get.
+ * Если тапла нет, ничего не делает, *result == NULL.
+ */
+int
+memtx_space_execute_update(struct memtx_space *space, struct txn *txn, uint32_t index_id, const char *key, const char *ops, const char *ops_end, struct tuple **result);
+
+/**
+ * Вставить @a new_tuple или, если тапл с таким первичным ключом уже
+ * есть, применить к нему операции [@a ops, @a ops_end).
+ *
+ * С @a is_tracked прочитанная версия трекается, а отсутствие ключа
+ * гарантирует вставка с DUP_INSERT. Без него (отложенный upsert при
+ * prepare, см. txn_add_upsert) не трекается ничего, как в
+ * memtx_space_execute_delta.
+ */
+int
+memtx_space_execute_upsert(struct memtx_space *space, struct txn *txn, struct tuple *new_tuple, const char *ops, const char *ops_end, bool is_tracked);
+
+/**
+ * Записать в *@a is_blind, что @a txn не видит тапла с первичным ключом
+ * @a new_tuple, так что upsert будет вставкой. Чтение не трекается.
+ */
+int
+memtx_space_upsert_is_blind(struct memtx_space *space, struct txn *txn, struct tuple *new_tuple, bool *is_blind);
+
+/**
+ * Применить коммутативные операции [@a ops, @a ops_end) к самой новой
+ * версии тапла с ключом @a key в индексе @a index_id, которую видит
+ * @a txn, включая prepared. В отличие от memtx_space_execute_update,
+ * ни версия, ни отсутствие тапла не трекаются. Вызывается при prepare
+ * для отложенных изменений транзакции, см. txn_delta.
+ */
+int
+memtx_space_execute_delta(struct memtx_space *space, struct txn *txn, uint32_t index_id, const char *key, const char *ops, const char *ops_end);
+
+/**
+ * Вставить @a count новых таплов прямо в индексы, в обход TX менеджера:
+ * у таплов не будет историй, и они сразу видны всем. Поэтому годится
+ * только для спейса, который не может наблюдать ни одна транзакция, см.
+ * memtx_tx_space_is_unobserved. Если ключ повторяется, не вставляется
+ * ничего.
+ */
+int
+memtx_space_load(struct memtx_space *space, struct tuple **tuples, uint32_t count);
+
+/**
+ * Создать спейс с индексами по ключам @a key_defs: индекс i строится
+ * по key_defs[i]. Вторичные индексы могут быть неуникальными, multikey
+ * (тогда в уникальном индексе уникален каждый элемент массива),
+ * функциональными, частичными и sparse, первичный - нет.
+ */
+struct memtx_space *
+memtx_space_new_with_key_defs(const key_def *key_defs, uint32_t index_count);
+
+/**
+ * Начать построение индекса по ключу @a def на живом спейсе, без
+ * остановки записи. Индекс получит номер space->index_count, но до конца
+ * построения его не видит никто: его заполняют шаги построения, а
+ * одновременно с ними все физические замены в первичном индексе сразу
+ * повторяются и в новом.
+ *
+ * Новые таплы с этого момента создаются в формате с новым ключом, так
+ * что тапл, который не подходит под индекс, не вставится. Функциональные
+ * и частичные индексы так строить нельзя, и в спейсе не может строиться
+ * два индекса сразу.
+ */
+int
+memtx_space_build_index_begin(struct memtx_space *space, const key_def *def);
+
+/**
+ * Шаг построения индекса спейса @a space: переносить в него таплы,
+ * существовавшие до начала построения, пачками по
+ * MEMTX_INDEX_BUILD_BATCH, пока не истечет @a budget секунд. Перенеся
+ * все, сделать индекс доступным: всю историю спейса приходится удалить,
+ * поэтому транзакции, работавшие со спейсом, и read view, которым она
+ * нужна, абортятся, как при DDL (см. memtx_tx_space_clear_history).
+ * Вызывается вне транзакции.
+ *
+ * @retval 1 индекс готов, 0 построение продолжается, -1 ошибка (тапл
+ *         не подходит под ключ или дубликат в уникальном индексе), тогда
+ *         построение отменено.
+ */
+int
+memtx_space_build_index_step(struct memtx_space *space, double budget);
+
+/** Отменить построение индекса спейса @a space, если оно идет. */
+void
+memtx_space_build_index_abort(struct memtx_space *space);
+
+/** Идет ли построение индекса спейса @a space. */
+bool
+memtx_space_build_index_is_active(struct memtx_space *space);
+
+/**
+ * Сделать шаги всех идущих построений индексов, поделив между ними
+ * @a budget секунд. Ошибки печатаются, неудачные построения отменяются.
+ */
+void
+memtx_space_build_index_idle(double budget);
+
+/**
+ * Создать ephemeral спейс с индексами по ключам @a key_defs (см.
+ * memtx_space_new_with_key_defs) для транзакции @a txn: временное
+ * хранилище, например, для сортировки и дедупликации, которое никто,
+ * кроме нее, не видит. Поэтому TX менеджер в нем не участвует: записи
+ * сразу ложатся в индексы и видны, чтения не трекаются, откат
+ * транзакции записи не откатывает. Построение индексов не поддерживается.
+ *
+ * Спейс удаляется целиком вместе со всеми таплами, когда транзакция
+ * завершается (см. txn_free), или раньше, memtx_space_delete_ephemeral.
+ */
+struct memtx_space *
+memtx_space_new_ephemeral(struct txn *txn, const key_def *key_defs, uint32_t index_count);
+
+/**
+ * Удалить ephemeral спейс @a space. Таплы, на которые остались ссылки,
+ * не освобождаются и держат свой формат, так что читать их можно как
+ * обычно.
+ */
+void
+memtx_space_delete_ephemeral(struct memtx_space *space);
+
+/**
+ * Заменить в ephemeral спейсе @a space тапл @a old_tuple на @a new_tuple
+ * прямо в индексах. Если @a old_tuple == NULL, заменяемый тапл ищется по
+ * первичному ключу @a new_tuple и проверяется по @a mode. Дубликат в
+ * уникальном индексе - ошибка, и тогда спейс не меняется.
+ */
+int
+memtx_space_ephemeral_replace(struct memtx_space *space, struct tuple *old_tuple, struct tuple *new_tuple, enum dup_replace_mode mode);
+
+/** Удалить тапл ephemeral спейса по ключу, как memtx_space_execute_delete. */
 int
-memtx_space_execute_delete(struct memtx_space *space, struct txn *txn, uint32_t index_id, int key, struct tuple **result);
+memtx_space_ephemeral_delete(struct memtx_space *space, uint32_t index_id, const char *key);
 
+/**
+ * Применить операции [@a ops, @a ops_end) к таплу ephemeral спейса с
+ * ключом @a key в индексе @a index_id, как memtx_space_execute_update.
+ */
+int
+memtx_space_ephemeral_update(struct memtx_space *space, uint32_t index_id, const char *key, const char *ops, const char *ops_end);
+
+/** Upsert в ephemeral спейс, как memtx_space_execute_upsert. */
+int
+memtx_space_ephemeral_upsert(struct memtx_space *space, struct tuple *new_tuple, const char *ops, const char *ops_end);
+
+/** Спейс, в котором индекс i строится по целому полю i. */
 struct memtx_space *
 memtx_space_new(uint32_t index_count);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
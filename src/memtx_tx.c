@@ -2,6 +2,9 @@
 #include "key_def.h"
 #include "salad/stailq.h"
 #include "memtx_space.h"
+#include "clock.h"
+#include "tx_profile.h"
+#include "trivia/util.h"
 
 enum {
 	/**
@@ -16,20 +19,48 @@ static_assert((int)MEMTX_TX_ROLLBACKED_PSN < (int)TXN_MIN_PSN,
 
 struct memtx_story;
 
+/*
+ * Ссылка story в цепочке одного ключа индекса. Цепочки связывают ссылки,
+ * а не stories: у multikey индекса story стоит сразу в нескольких
+ * цепочках одного индекса, по одной на ключ.
+ *
+ * Ссылки лежат в самой story, и на каждую story их столько же, сколько
+ * ключей у тапла, поэтому ссылка не хранит ни указатель на story (она
+ * находится по pos), ни отдельный указатель на индекс для in_index.
+ */
 struct memtx_story_link {
-	struct memtx_story *newer_story;
-	struct memtx_story *older_story;
+	/* Индекс цепочки. */
+	struct index *index;
+	/* Номер ссылки в story->link, см. memtx_tx_link_story. */
+	uint32_t pos;
+	/* Какой из ключей тапла в индексе (см. index_entry). */
+	uint32_t mk_index : 29;
+	/*
+	 * 1, если и только если соотв. story представлена в индексе (соотв.
+	 * тапл физически лежит в дереве индекса по этому ключу).
+	 */
+	uint32_t in_index : 1;
+	/* 1, если элемент учтен в index->invisible_count. */
+	uint32_t is_invisible : 1;
+	/* Метка прохода memtx_tx_index_invisible_count по верхушкам. */
+	uint32_t is_visited : 1;
+	struct memtx_story_link *newer;
+	struct memtx_story_link *older;
     /*
 	 * Зафиксированные случаи, отсутствия ключа в момент выполнения REPLACE,
 	 * тапл, соответствующий данной стори, был следующим справа от вставляемого тапла.
 	 */
 	struct rlist read_gaps;
 	/*
-	 * != NULL, если и только если соотв. story представлена в индексе (соотв.
-	 * тапл физически лежит в дереве индекса). Указывает, очевидно, на индекс,
-	 * в котором тапл находится.
+	 * Skip-указатель для читателей в read view: более старая ссылка цепочки,
+	 * до которой (не включая её) все stories закоммичены и имеют add_psn и
+	 * del_psn не меньше skip_psn. Читатель с rv_psn <= skip_psn не увидит
+	 * ни одну из них и может сразу перейти к skip. NULL - указателя нет.
 	 */
-	struct index *in_index;
+	struct memtx_story_link *skip;
+	/* Ссылка, чей skip указывает на данную (не больше одной). */
+	struct memtx_story_link *skip_from;
+	int64_t skip_psn;
 };
 
 struct memtx_story {
@@ -59,12 +90,26 @@ struct memtx_story {
 	struct rlist reader_list;
 	/* Link in tx_manager::all_stories */
 	struct rlist in_all_stories;
-	/* Кол-во индексов мы тут прихранили. */
-	uint32_t index_count;
+	/* Link in tx_manager::prepared_stories. */
+	struct rlist in_prepared_stories;
+	/*
+	 * Кол-во ссылок: по одной на каждый ключ тапла в каждом индексе.
+	 * Ссылки упорядочены по индексу и mk_index, первичный ключ - link[0].
+	 * Если в спейсе нет multikey индексов, link[i] - ссылка в индексе i.
+	 */
+	uint32_t link_count;
 	enum memtx_tx_story_status status;
 	struct memtx_story_link link[];
 };
 
+/** Story, которой принадлежит ссылка @a link. */
+static inline struct memtx_story *
+memtx_tx_link_story(struct memtx_story_link *link)
+{
+	return (struct memtx_story *)((char *)(link - link->pos) -
+				      offsetof(struct memtx_story, link));
+}
+
 static uint32_t
 memtx_tx_story_key_hash(const struct tuple *a)
 {
@@ -94,6 +139,9 @@ struct tx_read_tracker {
 	struct rlist in_read_set;
 };
 
+static void
+tx_read_tracker_delete(struct tx_read_tracker *tracker);
+
 /**
  * Элемент, который содержит информацию о том, что какая-то транзакция
  * прочитала full key и ничего не нашли.
@@ -106,12 +154,21 @@ struct point_hole_item {
 	struct rlist ring;
 	/** Ссылка в txn->point_holes_list. */
 	struct rlist in_point_holes_list;
+	/**
+	 * Индекс, в котором искали. Индексы не удаляются, поэтому ссылку на
+	 * него не берем; нужен только key_def для сравнения ключей.
+	 */
+	struct index *index;
 	/** Saved index->unique_id. */
 	uint32_t index_unique_id;
 	/** Precalculated hash for storing in hash table. */
 	uint32_t hash;
 	struct txn *txn;
-	int key;
+	/** MsgPack ключ: short_key или память сразу за элементом. */
+	const char *key;
+	uint32_t key_len;
+	/** Короткие ключи хранятся прямо в элементе. */
+	char short_key[16];
 	/** Flag that the hash tables stores pointer to this item. */
 	bool is_head;
 };
@@ -121,11 +178,38 @@ struct inplace_gap_item {
 	struct rlist in_read_gaps;
 	struct rlist in_gap_list;
 	struct txn *txn;
+	/* Элемент перенесен из point hole (нужно только для статистики конфликтов). */
+	bool is_point_hole;
+	/* Элемент - range_gap_item. */
+	bool is_range;
 };
 
+/*
+ * Читатель отрезка ключей индекса (memtx_tx_track_range) в index::read_gaps.
+ * Остальные элементы этого списка - читатели числа элементов.
+ */
+struct range_gap_item {
+	struct inplace_gap_item base;
+	/* Границы отрезка (NULL - без границы) лежат сразу за элементом. */
+	const char *from;
+	const char *to;
+	/* Размер аллокации вместе с границами. */
+	uint32_t size;
+};
+
+/** Аллоцировать объект TX менеджера, учитывая его в статистике. */
+static void *
+memtx_tx_alloc(size_t size, enum memtx_tx_alloc_object object);
+
+/** Освободить объект, аллоцированный через memtx_tx_alloc. */
+static void
+memtx_tx_free(void *ptr, size_t size, enum memtx_tx_alloc_object object);
+
 static void
 gap_item_base_create(struct inplace_gap_item *item, struct txn *txn) {
 	item->txn = txn;
+	item->is_point_hole = false;
+	item->is_range = false;
     /* У транзакции может быть несколько inplace_gap_item. */
 	rlist_add(&txn->gap_list, &item->in_gap_list);
 }
@@ -133,7 +217,8 @@ gap_item_base_create(struct inplace_gap_item *item, struct txn *txn) {
 /** Учтите, что in_read_gaps должен быть проинициализирован позже. */
 static struct inplace_gap_item *
 memtx_tx_inplace_gap_item_new(struct txn *txn) {
-	struct inplace_gap_item *item = (struct inplace_gap_item *)malloc(sizeof(struct inplace_gap_item));
+	struct inplace_gap_item *item = (struct inplace_gap_item *)
+		memtx_tx_alloc(sizeof(struct inplace_gap_item), MEMTX_TX_OBJECT_GAP_ITEM);
 	gap_item_base_create(item, txn);
 	return item;
 }
@@ -143,18 +228,22 @@ memtx_tx_inplace_gap_item_delete(struct inplace_gap_item *item) {
     /* Удаляем из обоих списков. */
     rlist_del(&item->in_gap_list);
 	rlist_del(&item->in_read_gaps);
-    free(item);
+	size_t size = sizeof(struct inplace_gap_item);
+	if (item->is_range)
+		size = ((struct range_gap_item *)item)->size;
+	memtx_tx_free(item, size, MEMTX_TX_OBJECT_GAP_ITEM);
 }
 
 /* Хелпер структура для поиска point_hole_item в хеш-таблице */
 struct point_hole_key {
 	/** Индекс, в котором осуществлялся поиск. */
 	struct index *index;
-	/** Мы используем тапл как ключ - он сравнивается с ключом из point_hole_item. */
-	struct tuple *tuple;
-	/* func_key пока игнорируем. */
-	/** Functional key of the tuple, must be set if index is functional. */
-	//tuple *func_key;
+	/**
+	 * Ключ вставленного тапла в этом индексе (для multikey - элемент
+	 * массива, для функционального - ключ, вычисленный при создании
+	 * тапла), сравнивается с ключом из point_hole_item.
+	 */
+	const char *key;
 };
 
 static uint32_t
@@ -168,28 +257,20 @@ static uint32_t
 point_hole_storage_key_hash(struct point_hole_key *key)
 {
 	key_def *def = &key->index->_key_def;
-	//uint32_t tuple_hash = 0;
-	/* func_key пока игнорируем. */
-	//if (likely(!def->for_func_index)) {
-	//	assert(key->func_key == NULL);
-	//	tuple_hash = tuple_hash(key->tuple, def);
-	//} else {
-	//	assert(key->func_key != NULL);
-	//	const char *data = tuple_data(key->func_key);
-	//	mp_decode_array(&data);
-	//	tuple_hash = key_hash(data, def);
-	//}
-	return point_hole_storage_combine_index_and_tuple_hash(key->index, tuple_hash(key->tuple, def));
+	return point_hole_storage_combine_index_and_tuple_hash(key->index, key_hash(key->key, def));
 }
 
 /** point_hole_item компаратор. */
 static int
 point_hole_storage_equal(const struct point_hole_item *obj1, const struct point_hole_item *obj2)
 {
-	/* Canonical msgpack is comparable by memcmp. */
 	if (obj1->index_unique_id != obj2->index_unique_id)
 		return 1;
-	return obj1->key == obj2->key;
+	/*
+	 * MsgPack здесь не канонический (1 бывает и MP_UINT, и MP_INT),
+	 * поэтому memcmp не годится - сравниваем по типу ключа.
+	 */
+	return key_compare(obj1->key, obj2->key, &obj1->index->_key_def) != 0;
 }
 
 /** point_hole_item компаратор с ключом. */
@@ -199,18 +280,13 @@ point_hole_storage_key_equal(const struct point_hole_key *key, const struct poin
 	if (key->index->unique_id != object->index_unique_id)
 		return 1;
 	assert(key->index != NULL);
-	assert(key->tuple != NULL);
+	assert(key->key != NULL);
 	key_def *def = &key->index->_key_def;
-	/* Для простоты считаем, что никаких хинтов у нас пока нет. */
-	//uint64_t tuple_hint = HINT_NONE;
-	/* func_key пока игнорируем. */
-	//if (unlikely(def->for_func_index))
-	//	tuple_hint = (uint64_t)key->func_key;
 	/*
-	 * Note that it's OK to always pass HINT_NONE for the key - hints
-	 * won't be used then if the index is not functional.
+	 * Хинтов, через которые tarantool передает функциональный ключ, у
+	 * нас нет: он лежит в тапле, и key->key уже указывает на него.
 	 */
-	return tuple_compare_with_key(key->tuple, object->key, def);
+	return key_compare(key->key, object->key, def);
 }
 
 #define mh_name _point_holes
@@ -246,10 +322,26 @@ struct tx_manager
 	struct mh_point_holes_t *point_holes;
 	/** List of all memtx_story objects. */
 	struct rlist all_stories;
+	/*
+	 * Stories с PSN (подготовленные вставка или удаление), упорядоченные
+	 * по наибольшему из них: с конца списка берутся stories, которые
+	 * читатель в read view видит не так, как остальные.
+	 */
+	struct rlist prepared_stories;
 	/** Iterator that sequentially traverses all memtx_story objects. */
 	struct rlist *traverse_all_stories;
 	/** Accumulated number of GC steps that should be done. */
 	size_t must_do_gc_steps;
+	/**
+	 * Сглаженная доля шагов GC, которые что-то удалили. Определяет,
+	 * сколько шагов выгодно делать на пути записи.
+	 */
+	double gc_garbage_ratio;
+	/** Статистика памяти, см. memtx_tx_statistics_collect. */
+	struct memtx_tx_statistics stats;
+	/** Ключи, на которых чаще всего конфликтуют транзакции. */
+	struct memtx_tx_hot_key hot_keys[MEMTX_TX_HOT_KEYS_MAX];
+	uint32_t hot_key_count;
 };
 
 enum {
@@ -259,11 +351,70 @@ enum {
 	 * a new story.
 	 */
 	TX_MANAGER_GC_STEPS_SIZE = 2,
+	/**
+	 * Максимальное число шагов GC за один вызов на пути записи, чтобы
+	 * после массовых удалений не расплачиваться за них латентностью.
+	 */
+	TX_MANAGER_GC_STEPS_MAX = 64,
+	/**
+	 * Если долг больше TX_MANAGER_GC_BACKLOG_FACTOR * TX_MANAGER_GC_STEPS_MAX
+	 * шагов, GC на пути записи делает максимум шагов независимо от доли мусора.
+	 */
+	TX_MANAGER_GC_BACKLOG_FACTOR = 8,
+	/** Раз во сколько шагов memtx_tx_story_gc_idle проверяет время. */
+	TX_MANAGER_GC_IDLE_CLOCK_STEPS = 16,
+	/**
+	 * Сколько таплов без ссылок должно накопиться, чтобы GC на пути
+	 * записи начал их освобождать, и сколько он освобождает за вызов.
+	 * Остальное освобождает memtx_tx_story_gc_idle.
+	 */
+	TX_MANAGER_TUPLE_GC_BATCH = 64,
 };
 
 /* Менеджер */
 static struct tx_manager txm;
 
+static inline void
+memtx_tx_mem_stat_add(struct memtx_tx_mem_stat *stat, size_t size)
+{
+	stat->count++;
+	stat->total += size;
+}
+
+static inline void
+memtx_tx_mem_stat_sub(struct memtx_tx_mem_stat *stat, size_t size)
+{
+	assert(stat->count > 0 && stat->total >= size);
+	stat->count--;
+	stat->total -= size;
+}
+
+static void *
+memtx_tx_alloc(size_t size, enum memtx_tx_alloc_object object)
+{
+	void *ptr = xmalloc(size);
+	memtx_tx_mem_stat_add(&txm.stats.objects[object], size);
+	txm.stats.total += size;
+	txm.stats.allocated += size;
+	return ptr;
+}
+
+static void
+memtx_tx_free(void *ptr, size_t size, enum memtx_tx_alloc_object object)
+{
+	memtx_tx_mem_stat_sub(&txm.stats.objects[object], size);
+	assert(txm.stats.total >= size);
+	txm.stats.total -= size;
+	free(ptr);
+}
+
+static inline bool
+memtx_tx_memory_limit_is_exceeded(void)
+{
+	return txm.stats.memory_limit != 0 &&
+	       txm.stats.total > txm.stats.memory_limit;
+}
+
 /* Очистить все read списки транзакции @a txn. */
 static void
 memtx_tx_clear_txn_read_lists(struct txn *txn);
@@ -328,12 +479,28 @@ memtx_tx_send_to_read_view(struct txn *txn, int64_t psn)
 	memtx_tx_adjust_position_in_read_view_list(txn); // единственное место вызова
 }
 
+/** Сколько байт занимает @a story вместе со ссылками во всех индексах. */
+static inline size_t
+memtx_tx_story_size(const struct memtx_story *story)
+{
+	return sizeof(struct memtx_story) +
+	       story->link_count * sizeof(struct memtx_story_link);
+}
+
+static bool
+memtx_tx_tuple_key_is_excluded(struct tuple *tuple, struct index *index, key_def *def);
+
 static inline void
 memtx_tx_story_set_status(struct memtx_story *story, enum memtx_tx_story_status new_status)
 {
 	assert(story->status < MEMTX_TX_STORY_STATUS_MAX);
+	assert(new_status < MEMTX_TX_STORY_STATUS_MAX);
+	if (story->status == new_status)
+		return;
+	size_t size = memtx_tx_story_size(story);
+	memtx_tx_mem_stat_sub(&txm.stats.stories[story->status], size);
+	memtx_tx_mem_stat_add(&txm.stats.stories[new_status], size);
 	story->status = new_status;
-    //дальше обновление статистик - нам не интересно
 }
 
 static struct memtx_story *
@@ -341,11 +508,28 @@ memtx_tx_story_new(struct memtx_space *space, struct tuple *tuple)
 {
 	txm.must_do_gc_steps += TX_MANAGER_GC_STEPS_SIZE;
 	assert(!tuple_has_flag(tuple, TUPLE_IS_DIRTY));
-	uint32_t index_count = space->index_count;
+	/* Сколько у тапла ключей во всех индексах. */
+	uint32_t link_count = 0;
+	struct tuple_key_iterator it;
+	uint32_t mk_index;
+	for (uint32_t i = 0; i < space->index_count; i++) {
+		struct index *index = space->index[i];
+		if (memtx_tx_tuple_key_is_excluded(tuple, index, &index->_key_def))
+			continue;
+		if (!index->_key_def.is_multikey) {
+			link_count++;
+			continue;
+		}
+		tuple_key_iterator_create(&it, tuple, &index->_key_def);
+		while (tuple_key_iterator_next(&it, &mk_index) != NULL)
+			link_count++;
+	}
 	struct memtx_story *story = (struct memtx_story *)
-        (malloc(sizeof(struct memtx_story) +
-            index_count * sizeof(struct memtx_story_link)));
+		memtx_tx_alloc(sizeof(struct memtx_story) +
+			       link_count * sizeof(struct memtx_story_link),
+			       MEMTX_TX_OBJECT_STORY);
 	story->tuple = tuple;
+	tuple_ref(tuple);
 
 	const struct memtx_story **put_story =
 	(const struct memtx_story **) &story;
@@ -353,21 +537,46 @@ memtx_tx_story_new(struct memtx_space *space, struct tuple *tuple)
 	struct memtx_story **preplaced = &replaced;
 	mh_history_put(txm.history, put_story, &preplaced, 0);
 	assert(preplaced == NULL);
+	tuple_set_flag(tuple, TUPLE_IS_DIRTY);
 	story->status = MEMTX_TX_STORY_USED;
 
-	story->index_count = index_count;
+	story->link_count = link_count;
+	memtx_tx_mem_stat_add(&txm.stats.stories[MEMTX_TX_STORY_USED], memtx_tx_story_size(story));
+	txm.stats.links.count += link_count;
+	txm.stats.links.total += link_count * sizeof(struct memtx_story_link);
 	story->add_stmt = NULL;
 	story->add_psn = 0;
 	story->del_stmt = NULL;
 	story->del_psn = 0;
 	rlist_create(&story->reader_list);
 	rlist_add_tail(&txm.all_stories, &story->in_all_stories);
+	rlist_create(&story->in_prepared_stories);
 
-	for (uint32_t i = 0; i < index_count; i++) {
-		story->link[i].newer_story = story->link[i].older_story = NULL;
-		rlist_create(&story->link[i].read_gaps);
-		story->link[i].in_index = &space->index[i];
+	struct memtx_story_link *link = story->link;
+	for (uint32_t i = 0; i < space->index_count; i++) {
+		struct index *index = space->index[i];
+		if (memtx_tx_tuple_key_is_excluded(tuple, index, &index->_key_def))
+			continue;
+		tuple_key_iterator_create(&it, tuple, &index->_key_def);
+		while (tuple_key_iterator_next(&it, &mk_index) != NULL) {
+			link->index = index;
+			link->pos = link - story->link;
+			/* Столько элементов в массиве тапла не бывает. */
+			assert(mk_index < (1U << 29));
+			link->mk_index = mk_index;
+			link->in_index = 1;
+			link->is_invisible = 0;
+			link->is_visited = 0;
+			link->newer = link->older = NULL;
+			link->skip = link->skip_from = NULL;
+			link->skip_psn = 0;
+			rlist_create(&link->read_gaps);
+			link++;
+		}
 	}
+	assert(link == story->link + link_count);
+	/* Первичный ключ есть у любого тапла и всегда один. */
+	assert(link_count > 0 && story->link[0].index->dense_id == 0);
 	return story;
 }
 
@@ -379,15 +588,19 @@ memtx_tx_story_delete(struct memtx_story *story)
 	assert(story->add_stmt == NULL);
 	assert(story->del_stmt == NULL);
 	assert(rlist_empty(&story->reader_list));
-	for (uint32_t i = 0; i < story->index_count; i++) {
-		assert(story->link[i].newer_story == NULL);
-		assert(story->link[i].older_story == NULL);
+	for (uint32_t i = 0; i < story->link_count; i++) {
+		assert(story->link[i].newer == NULL);
+		assert(story->link[i].older == NULL);
 		assert(rlist_empty(&story->link[i].read_gaps));
+		assert(story->link[i].skip == NULL);
+		assert(story->link[i].skip_from == NULL);
+		assert(!story->link[i].is_invisible);
 	}
 
 	if (txm.traverse_all_stories == &story->in_all_stories)
 		txm.traverse_all_stories = rlist_next(txm.traverse_all_stories);
 	rlist_del(&story->in_all_stories);
+	rlist_del(&story->in_prepared_stories);
 
     /* Удаляем из мапчика tuple -> story. */
 	mh_int_t pos = mh_history_find(txm.history, story->tuple, 0);
@@ -395,8 +608,13 @@ memtx_tx_story_delete(struct memtx_story *story)
 	mh_history_del(txm.history, pos, 0);
 
 	tuple_clear_flag(story->tuple, TUPLE_IS_DIRTY);
+	tuple_unref(story->tuple);
 
-	free(story);
+	size_t size = memtx_tx_story_size(story);
+	memtx_tx_mem_stat_sub(&txm.stats.stories[story->status], size);
+	txm.stats.links.count -= story->link_count;
+	txm.stats.links.total -= story->link_count * sizeof(struct memtx_story_link);
+	memtx_tx_free(story, size, MEMTX_TX_OBJECT_STORY);
 }
 
 static struct memtx_story *
@@ -460,131 +678,240 @@ memtx_tx_story_unlink_deleted_by(struct memtx_story *story, struct txn_stmt *stm
 }
 
 /**
- * Соединяет @a story с @a old_story в @a индексе (в обоих направлениях).
- * @a old_story может быть NULL.
+ * Соединяет ссылку @a link с более старой @a old_link одной цепочки (в обоих
+ * направлениях). @a old_link может быть NULL.
  */
 static void
-memtx_tx_story_link(struct memtx_story *story, struct memtx_story *old_story, uint32_t idx)
+memtx_tx_story_link(struct memtx_story_link *link, struct memtx_story_link *old_link)
 {
-	assert(idx < story->index_count);
-	struct memtx_story_link *link = &story->link[idx];
-	assert(link->older_story == NULL);
+	assert(link->older == NULL);
 
-	if (old_story == NULL)
+	if (old_link == NULL)
 		return;
 
-	assert(idx < old_story->index_count);
-	struct memtx_story_link *old_link = &old_story->link[idx];
-	assert(old_link->newer_story == NULL);
+	assert(old_link->index == link->index);
+	assert(old_link->newer == NULL);
 
-	link->older_story = old_story;
-	old_link->newer_story = story;
+	link->older = old_link;
+	old_link->newer = link;
 }
 
 /**
- * Отсоединяет @a story от @a old_story в @a индексе (в обоих направлениях).
- * Older story может быть NULL.
+ * Отсоединяет ссылку @a link от @a old_link (в обоих направлениях).
+ * Older link может быть NULL.
  */
 static void
-memtx_tx_story_unlink(struct memtx_story *story, struct memtx_story *old_story, uint32_t idx)
+memtx_tx_story_unlink(struct memtx_story_link *link, struct memtx_story_link *old_link)
 {
-	assert(idx < story->index_count);
-	struct memtx_story_link *link = &story->link[idx];
-	assert(link->older_story == old_story);
+	assert(link->older == old_link);
 
-	if (old_story == NULL)
+	if (old_link == NULL)
 		return;
 
-	assert(idx < old_story->index_count);
-	struct memtx_story_link *old_link = &old_story->link[idx];
-	assert(old_link->newer_story == story);
+	assert(old_link->newer == link);
+
+	link->older = NULL;
+	old_link->newer = NULL;
+}
+
+/**
+ * Удаляет skip-указатели, которые начинаются или заканчиваются в @a link.
+ * Вызывается перед тем, как story меняет свое место в цепочке или покидает
+ * её: указатели через story остаются корректными, а указатели на неё - нет.
+ */
+static void
+memtx_tx_story_clear_skip(struct memtx_story_link *link)
+{
+	if (link->skip != NULL) {
+		assert(link->skip->skip_from == link);
+		link->skip->skip_from = NULL;
+		link->skip = NULL;
+	}
+	if (link->skip_from != NULL) {
+		assert(link->skip_from->skip == link);
+		link->skip_from->skip = NULL;
+		link->skip_from = NULL;
+	}
+}
+
+/**
+ * Проставляет skip-указатель из @a link в более старую ссылку @a skip_link
+ * той же цепочки. Существующий указатель заменяется, только если новый
+ * годится всем читателям, которым годился старый (@a skip_psn не меньше),
+ * иначе более новые read view перезатирали бы указатели более старых.
+ */
+static void
+memtx_tx_story_set_skip(struct memtx_story_link *link, struct memtx_story_link *skip_link, int64_t skip_psn)
+{
+	if (link->skip == skip_link ||
+	    (link->skip != NULL && link->skip_psn > skip_psn))
+		return;
+	if (link->skip != NULL) {
+		link->skip->skip_from = NULL;
+		link->skip = NULL;
+	}
+	if (skip_link->skip_from != NULL)
+		skip_link->skip_from->skip = NULL;
+	skip_link->skip_from = link;
+	link->skip = skip_link;
+	link->skip_psn = skip_psn;
+}
+
+/**
+ * Story закоммичена, и ни вставка, ни удаление не видны читателю в read
+ * view @a rv_psn: проход по цепочке просто перешагнул бы её.
+ */
+static bool
+memtx_tx_story_is_skippable(struct memtx_story *story, int64_t rv_psn)
+{
+	return story->add_stmt == NULL && story->del_stmt == NULL &&
+	       story->add_psn >= rv_psn &&
+	       (story->del_psn == 0 || story->del_psn >= rv_psn);
+}
+
+/** Минимальный PSN story, учитываемый в skip_psn. */
+static int64_t
+memtx_tx_story_min_psn(struct memtx_story *story)
+{
+	if (story->del_psn == 0)
+		return story->add_psn;
+	return MIN(story->add_psn, story->del_psn);
+}
+
+/** Элемент индекса, который представляет ссылка @a link. */
+static inline struct index_entry
+memtx_tx_story_link_entry(struct memtx_story_link *link)
+{
+	struct index_entry entry = {memtx_tx_link_story(link)->tuple, link->mk_index};
+	return entry;
+}
+
+/** Ключ цепочки @a link: MsgPack значение внутри тапла story. */
+static inline const char *
+memtx_tx_story_link_key(struct memtx_story_link *link)
+{
+	return tuple_extract_multikey(memtx_tx_link_story(link)->tuple, &link->index->_key_def, link->mk_index);
+}
+
+/**
+ * Ссылка @a story в цепочке ключа @a mk_index индекса @a index или NULL,
+ * если этого ключа у тапла в индексе нет.
+ */
+static struct memtx_story_link *
+memtx_tx_story_find_link(struct memtx_story *story, struct index *index, uint32_t mk_index)
+{
+	/* Быстрый путь: в спейсе без multikey индексов ссылка i - индекс i. */
+	uint32_t i = index->dense_id;
+	if (i < story->link_count && story->link[i].index == index &&
+	    story->link[i].mk_index == mk_index)
+		return &story->link[i];
+	for (i = 0; i < story->link_count; i++) {
+		struct memtx_story_link *link = &story->link[i];
+		if (link->index == index && link->mk_index == mk_index)
+			return link;
+	}
+	return NULL;
+}
 
-	link->older_story = NULL;
-	old_link->newer_story = NULL;
+/**
+ * Учесть (@a is_invisible) или перестать учитывать элемент индекса
+ * @a link в index->invisible_count.
+ */
+static inline void
+memtx_tx_link_count_invisible(struct memtx_story_link *link, bool is_invisible)
+{
+	if (link->is_invisible == is_invisible)
+		return;
+	link->is_invisible = is_invisible;
+	if (is_invisible) {
+		link->index->invisible_count++;
+	} else {
+		assert(link->index->invisible_count > 0);
+		link->index->invisible_count--;
+	}
 }
 
 /**
- * Соединили @a new_top с @a old_top в @a idx (в обоих направлениях), где
- * @a old_top был на верхушке цепочки.
+ * Соединили @a new_link с @a old_link (в обоих направлениях), где
+ * @a old_link был на верхушке цепочки.
  * Есть две различных, но очень похожих реализационных сценариев, в которых
  * данная функция может использоваться:
  *
  * * @a is_new_tuple == true:
- *   @a new_top это только что созданная story для нового тапла, который
- *   только что был вставлен в индекс. @a old_top это story, которая до этого
- *   была на верхушке цепочки или NULL если цепочка была пустой.
+ *   @a new_link - ссылка только что созданной story для нового тапла, который
+ *   только что был вставлен в индекс. @a old_link это ссылка story, которая до
+ *   этого была на верхушке цепочки или NULL если цепочка была пустой.
  *
  * * @a is_new_tuple == false:
- *   @a old_top был на верхушке цепочки в то время как @a new_top был следующей
- *   story, и цепочка должна быть reordered и @a new_top должен попасть на
- *   верхушку цепочки и @a old_top должен быть соединен после него. Случай также
- *   требует физического replacement в индексе - он будет указывать на new_top->tuple.
+ *   @a old_link был на верхушке цепочки в то время как @a new_link был следующей
+ *   ссылкой, и цепочка должна быть reordered и @a new_link должен попасть на
+ *   верхушку цепочки и @a old_link должен быть соединен после него. Случай также
+ *   требует физического replacement в индексе - он будет указывать на тапл
+ *   new_link.
  * 
  *	C is_new_tuple == false вызывается только из memtx_tx_story_reorder в момент,
  *	когда story свапается с верхушкой и становится новой верхушкой. Производим
  *	replacement, чтобы сохранить инвариант, что верхушка всегда находится в индексе.
  */
 static void
-memtx_tx_story_link_top(struct memtx_story *new_top, struct memtx_story *old_top, uint32_t idx, bool is_new_tuple)
+memtx_tx_story_link_top(struct memtx_story_link *new_link, struct memtx_story_link *old_link, bool is_new_tuple)
 {
-	assert(old_top != NULL || is_new_tuple);
-	if (is_new_tuple && old_top == NULL) {
-		//if (idx == 0)
-		//	memtx_tx_ref_to_primary(new_top);
+	assert(old_link != NULL || is_new_tuple);
+	if (is_new_tuple && old_link == NULL)
 		return;
-	}
-	struct memtx_story_link *new_link = &new_top->link[idx];
-	struct memtx_story_link *old_link = &old_top->link[idx];
-	assert(old_link->in_index != NULL);
-	assert(old_link->newer_story == NULL);
+	assert(old_link->in_index);
+	assert(old_link->newer == NULL);
 	if (is_new_tuple) {
-		assert(new_link->newer_story == NULL);
-		assert(new_link->older_story == NULL);
+		assert(new_link->newer == NULL);
+		assert(new_link->older == NULL);
 	} else {
-		assert(new_link->newer_story == old_top);
-		assert(old_link->older_story == new_top);
+		assert(new_link->newer == old_link);
+		assert(old_link->older == new_link);
 	}
 
 	if (!is_new_tuple) {
-		/* Делаем физиески реплейс. */
-		struct index *index = old_link->in_index;
-		struct tuple *removed/*, *unused*/;
-		if (index_replace(index, old_top->tuple, new_top->tuple, DUP_REPLACE, &removed/*, &unused*/) != 0) {
+		/*
+		 * Делаем физиески реплейс. В multikey индексе у таплов один и
+		 * тот же ключ может стоять на разных местах, поэтому заменяем
+		 * именно элемент цепочки, а не весь тапл.
+		 */
+		struct index *index = old_link->index;
+		struct index_entry removed, none = {NULL, 0};
+		if (index_replace_entry(index, none, memtx_tx_story_link_entry(new_link), &removed) != 0) {
 			/*panic*/fprintf(stderr, "failed to rebind story in index");
 			exit(1);
 		}
-		assert(old_top->tuple == removed);
+		assert(memtx_tx_link_story(old_link)->tuple == removed.tuple);
+		assert(old_link->mk_index == removed.mk_index);
 	}
 
 	/* Link the list. */
 	if (is_new_tuple) {
-		memtx_tx_story_link(new_top, old_top, idx);
+		memtx_tx_story_link(new_link, old_link);
 		/* in_index must be set in story_new. */
-		assert(new_link->in_index == old_link->in_index);
-		old_link->in_index = NULL;
+		assert(new_link->in_index);
+		old_link->in_index = 0;
+		memtx_tx_link_count_invisible(old_link, false);
 	} else {
         /**
-         * Свап old_top и new_top
-         * older_story -> new_top -> old_top =>
-         *      older_story -> old_top -> new_top
+         * Свап old_link и new_link
+         * older -> new_link -> old_link =>
+         *      older -> old_link -> new_link
          */
-		struct memtx_story *older_story = new_link->older_story;
-		memtx_tx_story_unlink(old_top, new_top, idx);
-		memtx_tx_story_unlink(new_top, older_story, idx);
-		memtx_tx_story_link(new_top, old_top, idx);
-		memtx_tx_story_link(old_top, older_story, idx);
-		new_link->in_index = old_link->in_index;
-		old_link->in_index = NULL;
+		struct memtx_story_link *older = new_link->older;
+		memtx_tx_story_unlink(old_link, new_link);
+		memtx_tx_story_unlink(new_link, older);
+		memtx_tx_story_link(new_link, old_link);
+		memtx_tx_story_link(old_link, older);
+		new_link->in_index = 1;
+		old_link->in_index = 0;
+		memtx_tx_link_count_invisible(old_link, false);
 	}
 
 	/*
-	 * Все таплы, которые физически находятся в первичном индексе должны
-     * быть referenced. Нам это сейчас не очень важно.
+	 * Все таплы, которые физически находятся в индексе, referenced:
+	 * ссылки при замене выше переносит index_replace_entry.
 	 */
-	//if (idx == 0) {
-	//	memtx_tx_ref_to_primary(new_top);
-	//	memtx_tx_unref_from_primary(old_top);
-	//}
 
 	/*
      * Переносим все gap records в новую вершину списка.
@@ -594,32 +921,30 @@ memtx_tx_story_link_top(struct memtx_story *new_top, struct memtx_story *old_top
 	rlist_splice(&new_link->read_gaps, &old_link->read_gaps);
 }
 
-/** Свап двух соседних story. */
+/** Свап двух соседних ссылок цепочки. */
 static void
-memtx_tx_story_reorder(struct memtx_story *story, struct memtx_story *old_story, uint32_t idx)
+memtx_tx_story_reorder(struct memtx_story_link *link, struct memtx_story_link *old_link)
 {
-	assert(idx < story->index_count);
-	assert(idx < old_story->index_count);
-	struct memtx_story_link *link = &story->link[idx];
-	struct memtx_story_link *old_link = &old_story->link[idx];
-	assert(link->older_story == old_story);
-	assert(old_link->newer_story == story);
-	struct memtx_story *newer_story = link->newer_story;
-	struct memtx_story *older_story = old_link->older_story;
+	assert(link->older == old_link);
+	assert(old_link->newer == link);
+	struct memtx_story_link *newer = link->newer;
+	struct memtx_story_link *older = old_link->older;
+	memtx_tx_story_clear_skip(link);
+	memtx_tx_story_clear_skip(old_link);
 
 	/*
-	 * older_story -> old_story -> story -> newer_story =>
-     * older_story -> story -> old_story -> newer_story
+	 * older -> old_link -> link -> newer =>
+     * older -> link -> old_link -> newer
 	 */
-	if (newer_story != NULL) {
+	if (newer != NULL) {
 		/* Это не верхушка списка, поэтому просто переприсоединяем все. */
-		memtx_tx_story_unlink(newer_story, story, idx);
-		memtx_tx_story_unlink(story, old_story, idx);
-		memtx_tx_story_unlink(old_story, older_story, idx);
+		memtx_tx_story_unlink(newer, link);
+		memtx_tx_story_unlink(link, old_link);
+		memtx_tx_story_unlink(old_link, older);
 
-		memtx_tx_story_link(newer_story, old_story, idx);
-		memtx_tx_story_link(old_story, story, idx);
-		memtx_tx_story_link(story, older_story, idx);
+		memtx_tx_story_link(newer, old_link);
+		memtx_tx_story_link(old_link, link);
+		memtx_tx_story_link(link, older);
 	} else {
 		/*
 		 * Случай, когда свапаются две верхние story обрабатывается отдельно
@@ -630,7 +955,7 @@ memtx_tx_story_reorder(struct memtx_story *story, struct memtx_story *old_story,
          * списка всегда представлена фиизически в индексе. Для этого в качестве
 		 * is_new_tuple передается false.
          */
-		memtx_tx_story_link_top(old_story, story, idx, false);
+		memtx_tx_story_link_top(old_link, link, false);
 	}
 }
 
@@ -642,23 +967,24 @@ static void
 memtx_tx_story_full_unlink_on_space_delete(struct memtx_story *story)
 {
 	/* Извлекаем story из всех цепочек. */
-	for (uint32_t i = 0; i < story->index_count; i++) {
+	for (uint32_t i = 0; i < story->link_count; i++) {
 		struct memtx_story_link *link = &story->link[i];
+		memtx_tx_story_clear_skip(link);
         /*
          * Если это верхушка. Странно, что не перенесли пробелы в новую верхушку
          * и не сделали замену в индексе. Скорее всего эта функция отвечает чисто
          * за отсоединение, а остальное делается в другом месте.
          */
-		if (link->newer_story == NULL) {
-			assert(link->in_index == NULL);
-			memtx_tx_story_unlink(story, link->older_story, i);
+		if (link->newer == NULL) {
+			assert(!link->in_index);
+			memtx_tx_story_unlink(link, link->older);
 		} else {
 			/* Обычное извлечение вершины из двусвязного списка. */
-			link->newer_story->link[i].older_story = link->older_story;
-			if (link->older_story != NULL)
-				link->older_story->link[i].newer_story = link->newer_story;
-			link->older_story = NULL;
-			link->newer_story = NULL;
+			link->newer->older = link->older;
+			if (link->older != NULL)
+				link->older->newer = link->newer;
+			link->older = NULL;
+			link->newer = NULL;
 		}
 	}
 
@@ -669,7 +995,7 @@ memtx_tx_story_full_unlink_on_space_delete(struct memtx_story *story)
 	while (story->del_stmt != NULL)
 		memtx_tx_story_unlink_deleted_by(story, story->del_stmt);
 	/* on_space_delete => gap'ы можно удалять, а не перемещать в новую верхушку. */
-	for (uint32_t i = 0; i < story->index_count; i++) {
+	for (uint32_t i = 0; i < story->link_count; i++) {
 		struct rlist *read_gaps = &story->link[i].read_gaps;
 		while (!rlist_empty(&story->link[i].read_gaps)) {
 			struct inplace_gap_item *item = rlist_first_entry(read_gaps, struct inplace_gap_item, in_read_gaps);
@@ -679,30 +1005,37 @@ memtx_tx_story_full_unlink_on_space_delete(struct memtx_story *story)
 	}
 	/*
 	 * Удаляем все трекеры, потому что они указывают на story,
-     * которую мы собираемся удалить. Интересно, почему трекеры
-     * не удалили, а просто убрали из списков.
-     * Кто в последствии освободит память из под них?
+     * которую мы собираемся удалить. Раньше трекеры просто убирали
+     * из списков и память из-под них терялась.
 	 */
 	while (!rlist_empty(&story->reader_list)) {
 		struct tx_read_tracker *tracker =
 			rlist_first_entry(&story->reader_list, struct tx_read_tracker, in_reader_list);
-		rlist_del(&tracker->in_reader_list);
-		rlist_del(&tracker->in_read_set);
+		tx_read_tracker_delete(tracker);
 	}
 }
 
-static struct memtx_story *
-memtx_tx_story_find_top(struct memtx_story *story, uint32_t ind)
+static struct memtx_story_link *
+memtx_tx_story_find_top(struct memtx_story_link *link)
 {
-	while (story->link[ind].newer_story != NULL)
-		story = story->link[ind].newer_story;
-	return story;
+	while (link->newer != NULL)
+		link = link->newer;
+	return link;
 }
 
+static void
+memtx_tx_link_update_invisible(struct memtx_story_link *top);
+
+/**
+ * Тапл не представлен в индексе @a index: у него нет ни одного ключа в
+ * нем (см. tuple_key_is_excluded). Для такого индекса у story нет
+ * ссылок, и тапл не вставляется в индекс.
+ */
 static bool
 memtx_tx_tuple_key_is_excluded(struct tuple *tuple, struct index *index, key_def *def)
 {
-	return false;
+	(void)index;
+	return tuple_key_is_excluded(tuple, def);
 }
 
 /**
@@ -716,26 +1049,27 @@ memtx_tx_tuple_key_is_excluded(struct tuple *tuple, struct index *index, key_def
 static void
 memtx_tx_story_full_unlink_story_gc_step(struct memtx_story *story)
 {
-	for (uint32_t i = 0; i < story->index_count; i++) {
+	for (uint32_t i = 0; i < story->link_count; i++) {
 		struct memtx_story_link *link = &story->link[i];
-		if (link->newer_story == NULL) {
+		memtx_tx_story_clear_skip(link);
+		if (link->newer == NULL) {
 			/*
 			 * Верхушка цепочки, а значит выполняется одно из двух:
              * либо story->tuple находится в индексе либо story откатили.
              * Если story фактически удаляет тапл и этот story представлен в индексе,
 			 * он должен быть удален из индекса.
 			 */
-			assert(link->in_index != NULL);
+			assert(link->in_index);
 			/*
              * Здесь мы не заменяем тапл на предыдущий, а просто удаляем тот,
-             * который находится там сейчас. Мы предполагаем, что link->older_story
+             * который находится там сейчас. Мы предполагаем, что link->older
              * является NULL. Если бы это было не так, то мы нарушили бы инвариант
              * и новая верхушка не была бы представлена в индексе после удаления.
-             * О том, что link->older_story == NULL должен позаботиться вызывающий. То есть
+             * О том, что link->older == NULL должен позаботиться вызывающий. То есть
              * gc удаляет верхушку в последнюю очередь, когда уже удалил все, что
              * находится перед ней.
 			 */
-			assert(link->older_story == NULL);
+			assert(link->older == NULL);
             // странный if, мы уже ассертили это выше ---+
             //                                           |
             //                          vvvvvvvvvvvvvvvvvvvvvv
@@ -753,40 +1087,46 @@ memtx_tx_story_full_unlink_story_gc_step(struct memtx_story *story)
 			 * If the story is actually delete the tuple, it must be deleted from index.
              */
             if (story->del_psn > 0) {
-                struct index *index = link->in_index;
-				struct tuple *removed/*, *unused*/;
-				if (index_replace(index, story->tuple, NULL, DUP_INSERT, &removed/*, &unused*/) != 0) {
+                struct index *index = link->index;
+				struct index_entry removed, none = {NULL, 0};
+				if (index_replace_entry(index, memtx_tx_story_link_entry(link), none, &removed) != 0) {
 					/*panic*/fprintf(stderr, "failed to rollback change");
 					exit(1);
 				}
-				//key_def *key_def = index->def->_key_def;
-				assert(story->tuple == removed || (removed == NULL/* && memtx_tx_tuple_key_is_excluded(story->tuple, index, key_def)*/));
-				//(void)key_def;
-				link->in_index = NULL;
-				/* Сейчас нам это не важно. */
-				//if (i == 0)
-				//	memtx_tx_unref_from_primary(story);
+				/* Исключенные из индекса таплы ссылок в нем не имеют. */
+				assert(story->tuple == removed.tuple);
+				link->in_index = 0;
+				/* Ссылку индекса отпустил index_replace. */
 			}
+			/* Элемент либо удален, либо остался чистым и видным всем. */
+			memtx_tx_link_count_invisible(link, false);
             /* Отсоединили. */
-			memtx_tx_story_unlink(story, link->older_story, i);
+			memtx_tx_story_unlink(link, link->older);
 		} else {
 			/* Обычное извлечение вершины из двусвязного списка. (копипаста кода выше) */
-			link->newer_story->link[i].older_story = link->older_story;
-			if (link->older_story != NULL)
-				link->older_story->link[i].newer_story = link->newer_story;
-			link->older_story = NULL;
-			link->newer_story = NULL;
+			struct memtx_story_link *newer = link->newer;
+			link->newer->older = link->older;
+			if (link->older != NULL)
+				link->older->newer = link->newer;
+			link->older = NULL;
+			link->newer = NULL;
+			memtx_tx_link_update_invisible(memtx_tx_story_find_top(newer));
 		}
 	}
 }
 
-void
+/**
+ * Один шаг GC: проверяет очередную story из txm.all_stories и удаляет её,
+ * если она больше никому не нужна.
+ * @retval true, если story была удалена.
+ */
+static bool
 memtx_tx_story_gc_step()
 {
 	if (txm.traverse_all_stories == &txm.all_stories) {
 		/* Дошли до конца, делаем шаг вперед и выходим. */
 		txm.traverse_all_stories = txm.traverse_all_stories->next;
-		return;
+		return false;
 	}
 
 	/*
@@ -811,7 +1151,7 @@ memtx_tx_story_gc_step()
 	if (story->add_stmt != NULL || story->del_stmt != NULL || !rlist_empty(&story->reader_list)) {
 		memtx_tx_story_set_status(story, MEMTX_TX_STORY_USED);
 		/* Story напрямую используется какими-то транзакциями. */
-		return;
+		return false;
 	}
 	if (story->add_psn >= lowest_rv_psn || story->del_psn >= lowest_rv_psn) {
 		memtx_tx_story_set_status(story, MEMTX_TX_STORY_READ_VIEW);
@@ -819,12 +1159,12 @@ memtx_tx_story_gc_step()
 		 * Story может быть использована в read view. Не понятно, почему мы
 		 * проверяем ..._psn >= lowest_rv_psn, а не _psn <= greatest_rv_psn.
 		 */
-		return;
+		return false;
 	}
-	for (uint32_t i = 0; i < story->index_count; i++) {
+	for (uint32_t i = 0; i < story->link_count; i++) {
 		struct memtx_story_link *link = &story->link[i];
-		if (link->newer_story == NULL) { //если это верхушка
-			assert(link->in_index != NULL);
+		if (link->newer == NULL) { //если это верхушка
+			assert(link->in_index);
 			/*
 			 * Тикет: https://github.com/tarantool/tarantool/issues/7490
 			 *
@@ -832,13 +1172,13 @@ memtx_tx_story_gc_step()
 			 *
 			 * Мы могли бы отсоединить этот тапл (и даже удалить его
 			 * из индекса если story->del_psn > 0), но мы не можем
-			 * сделать это, т.к. после этого `link->older_story`
+			 * сделать это, т.к. после этого `link->older`
 			 * станет верхушкой цепочки, но не будет представлено
 			 * в индексе, что нарушает инвариант.
 			 */
-			if (link->older_story != NULL) {
+			if (link->older != NULL) {
 				memtx_tx_story_set_status(story, MEMTX_TX_STORY_USED);
-				return;
+				return false;
 			}
 		}
 		/*
@@ -854,19 +1194,19 @@ memtx_tx_story_gc_step()
 		 * и теряется после сборки мусора: сохраняйте истории, если в цепочке истории вторичных
 		 * индексов есть более новая незафиксированная история.
 		 */
-		else if (i > 0 && link->newer_story->add_stmt != NULL) {
+		else if (link->index->dense_id > 0 && memtx_tx_link_story(link->newer)->add_stmt != NULL) {
 			/*
 			 * Нам необходимо сохранить историю, так как более новая история может
 			 * быть откачена (это поддерживается в списке del_stmt в случае
 			 * первичного индекса).
 			 */
 			memtx_tx_story_set_status(story, MEMTX_TX_STORY_USED);
-			return;
+			return false;
 		}
 		if (!rlist_empty(&link->read_gaps)) {
 			memtx_tx_story_set_status(story, MEMTX_TX_STORY_TRACK_GAP);
 			/* Story используется для отслеживания пробелов. */
-			return;
+			return false;
 		}
 	}
 	/*
@@ -875,14 +1215,118 @@ memtx_tx_story_gc_step()
 	 */
 	memtx_tx_story_full_unlink_story_gc_step(story);
 	memtx_tx_story_delete(story);
+	return true;
+}
+
+/**
+ * Сделать @a steps шагов GC, списать их с долга и обновить оценку доли
+ * мусора среди просмотренных stories.
+ * @return количество удаленных stories.
+ */
+static size_t
+memtx_tx_story_gc_steps(size_t steps)
+{
+	size_t freed = 0;
+	for (size_t i = 0; i < steps; i++)
+		freed += memtx_tx_story_gc_step();
+	TX_PROFILE_COUNT(TX_PROFILE_GC_STEPS, steps);
+	TX_PROFILE_COUNT(TX_PROFILE_GC_FREED, freed);
+	txm.must_do_gc_steps -= MIN(steps, txm.must_do_gc_steps);
+	if (steps > 0) {
+		double ratio = (double)freed / steps;
+		txm.gc_garbage_ratio = 0.75 * txm.gc_garbage_ratio + 0.25 * ratio;
+	}
+	return freed;
+}
+
+/**
+ * Сколько шагов GC можно сделать прямо на пути записи.
+ *
+ * Долг (must_do_gc_steps) копится по TX_MANAGER_GC_STEPS_SIZE на каждую
+ * новую story, но за один вызов выплачивается не больше лимита: от
+ * TX_MANAGER_GC_STEPS_SIZE, когда шаги почти не находят мусор (тогда
+ * они только тратят время), до TX_MANAGER_GC_STEPS_MAX, когда почти
+ * каждый шаг что-то освобождает или долг слишком вырос. Остаток
+ * доделывается в memtx_tx_story_gc_idle.
+ */
+static size_t
+memtx_tx_story_gc_budget(void)
+{
+	/* Больше одного полного прохода по stories долг не имеет смысла. */
+	size_t pass = txm.stats.objects[MEMTX_TX_OBJECT_STORY].count + 1;
+	txm.must_do_gc_steps = MIN(txm.must_do_gc_steps, pass);
+	size_t limit = TX_MANAGER_GC_STEPS_MAX;
+	if (txm.must_do_gc_steps < TX_MANAGER_GC_BACKLOG_FACTOR * TX_MANAGER_GC_STEPS_MAX) {
+		limit = TX_MANAGER_GC_STEPS_SIZE + (size_t)
+			((TX_MANAGER_GC_STEPS_MAX - TX_MANAGER_GC_STEPS_SIZE) *
+			 txm.gc_garbage_ratio);
+	}
+	return MIN(txm.must_do_gc_steps, limit);
 }
 
 void
 memtx_tx_story_gc()
 {
-	for (size_t i = 0; i < txm.must_do_gc_steps; i++)
-		memtx_tx_story_gc_step();
-	txm.must_do_gc_steps = 0;
+	TX_PROFILE_START(start);
+	memtx_tx_story_gc_steps(memtx_tx_story_gc_budget());
+	/*
+	 * Превысили лимит памяти - собираем агрессивно, пока не уложимся,
+	 * но не больше одного полного прохода по всем stories (+1 шаг на
+	 * переход через голову списка), чтобы не зациклиться, если собрать
+	 * больше нечего.
+	 */
+	size_t budget = txm.stats.objects[MEMTX_TX_OBJECT_STORY].count + 1;
+	while (memtx_tx_memory_limit_is_exceeded() && budget-- > 0) {
+		bool is_freed = memtx_tx_story_gc_step();
+		TX_PROFILE_COUNT(TX_PROFILE_GC_STEPS, 1);
+		TX_PROFILE_COUNT(TX_PROFILE_GC_FREED, is_freed);
+		(void)is_freed;
+	}
+	/* Запись платит за free() не больше чем пачки таплов. */
+	if (tuple_garbage_count() >= TX_MANAGER_TUPLE_GC_BATCH)
+		tuple_collect_garbage(TX_MANAGER_TUPLE_GC_BATCH);
+	TX_PROFILE_STOP(TX_PROFILE_GC, start);
+}
+
+/**
+ * Если даже агрессивный GC не уложился в лимит памяти, не даем
+ * начинаться новым пишущим транзакциям. Уже начатые могут писать
+ * дальше - их завершение как раз и освобождает память.
+ */
+static int
+memtx_tx_check_new_writer(void)
+{
+	if (!memtx_tx_memory_limit_is_exceeded())
+		return 0;
+	txm.stats.rejected_txns++;
+	fprintf(stderr, "Transaction manager memory limit exceeded: %zu bytes used, limit is %zu",
+		txm.stats.total, txm.stats.memory_limit);
+	return -1;
+}
+
+int
+memtx_tx_check_load(void)
+{
+	memtx_tx_story_gc();
+	return memtx_tx_check_new_writer();
+}
+
+size_t
+memtx_tx_story_gc_idle(double budget)
+{
+	double deadline = clock_monotonic() + budget;
+	size_t pass = txm.stats.objects[MEMTX_TX_OBJECT_STORY].count + 1;
+	size_t done = 0;
+	size_t freed = 0;
+	while (done < pass) {
+		size_t steps = MIN((size_t)TX_MANAGER_GC_IDLE_CLOCK_STEPS, pass - done);
+		freed += memtx_tx_story_gc_steps(steps);
+		done += steps;
+		if (clock_monotonic() >= deadline)
+			break;
+	}
+	tuple_collect_garbage(SIZE_MAX);
+	return freed;
 }
 
 /**
@@ -975,17 +1419,23 @@ memtx_tx_story_delete_is_visible(struct memtx_story *story, struct txn *txn, boo
 }
 
 /**
- * Сканировать историю начиная с @a story в индексе @a index в поисках
- * видимого тапла @a visible_tuple.
+ * Сканировать историю начиная со ссылки @a link в поисках видимого тапла
+ * @a visible_tuple.
  * @param is_prepared_ok - устраивает нас prepared, не confirmed или нет.
  * @param own_change - return true если @txn сама этот вставила. В этом случае возвращается true
  */
 static void
 memtx_tx_story_find_visible_tuple(
-    struct memtx_story *story, struct txn *txn, uint32_t index, bool is_prepared_ok, struct tuple **visible_tuple, bool *is_own_change)
-{
-	for (; story != NULL; story = story->link[index].older_story) {
-		assert(index < story->index_count);
+    struct memtx_story_link *link, struct txn *txn, bool is_prepared_ok, struct tuple **visible_tuple, bool *is_own_change)
+{
+	for (; link != NULL; link = link->older) {
+		/* Пропускаем серии stories, невидимых для read view. */
+		while (txn != NULL && txn->status == TXN_IN_READ_VIEW &&
+		       link->skip != NULL &&
+		       txn->rv_psn <= link->skip_psn &&
+		       memtx_tx_story_is_skippable(memtx_tx_link_story(link), txn->rv_psn))
+			link = link->skip;
+		struct memtx_story *story = memtx_tx_link_story(link);
         /*
          * Пока не понятно, как может быть видимо удаление, но не видна вставка следующего. Возможно,
          * это предусмотрено именно для того случая, когда тапл соотв. story A был просто удален, тогда
@@ -1003,6 +1453,67 @@ memtx_tx_story_find_visible_tuple(
 	*visible_tuple = NULL;
 }
 
+/**
+ * Ни одна версия цепочки с верхушкой @a top не видна транзакции @a txn
+ * (NULL - транзакции без своих изменений и read view).
+ */
+static bool
+memtx_tx_link_is_invisible(struct memtx_story_link *top, struct txn *txn)
+{
+	struct tuple *visible;
+	bool unused;
+	memtx_tx_story_find_visible_tuple(top, txn, true, &visible, &unused);
+	return visible == NULL;
+}
+
+/** Пересчитать вклад цепочки с верхушкой @a top в index->invisible_count. */
+static void
+memtx_tx_link_update_invisible(struct memtx_story_link *top)
+{
+	assert(top->newer == NULL);
+	memtx_tx_link_count_invisible(top, top->in_index &&
+				      memtx_tx_link_is_invisible(top, NULL));
+}
+
+/**
+ * Пересчитать index->invisible_count по всем цепочкам @a story: вызывается,
+ * когда у нее или у соседей по цепочкам поменялись стейтменты или PSN.
+ */
+static void
+memtx_tx_story_update_invisible(struct memtx_story *story)
+{
+	for (uint32_t i = 0; i < story->link_count; i++)
+		memtx_tx_link_update_invisible(memtx_tx_story_find_top(&story->link[i]));
+}
+
+/** Наибольший PSN подготовленных вставки и удаления @a story или 0. */
+static int64_t
+memtx_tx_story_max_psn(struct memtx_story *story)
+{
+	int64_t psn = MAX(story->add_psn, story->del_psn);
+	/* MEMTX_TX_ROLLBACKED_PSN меньше любого rv_psn. */
+	return psn >= TXN_MIN_PSN ? psn : 0;
+}
+
+/**
+ * Поставить @a story в txm.prepared_stories по ее наибольшему PSN или
+ * убрать оттуда, если PSN у нее не осталось. На prepare PSN самый новый,
+ * и место находится сразу в конце списка.
+ */
+static void
+memtx_tx_story_update_prepared(struct memtx_story *story)
+{
+	rlist_del(&story->in_prepared_stories);
+	int64_t psn = memtx_tx_story_max_psn(story);
+	if (psn == 0)
+		return;
+	struct rlist *prev = rlist_last(&txm.prepared_stories);
+	while (prev != &txm.prepared_stories &&
+	       memtx_tx_story_max_psn(rlist_entry(prev, struct memtx_story, in_prepared_stories)) > psn)
+		prev = prev->prev;
+	rlist_add(prev, &story->in_prepared_stories);
+}
+
 /**
  * Отмечаем факт, что транзакция прочитала конкретный тапл. Мы должны
  * будем гарантировать, что транзакция сериализуется так, что в момент,
@@ -1016,13 +1527,24 @@ memtx_tx_track_read_story(struct txn *txn, struct memtx_space *space, struct mem
  * То же самое, что функция выше, но здесь мы хотим зафиксировать тот факт,
  * что транзакция ничего не прочитала в определенном месте.
  */
-static void
-memtx_tx_track_story_gap(struct txn *txn, struct memtx_story *story, uint32_t ind);
+static struct inplace_gap_item *
+memtx_tx_track_story_gap(struct txn *txn, struct memtx_story_link *link);
+
+/** Размер элемента с ключом длины @a key_len. */
+static inline size_t
+point_hole_item_size(uint32_t key_len)
+{
+	size_t size = sizeof(struct point_hole_item);
+	if (key_len > sizeof(((struct point_hole_item *)NULL)->short_key))
+		size += key_len;
+	return size;
+}
 
 static struct point_hole_item *
-point_hole_item_new()
+point_hole_item_new(uint32_t key_len)
 {
-	return (struct point_hole_item *)malloc(sizeof(struct point_hole_item));
+	return (struct point_hole_item *)
+		memtx_tx_alloc(point_hole_item_size(key_len), MEMTX_TX_OBJECT_POINT_HOLE_ITEM);
 }
 
 /**
@@ -1034,37 +1556,47 @@ point_hole_item_delete(struct point_hole_item *object)
 {
 	rlist_del(&object->ring);
 	rlist_del(&object->in_point_holes_list);
-	free(object);
+	assert(object->index->point_hole_count > 0);
+	object->index->point_hole_count--;
+	memtx_tx_free(object, point_hole_item_size(object->key_len), MEMTX_TX_OBJECT_POINT_HOLE_ITEM);
 }
 
 /**
- * Переносим gap'ы из мапчика в @a story только что вставленного тапла
- * @a new tuple в индекс @a ind. Это нужно если и только если
- * это была реальная фактическая вставка - никакой тапл не был заменен.
- * Потому что в этом и только в этом случае в мапчике может лежать какой-то
- * непустой список point_hole_item'ов.
+ * Переносим gap'ы из мапчика в ссылку @a link story только что вставленного
+ * тапла. Это нужно если и только если это была реальная фактическая
+ * вставка - никакой тапл не был заменен. Потому что в этом и только в этом
+ * случае в мапчике может лежать какой-то непустой список point_hole_item'ов.
+ *
+ * В неуникальном индексе ключ point hole - это целая группа элементов, и
+ * вставка в нее не последняя: элементы остаются в мапчике, а в ссылку
+ * копируются.
  */
 static void
-memtx_tx_handle_point_hole_write(struct memtx_space *space, struct memtx_story *story, uint32_t ind)
+memtx_tx_handle_point_hole_write(struct memtx_story_link *link)
 {
 	/*
 	 * Нам важно, что данная story - это верхушка, потому что мы будем добавлять
 	 * элементы в её read_gaps (memtx_tx_track_story_gap должна вызываться только
 	 * на верхушке).
 	 */
-	assert(story->link[ind].newer_story == NULL);
-	struct index *index = &space->index[ind];
+	assert(link->newer == NULL);
 	struct mh_point_holes_t *ht = txm.point_holes;
 	struct point_hole_key key;
-	key.index = index;
-	key.tuple = story->tuple;
-	//key.func_key = NULL;
-	//if (index->def->_key_def->for_func_index)
-	//	key.func_key = memtx_tx_tuple_func_key(story->tuple, index);
+	key.index = link->index;
+	key.key = memtx_tx_story_link_key(link);
 	mh_int_t pos = mh_point_holes_find(ht, &key, 0);
 	if (pos == mh_end(ht))
 		return;
 	struct point_hole_item *item = *mh_point_holes_node(ht, pos);
+	if (!link->index->_key_def.is_unique) {
+		struct point_hole_item *next = item;
+		do {
+			struct inplace_gap_item *gap_item = memtx_tx_track_story_gap(next->txn, link);
+			gap_item->is_point_hole = true;
+			next = rlist_entry(next->ring.next, struct point_hole_item, ring);
+		} while (next != item);
+		return;
+	}
 	/*
 	 * Remove from the storage before deleting the element because
 	 * it still can be used under the hood.
@@ -1073,7 +1605,8 @@ memtx_tx_handle_point_hole_write(struct memtx_space *space, struct memtx_story *
 
 	bool has_more_items;
 	do {
-		memtx_tx_track_story_gap(item->txn, story, ind);
+		struct inplace_gap_item *gap_item = memtx_tx_track_story_gap(item->txn, link);
+		gap_item->is_point_hole = true;
 		struct point_hole_item *next_item = rlist_entry(item->ring.next, struct point_hole_item, ring);
 		has_more_items = next_item != item;
 		point_hole_item_delete(item);
@@ -1082,7 +1615,7 @@ memtx_tx_handle_point_hole_write(struct memtx_space *space, struct memtx_story *
 }
 
 static bool
-memtx_tx_tuple_matches(key_def *def, struct tuple *tuple, int key)
+memtx_tx_tuple_matches(key_def *def, struct tuple *tuple, const char *key)
 {
 	return (tuple_compare_with_key(tuple, key, def) == 0);
 }
@@ -1102,29 +1635,33 @@ memtx_tx_track_read(struct txn *txn, struct memtx_space *space, struct tuple *tu
  *
  * `is_own_change` выставляется в true если `old_tuple` был изменен (
  * удален или добавлен) транзакцией данного стейтмента.
+ *
+ * directly_replaced[i] - элемент, вытесненный ссылкой i story @a add_story
+ * нового тапла (для multikey индекса их несколько на индекс).
  */
 static int
-check_dup(struct txn_stmt *stmt, struct tuple *new_tuple, struct tuple **directly_replaced, struct tuple **old_tuple, enum dup_replace_mode mode, bool *is_own_change)
+check_dup(struct txn_stmt *stmt, struct memtx_story *add_story, struct index_entry *directly_replaced, struct tuple **old_tuple, enum dup_replace_mode mode, bool *is_own_change)
 {
 	struct memtx_space *space = stmt->space;
 	struct txn *txn = stmt->txn;
+	struct tuple *new_tuple = add_story->tuple;
 
 	struct tuple *visible_replaced;
-	if (directly_replaced[0] == NULL ||
+	if (directly_replaced[0].tuple == NULL ||
         /*
          * TUPLE_IS_DIRTY означает, что у тапла есть какая-то история и нужно
          * внимательно смотреть, какая версия видна нам.
          */
-	    !tuple_has_flag(directly_replaced[0], TUPLE_IS_DIRTY)) {
+	    !tuple_has_flag(directly_replaced[0].tuple, TUPLE_IS_DIRTY)) {
 		*is_own_change = false;
-		visible_replaced = directly_replaced[0];
+		visible_replaced = directly_replaced[0].tuple;
 	} else {
-		struct memtx_story *story = memtx_tx_story_get(directly_replaced[0]);
-		memtx_tx_story_find_visible_tuple(story, txn, 0, true, &visible_replaced, is_own_change);
+		struct memtx_story *story = memtx_tx_story_get(directly_replaced[0].tuple);
+		memtx_tx_story_find_visible_tuple(&story->link[0], txn, true, &visible_replaced, is_own_change);
 	}
 
     /* old_tuple' == old_tuple, dup_tuple == visible_replaced */
-	if (index_check_dup(&space->index[0], *old_tuple, new_tuple, visible_replaced, mode) != 0) {
+	if (index_check_dup(space->index[0], *old_tuple, new_tuple, visible_replaced, mode) != 0) {
         /*
          * Если получили ошибку по первичному ключу, трекаем чтение. Нужно подумать отдельно,
          * почему именно так.
@@ -1133,22 +1670,29 @@ check_dup(struct txn_stmt *stmt, struct tuple *new_tuple, struct tuple **directl
 		return -1;
 	}
 
-	for (uint32_t i = 1; i < space->index_count; i++) {
+	for (uint32_t i = 1; i < add_story->link_count; i++) {
 		/* Проверяем, что visible tuple == NULL или такой же как в первичном индексе. */
-		if (directly_replaced[i] == NULL)
+		struct index_entry *replaced = &directly_replaced[i];
+		if (replaced->tuple == NULL)
 			continue; /* NULL is OK in any case. */
 
+		struct index *index = add_story->link[i].index;
+		/* Элемент неуникального индекса с тем же первичным ключом - не дубликат. */
+		if (!index->_key_def.is_unique)
+			continue;
 		struct tuple *visible;
-		if (!tuple_has_flag(directly_replaced[i], TUPLE_IS_DIRTY)) {
-			visible = directly_replaced[i];
+		if (!tuple_has_flag(replaced->tuple, TUPLE_IS_DIRTY)) {
+			visible = replaced->tuple;
 		} else {
 			/* У тапла есть какая-то нетривиальная история. */
-			struct memtx_story *story = memtx_tx_story_get(directly_replaced[i]);
+			struct memtx_story *story = memtx_tx_story_get(replaced->tuple);
+			struct memtx_story_link *link = memtx_tx_story_find_link(story, index, replaced->mk_index);
+			assert(link != NULL);
 			bool unused;
-			memtx_tx_story_find_visible_tuple(story, txn, i, true, &visible, &unused);
+			memtx_tx_story_find_visible_tuple(link, txn, true, &visible, &unused);
 		}
         /* old_tuple' == visible_replaced, dup_tuple == visible */
-		if (index_check_dup(&space->index[i], visible_replaced, new_tuple, visible, DUP_INSERT) != 0) {
+		if (index_check_dup(index, visible_replaced, new_tuple, visible, DUP_INSERT) != 0) {
             /* Также трекаем чтение при первой же ошибке и выходим. */
 			memtx_tx_track_read(txn, space, visible);
 			return -1;
@@ -1163,23 +1707,25 @@ check_dup(struct txn_stmt *stmt, struct tuple *new_tuple, struct tuple **directl
 	return 0;
 }
 
-/* Добавляет inplace_gap_item в story::link[ind] */
-static void
-memtx_tx_track_story_gap(struct txn *txn, struct memtx_story *story, uint32_t ind)
+/* Добавляет inplace_gap_item в ссылку-верхушку цепочки @a link. */
+static struct inplace_gap_item *
+memtx_tx_track_story_gap(struct txn *txn, struct memtx_story_link *link)
 {
-	assert(story->link[ind].newer_story == NULL);
+	assert(link->newer == NULL);
 	assert(txn != NULL);
 	struct inplace_gap_item *item = memtx_tx_inplace_gap_item_new(txn);
-	rlist_add(&story->link[ind].read_gaps, &item->in_read_gaps);
+	rlist_add(&link->read_gaps, &item->in_read_gaps);
+	return item;
 }
 
 static void
 memtx_tx_history_add_stmt_prepare_result(struct tuple *old_tuple, struct tuple **result)
 {
 	*result = old_tuple;
-	//if (*result != NULL) {
-	//	tuple_ref(*result);
-	//}
+	/* Ссылка стейтмента (stmt->old_tuple), отпускается в txn_stmt_destroy. */
+	if (*result != NULL) {
+		tuple_ref(*result);
+	}
 }
 
 /**
@@ -1199,28 +1745,30 @@ memtx_tx_history_add_insert_stmt(struct txn_stmt *stmt, struct tuple *old_tuple,
 	struct memtx_story *add_story = memtx_tx_story_new(space, new_tuple);
 
 	/*
-     * Реплейсим физически в каждом индексе, запоминаем при этом какой элемент
-     * заменили (directly_replaced[i]), и какой элемент был следующим (direct_successor[i]).
+     * Реплейсим физически каждый ключ тапла (по ссылке story на ключ),
+     * запоминаем при этом какой элемент заменили (directly_replaced[i]), и
+     * какой элемент был следующим (direct_successor[i]).
      */
-	struct tuple *directly_replaced[space->index_count];
-	//struct tuple *direct_successor[space->index_count];
+	uint32_t link_count = add_story->link_count;
+	struct index_entry directly_replaced[link_count];
+	//struct tuple *direct_successor[link_count];
 	uint32_t directly_replaced_count = 0;
-	for (uint32_t i = 0; i < space->index_count; i++) {
-		struct index *index = &space->index[i];
-		struct tuple **replaced = &directly_replaced[i];
-		//struct tuple **successor = &direct_successor[i];
-		*replaced /*= *successor*/ = NULL;
-		if (index_replace(index, NULL, new_tuple, DUP_REPLACE_OR_INSERT, replaced/*, successor*/) != 0)
+	struct index_entry none = {NULL, 0};
+	for (uint32_t i = 0; i < link_count; i++) {
+		struct memtx_story_link *link = &add_story->link[i];
+		if (index_replace_entry(link->index, none, memtx_tx_story_link_entry(link), &directly_replaced[i]) != 0)
 		{
 			directly_replaced_count = i;
 			goto fail;
 		}
 	}
-	directly_replaced_count = space->index_count;
+	directly_replaced_count = link_count;
 
 	/* Проверяем, что все условия удовлетворены, а также получаем видимый old_tuple. */
 	bool is_own_change = false;
-	int rc = check_dup(stmt, new_tuple, directly_replaced, &old_tuple, mode, &is_own_change);
+	TX_PROFILE_START(check_dup_start);
+	int rc = check_dup(stmt, add_story, directly_replaced, &old_tuple, mode, &is_own_change);
+	TX_PROFILE_STOP(TX_PROFILE_CHECK_DUP, check_dup_start);
 	if (rc != 0)
 		goto fail;
     /* Выставили is_own_change для стейтмента. */
@@ -1230,7 +1778,7 @@ memtx_tx_history_add_insert_stmt(struct txn_stmt *stmt, struct tuple *old_tuple,
 	memtx_tx_story_link_added_by(add_story, stmt);
 
 	/* Создаем, если необходимо, story для замененного тапла. */
-	struct tuple *next_pk = directly_replaced[0];
+	struct tuple *next_pk = directly_replaced[0].tuple;
 	struct memtx_story *next_pk_story = NULL;
 	if (next_pk != NULL && tuple_has_flag(next_pk, TUPLE_IS_DIRTY)) {
 		next_pk_story = memtx_tx_story_get(next_pk);
@@ -1238,13 +1786,15 @@ memtx_tx_history_add_insert_stmt(struct txn_stmt *stmt, struct tuple *old_tuple,
 		next_pk_story = memtx_tx_story_new(space, next_pk);
 	}
 
-	/* Collect conflicts or form chains. */
-	for (uint32_t i = 0; i < space->index_count; i++) {
-		struct tuple *next = directly_replaced[i];
+	/*
+	 * Collect conflicts or form chains. Ключей, по которым тапл исключен из
+	 * индекса (memtx_tx_tuple_key_is_excluded), у story нет вовсе.
+	 */
+	for (uint32_t i = 0; i < link_count; i++) {
+		struct memtx_story_link *link = &add_story->link[i];
+		struct tuple *next = directly_replaced[i].tuple;
 		//struct tuple *succ = direct_successor[i];
-		struct index *index = &space->index[i];
-		bool tuple_is_excluded = memtx_tx_tuple_key_is_excluded(new_tuple, index, &index->_key_def);
-		if (next == NULL && !tuple_is_excluded) {
+		if (next == NULL) {
 			/* Collect conflicts. */
 			/*
 			 * memtx_tx_handle_gap_write не обрабатывает inplace gap'ы,
@@ -1257,8 +1807,8 @@ memtx_tx_history_add_insert_stmt(struct txn_stmt *stmt, struct tuple *old_tuple,
 			 * те пробелы, которые хранятся в нас в мапчике. (Удалить из мапчика
 			 * и перенести в story->link[i].read_gaps).
 			 */
-			memtx_tx_handle_point_hole_write(space, add_story, i);
-			memtx_tx_story_link_top(add_story, NULL, i, true);
+			memtx_tx_handle_point_hole_write(link);
+			memtx_tx_story_link_top(link, NULL, true);
 		}
 		if (next != NULL) {
 			/* Form chains. */
@@ -1267,7 +1817,10 @@ memtx_tx_history_add_insert_stmt(struct txn_stmt *stmt, struct tuple *old_tuple,
 				assert(tuple_has_flag(next, TUPLE_IS_DIRTY));
 				next_story = memtx_tx_story_get(next);
 			}
-			memtx_tx_story_link_top(add_story, next_story, i, true);
+			struct memtx_story_link *next_link =
+				memtx_tx_story_find_link(next_story, link->index, directly_replaced[i].mk_index);
+			assert(next_link != NULL);
+			memtx_tx_story_link_top(link, next_link, true);
 		}
 	}
 
@@ -1304,21 +1857,24 @@ memtx_tx_history_add_insert_stmt(struct txn_stmt *stmt, struct tuple *old_tuple,
 	     space_has_on_replace_triggers(stmt->space)*/)) {
 		assert(mode != DUP_INSERT || del_story == NULL);
 		if (del_story == NULL) {
-			memtx_tx_track_story_gap(stmt->txn, add_story, 0);
+			memtx_tx_track_story_gap(stmt->txn, &add_story->link[0]);
 		} else {
 			memtx_tx_track_read_story(stmt->txn, space, del_story);
 		}
 	}
 
+	/* Верхушки цепочек сменились: новый ключ пока виден только этой транзакции. */
+	memtx_tx_story_update_invisible(add_story);
+
 	memtx_tx_history_add_stmt_prepare_result(old_tuple, result); //*result = old_tuple;
 	return 0;
 
 fail:
 	/* Откатываем то, что уже успели применить. */
 	for (uint32_t i = directly_replaced_count - 1; i + 1 > 0; i--) {
-		struct index *index = &space->index[i];
-		struct tuple *unused;
-		if (index_replace(index, new_tuple, directly_replaced[i], DUP_INSERT, &unused/*, &unused*/) != 0) {
+		struct memtx_story_link *link = &add_story->link[i];
+		struct index_entry unused;
+		if (index_replace_entry(link->index, memtx_tx_story_link_entry(link), directly_replaced[i], &unused) != 0) {
 			//diag_log();
 			/*panic*/fprintf(stderr, "failed to rollback change");
 			exit(1);
@@ -1377,18 +1933,167 @@ int
 memtx_tx_history_add_stmt(struct txn_stmt *stmt, struct tuple *old_tuple, struct tuple *new_tuple, enum dup_replace_mode mode, struct tuple **result)
 {
 	assert(stmt != NULL);
-	/* ephemeral поддерживать не будем. */
-	assert(stmt->space != NULL/* && !stmt->space->def->opts.is_ephemeral*/);
+	/* Ephemeral спейс пишется мимо стейтментов. */
+	assert(stmt->space != NULL && !stmt->space->is_ephemeral);
 	assert(new_tuple != NULL || old_tuple != NULL);
 	assert(new_tuple == NULL || !tuple_has_flag(new_tuple, TUPLE_IS_DIRTY));
 
 	memtx_tx_story_gc();
+	if (stailq_first(&stmt->txn->stmts) == &stmt->next &&
+	    memtx_tx_check_new_writer() != 0)
+		return -1;
+	TX_PROFILE_START(start);
+	int rc;
 	if (new_tuple != NULL)
 		// см. выше
-		return memtx_tx_history_add_insert_stmt(stmt, old_tuple, new_tuple, mode, result);
+		rc = memtx_tx_history_add_insert_stmt(stmt, old_tuple, new_tuple, mode, result);
 	else
 		// см. выше
-		return memtx_tx_history_add_delete_stmt(stmt, old_tuple, result);
+		rc = memtx_tx_history_add_delete_stmt(stmt, old_tuple, result);
+	TX_PROFILE_STOP(TX_PROFILE_ADD_STMT, start);
+	return rc;
+}
+
+/**
+ * Учесть конфликт на ключе @a key в индексе @a ind спейса @a space.
+ * Горячие ключи хранятся алгоритмом Space-Saving: K счетчиков, ключ без
+ * своего счетчика вытесняет самый редкий и наследует его значение (оно
+ * же становится погрешностью). O(K) на конфликт, K = MEMTX_TX_HOT_KEYS_MAX.
+ */
+static void
+memtx_tx_hot_key_record(struct memtx_space *space, uint32_t ind, const char *key, enum memtx_tx_conflict_reason reason)
+{
+	const char *key_end = key;
+	mp_next(&key_end);
+	uint32_t key_size = key_end - key;
+	uint32_t copy_size = MIN(key_size, (uint32_t)MEMTX_TX_HOT_KEY_SIZE);
+	struct memtx_tx_hot_key *min = NULL;
+	for (uint32_t i = 0; i < txm.hot_key_count; i++) {
+		struct memtx_tx_hot_key *hot = &txm.hot_keys[i];
+		if (hot->space_id == space->id && hot->index_id == ind &&
+		    hot->key_size == key_size &&
+		    memcmp(hot->key, key, copy_size) == 0) {
+			hot->conflicts++;
+			hot->by_reason[reason]++;
+			return;
+		}
+		if (min == NULL || hot->conflicts < min->conflicts)
+			min = hot;
+	}
+	uint64_t error = 0;
+	if (txm.hot_key_count < MEMTX_TX_HOT_KEYS_MAX) {
+		min = &txm.hot_keys[txm.hot_key_count++];
+	} else {
+		error = min->conflicts;
+	}
+	memset(min, 0, sizeof(*min));
+	min->space_id = space->id;
+	min->index_id = ind;
+	memcpy(min->key, key, copy_size);
+	min->key_size = key_size;
+	min->conflicts = error + 1;
+	min->error = error;
+	min->by_reason[reason] = 1;
+}
+
+/**
+ * Отправить транзакцию @a victim в read view @a psn (или зааборить, если
+ * @a psn == 0) из-за записи в ключ @a key в индексе @a ind. Если
+ * транзакция в итоге зааборчена, ключ учитывается в горячих ключах.
+ */
+static void
+memtx_tx_handle_conflict(struct txn *victim, int64_t psn, struct memtx_space *space, uint32_t ind, const char *key, enum memtx_tx_conflict_reason reason)
+{
+	if (victim->status == TXN_ABORTED)
+		return;
+	if (psn == 0)
+		txn_abort_with_conflict(victim);
+	else
+		txn_send_to_read_view(victim, psn);
+	if (victim->status == TXN_ABORTED)
+		memtx_tx_hot_key_record(space, ind, key, reason);
+}
+
+static inline enum memtx_tx_conflict_reason
+memtx_tx_gap_conflict_reason(const struct inplace_gap_item *item)
+{
+	return item->is_point_hole ? MEMTX_TX_CONFLICT_POINT_HOLE : MEMTX_TX_CONFLICT_GAP;
+}
+
+/** Сколько элементов у тапла @a story в индексе @a index (ссылок в нем). */
+static uint32_t
+memtx_tx_story_entry_count(struct memtx_story *story, struct index *index, struct memtx_story_link **first)
+{
+	uint32_t count = 0;
+	for (uint32_t i = 0; story != NULL && i < story->link_count; i++) {
+		if (story->link[i].index != index)
+			continue;
+		if (count++ == 0)
+			*first = &story->link[i];
+	}
+	return count;
+}
+
+/**
+ * Ссылка @a story в индексе @a index с ключом из отрезка @a item или NULL.
+ */
+static struct memtx_story_link *
+memtx_tx_story_find_in_range(struct memtx_story *story, struct index *index, struct range_gap_item *item)
+{
+	key_def *def = &index->_key_def;
+	for (uint32_t i = 0; story != NULL && i < story->link_count; i++) {
+		struct memtx_story_link *link = &story->link[i];
+		if (link->index != index)
+			continue;
+		const char *key = memtx_tx_story_link_key(link);
+		if ((item->from == NULL || key_compare(item->from, key, def) <= 0) &&
+		    (item->to == NULL || key_compare(key, item->to, def) <= 0))
+			return link;
+	}
+	return NULL;
+}
+
+/**
+ * Обработать читателей числа элементов (memtx_tx_track_count) во всех
+ * индексах, где стейтмент @a stmt меняет это число, и читателей отрезков
+ * ключей (memtx_tx_track_range), в которых он меняет элементы. Замена
+ * тапла с тем же числом ключей в индексе число не меняет и его читателям
+ * не мешает.
+ * @a psn == 0 - абортим читателей, иначе отправляем в read view.
+ */
+static void
+memtx_tx_handle_counted_write(struct txn_stmt *stmt, int64_t psn)
+{
+	struct memtx_space *space = stmt->space;
+	for (uint32_t i = 0; i < space->index_count; i++) {
+		struct index *index = space->index[i];
+		if (rlist_empty(&index->read_gaps))
+			continue;
+		struct memtx_story_link *link = NULL;
+		uint32_t added = memtx_tx_story_entry_count(stmt->add_story, index, &link);
+		uint32_t deleted = memtx_tx_story_entry_count(stmt->del_story, index, &link);
+		if (added == 0 && deleted == 0)
+			continue;
+		struct inplace_gap_item *item, *tmp;
+		rlist_foreach_entry_safe(item, &index->read_gaps, in_read_gaps, tmp) {
+			if (item->txn == stmt->txn)
+				continue;
+			if (!item->is_range) {
+				if (added != deleted)
+					memtx_tx_handle_conflict(item->txn, psn, space, i, memtx_tx_story_link_key(link),
+								 MEMTX_TX_CONFLICT_COUNT);
+				continue;
+			}
+			struct range_gap_item *range = (struct range_gap_item *)item;
+			struct memtx_story_link *touched =
+				memtx_tx_story_find_in_range(stmt->add_story, index, range);
+			if (touched == NULL)
+				touched = memtx_tx_story_find_in_range(stmt->del_story, index, range);
+			if (touched != NULL)
+				memtx_tx_handle_conflict(item->txn, psn, space, i, memtx_tx_story_link_key(touched),
+							 MEMTX_TX_CONFLICT_RANGE);
+		}
+	}
 }
 
 /*
@@ -1396,11 +2101,28 @@ memtx_tx_history_add_stmt(struct txn_stmt *stmt, struct tuple *old_tuple, struct
  * чтобы понять, когда и почему пушим в этот список.
  */
 static void
-memtx_tx_abort_story_readers(struct memtx_story *story)
+memtx_tx_abort_story_readers(struct memtx_space *space, struct memtx_story *story)
 {
 	struct tx_read_tracker *tracker, *tmp;
 	rlist_foreach_entry_safe(tracker, &story->reader_list, in_reader_list, tmp)
-		txn_abort_with_conflict(tracker->reader);
+		memtx_tx_handle_conflict(tracker->reader, 0, space, 0, memtx_tx_story_link_key(&story->link[0]), MEMTX_TX_CONFLICT_READ);
+}
+
+/**
+ * Стейтмент с @a add_story и @a del_story подготовлен или откачен: их
+ * PSN поменялись, обновляем txm.prepared_stories и index->invisible_count.
+ */
+static void
+memtx_tx_stmt_update_stories(struct memtx_story *add_story, struct memtx_story *del_story)
+{
+	if (add_story != NULL) {
+		memtx_tx_story_update_prepared(add_story);
+		memtx_tx_story_update_invisible(add_story);
+	}
+	if (del_story != NULL) {
+		memtx_tx_story_update_prepared(del_story);
+		memtx_tx_story_update_invisible(del_story);
+	}
 }
 
 /*
@@ -1457,7 +2179,7 @@ memtx_tx_history_rollback_added_story(struct txn_stmt *stmt)
 			del_story->del_psn = 0;
 
 		/* Транзакции, читавшие данный story должны заабортиться. */
-		memtx_tx_abort_story_readers(add_story);
+		memtx_tx_abort_story_readers(stmt->space, add_story);
 	}
 
 	/* Отсоединяем story от стейтмента. */
@@ -1472,34 +2194,35 @@ memtx_tx_history_rollback_added_story(struct txn_stmt *stmt)
 	 * любого читателя (это именно то, чего бы мы хотели) и все еще сможет
 	 * хранить read set, если это необходимо.
 	 */
-	for (uint32_t i = 0; i < add_story->index_count; ) {
-		struct memtx_story *old_story = add_story->link[i].older_story;
-		if (old_story == NULL) {
-			/* Эта story теперь самая первая, переходим на следующий индекс. */
+	for (uint32_t i = 0; i < add_story->link_count; ) {
+		struct memtx_story_link *link = &add_story->link[i];
+		if (link->older == NULL) {
+			/* Эта story теперь самая первая, переходим к следующей цепочке. */
 			i++;
 			continue;
 		}
-		memtx_tx_story_reorder(add_story, old_story, i);
+		memtx_tx_story_reorder(link, link->older);
 	}
 	add_story->del_psn = MEMTX_TX_ROLLBACKED_PSN; // psn = 1;
 }
 
 /* Абортим все транзакции, которые прочитали отсутствие @a story. */
 static void
-memtx_tx_abort_gap_readers(struct memtx_story *story)
+memtx_tx_abort_gap_readers(struct memtx_space *space, struct memtx_story *story)
 {
-	for (uint32_t i = 0; i < story->index_count; i++) {
+	for (uint32_t i = 0; i < story->link_count; i++) {
 		/*
 		 * Здесь мы опираемся на инвариант, что все gap трекеры храняться в самой
 		 * верхушке цепочки. Выше уже обсуждали наличие данного инварианта.
 		 */
-		struct memtx_story *top = memtx_tx_story_find_top(story, i);
+		struct memtx_story_link *top = memtx_tx_story_find_top(&story->link[i]);
 		struct inplace_gap_item *item, *tmp;
-		rlist_foreach_entry_safe(item, &top->link[i].read_gaps, in_read_gaps, tmp) {
+		rlist_foreach_entry_safe(item, &top->read_gaps, in_read_gaps, tmp) {
 			/* Пока что для понимания у нас все gap'ы - inplace. */
 			//if (item->type != GAP_INPLACE)
 			//	continue;
-			txn_abort_with_conflict(item->txn);
+			memtx_tx_handle_conflict(item->txn, 0, space, top->index->dense_id,
+						 memtx_tx_story_link_key(top), memtx_tx_gap_conflict_reason(item));
 		}
 	}
 }
@@ -1524,11 +2247,11 @@ memtx_tx_history_rollback_deleted_story(struct txn_stmt *stmt)
 		 * она не представлены в цепочках. Но к счастью by design все их транзакции, конечно,
 		 * сконфликтовали из-за read-write конфликта и поэтому не важны для нас.
 		 */
-		struct memtx_story *test_story;
-		for (test_story = del_story->link[0].newer_story;
-		     test_story != NULL;
-		     test_story = test_story->link[0].newer_story) {
-			struct txn_stmt *test_stmt = test_story->add_stmt;
+		struct memtx_story_link *test_link;
+		for (test_link = del_story->link[0].newer;
+		     test_link != NULL;
+		     test_link = test_link->newer) {
+			struct txn_stmt *test_stmt = memtx_tx_link_story(test_link)->add_stmt;
 			/* Добавил туда же, откуда удалил. */
 			if (test_stmt->is_own_change)
 				continue;
@@ -1544,7 +2267,7 @@ memtx_tx_history_rollback_deleted_story(struct txn_stmt *stmt)
 		del_story->del_psn = 0;
 
 		/* Транзакции, которые прочитали отсутствие этой story, должны быть зааборчены. */
-		memtx_tx_abort_gap_readers(del_story);
+		memtx_tx_abort_gap_readers(stmt->space, del_story);
 	}
 
 	/* Отсоединяем story от стейтмента. */
@@ -1578,23 +2301,21 @@ memtx_tx_history_rollback_empty_stmt(struct txn_stmt *stmt)
 	/* Не DDL и не prepared. */
 	if (/*!stmt->txn->is_schema_changed && */stmt->txn->psn == 0)
 		return;
-	/* ephemeral поддерживать не будем. */
-	if (/*stmt->space->def->opts.is_ephemeral ||*/
+	if (stmt->space->is_ephemeral ||
 	    (old_tuple == NULL && new_tuple == NULL))
 		return;
 	for (size_t i = 0; i < stmt->space->index_count; i++) {
 		struct tuple *unused;
-		if (index_replace(&stmt->space->index[i], new_tuple, old_tuple, DUP_REPLACE_OR_INSERT, &unused/*, &unused*/) != 0) {
+		if (index_replace(stmt->space->index[i], new_tuple, old_tuple, DUP_REPLACE_OR_INSERT, &unused/*, &unused*/) != 0) {
 			/*panic*/fprintf(stderr, "failed to rebind story in index on "
 			      "rollback of statement without story");
 			exit(1);
 		}
 	}
-	/* We have no stories here so reference bare tuples instead. */
-	//if (new_tuple != NULL)
-	//	tuple_unref(new_tuple);
-	//if (old_tuple != NULL)
-	//	tuple_ref(old_tuple);
+	/*
+	 * Ссылки индексов index_replace перенес сам, а ссылки стейтмента
+	 * держат оба тапла до txn_stmt_destroy.
+	 */
 }
 
 void
@@ -1619,6 +2340,11 @@ memtx_tx_history_rollback_stmt(struct txn_stmt *stmt)
 	 * Видимо memtx_tx_history_rollback_added_story обрабатывает и
 	 * удаление сразу??? Ну да, кажется, это правда.
 	*/
+	/* Читатели числа элементов могли увидеть prepared изменение. */
+	if (stmt->txn->psn != 0 && (stmt->add_story != NULL || stmt->del_story != NULL))
+		memtx_tx_handle_counted_write(stmt, 0);
+	struct memtx_story *add_story = stmt->add_story;
+	struct memtx_story *del_story = stmt->del_story;
 	if (stmt->add_story != NULL)
 		memtx_tx_history_rollback_added_story(stmt);
 	else if (stmt->del_story != NULL)
@@ -1626,6 +2352,7 @@ memtx_tx_history_rollback_stmt(struct txn_stmt *stmt)
 	else
 		memtx_tx_history_rollback_empty_stmt(stmt);
 	assert(stmt->add_story == NULL && stmt->del_story == NULL);
+	memtx_tx_stmt_update_stories(add_story, del_story);
 }
 
 /**
@@ -1633,13 +2360,13 @@ memtx_tx_history_rollback_stmt(struct txn_stmt *stmt)
  * за исключением транзакции @a writer, которая удалила данный story.
  */
 static void
-memtx_tx_handle_conflict_story_readers(struct memtx_story *story, struct txn *writer)
+memtx_tx_handle_conflict_story_readers(struct memtx_space *space, struct memtx_story *story, struct txn *writer)
 {
 	struct tx_read_tracker *tracker, *tmp;
 	rlist_foreach_entry_safe(tracker, &story->reader_list, in_reader_list, tmp) {
 		if (tracker->reader == writer)
 			continue;
-		txn_send_to_read_view(tracker->reader, writer->psn);
+		memtx_tx_handle_conflict(tracker->reader, writer->psn, space, 0, memtx_tx_story_link_key(&story->link[0]), MEMTX_TX_CONFLICT_READ);
 	}
 }
 
@@ -1648,14 +2375,15 @@ memtx_tx_handle_conflict_story_readers(struct memtx_story *story, struct txn *wr
  * за исключением транзакции @a writer, которая удалила данный story.
  */
 static void
-memtx_tx_handle_conflict_gap_readers(struct memtx_story *top_story, uint32_t ind, struct txn *writer)
+memtx_tx_handle_conflict_gap_readers(struct memtx_space *space, struct memtx_story_link *top, struct txn *writer)
 {
-	assert(top_story->link[ind].newer_story == NULL);
+	assert(top->newer == NULL);
 	struct inplace_gap_item *item, *tmp;
-	rlist_foreach_entry_safe(item, &top_story->link[ind].read_gaps, in_read_gaps, tmp) {
+	rlist_foreach_entry_safe(item, &top->read_gaps, in_read_gaps, tmp) {
 		if (item->txn == writer/* || item->type != GAP_INPLACE*/)
 			continue;
-		txn_send_to_read_view(item->txn, writer->psn);
+		memtx_tx_handle_conflict(item->txn, writer->psn, space, top->index->dense_id,
+					 memtx_tx_story_link_key(top), memtx_tx_gap_conflict_reason(item));
 	}
 }
 
@@ -1686,21 +2414,23 @@ memtx_tx_history_prepare_insert_stmt(struct txn_stmt *stmt)
 	 * Если стейтмент становится prepared, story, которую он добавил, должна быть
 	 * погружена на уровень prepared stories.
 	 */
-	for (uint32_t i = 0; i < story->index_count; ) {
-		struct memtx_story *old_story = story->link[i].older_story;
+	for (uint32_t i = 0; i < story->link_count; ) {
+		struct memtx_story_link *link = &story->link[i];
+		struct memtx_story *old_story = link->older == NULL ? NULL : memtx_tx_link_story(link->older);
 		if (old_story == NULL || old_story->add_psn != 0 || old_story->add_stmt == NULL) {
-			/* Предыдущая story - prepared, поэтому можно перейти к след. индексу. */
+			/* Предыдущая story - prepared, поэтому можно перейти к след. цепочке. */
 			i++;
 			continue;
 		}
-		memtx_tx_story_reorder(story, old_story, i);
+		memtx_tx_story_reorder(link, link->older);
 	}
 
 	/* Consistency asserts. */
 	{
 		assert(story->del_stmt == NULL ||
 		       story->del_stmt->next_in_del_list == NULL);
-		struct memtx_story *old_story = story->link[0].older_story;
+		struct memtx_story *old_story = story->link[0].older == NULL ?
+						NULL : memtx_tx_link_story(story->link[0].older);
 		if (stmt->del_story == NULL)
 			assert(old_story == NULL || old_story->del_psn != 0);
 		else
@@ -1721,11 +2451,11 @@ memtx_tx_history_prepare_insert_stmt(struct txn_stmt *stmt)
 		 * которые думают, что они ничего не реплейсят. Им нужно сообщить,
 		 * что теперь они реплейсят данный тапл.
 		 */
-		struct memtx_story *test_story;
-		for (test_story = story->link[0].newer_story; //идем вперед по первичной цепочке
-		     test_story != NULL;
-		     test_story = test_story->link[0].newer_story) {
-			struct txn_stmt *test_stmt = test_story->add_stmt;
+		struct memtx_story_link *test_link;
+		for (test_link = story->link[0].newer; //идем вперед по первичной цепочке
+		     test_link != NULL;
+		     test_link = test_link->newer) {
+			struct txn_stmt *test_stmt = memtx_tx_link_story(test_link)->add_stmt;
 			if (test_stmt->is_own_change)
 				continue;
 			assert(test_stmt->txn != stmt->txn);
@@ -1781,7 +2511,7 @@ memtx_tx_history_prepare_insert_stmt(struct txn_stmt *stmt)
 		 * Всем, кто удаляли этот тапл, просто переставили ссылки, а тех, кто прочитали
 		 * отправляем в read view либо откатываем. В принципе, наверное, логично.
 		 */
-		memtx_tx_handle_conflict_story_readers(stmt->del_story, stmt->txn);
+		memtx_tx_handle_conflict_story_readers(stmt->space, stmt->del_story, stmt->txn);
 	} else {
 		/*
 		 * Тапл был вставлен на пустое место. Каждая транзакция, зависящая
@@ -1789,7 +2519,7 @@ memtx_tx_history_prepare_insert_stmt(struct txn_stmt *stmt)
 		 * в read view или быть зааборчена.
 		 * Мы чекаем только первичный индекс здесь, остальные вторичные чекнем ниже.
 		 */
-		struct memtx_story *top_story = memtx_tx_story_find_top(story, 0);
+		struct memtx_story_link *top = memtx_tx_story_find_top(&story->link[0]);
 		/*
 		 * У memtx_tx_handle_conflict_gap_readers немного другой интерфейс, не такой
 		 * как у memtx_tx_abort_gap_readers. memtx_tx_handle_conflict_gap_readers принимает
@@ -1797,11 +2527,14 @@ memtx_tx_history_prepare_insert_stmt(struct txn_stmt *stmt)
 		 * можно передавать любую story из цепочки, он сам вызовет memtx_tx_story_find_top
 		 * и найдет верхушку.
 		 */
-		memtx_tx_handle_conflict_gap_readers(top_story, 0, stmt->txn);
+		memtx_tx_handle_conflict_gap_readers(stmt->space, top, stmt->txn);
 	}
 
-	/* Обработка конфликтов во вторичных индексах. */
-	for (uint32_t i = 1; i < story->index_count; i++) {
+	/*
+	 * Обработка конфликтов во вторичных индексах: во всех цепочках, кроме
+	 * первичной (у multikey индекса - в цепочке каждого ключа).
+	 */
+	for (uint32_t i = 1; i < story->link_count; i++) {
 		/*
 		 * Обработка вторичных cross-write конфликтов. Этот случай
 		 * слишком сложен и заслуживает пояснения на примере.
@@ -1820,10 +2553,10 @@ memtx_tx_history_prepare_insert_stmt(struct txn_stmt *stmt)
 		 * Чтобы обработать эти конфликты, мы должны просканировать
 		 * цепочки в направлении верхушки и проверить все insert стейтменты.
 		 */
-		struct memtx_story *newer_story = story;
-		while (newer_story->link[i].newer_story != NULL) {
-			newer_story = newer_story->link[i].newer_story;
-			struct txn_stmt *test_stmt = newer_story->add_stmt;
+		struct memtx_story_link *newer = &story->link[i];
+		while (newer->newer != NULL) {
+			newer = newer->newer;
+			struct txn_stmt *test_stmt = memtx_tx_link_story(newer)->add_stmt;
 			/* Не конфликтуем с собственными изменениями. */
 			if (test_stmt->txn == stmt->txn)
 				continue;
@@ -1840,18 +2573,19 @@ memtx_tx_history_prepare_insert_stmt(struct txn_stmt *stmt)
 			 * понятно, почему мы не отправили сразу в read view. Видимо,
 			 * эта ситуация может меняться со временем.
 			 */
-			txn_send_to_read_view(test_stmt->txn, stmt->txn->psn);
+			memtx_tx_handle_conflict(test_stmt->txn, stmt->txn->psn, stmt->space, newer->index->dense_id,
+						 memtx_tx_story_link_key(newer), MEMTX_TX_CONFLICT_SECONDARY);
 		}
 		/*
 		 * Мы уже обработали gap readers для вставки в первичный индекс.
 		 * В любом (replace или insert) случае мы должны обработать gap
 		 * readers во вторичных индексах.
-		 * Заметим, что newer_story уже верхушка, поэтому мы решили сделать
+		 * Заметим, что newer уже верхушка, поэтому мы решили сделать
 		 * странный интерфейс, хотя могли бы в memtx_tx_handle_conflict_gap_readers
 		 * добавить одну проверку и не заплатили бы за нее ничего, зато был
 		 * бы порядок.
 		 */
-		memtx_tx_handle_conflict_gap_readers(newer_story, i, stmt->txn);
+		memtx_tx_handle_conflict_gap_readers(stmt->space, newer, stmt->txn);
 	}
 
 	/* Выставляем psn PSNs в stories, чтобы показать, что они - prepared. */
@@ -1898,7 +2632,7 @@ memtx_tx_history_prepare_delete_stmt(struct txn_stmt *stmt)
 	 * Story stmt->del_story перестает действовать. Каждая транзакция, которая
 	 * зависит от нее, должна отправиться в read view либо заабортиться.
 	 */
-	memtx_tx_handle_conflict_story_readers(stmt->del_story, stmt->txn);
+	memtx_tx_handle_conflict_story_readers(stmt->space, stmt->del_story, stmt->txn);
 
 	/* Выставляем PSN в story, чтобы показать, что соотв. транзакция - prepared. */
 	stmt->del_story->del_psn = stmt->txn->psn;
@@ -1908,23 +2642,31 @@ void
 memtx_tx_history_prepare_stmt(struct txn_stmt *stmt)
 {
 	assert(stmt->txn->psn != 0);
-	assert(stmt->space != NULL);
-	/* ephemeral поддерживать не будем. */
-	//if (stmt->space->def->opts.is_ephemeral)
-	//	assert(stmt->add_story == NULL && stmt->del_story == NULL);
+	/* Стейтмент, откаченный txn_rollback_stmt: ни спейса, ни stories у него нет. */
+	if (stmt->space == NULL) {
+		assert(stmt->add_story == NULL && stmt->del_story == NULL);
+		return;
+	}
+	if (stmt->space->is_ephemeral)
+		assert(stmt->add_story == NULL && stmt->del_story == NULL);
 
 	/*
 	 * Заметим, что оба add_story и del_story могут быть NULL в случаях:
-	 * * Спейс - is_ephemeral (нам это пока не интересно).
+	 * * Спейс - is_ephemeral (сюда такие стейтменты не попадают).
 	 * * Во время initial recovery (тоже скип).
 	 * Для нас актуально:
 	 * * Это удаление из спейса по ключу, который не был найден в спейсе.
 	 * В каждом из этих случаев, ничего делать не требуется.
 	 */
+	TX_PROFILE_START(start);
 	if (stmt->add_story != NULL)
 		memtx_tx_history_prepare_insert_stmt(stmt);
 	else if (stmt->del_story != NULL)
 		memtx_tx_history_prepare_delete_stmt(stmt);
+	if (stmt->add_story != NULL || stmt->del_story != NULL)
+		memtx_tx_handle_counted_write(stmt, stmt->txn->psn);
+	memtx_tx_stmt_update_stories(stmt->add_story, stmt->del_story);
+	TX_PROFILE_STOP(TX_PROFILE_PREPARE_STMT, start);
 
 	memtx_tx_story_gc();
 }
@@ -1962,13 +2704,58 @@ memtx_tx_history_commit_stmt(struct txn_stmt *stmt)
 
 /* Хелпер функции @sa memtx_tx_tuple_clarify. */
 static struct tuple *
-memtx_tx_story_clarify_impl(struct txn *txn, struct memtx_space *space, struct memtx_story *top_story, struct index *index, /*uint32_t mk_index, */bool is_prepared_ok)
+memtx_tx_story_clarify_impl(struct txn *txn, struct memtx_space *space, struct memtx_story *top_story, struct index *index, uint32_t mk_index, bool is_prepared_ok)
 {
+	struct memtx_story_link *top = memtx_tx_story_find_link(top_story, index, mk_index);
+	assert(top != NULL);
+	struct memtx_story_link *link = top;
 	struct memtx_story *story = top_story;
 	bool own_change = false;
 	struct tuple *result = NULL;
+	uint32_t chain_length = 0;
+	/*
+	 * Начало текущей серии stories, невидимых для read view, и минимальный
+	 * PSN в ней: когда серия закончится, из её начала проставляется
+	 * skip-указатель, и следующие читатели перепрыгнут её за один шаг.
+	 */
+	struct memtx_story_link *skip_start = NULL;
+	int64_t skip_psn = INT64_MAX;
 
 	while (true) {
+		story = memtx_tx_link_story(link);
+		chain_length++;
+		/*
+		 * Транзакция может попасть в read view прямо во время прохода,
+		 * поэтому проверяем на каждом шаге.
+		 */
+		if (txn != NULL && txn->status == TXN_IN_READ_VIEW &&
+		    memtx_tx_story_is_skippable(story, txn->rv_psn)) {
+			if (link->skip != NULL && txn->rv_psn <= link->skip_psn) {
+				/*
+				 * Серия до story заканчивается готовым указателем;
+				 * после прыжка начнется новая.
+				 */
+				if (skip_start != NULL && skip_start->older != link)
+					memtx_tx_story_set_skip(skip_start, link, skip_psn);
+				skip_start = NULL;
+				link = link->skip;
+				continue;
+			}
+			if (skip_start == NULL) {
+				skip_start = link;
+				skip_psn = INT64_MAX;
+			}
+			skip_psn = MIN(skip_psn, memtx_tx_story_min_psn(story));
+			if (link->older == NULL)
+				break;
+			link = link->older;
+			continue;
+		}
+		if (skip_start != NULL) {
+			if (skip_start->older != link)
+				memtx_tx_story_set_skip(skip_start, link, skip_psn);
+			skip_start = NULL;
+		}
 		/* Удаление видимо. */
 		if (memtx_tx_story_delete_is_visible(story, txn, is_prepared_ok, &own_change)) {
 			result = NULL;
@@ -1995,10 +2782,12 @@ memtx_tx_story_clarify_impl(struct txn *txn, struct memtx_space *space, struct m
 		}
 
 		/* Шаг назад. */
-		if (story->link[index->dense_id].older_story == NULL)
+		if (link->older == NULL)
 			break;
-		story = story->link[index->dense_id].older_story;
+		link = link->older;
 	}
+	TX_PROFILE_CHAIN(chain_length);
+	(void)chain_length;
 	if (txn != NULL && !own_change) {
 		/*
 		 * Если результирующий тапл существует (видим) - он виден в каждом
@@ -2010,7 +2799,7 @@ memtx_tx_story_clarify_impl(struct txn *txn, struct memtx_space *space, struct m
 		 * то и будет читаться в сериализованном порядке, поэтому мы трекаем здесь.
 		 */
 		if (result == NULL)
-			memtx_tx_track_story_gap(txn, top_story, index->dense_id);
+			memtx_tx_track_story_gap(txn, top);
 		else
 			memtx_tx_track_read_story(txn, space, story);
 	}
@@ -2019,11 +2808,11 @@ memtx_tx_story_clarify_impl(struct txn *txn, struct memtx_space *space, struct m
 
 /* Хелпер @sa memtx_tx_tuple_clarify. */
 static struct tuple *
-memtx_tx_tuple_clarify_impl(struct txn *txn, struct memtx_space *space, struct tuple *tuple, struct index *index, /*uint32_t mk_index, */bool is_prepared_ok)
+memtx_tx_tuple_clarify_impl(struct txn *txn, struct memtx_space *space, struct tuple *tuple, struct index *index, uint32_t mk_index, bool is_prepared_ok)
 {
 	assert(tuple_has_flag(tuple, TUPLE_IS_DIRTY));
 	struct memtx_story *story = memtx_tx_story_get(tuple);
-	return memtx_tx_story_clarify_impl(txn, space, story, index, /*mk_index, */is_prepared_ok);
+	return memtx_tx_story_clarify_impl(txn, space, story, index, mk_index, is_prepared_ok);
 }
 
 /**
@@ -2056,7 +2845,7 @@ memtx_tx_tuple_clarify_impl(struct txn *txn, struct memtx_space *space, struct t
  * Определяет is_prepared_ok флаг и отдает в memtx_tx_tuple_clarify_impl.
  */
 struct tuple *
-memtx_tx_tuple_clarify_slow(struct txn *txn, struct memtx_space *space, struct tuple *tuple, struct index *index/*, uint32_t mk_index*/)
+memtx_tx_tuple_clarify_slow(struct txn *txn, struct memtx_space *space, struct tuple *tuple, struct index *index, uint32_t mk_index)
 {
 	/* Если у тапла нет никакой истории, просто читаем его и, конечно, трекаем это чтение. */
 	if (!tuple_has_flag(tuple, TUPLE_IS_DIRTY)) {
@@ -2065,10 +2854,264 @@ memtx_tx_tuple_clarify_slow(struct txn *txn, struct memtx_space *space, struct t
 	}
 	//bool is_prepared_ok = detect_whether_prepared_ok(txn, space);
 	bool is_prepared_ok = true;
-	struct tuple *res = memtx_tx_tuple_clarify_impl(txn, space, tuple, index, /*mk_index, */is_prepared_ok);
+	struct tuple *res = memtx_tx_tuple_clarify_impl(txn, space, tuple, index, mk_index, is_prepared_ok);
 	return res;
 }
 
+bool
+memtx_tx_space_is_unobserved(struct memtx_space *space)
+{
+	if (!rlist_empty(&txm.read_view_txns))
+		return false;
+	for (uint32_t i = 0; i < space->index_count; i++) {
+		struct index *index = space->index[i];
+		if (index_size(index) != 0 || !rlist_empty(&index->read_gaps) ||
+		    index->point_hole_count != 0)
+			return false;
+	}
+	return true;
+}
+
+/** Story таплов спейса @a space. */
+static inline bool
+memtx_tx_story_is_in_space(struct memtx_story *story, struct memtx_space *space)
+{
+	return story->link[0].index->space_id == space->id;
+}
+
+void
+memtx_tx_space_foreach_tuple(struct memtx_space *space, void (*cb)(struct tuple *tuple, void *arg), void *arg)
+{
+	struct memtx_story *story;
+	rlist_foreach_entry(story, &txm.all_stories, in_all_stories) {
+		if (memtx_tx_story_is_in_space(story, space))
+			cb(story->tuple, arg);
+	}
+}
+
+/** Транзакции, которые надо абортить, см. memtx_tx_space_clear_history. */
+struct memtx_tx_victims {
+	struct txn **txns;
+	size_t count;
+	size_t capacity;
+};
+
+static void
+memtx_tx_victims_add(struct memtx_tx_victims *victims, struct txn *txn)
+{
+	if (victims->count == victims->capacity) {
+		victims->capacity = MAX(2 * victims->capacity, (size_t)16);
+		victims->txns = xrealloc(victims->txns, victims->capacity * sizeof(*victims->txns));
+	}
+	victims->txns[victims->count++] = txn;
+}
+
+/** Число stories спейса @a space. */
+static size_t
+memtx_tx_space_story_count(struct memtx_space *space)
+{
+	size_t count = 0;
+	struct memtx_story *story;
+	rlist_foreach_entry(story, &txm.all_stories, in_all_stories)
+		count += memtx_tx_story_is_in_space(story, space);
+	return count;
+}
+
+int
+memtx_tx_space_clear_history(struct memtx_space *space)
+{
+	/*
+	 * Сначала собираем транзакции, потом абортим: откат удаляет stories
+	 * прямо во время прохода. Одна транзакция может попасть в список
+	 * несколько раз, повторный аборт ничего не делает.
+	 */
+	struct memtx_tx_victims victims = {NULL, 0, 0};
+	int64_t max_psn = 0;
+	struct memtx_story *story;
+	rlist_foreach_entry(story, &txm.all_stories, in_all_stories) {
+		if (!memtx_tx_story_is_in_space(story, space))
+			continue;
+		max_psn = MAX(max_psn, MAX(story->add_psn, story->del_psn));
+		if (story->add_stmt != NULL)
+			memtx_tx_victims_add(&victims, story->add_stmt->txn);
+		for (struct txn_stmt *stmt = story->del_stmt; stmt != NULL;
+		     stmt = stmt->next_in_del_list)
+			memtx_tx_victims_add(&victims, stmt->txn);
+		struct tx_read_tracker *tracker;
+		rlist_foreach_entry(tracker, &story->reader_list, in_reader_list)
+			memtx_tx_victims_add(&victims, tracker->reader);
+		for (uint32_t i = 0; i < story->link_count; i++) {
+			struct inplace_gap_item *item;
+			rlist_foreach_entry(item, &story->link[i].read_gaps, in_read_gaps)
+				memtx_tx_victims_add(&victims, item->txn);
+		}
+	}
+	/* Read view держит stories, изменения которых он не видит. */
+	struct txn *txn;
+	rlist_foreach_entry(txn, &txm.read_view_txns, in_read_view_txns) {
+		if (txn->rv_psn <= max_psn)
+			memtx_tx_victims_add(&victims, txn);
+	}
+	for (size_t i = 0; i < victims.count; i++)
+		txn_abort_by_ddl(victims.txns[i]);
+	free(victims.txns);
+	/*
+	 * Цепочка отпускается по одной story за проход (верхушку держит
+	 * более старая story), поэтому проходов столько, сколько нужно, пока
+	 * они что-то удаляют.
+	 */
+	size_t count = memtx_tx_space_story_count(space);
+	while (count != 0) {
+		size_t pass = txm.stats.objects[MEMTX_TX_OBJECT_STORY].count + 1;
+		for (size_t i = 0; i < pass; i++)
+			memtx_tx_story_gc_step();
+		size_t left = memtx_tx_space_story_count(space);
+		if (left == count)
+			break;
+		count = left;
+	}
+	tuple_collect_garbage(SIZE_MAX);
+	if (count != 0) {
+		fprintf(stderr, "Failed to release the history of space %u: %zu stories left",
+			space->id, count);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Поправить @a delta на то, насколько иначе, чем index->invisible_count,
+ * транзакция @a txn видит элементы индекса @a index в цепочках @a story.
+ * Каждая цепочка учитывается один раз: ее верхушка помечается is_visited,
+ * а с @a delta == NULL метки снимаются.
+ */
+static void
+memtx_tx_story_count_invisible(struct memtx_story *story, struct index *index, struct txn *txn, ssize_t *delta)
+{
+	for (uint32_t i = 0; i < story->link_count; i++) {
+		struct memtx_story_link *link = &story->link[i];
+		if (link->index != index)
+			continue;
+		struct memtx_story_link *top = memtx_tx_story_find_top(link);
+		assert(top->in_index);
+		if (delta == NULL) {
+			top->is_visited = 0;
+		} else if (!top->is_visited) {
+			top->is_visited = 1;
+			*delta += (ssize_t)memtx_tx_link_is_invisible(top, txn) -
+				  (ssize_t)top->is_invisible;
+		}
+	}
+}
+
+/**
+ * Пройти по stories, которые @a txn может видеть не так, как транзакция
+ * без своих изменений и read view: по ее собственным, а в read view - по
+ * подготовленным не раньше rv_psn (своих изменений там не бывает).
+ */
+static void
+memtx_tx_txn_count_invisible(struct txn *txn, struct index *index, ssize_t *delta)
+{
+	if (txn->rv_psn != 0) {
+		struct memtx_story *story;
+		rlist_foreach_entry_reverse(story, &txm.prepared_stories, in_prepared_stories) {
+			if (memtx_tx_story_max_psn(story) < txn->rv_psn)
+				break;
+			memtx_tx_story_count_invisible(story, index, txn, delta);
+		}
+		return;
+	}
+	struct txn_stmt *stmt;
+	stailq_foreach_entry(stmt, &txn->stmts, next) {
+		if (stmt->add_story != NULL)
+			memtx_tx_story_count_invisible(stmt->add_story, index, txn, delta);
+		if (stmt->del_story != NULL)
+			memtx_tx_story_count_invisible(stmt->del_story, index, txn, delta);
+	}
+}
+
+size_t
+memtx_tx_index_invisible_count(struct txn *txn, struct index *index)
+{
+	if (txn == NULL)
+		return index->invisible_count;
+	ssize_t delta = 0;
+	memtx_tx_txn_count_invisible(txn, index, &delta);
+	memtx_tx_txn_count_invisible(txn, index, NULL);
+	assert((ssize_t)index->invisible_count + delta >= 0);
+	return index->invisible_count + delta;
+}
+
+void
+memtx_tx_track_count(struct txn *txn, struct index *index)
+{
+	if (txn == NULL || txn->status != TXN_INPROGRESS)
+		return;
+	/* Одного трекера на индекс достаточно. */
+	struct inplace_gap_item *item;
+	rlist_foreach_entry(item, &index->read_gaps, in_read_gaps) {
+		if (item->txn == txn && !item->is_range)
+			return;
+	}
+	item = memtx_tx_inplace_gap_item_new(txn);
+	rlist_add(&index->read_gaps, &item->in_read_gaps);
+}
+
+/** Размер MsgPack значения @a key или 0, если его нет. */
+static inline uint32_t
+memtx_tx_key_size(const char *key)
+{
+	if (key == NULL)
+		return 0;
+	const char *end = key;
+	mp_next(&end);
+	return end - key;
+}
+
+void
+memtx_tx_track_range(struct txn *txn, struct index *index, const char *from, const char *to)
+{
+	if (txn == NULL || txn->status != TXN_INPROGRESS)
+		return;
+	key_def *def = &index->_key_def;
+	/* Отрезок, уже прочитанный транзакцией целиком, второй раз не нужен. */
+	struct inplace_gap_item *item;
+	rlist_foreach_entry(item, &index->read_gaps, in_read_gaps) {
+		if (item->txn != txn || !item->is_range)
+			continue;
+		struct range_gap_item *range = (struct range_gap_item *)item;
+		if ((range->from == NULL || (from != NULL && key_compare(range->from, from, def) <= 0)) &&
+		    (range->to == NULL || (to != NULL && key_compare(to, range->to, def) <= 0)))
+			return;
+	}
+	uint32_t from_size = memtx_tx_key_size(from);
+	uint32_t to_size = memtx_tx_key_size(to);
+	uint32_t size = sizeof(struct range_gap_item) + from_size + to_size;
+	struct range_gap_item *range = (struct range_gap_item *)
+		memtx_tx_alloc(size, MEMTX_TX_OBJECT_GAP_ITEM);
+	gap_item_base_create(&range->base, txn);
+	range->base.is_range = true;
+	range->size = size;
+	char *data = (char *)(range + 1);
+	range->from = from == NULL ? NULL : (const char *)memcpy(data, from, from_size);
+	range->to = to == NULL ? NULL : (const char *)memcpy(data + from_size, to, to_size);
+	rlist_add(&index->read_gaps, &range->base.in_read_gaps);
+}
+
+struct tuple *
+memtx_tx_tuple_clarify_untracked(struct txn *txn, struct tuple *tuple, struct index *index, uint32_t mk_index)
+{
+	if (!tuple_has_flag(tuple, TUPLE_IS_DIRTY))
+		return tuple;
+	struct memtx_story *story = memtx_tx_story_get(tuple);
+	struct memtx_story_link *link = memtx_tx_story_find_link(story, index, mk_index);
+	assert(link != NULL);
+	struct tuple *visible;
+	bool unused;
+	memtx_tx_story_find_visible_tuple(link, txn, true, &visible, &unused);
+	return visible;
+}
+
 /**
  * Определяет, виден ли тапл @a tuple из индекса @a index спейса @a space
  * для транзакции @a txn.
@@ -2080,11 +3123,14 @@ memtx_tx_tuple_key_is_visible_slow(struct txn *txn, struct memtx_space *space, s
 		return true;
 
 	struct memtx_story *story = memtx_tx_story_get(tuple);
+	struct memtx_story_link *link = memtx_tx_story_find_link(story, index, 0);
+	if (link == NULL)
+		return false;
 	struct tuple *visible = NULL;
 	//bool is_prepared_ok = detect_whether_prepared_ok(txn, space);
 	bool is_prepared_ok = true;
 	bool unused;
-	memtx_tx_story_find_visible_tuple(story, txn, index->dense_id, is_prepared_ok, &visible, &unused);
+	memtx_tx_story_find_visible_tuple(link, txn, is_prepared_ok, &visible, &unused);
 	return visible != NULL;
 }
 
@@ -2095,12 +3141,22 @@ memtx_tx_tuple_key_is_visible_slow(struct txn *txn, struct memtx_space *space, s
 static struct tx_read_tracker *
 tx_read_tracker_new(struct txn *reader, struct memtx_story *story)
 {
-	struct tx_read_tracker *tracker = (struct tx_read_tracker *)malloc(sizeof(struct tx_read_tracker));
+	struct tx_read_tracker *tracker = (struct tx_read_tracker *)
+		memtx_tx_alloc(sizeof(struct tx_read_tracker), MEMTX_TX_OBJECT_READ_TRACKER);
 	tracker->reader = reader;
 	tracker->story = story;
 	return tracker;
 }
 
+/** Удаляет трекер из обоих списков и освобождает его. */
+static void
+tx_read_tracker_delete(struct tx_read_tracker *tracker)
+{
+	rlist_del(&tracker->in_reader_list);
+	rlist_del(&tracker->in_read_set);
+	memtx_tx_free(tracker, sizeof(struct tx_read_tracker), MEMTX_TX_OBJECT_READ_TRACKER);
+}
+
 /**
  * Трекает тот факт, что транзакция @a txn прочитала стори @a story в спейсе @a space.
  * Этот факт может привести к тому что транзакция отправится в read view или сконфликтует.
@@ -2110,8 +3166,8 @@ tx_read_tracker_new(struct txn *reader, struct memtx_story *story)
 static void
 memtx_tx_track_read_story(struct txn *txn, struct memtx_space *space, struct memtx_story *story)
 {
-	/* ephemeral поддерживать не будем. */
-	if (txn == NULL || space == NULL/* || space->def->opts.is_ephemeral*/)
+	/* Ephemeral спейс виден только своей транзакции, читать в нем не с кем конфликтовать. */
+	if (txn == NULL || space == NULL || space->is_ephemeral)
 		return;
 	(void)space;
 	assert(story != NULL);
@@ -2163,8 +3219,8 @@ memtx_tx_track_read(struct txn *txn, struct memtx_space *space, struct tuple *tu
 {
 	if (tuple == NULL)
 		return;
-	/* ephemeral поддерживать не будем. */
-	if (txn == NULL || space == NULL/* || space->def->opts.is_ephemeral*/)
+	/* См. memtx_tx_track_read_story. */
+	if (txn == NULL || space == NULL || space->is_ephemeral)
 		return;
 
 	if (tuple_has_flag(tuple, TUPLE_IS_DIRTY)) {
@@ -2195,29 +3251,29 @@ memtx_tx_track_read(struct txn *txn, struct memtx_space *space, struct tuple *tu
  * Вызывается только из memtx_tx_track_point_slow.
  */
 static void
-//point_hole_storage_new(index *index, const char *key, size_t key_len, txn *txn)
-point_hole_storage_new(struct index *index, int key, struct txn *txn)
+point_hole_storage_new(struct index *index, const char *key, uint32_t key_len, struct txn *txn)
 {
 	//memtx_tx_mempool *pool = &txm.point_hole_item_pool;
 	//point_hole_item *object = memtx_tx_xmempool_alloc(txn, pool);
 
-	struct point_hole_item *object = point_hole_item_new();
+	struct point_hole_item *object = point_hole_item_new(key_len);
 
 	rlist_create(&object->ring);
 	rlist_create(&object->in_point_holes_list);
 	object->txn = txn;
-	//index_ref(index);
-	//if (key_len <= sizeof(object->short_key)) {
-	//	object->key = object->short_key;
-	//} else {
-	//	object->key = memtx_tx_xregion_alloc(txn, key_len, MEMTX_TX_ALLOC_TRACKER);
-	//}
-	//memcpy((char *)object->key, key, key_len);
-	object->key = key;
+	object->index = index;
+	object->index_unique_id = index->unique_id;
+	/* Длинный ключ лежит в той же аллокации сразу за элементом. */
+	if (key_len <= sizeof(object->short_key))
+		object->key = object->short_key;
+	else
+		object->key = (const char *)(object + 1);
+	memcpy((char *)object->key, key, key_len);
+	object->key_len = key_len;
 	object->is_head = true;
 
 	key_def *def = &index->_key_def;
-	uint32_t hash = /*key_hash(key, def)*/tuple_hash(key, def);
+	uint32_t hash = key_hash(key, def);
 	object->hash = point_hole_storage_combine_index_and_tuple_hash(index, hash);
 
 	const struct point_hole_item **put = (const struct point_hole_item **)&object;
@@ -2234,6 +3290,7 @@ point_hole_storage_new(struct index *index, int key, struct txn *txn)
 		replaced->is_head = false;
 	}
 	rlist_add(&txn->point_holes_list, &object->in_point_holes_list);
+	index->point_hole_count++;
 }
 
 static void
@@ -2274,17 +3331,16 @@ point_hole_storage_delete(struct point_hole_item *object)
  * в спейсе @a space в индексе @a index. Вызывается из memtx_tx_track_point.
  */
 void
-memtx_tx_track_point_slow(struct txn *txn, struct index *index, int key)
+memtx_tx_track_point_slow(struct txn *txn, struct index *index, const char *key)
 {
 	if (txn->status != TXN_INPROGRESS)
 		return;
 
-	//key_def *def = index->def->_key_def;
-	//const char *tmp = key;
-	//for (uint32_t i = 0; i < def->part_count; i++)
-	//	mp_next(&tmp);
-	//size_t key_len = tmp - key;
-	point_hole_storage_new(index, key, txn);
+	/* Ключ из одного поля. */
+	const char *tmp = key;
+	mp_next(&tmp);
+	size_t key_len = tmp - key;
+	point_hole_storage_new(index, key, key_len, txn);
 }
 
 /* Clean and clear all read lists of @a txn. */
@@ -2301,10 +3357,8 @@ memtx_tx_clear_txn_read_lists(struct txn *txn)
 	}
 
 	struct tx_read_tracker *tracker, *tmp;
-	rlist_foreach_entry_safe(tracker, &txn->read_set, in_read_set, tmp) {
-		rlist_del(&tracker->in_reader_list);
-		rlist_del(&tracker->in_read_set);
-	}
+	rlist_foreach_entry_safe(tracker, &txn->read_set, in_read_set, tmp)
+		tx_read_tracker_delete(tracker);
 	assert(rlist_empty(&txn->read_set));
 
 	rlist_del(&txn->in_read_view_txns);
@@ -2327,8 +3381,12 @@ memtx_tx_manager_init(void)
 
 	txm.point_holes = mh_point_holes_new();
 	rlist_create(&txm.all_stories);
+	rlist_create(&txm.prepared_stories);
 	txm.traverse_all_stories = &txm.all_stories;
 	txm.must_do_gc_steps = 0;
+	txm.gc_garbage_ratio = 1.0;
+	memset(&txm.stats, 0, sizeof(txm.stats));
+	txm.hot_key_count = 0;
 }
 
 void
@@ -2340,11 +3398,51 @@ memtx_tx_manager_free(void)
 
 	struct memtx_story *story, *tmp;
 	rlist_foreach_entry_safe(story, &txm.all_stories, in_all_stories, tmp) {
-		for (size_t i = 0; i < story->index_count; i++)
-			story->link[i].in_index = NULL;
+		for (size_t i = 0; i < story->link_count; i++) {
+			story->link[i].in_index = 0;
+			story->link[i].is_invisible = 0;
+		}
 		memtx_tx_story_full_unlink_on_space_delete(story);
 		memtx_tx_story_delete(story);
 	}
 	mh_history_delete(txm.history);
 	mh_point_holes_delete(txm.point_holes);
+	tuple_collect_garbage(SIZE_MAX);
+}
+
+void
+memtx_tx_statistics_collect(struct memtx_tx_statistics *stats)
+{
+	*stats = txm.stats;
+}
+
+void
+memtx_tx_set_memory_limit(size_t limit)
+{
+	txm.stats.memory_limit = limit;
+}
+
+static int
+memtx_tx_hot_key_cmp(const void *a, const void *b)
+{
+	const struct memtx_tx_hot_key *l = (const struct memtx_tx_hot_key *)a;
+	const struct memtx_tx_hot_key *r = (const struct memtx_tx_hot_key *)b;
+	return l->conflicts < r->conflicts ? 1 : l->conflicts > r->conflicts ? -1 : 0;
+}
+
+uint32_t
+memtx_tx_hot_keys(struct memtx_tx_hot_key *keys, uint32_t size)
+{
+	struct memtx_tx_hot_key sorted[MEMTX_TX_HOT_KEYS_MAX];
+	memcpy(sorted, txm.hot_keys, txm.hot_key_count * sizeof(sorted[0]));
+	qsort(sorted, txm.hot_key_count, sizeof(sorted[0]), memtx_tx_hot_key_cmp);
+	uint32_t count = MIN(size, txm.hot_key_count);
+	memcpy(keys, sorted, count * sizeof(sorted[0]));
+	return count;
+}
+
+void
+memtx_tx_hot_keys_reset(void)
+{
+	txm.hot_key_count = 0;
 }
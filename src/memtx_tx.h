@@ -6,6 +6,10 @@
 #include "memtx_space.h"
 #include "txn.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * Status of story. Describes the reason why it is not deleted.
  * In the case when story fits several statuses at once, status with
@@ -27,6 +31,87 @@ enum memtx_tx_story_status {
 	MEMTX_TX_STORY_STATUS_MAX = 3,
 };
 
+/** Виды объектов, под которые TX менеджер аллоцирует память. */
+enum memtx_tx_alloc_object {
+	MEMTX_TX_OBJECT_STORY = 0,
+	MEMTX_TX_OBJECT_READ_TRACKER = 1,
+	MEMTX_TX_OBJECT_POINT_HOLE_ITEM = 2,
+	MEMTX_TX_OBJECT_GAP_ITEM = 3,
+	MEMTX_TX_OBJECT_MAX = 4,
+};
+
+/** Количество объектов и сколько байт они занимают. */
+struct memtx_tx_mem_stat {
+	size_t count;
+	size_t total;
+};
+
+/** Статистика памяти TX менеджера. */
+struct memtx_tx_statistics {
+	/** Память по видам объектов. */
+	struct memtx_tx_mem_stat objects[MEMTX_TX_OBJECT_MAX];
+	/** Память stories по статусам (см. memtx_tx_story_status). */
+	struct memtx_tx_mem_stat stories[MEMTX_TX_STORY_STATUS_MAX];
+	/**
+	 * Из памяти stories - связи stories по индексам (по одной на каждый
+	 * ключ тапла в каждом индексе), аллоцируются вместе со story.
+	 */
+	struct memtx_tx_mem_stat links;
+	/** Всего байт, занятых объектами менеджера. */
+	size_t total;
+	/** Сколько байт выделено за все время (растет монотонно). */
+	uint64_t allocated;
+	/** Лимит памяти, 0 - без лимита. */
+	size_t memory_limit;
+	/** Сколько пишущих транзакций было отклонено из-за лимита. */
+	size_t rejected_txns;
+};
+
+/** Почему транзакция сконфликтовала на ключе. */
+enum memtx_tx_conflict_reason {
+	/** Транзакция прочитала тапл (есть трекер), а его перезаписали. */
+	MEMTX_TX_CONFLICT_READ = 0,
+	/** Транзакция не нашла ключ в пустом месте (point hole), а его вставили. */
+	MEMTX_TX_CONFLICT_POINT_HOLE = 1,
+	/** Транзакция не нашла видимый тапл в цепочке (gap), а его вставили. */
+	MEMTX_TX_CONFLICT_GAP = 2,
+	/** Транзакция вставила дубликат во вторичный индекс. */
+	MEMTX_TX_CONFLICT_SECONDARY = 3,
+	/** Транзакция посчитала элементы индекса, а их число изменилось. */
+	MEMTX_TX_CONFLICT_COUNT = 4,
+	/** Транзакция прочитала отрезок ключей индекса, а в нем что-то записали. */
+	MEMTX_TX_CONFLICT_RANGE = 5,
+	MEMTX_TX_CONFLICT_REASON_MAX = 6,
+};
+
+enum {
+	/** Сколько горячих ключей отслеживает TX менеджер. */
+	MEMTX_TX_HOT_KEYS_MAX = 32,
+	/** Сколько байт ключа сохраняется в memtx_tx_hot_key. */
+	MEMTX_TX_HOT_KEY_SIZE = 32,
+};
+
+/** Ключ, на котором конфликтуют транзакции. */
+struct memtx_tx_hot_key {
+	uint32_t space_id;
+	/** Номер индекса в спейсе (dense id). */
+	uint32_t index_id;
+	/**
+	 * MsgPack значение ключа, как оно лежит в тапле, обрезанное до
+	 * MEMTX_TX_HOT_KEY_SIZE байт. Ключи сравниваются побайтно, а
+	 * длинные - по этому префиксу и полному размеру.
+	 */
+	char key[MEMTX_TX_HOT_KEY_SIZE];
+	/** Полный размер ключа. */
+	uint32_t key_size;
+	/** Число зааборченных транзакций (оценка сверху). */
+	uint64_t conflicts;
+	/** На сколько conflicts может быть завышено. */
+	uint64_t error;
+	/** Разбивка conflicts по причинам (без учета error). */
+	uint64_t by_reason[MEMTX_TX_CONFLICT_REASON_MAX];
+};
+
 /**
  * Initialize memtx transaction manager.
  */
@@ -39,6 +124,57 @@ memtx_tx_manager_init();
 void
 memtx_tx_manager_free();
 
+/** Заполнить @a stats текущей статистикой памяти TX менеджера. */
+void
+memtx_tx_statistics_collect(struct memtx_tx_statistics *stats);
+
+/**
+ * Выставить лимит памяти TX менеджера в байтах (0 - без лимита).
+ * При превышении лимита GC становится агрессивным: собирает stories,
+ * пока не уложится в лимит (не больше одного полного прохода за раз),
+ * а новые пишущие транзакции отклоняются, пока память не освободится.
+ */
+void
+memtx_tx_set_memory_limit(size_t limit);
+
+/**
+ * Собрать мусор и проверить, можно ли загрузить таплы в обход TX
+ * менеджера (memtx_space_load): загрузка отклоняется при превышении
+ * лимита памяти, как новая пишущая транзакция. Сама она stories не
+ * создает, а память таплов лимит не учитывает.
+ */
+int
+memtx_tx_check_load(void);
+
+/**
+ * Скопировать в @a keys не больше @a size самых горячих ключей, отсортированных
+ * по убыванию числа конфликтов.
+ * @return количество скопированных ключей.
+ */
+uint32_t
+memtx_tx_hot_keys(struct memtx_tx_hot_key *keys, uint32_t size);
+
+/** Сбросить таблицу горячих ключей. */
+void
+memtx_tx_hot_keys_reset(void);
+
+/**
+ * Фоновая сборка мусора: делает шаги GC, пока не истечет @a budget секунд,
+ * но не больше одного полного прохода по всем stories. Предназначена для
+ * вызова, когда система простаивает - выплачивает долг, который GC не
+ * успел сделать на пути записи, и освобождает все таплы из очереди мусора.
+ * @return количество удаленных stories.
+ */
+size_t
+memtx_tx_story_gc_idle(double budget);
+
+/**
+ * Очистить memtx_tx часть транзакции @a txn: удалить все трекеры,
+ * point holes и gap'ы транзакции и сделать шаги GC.
+ */
+void
+memtx_tx_clean_txn(struct txn *txn);
+
 /**
  * Implementation of engine_send_to_read_view callback.
  * Do not use directly.
@@ -137,11 +273,11 @@ memtx_tx_history_commit_stmt(struct txn_stmt *stmt);
 
 /** Хелпер функции memtx_tx_tuple_clarify */
 struct tuple *
-memtx_tx_tuple_clarify_slow(struct txn *txn, struct memtx_space *space, struct tuple *tuples, struct index *index/*, uint32_t mk_index*/);
+memtx_tx_tuple_clarify_slow(struct txn *txn, struct memtx_space *space, struct tuple *tuples, struct index *index, uint32_t mk_index);
 
 /** Хелпер функции memtx_tx_track_point */
 void
-memtx_tx_track_point_slow(struct txn *txn, struct index *index, int key);
+memtx_tx_track_point_slow(struct txn *txn, struct index *index, const char *key);
 
 /**
  * Записать в TX менеджере, что транзакция @a txn ничего не прочитала
@@ -158,11 +294,11 @@ memtx_tx_track_point_slow(struct txn *txn, struct index *index, int key);
  * @return 0 on success, -1 on memory error.
  */
 static inline void
-memtx_tx_track_point(struct txn *txn, struct memtx_space *space, struct index *index, int key)
+memtx_tx_track_point(struct txn *txn, struct memtx_space *space, struct index *index, const char *key)
 {
 	//if (!memtx_tx_manager_use_mvcc_engine)
 	//	return;
-	if (txn == NULL || space == NULL/* || space->def->opts.is_ephemeral*/)
+	if (txn == NULL || space == NULL || space->is_ephemeral)
 		return;
 	memtx_tx_track_point_slow(txn, index, key);
 }
@@ -174,13 +310,83 @@ memtx_tx_track_point(struct txn *txn, struct memtx_space *space, struct index *i
  * @param space - space in which the tuple was found.
  * @param tuple - tuple to clean.
  * @param index - index in which the tuple was found.
- * @param mk_index - multikey index (iа the index is multikey).
+ * @param mk_index - multikey index (iа the index is multikey): which of
+ *                   the tuple's keys was found (see index_get_internal).
  * @return clean tuple (can be NULL).
  */
 static inline struct tuple *
-memtx_tx_tuple_clarify(struct txn *txn, struct memtx_space *space, struct tuple *tuple, struct index *index/*, uint32_t mk_index*/)
+memtx_tx_tuple_clarify(struct txn *txn, struct memtx_space *space, struct tuple *tuple, struct index *index, uint32_t mk_index)
 {
 	//if (!memtx_tx_manager_use_mvcc_engine)
 	//	return tuple;
-	return memtx_tx_tuple_clarify_slow(txn, space, tuple, index/*, mk_index*/);
+	return memtx_tx_tuple_clarify_slow(txn, space, tuple, index, mk_index);
 }
+
+/**
+ * Спейс пуст, и ни одна транзакция не заметит, если таплы появятся в нем
+ * в обход TX менеджера (memtx_space_load): никто не ждет в нем ключей,
+ * которых не нашел, и нет read view, для которых загрузка должна была
+ * бы остаться невидимой.
+ */
+bool
+memtx_tx_space_is_unobserved(struct memtx_space *space);
+
+/**
+ * Вызвать @a cb для тапла каждой story спейса @a space: это все таплы,
+ * которые откат или read view могут еще вернуть в индексы спейса.
+ */
+void
+memtx_tx_space_foreach_tuple(struct memtx_space *space, void (*cb)(struct tuple *tuple, void *arg), void *arg);
+
+/**
+ * Удалить всю историю спейса @a space, как при DDL: абортить транзакции,
+ * которые в нем писали или читали (кроме point holes), и read view, для
+ * которых история еще нужна, а потом собрать все stories спейса. После
+ * этого все таплы спейса закоммичены и видны всем.
+ * @retval -1, если stories остались (ошибка напечатана).
+ */
+int
+memtx_tx_space_clear_history(struct memtx_space *space);
+
+/**
+ * Сколько элементов индекса @a index не видно транзакции @a txn (NULL -
+ * вне транзакции): грязных элементов, ни одна версия которых ей не видна.
+ * Берет счетчик индекса и поправляет его только по stories, которые
+ * @a txn видит иначе других: ее собственным или, в read view, подготовленным
+ * после него. Стоит O(числа этих stories), а не всей истории.
+ */
+size_t
+memtx_tx_index_invisible_count(struct txn *txn, struct index *index);
+
+/**
+ * Запомнить, что @a txn прочитала число элементов индекса @a index. Когда
+ * подготовится чужая запись, меняющая это число, @a txn отправится в read
+ * view или будет зааборчена, как после чтения тапла.
+ */
+void
+memtx_tx_track_count(struct txn *txn, struct index *index);
+
+/**
+ * Запомнить, что @a txn прочитала элементы индекса @a index с ключами от
+ * @a from до @a to включительно (NULL - без границы). Когда подготовится
+ * чужая запись элемента с ключом из этого отрезка, @a txn отправится в
+ * read view или будет зааборчена.
+ */
+void
+memtx_tx_track_range(struct txn *txn, struct index *index, const char *from, const char *to);
+
+/**
+ * То же, что memtx_tx_tuple_clarify, но чтение не трекается. Годится
+ * только там, где оно не может ни с кем сконфликтовать: вне транзакции,
+ * в read only транзакции, уже отправленной в read view, или под трекером
+ * отрезка ключей (memtx_tx_track_range).
+ *
+ * В отличие от memtx_tx_tuple_clarify, не проставляет skip-указатели
+ * и не отправляет @a txn в read view.
+ */
+struct tuple *
+memtx_tx_tuple_clarify_untracked(struct txn *txn, struct tuple *tuple, struct index *index, uint32_t mk_index);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
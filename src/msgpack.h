@@ -0,0 +1,558 @@
+#pragma once
+/*
+ * Минимальный MsgPack: кодирование, декодирование, пропуск и проверка
+ * значений. Имена и контракты повторяют msgpuck, на котором построен
+ * tarantool, чтобы код можно было переносить без изменений: decode-функции
+ * сдвигают указатель на следующее значение и не проверяют границы буфера -
+ * это делает mp_check один раз при приеме данных от клиента.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum mp_type {
+	MP_NIL = 0,
+	MP_UINT,
+	MP_INT,
+	MP_STR,
+	MP_BIN,
+	MP_ARRAY,
+	MP_MAP,
+	MP_BOOL,
+	MP_FLOAT,
+	MP_DOUBLE,
+	MP_EXT,
+};
+
+/** Тип значения по первому байту. */
+static inline enum mp_type
+mp_typeof(const char c)
+{
+	uint8_t b = (uint8_t)c;
+	if (b <= 0x7f)
+		return MP_UINT;
+	if (b <= 0x8f)
+		return MP_MAP;
+	if (b <= 0x9f)
+		return MP_ARRAY;
+	if (b <= 0xbf)
+		return MP_STR;
+	if (b >= 0xe0)
+		return MP_INT;
+	switch (b) {
+	case 0xc0:
+		return MP_NIL;
+	case 0xc2: case 0xc3:
+		return MP_BOOL;
+	case 0xc4: case 0xc5: case 0xc6:
+		return MP_BIN;
+	case 0xca:
+		return MP_FLOAT;
+	case 0xcb:
+		return MP_DOUBLE;
+	case 0xcc: case 0xcd: case 0xce: case 0xcf:
+		return MP_UINT;
+	case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+		return MP_INT;
+	case 0xd9: case 0xda: case 0xdb:
+		return MP_STR;
+	case 0xdc: case 0xdd:
+		return MP_ARRAY;
+	case 0xde: case 0xdf:
+		return MP_MAP;
+	default:
+		/* 0xc1 не используется, остальное - ext. */
+		return MP_EXT;
+	}
+}
+
+/* {{{ Big-endian load/store */
+
+static inline uint8_t
+mp_load_u8(const char **data)
+{
+	uint8_t v = (uint8_t)**data;
+	*data += 1;
+	return v;
+}
+
+static inline uint16_t
+mp_load_u16(const char **data)
+{
+	const uint8_t *p = (const uint8_t *)*data;
+	*data += 2;
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t
+mp_load_u32(const char **data)
+{
+	const uint8_t *p = (const uint8_t *)*data;
+	*data += 4;
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint64_t
+mp_load_u64(const char **data)
+{
+	uint64_t hi = mp_load_u32(data);
+	return (hi << 32) | mp_load_u32(data);
+}
+
+static inline char *
+mp_store_u8(char *data, uint8_t v)
+{
+	*data = (char)v;
+	return data + 1;
+}
+
+static inline char *
+mp_store_u16(char *data, uint16_t v)
+{
+	data[0] = (char)(v >> 8);
+	data[1] = (char)v;
+	return data + 2;
+}
+
+static inline char *
+mp_store_u32(char *data, uint32_t v)
+{
+	data = mp_store_u16(data, (uint16_t)(v >> 16));
+	return mp_store_u16(data, (uint16_t)v);
+}
+
+static inline char *
+mp_store_u64(char *data, uint64_t v)
+{
+	data = mp_store_u32(data, (uint32_t)(v >> 32));
+	return mp_store_u32(data, (uint32_t)v);
+}
+
+/* }}} */
+
+/* {{{ Encoding */
+
+static inline uint32_t
+mp_sizeof_array(uint32_t size)
+{
+	return size <= 15 ? 1 : size <= UINT16_MAX ? 3 : 5;
+}
+
+static inline char *
+mp_encode_array(char *data, uint32_t size)
+{
+	if (size <= 15)
+		return mp_store_u8(data, 0x90 | size);
+	if (size <= UINT16_MAX)
+		return mp_store_u16(mp_store_u8(data, 0xdc), size);
+	return mp_store_u32(mp_store_u8(data, 0xdd), size);
+}
+
+static inline uint32_t
+mp_sizeof_uint(uint64_t num)
+{
+	return num <= 0x7f ? 1 : num <= UINT8_MAX ? 2 : num <= UINT16_MAX ? 3 :
+	       num <= UINT32_MAX ? 5 : 9;
+}
+
+static inline char *
+mp_encode_uint(char *data, uint64_t num)
+{
+	if (num <= 0x7f)
+		return mp_store_u8(data, num);
+	if (num <= UINT8_MAX)
+		return mp_store_u8(mp_store_u8(data, 0xcc), num);
+	if (num <= UINT16_MAX)
+		return mp_store_u16(mp_store_u8(data, 0xcd), num);
+	if (num <= UINT32_MAX)
+		return mp_store_u32(mp_store_u8(data, 0xce), num);
+	return mp_store_u64(mp_store_u8(data, 0xcf), num);
+}
+
+/** @pre num < 0 */
+static inline uint32_t
+mp_sizeof_int(int64_t num)
+{
+	return num >= -0x20 ? 1 : num >= INT8_MIN ? 2 : num >= INT16_MIN ? 3 :
+	       num >= INT32_MIN ? 5 : 9;
+}
+
+/** @pre num < 0 */
+static inline char *
+mp_encode_int(char *data, int64_t num)
+{
+	if (num >= -0x20)
+		return mp_store_u8(data, (uint8_t)(0xe0 | (num + 0x20)));
+	if (num >= INT8_MIN)
+		return mp_store_u8(mp_store_u8(data, 0xd0), (uint8_t)num);
+	if (num >= INT16_MIN)
+		return mp_store_u16(mp_store_u8(data, 0xd1), (uint16_t)num);
+	if (num >= INT32_MIN)
+		return mp_store_u32(mp_store_u8(data, 0xd2), (uint32_t)num);
+	return mp_store_u64(mp_store_u8(data, 0xd3), (uint64_t)num);
+}
+
+static inline uint32_t
+mp_sizeof_strl(uint32_t len)
+{
+	return len <= 31 ? 1 : len <= UINT8_MAX ? 2 : len <= UINT16_MAX ? 3 : 5;
+}
+
+static inline uint32_t
+mp_sizeof_str(uint32_t len)
+{
+	return mp_sizeof_strl(len) + len;
+}
+
+static inline char *
+mp_encode_strl(char *data, uint32_t len)
+{
+	if (len <= 31)
+		return mp_store_u8(data, 0xa0 | len);
+	if (len <= UINT8_MAX)
+		return mp_store_u8(mp_store_u8(data, 0xd9), len);
+	if (len <= UINT16_MAX)
+		return mp_store_u16(mp_store_u8(data, 0xda), len);
+	return mp_store_u32(mp_store_u8(data, 0xdb), len);
+}
+
+static inline char *
+mp_encode_str(char *data, const char *str, uint32_t len)
+{
+	data = mp_encode_strl(data, len);
+	memcpy(data, str, len);
+	return data + len;
+}
+
+static inline uint32_t
+mp_sizeof_binl(uint32_t len)
+{
+	return len <= UINT8_MAX ? 2 : len <= UINT16_MAX ? 3 : 5;
+}
+
+static inline uint32_t
+mp_sizeof_bin(uint32_t len)
+{
+	return mp_sizeof_binl(len) + len;
+}
+
+static inline char *
+mp_encode_binl(char *data, uint32_t len)
+{
+	if (len <= UINT8_MAX)
+		return mp_store_u8(mp_store_u8(data, 0xc4), len);
+	if (len <= UINT16_MAX)
+		return mp_store_u16(mp_store_u8(data, 0xc5), len);
+	return mp_store_u32(mp_store_u8(data, 0xc6), len);
+}
+
+static inline char *
+mp_encode_bin(char *data, const char *str, uint32_t len)
+{
+	data = mp_encode_binl(data, len);
+	memcpy(data, str, len);
+	return data + len;
+}
+
+static inline char *
+mp_encode_nil(char *data)
+{
+	return mp_store_u8(data, 0xc0);
+}
+
+static inline char *
+mp_encode_bool(char *data, bool val)
+{
+	return mp_store_u8(data, val ? 0xc3 : 0xc2);
+}
+
+static inline char *
+mp_encode_double(char *data, double num)
+{
+	uint64_t bits;
+	memcpy(&bits, &num, sizeof(bits));
+	return mp_store_u64(mp_store_u8(data, 0xcb), bits);
+}
+
+/* }}} */
+
+/* {{{ Decoding */
+
+static inline uint32_t
+mp_decode_array(const char **data)
+{
+	uint8_t c = mp_load_u8(data);
+	if (c <= 0x9f)
+		return c & 0x0f;
+	if (c == 0xdc)
+		return mp_load_u16(data);
+	return mp_load_u32(data);
+}
+
+static inline uint32_t
+mp_decode_map(const char **data)
+{
+	uint8_t c = mp_load_u8(data);
+	if (c <= 0x8f)
+		return c & 0x0f;
+	if (c == 0xde)
+		return mp_load_u16(data);
+	return mp_load_u32(data);
+}
+
+static inline uint64_t
+mp_decode_uint(const char **data)
+{
+	uint8_t c = mp_load_u8(data);
+	switch (c) {
+	case 0xcc:
+		return mp_load_u8(data);
+	case 0xcd:
+		return mp_load_u16(data);
+	case 0xce:
+		return mp_load_u32(data);
+	case 0xcf:
+		return mp_load_u64(data);
+	default:
+		return c;
+	}
+}
+
+static inline int64_t
+mp_decode_int(const char **data)
+{
+	uint8_t c = mp_load_u8(data);
+	switch (c) {
+	case 0xd0:
+		return (int8_t)mp_load_u8(data);
+	case 0xd1:
+		return (int16_t)mp_load_u16(data);
+	case 0xd2:
+		return (int32_t)mp_load_u32(data);
+	case 0xd3:
+		return (int64_t)mp_load_u64(data);
+	default:
+		return (int8_t)c;
+	}
+}
+
+static inline uint32_t
+mp_decode_strl(const char **data)
+{
+	uint8_t c = mp_load_u8(data);
+	if (c <= 0xbf)
+		return c & 0x1f;
+	if (c == 0xd9)
+		return mp_load_u8(data);
+	if (c == 0xda)
+		return mp_load_u16(data);
+	return mp_load_u32(data);
+}
+
+static inline const char *
+mp_decode_str(const char **data, uint32_t *len)
+{
+	*len = mp_decode_strl(data);
+	const char *str = *data;
+	*data += *len;
+	return str;
+}
+
+static inline uint32_t
+mp_decode_binl(const char **data)
+{
+	uint8_t c = mp_load_u8(data);
+	if (c == 0xc4)
+		return mp_load_u8(data);
+	if (c == 0xc5)
+		return mp_load_u16(data);
+	return mp_load_u32(data);
+}
+
+static inline const char *
+mp_decode_bin(const char **data, uint32_t *len)
+{
+	*len = mp_decode_binl(data);
+	const char *bin = *data;
+	*data += *len;
+	return bin;
+}
+
+static inline bool
+mp_decode_bool(const char **data)
+{
+	return mp_load_u8(data) == 0xc3;
+}
+
+static inline float
+mp_decode_float(const char **data)
+{
+	*data += 1;
+	uint32_t bits = mp_load_u32(data);
+	float num;
+	memcpy(&num, &bits, sizeof(num));
+	return num;
+}
+
+static inline double
+mp_decode_double(const char **data)
+{
+	*data += 1;
+	uint64_t bits = mp_load_u64(data);
+	double num;
+	memcpy(&num, &bits, sizeof(num));
+	return num;
+}
+
+/* }}} */
+
+/* {{{ Skip and validation */
+
+/**
+ * Размер заголовка значения, которое начинается байтом @a c, без учета
+ * тела (строки, бинарных данных, ext) и вложенных элементов. Для длинных
+ * форм длина тела или число элементов читаются следом за байтом типа.
+ * @retval -1 байт не может начинать значение.
+ */
+static inline int
+mp_header_size(uint8_t c)
+{
+	if (c <= 0xbf || c >= 0xe0)
+		return 1;
+	switch (c) {
+	case 0xc0: case 0xc2: case 0xc3:
+		return 1;
+	case 0xc4: case 0xcc: case 0xd0: case 0xd9: case 0xc7:
+		return 2;
+	case 0xc5: case 0xcd: case 0xd1: case 0xda: case 0xdc: case 0xde:
+	case 0xc8:
+		return 3;
+	case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+		/* fixext: тип + данные 1..16 байт. */
+		return 2 + (1 << (c - 0xd4));
+	case 0xc6: case 0xca: case 0xce: case 0xd2: case 0xdb: case 0xdd:
+	case 0xdf: case 0xc9:
+		return 5;
+	case 0xcb: case 0xcf: case 0xd3:
+		return 9;
+	default:
+		return -1;
+	}
+}
+
+/**
+ * Разобрать заголовок значения: вернуть длину тела в байтах и добавить
+ * в @a k число вложенных значений, которые еще предстоит пройти.
+ * @pre заголовок целиком лежит в буфере.
+ */
+static inline uint32_t
+mp_parse_header(const char **data, uint64_t *k)
+{
+	const char *p = *data;
+	uint8_t c = mp_load_u8(&p);
+	uint32_t body = 0;
+	if (c >= 0x80 && c <= 0x8f) {
+		*k += 2 * (c & 0x0f);
+	} else if (c >= 0x90 && c <= 0x9f) {
+		*k += c & 0x0f;
+	} else if (c >= 0xa0 && c <= 0xbf) {
+		body = c & 0x1f;
+	} else {
+		switch (c) {
+		case 0xc4: case 0xd9:
+			body = mp_load_u8(&p);
+			break;
+		case 0xc5: case 0xda:
+			body = mp_load_u16(&p);
+			break;
+		case 0xc6: case 0xdb:
+			body = mp_load_u32(&p);
+			break;
+		case 0xc7:
+			body = 1 + mp_load_u8(&p);
+			break;
+		case 0xc8:
+			body = 1 + mp_load_u16(&p);
+			break;
+		case 0xc9:
+			body = 1 + mp_load_u32(&p);
+			break;
+		case 0xdc:
+			*k += mp_load_u16(&p);
+			break;
+		case 0xdd:
+			*k += mp_load_u32(&p);
+			break;
+		case 0xde:
+			*k += 2 * (uint64_t)mp_load_u16(&p);
+			break;
+		case 0xdf:
+			*k += 2 * (uint64_t)mp_load_u32(&p);
+			break;
+		default:
+			break;
+		}
+	}
+	*data += mp_header_size(c);
+	return body;
+}
+
+/** Пропустить одно значение вместе со всеми вложенными. */
+static inline void
+mp_next(const char **data)
+{
+	uint64_t k = 1;
+	for (; k > 0; k--) {
+		uint32_t body = mp_parse_header(data, &k);
+		*data += body;
+	}
+}
+
+/**
+ * Проверить, что в [*data, end) лежит одно корректное значение, и
+ * сдвинуть *data за него.
+ * @retval 0 значение корректно.
+ * @retval 1 значение обрезано или содержит неизвестный байт.
+ */
+static inline int
+mp_check(const char **data, const char *end)
+{
+	uint64_t k = 1;
+	for (; k > 0; k--) {
+		if (*data >= end)
+			return 1;
+		int header = mp_header_size((uint8_t)**data);
+		if (header < 0 || end - *data < header)
+			return 1;
+		uint32_t body = mp_parse_header(data, &k);
+		if ((uint64_t)(end - *data) < body)
+			return 1;
+		*data += body;
+	}
+	return 0;
+}
+
+/**
+ * Проверить, что заголовок массива, который начинается в @a cur, целиком
+ * лежит в [@a cur, @a end). Элементы не проверяются.
+ * @pre cur < end и mp_typeof(*cur) == MP_ARRAY.
+ * @retval > 0 сколько байт заголовка не хватает.
+ * @retval <= 0 заголовок в буфере.
+ */
+static inline ptrdiff_t
+mp_check_array(const char *cur, const char *end)
+{
+	return mp_header_size((uint8_t)*cur) - (end - cur);
+}
+
+/* }}} */
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
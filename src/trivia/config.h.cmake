@@ -83,6 +83,11 @@
  * Defined if configured with FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION.
  */
 #cmakedefine FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION 1
+/*
+ * Defined if configured with ENABLE_TX_PROFILE (per-phase latency
+ * histograms of the transaction path, see tx_profile.h).
+ */
+#cmakedefine ENABLE_TX_PROFILE 1
 
 /*
  * Set if the system has bfd.h header and GNU bfd library.
@@ -1,4 +1,460 @@
 #include "tuple.h"
+#include "key_def.h"
+#include "trivia/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <unordered_map>
+#include <vector>
+
+/** Ссылки, не поместившиеся в tuple::local_refs. */
+static std::unordered_map<struct tuple *, uint32_t> tuple_uploaded_refs;
+/** Таплы без ссылок, которые еще не освобождены. */
+static std::vector<struct tuple *> tuple_garbage;
+/** Буфер для ключей функциональных индексов создаваемого тапла. */
+static std::vector<char> tuple_func_keys;
+
+/**
+ * Описать в формате ключевое поле индекса @a def. Новый слот field map
+ * добавляется в конец, слоты других полей не меняются.
+ */
+static int
+tuple_format_add_field(struct tuple_format *format, const struct key_def *def)
+{
+	uint32_t fieldno = def->fieldno;
+	enum field_type type = def->type;
+	bool is_multikey = def->is_multikey;
+	struct tuple_format_field *field = &format->fields[fieldno];
+	/*
+	 * Поле может быть ключом нескольких индексов. Оно
+	 * необязательное, только если все они sparse.
+	 */
+	if (field->type == type && field->is_multikey == is_multikey) {
+		field->is_nullable &= def->exclude_null;
+		return 0;
+	}
+	if (field->type != FIELD_TYPE_ANY) {
+		fprintf(stderr, "Field %u has type '%s' in one index, but type '%s' in another",
+			fieldno + 1,
+			field->is_multikey ? "array" : field_type_strs[field->type],
+			is_multikey ? "array" : field_type_strs[type]);
+		return -1;
+	}
+	field->type = type;
+	field->is_multikey = is_multikey;
+	field->is_nullable = def->exclude_null;
+	/* Необязательному полю 0 слот нужен, чтобы отметить его отсутствие. */
+	if (fieldno != 0 || field->is_nullable)
+		field->offset_slot = format->field_map_count++;
+	return 0;
+}
+
+static void
+tuple_format_update_min_field_count(struct tuple_format *format)
+{
+	format->min_field_count = 0;
+	for (uint32_t i = 0; i < format->field_count; i++) {
+		struct tuple_format_field *field = &format->fields[i];
+		if (field->type != FIELD_TYPE_ANY && !field->is_nullable)
+			format->min_field_count = i + 1;
+	}
+}
+
+struct tuple_format *
+tuple_format_new(const struct key_def *key_defs, uint32_t key_count)
+{
+	uint32_t field_count = 0;
+	uint32_t func_count = 0;
+	uint32_t filter_count = 0;
+	for (uint32_t i = 0; i < key_count; i++) {
+		if (key_defs[i].for_func_index)
+			func_count++;
+		else
+			field_count = MAX(field_count, key_defs[i].fieldno + 1);
+		if (key_defs[i].filter != NULL)
+			filter_count++;
+	}
+	if (filter_count > TUPLE_FILTER_MAX) {
+		fprintf(stderr, "Too many partial indexes: %u, maximum is %u",
+			filter_count, (uint32_t)TUPLE_FILTER_MAX);
+		return NULL;
+	}
+	struct tuple_format *format = (struct tuple_format *)
+		xmalloc(sizeof(struct tuple_format) +
+			field_count * sizeof(struct tuple_format_field));
+	format->refs = 0;
+	format->min_field_count = 0;
+	format->field_count = field_count;
+	format->field_map_count = 0;
+	format->func_count = 0;
+	format->funcs = NULL;
+	if (func_count != 0)
+		format->funcs = (struct tuple_format_func *)
+			xmalloc(func_count * sizeof(struct tuple_format_func));
+	format->filter_count = 0;
+	format->filter_slot = TUPLE_OFFSET_SLOT_NIL;
+	format->filters = NULL;
+	if (filter_count != 0)
+		format->filters = (bool (**)(const char *, const char *))
+			xmalloc(filter_count * sizeof(*format->filters));
+	for (uint32_t i = 0; i < field_count; i++) {
+		format->fields[i].offset_slot = TUPLE_OFFSET_SLOT_NIL;
+		format->fields[i].type = FIELD_TYPE_ANY;
+		format->fields[i].is_multikey = false;
+		format->fields[i].is_nullable = false;
+	}
+	for (uint32_t i = 0; i < key_count; i++) {
+		if (key_defs[i].for_func_index)
+			continue;
+		if (tuple_format_add_field(format, &key_defs[i]) != 0) {
+			tuple_format_delete(format);
+			return NULL;
+		}
+	}
+	tuple_format_update_min_field_count(format);
+	for (uint32_t i = 0; i < key_count; i++) {
+		if (!key_defs[i].for_func_index)
+			continue;
+		struct tuple_format_func *func = &format->funcs[format->func_count++];
+		func->func = key_defs[i].func;
+		func->type = key_defs[i].type;
+		func->is_nullable = key_defs[i].exclude_null;
+		func->index_id = i;
+		func->offset_slot = format->field_map_count++;
+	}
+	for (uint32_t i = 0; i < key_count; i++) {
+		if (key_defs[i].filter != NULL)
+			format->filters[format->filter_count++] = key_defs[i].filter;
+	}
+	if (format->filter_count != 0)
+		format->filter_slot = format->field_map_count++;
+	format->base_field_map_count = format->field_map_count;
+	return format;
+}
+
+struct tuple_format *
+tuple_format_add_key(const struct tuple_format *format, const struct key_def *def)
+{
+	assert(!def->for_func_index && def->filter == NULL);
+	uint32_t field_count = MAX(format->field_count, def->fieldno + 1);
+	struct tuple_format *result = (struct tuple_format *)
+		xmalloc(sizeof(struct tuple_format) +
+			field_count * sizeof(struct tuple_format_field));
+	*result = *format;
+	result->refs = 0;
+	result->field_count = field_count;
+	memcpy(result->fields, format->fields,
+	       format->field_count * sizeof(struct tuple_format_field));
+	for (uint32_t i = format->field_count; i < field_count; i++) {
+		result->fields[i].offset_slot = TUPLE_OFFSET_SLOT_NIL;
+		result->fields[i].type = FIELD_TYPE_ANY;
+		result->fields[i].is_multikey = false;
+		result->fields[i].is_nullable = false;
+	}
+	result->funcs = NULL;
+	if (format->func_count != 0) {
+		size_t size = format->func_count * sizeof(*format->funcs);
+		result->funcs = (struct tuple_format_func *)xmalloc(size);
+		memcpy(result->funcs, format->funcs, size);
+	}
+	result->filters = NULL;
+	if (format->filter_count != 0) {
+		size_t size = format->filter_count * sizeof(*format->filters);
+		result->filters = (bool (**)(const char *, const char *))xmalloc(size);
+		memcpy(result->filters, format->filters, size);
+	}
+	if (tuple_format_add_field(result, def) != 0) {
+		tuple_format_delete(result);
+		return NULL;
+	}
+	tuple_format_update_min_field_count(result);
+	return result;
+}
+
+void
+tuple_format_delete(struct tuple_format *format)
+{
+	free(format->funcs);
+	free(format->filters);
+	free(format);
+}
+
+/**
+ * Проверить, что multikey поле @a fieldno в [*@a pos, @a end) - массив
+ * элементов типа поля @a field. Позиция @a pos сдвигается за поле.
+ */
+static int
+tuple_multikey_field_check(struct tuple_format_field *field, uint32_t fieldno, const char **pos, const char *end)
+{
+	if (mp_typeof(**pos) != MP_ARRAY) {
+		fprintf(stderr, "Tuple field %u type does not match one required by operation: expected array",
+			fieldno + 1);
+		return -1;
+	}
+	if (mp_check_array(*pos, end) > 0)
+		goto invalid;
+	uint32_t count;
+	count = mp_decode_array(pos);
+	for (uint32_t i = 0; i < count; i++) {
+		if (*pos == end)
+			goto invalid;
+		if (!field_mp_type_is_compatible(field->type, mp_typeof(**pos))) {
+			fprintf(stderr, "Tuple field %u[%u] type does not match one required by operation: expected %s",
+				fieldno + 1, i + 1, field_type_strs[field->type]);
+			return -1;
+		}
+		if (mp_check(pos, end) != 0)
+			goto invalid;
+	}
+	return 0;
+invalid:
+	fprintf(stderr, "Invalid MsgPack - tuple data");
+	return -1;
+}
+
+/**
+ * Проверить данные тапла и заполнить @a field_map: смещения полей и
+ * маску фильтров частичных индексов. Данные проходятся один раз: тип
+ * поля проверяется по первому байту, а mp_check проверяет поле целиком
+ * и сдвигает позицию за него.
+ * @retval 0 успех, -1 ошибка (уже напечатана).
+ */
+static int
+tuple_field_map_create(struct tuple_format *format, const char *data, const char *end, uint32_t *field_map)
+{
+	const char *pos = data;
+	if (pos == end)
+		goto invalid;
+	if (mp_typeof(*pos) != MP_ARRAY) {
+		if (mp_check(&pos, end) != 0 || pos != end)
+			goto invalid;
+		fprintf(stderr, "Tuple must be a MsgPack array");
+		return -1;
+	}
+	if (mp_check_array(pos, end) > 0)
+		goto invalid;
+	uint32_t field_count;
+	field_count = mp_decode_array(&pos);
+	if (field_count < format->min_field_count) {
+		fprintf(stderr, "Tuple field %u required by space format is missing",
+			field_count + 1);
+		return -1;
+	}
+	for (uint32_t i = 0; i < format->field_count; i++) {
+		struct tuple_format_field *field = &format->fields[i];
+		if (i >= field_count) {
+			/* Необязательных полей в конце тапла может не быть. */
+			assert(field->is_nullable || field->type == FIELD_TYPE_ANY);
+			if (field->offset_slot != TUPLE_OFFSET_SLOT_NIL)
+				field_map[field->offset_slot] = 0;
+			continue;
+		}
+		if (pos == end)
+			goto invalid;
+		if (field->offset_slot != TUPLE_OFFSET_SLOT_NIL)
+			field_map[field->offset_slot] = pos - data;
+		if (field->is_nullable && mp_typeof(*pos) == MP_NIL) {
+			pos++;
+			continue;
+		}
+		if (field->is_multikey) {
+			if (tuple_multikey_field_check(field, i, &pos, end) != 0)
+				return -1;
+			continue;
+		}
+		if (!field_mp_type_is_compatible(field->type, mp_typeof(*pos))) {
+			fprintf(stderr, "Tuple field %u type does not match one required by operation: expected %s",
+				i + 1, field_type_strs[field->type]);
+			return -1;
+		}
+		if (mp_check(&pos, end) != 0)
+			goto invalid;
+	}
+	/* Поля за форматом только проверяются. */
+	for (uint32_t i = format->field_count; i < field_count; i++) {
+		if (mp_check(&pos, end) != 0)
+			goto invalid;
+	}
+	if (pos != end)
+		goto invalid;
+	if (format->filter_count != 0) {
+		uint32_t mask = 0;
+		for (uint32_t i = 0; i < format->filter_count; i++) {
+			if (!format->filters[i](data, end))
+				mask |= 1U << i;
+		}
+		field_map[format->filter_slot] = mask;
+	}
+	return 0;
+invalid:
+	fprintf(stderr, "Invalid MsgPack - tuple data");
+	return -1;
+}
+
+/**
+ * Вычислить в tuple_func_keys ключи функциональных индексов тапла с
+ * данными [@a data, @a end) и записать в @a field_map их смещения от
+ * начала данных: ключи будут лежать сразу за данными.
+ * @param[out] keys_size сколько байт занимают ключи.
+ * @retval 0 успех, -1 ошибка (уже напечатана).
+ */
+static int
+tuple_func_keys_create(struct tuple_format *format, const char *data, const char *end, uint32_t *field_map, size_t *keys_size)
+{
+	size_t bsize = end - data;
+	size_t size = 0;
+	for (uint32_t i = 0; i < format->func_count; i++) {
+		struct tuple_format_func *func = &format->funcs[i];
+		ssize_t key_size;
+		for (;;) {
+			if (tuple_func_keys.size() == size)
+				tuple_func_keys.resize(MAX(2 * size, (size_t)64));
+			size_t avail = tuple_func_keys.size() - size;
+			key_size = func->func(data, end, tuple_func_keys.data() + size, avail);
+			if (key_size < 0 || (size_t)key_size <= avail)
+				break;
+			tuple_func_keys.resize(size + key_size);
+		}
+		if (key_size < 0) {
+			fprintf(stderr, "Failed to build a key for functional index %u", func->index_id);
+			return -1;
+		}
+		const char *key = tuple_func_keys.data() + size;
+		const char *pos = key;
+		if (key_size == 0 || mp_check(&pos, key + key_size) != 0 || pos != key + key_size) {
+			fprintf(stderr, "Key format doesn't match one defined in functional index %u: invalid MsgPack", func->index_id);
+			return -1;
+		}
+		if (!field_mp_type_is_compatible(func->type, mp_typeof(*key)) &&
+		    !(func->is_nullable && mp_typeof(*key) == MP_NIL)) {
+			fprintf(stderr, "Key format doesn't match one defined in functional index %u: expected %s",
+				func->index_id, field_type_strs[func->type]);
+			return -1;
+		}
+		if (bsize + size + key_size > UINT32_MAX) {
+			fprintf(stderr, "Tuple is too large");
+			return -1;
+		}
+		field_map[func->offset_slot] = bsize + size;
+		size += key_size;
+	}
+	*keys_size = size;
+	return 0;
+}
+
+int
+tuple_validate(struct tuple_format *format, struct tuple *tuple)
+{
+	static std::vector<uint32_t> field_map;
+	field_map.resize(MAX(format->field_map_count, 1U));
+	const char *data = tuple_data(tuple);
+	return tuple_field_map_create(format, data, data + tuple->bsize, field_map.data());
+}
+
+struct tuple *
+tuple_new(struct tuple_format *format, const char *data, const char *end)
+{
+	size_t field_map_size = format->field_map_count * sizeof(uint32_t);
+	size_t data_offset = sizeof(struct tuple) + field_map_size;
+	size_t bsize = end - data;
+	if (data_offset > UINT16_MAX || bsize > UINT32_MAX) {
+		fprintf(stderr, "Tuple is too large");
+		return NULL;
+	}
+	struct tuple *tuple = (struct tuple *)xmalloc(data_offset + bsize);
+	if (tuple_field_map_create(format, data, end, (uint32_t *)(tuple + 1)) != 0) {
+		free(tuple);
+		return NULL;
+	}
+	if (format->func_count != 0) {
+		/*
+		 * Функции можно звать только на проверенных данных, а размер
+		 * ключей известен только после них, поэтому тапл растет.
+		 */
+		size_t keys_size;
+		if (tuple_func_keys_create(format, data, end, (uint32_t *)(tuple + 1), &keys_size) != 0) {
+			free(tuple);
+			return NULL;
+		}
+		tuple = (struct tuple *)xrealloc(tuple, data_offset + bsize + keys_size);
+		memcpy((char *)tuple + data_offset + bsize, tuple_func_keys.data(), keys_size);
+	}
+	tuple->flags = 0;
+	tuple->local_refs = 0;
+	tuple->data_offset = data_offset;
+	tuple->bsize = bsize;
+	tuple->format = format;
+	tuple_format_ref(format);
+	memcpy((char *)tuple + data_offset, data, bsize);
+	return tuple;
+}
+
+void
+tuple_delete(struct tuple *tuple)
+{
+	assert(tuple->local_refs == 0);
+	assert(!tuple_has_flag(tuple, TUPLE_IS_DIRTY));
+	assert(!tuple_has_flag(tuple, TUPLE_IS_GARBAGE));
+	tuple_format_unref(tuple->format);
+	free(tuple);
+}
+
+void
+tuple_upload_refs(struct tuple *tuple)
+{
+	assert(tuple->local_refs == TUPLE_LOCAL_REF_MAX);
+	tuple_uploaded_refs[tuple] += TUPLE_UPLOAD_REFS;
+	tuple->local_refs -= TUPLE_UPLOAD_REFS;
+	tuple_set_flag(tuple, TUPLE_HAS_UPLOADED_REFS);
+}
+
+void
+tuple_acquire_uploaded_refs(struct tuple *tuple)
+{
+	auto it = tuple_uploaded_refs.find(tuple);
+	assert(it != tuple_uploaded_refs.end());
+	assert(it->second >= TUPLE_UPLOAD_REFS);
+	it->second -= TUPLE_UPLOAD_REFS;
+	tuple->local_refs += TUPLE_UPLOAD_REFS;
+	if (it->second == 0) {
+		tuple_uploaded_refs.erase(it);
+		tuple_clear_flag(tuple, TUPLE_HAS_UPLOADED_REFS);
+	}
+}
+
+void
+tuple_put_garbage(struct tuple *tuple)
+{
+	assert(tuple->local_refs == 0);
+	if (tuple_has_flag(tuple, TUPLE_IS_GARBAGE))
+		return;
+	tuple_set_flag(tuple, TUPLE_IS_GARBAGE);
+	tuple_garbage.push_back(tuple);
+}
+
+size_t
+tuple_garbage_count(void)
+{
+	return tuple_garbage.size();
+}
+
+size_t
+tuple_collect_garbage(size_t limit)
+{
+	size_t count = 0;
+	while (count < limit && !tuple_garbage.empty()) {
+		struct tuple *tuple = tuple_garbage.back();
+		tuple_garbage.pop_back();
+		tuple_clear_flag(tuple, TUPLE_IS_GARBAGE);
+		/* На тапл снова сослались, пока он ждал в очереди. */
+		if (tuple->local_refs != 0)
+			continue;
+		tuple_delete(tuple);
+		count++;
+	}
+	return count;
+}
 
 char *
 tuple_str(struct tuple *tuple)
@@ -3,23 +3,139 @@
 #include "assert.h"
 #include "stdbool.h"
 #include "stdint.h"
-#ifdef __cplusplus
-#include <vector>
-#endif
+#include "msgpack.h"
+#include "field_def.h"
+#include "trivia/util.h"
 
 enum tuple_flag {
-	//TUPLE_HAS_UPLOADED_REFS = 0,
+	TUPLE_HAS_UPLOADED_REFS = 0,
 	TUPLE_IS_DIRTY = 1,
 	//TUPLE_IS_TEMPORARY = 2,
+	/** Тапл в очереди мусора (см. tuple_unref). */
+	TUPLE_IS_GARBAGE = 3,
 	tuple_flag_MAX,
 };
 
+enum {
+	/** Поле не индексировано и не имеет слота в field map. */
+	TUPLE_OFFSET_SLOT_NIL = INT32_MAX,
+	/**
+	 * Слот ключа берется из формата самого тапла: индекс построен на
+	 * живом спейсе, и у таплов, созданных до него, слота поля нет (см.
+	 * tuple_format_add_key).
+	 */
+	TUPLE_OFFSET_SLOT_FORMAT = INT32_MAX - 1,
+	/** Больше ссылок в самом тапле не помещается. */
+	TUPLE_LOCAL_REF_MAX = UINT8_MAX,
+	/** Сколько ссылок за раз переносится в таблицу и обратно. */
+	TUPLE_UPLOAD_REFS = TUPLE_LOCAL_REF_MAX / 2 + 1,
+	/** Частичных индексов в спейсе не больше, чем бит в маске фильтров. */
+	TUPLE_FILTER_MAX = 32,
+};
+
+/** Описание поля в формате спейса. */
+struct tuple_format_field {
+	/** Слот field map со смещением поля или TUPLE_OFFSET_SLOT_NIL. */
+	int32_t offset_slot;
+	/** Тип значений поля, FIELD_TYPE_ANY, если поле не ключевое. */
+	enum field_type type;
+	/** Поле - массив ключей multikey индекса, type - тип элементов. */
+	bool is_multikey;
+	/**
+	 * Поле - ключ только sparse индексов: его может не быть в тапле
+	 * (тогда в слоте field map 0) или в нем может быть nil.
+	 */
+	bool is_nullable;
+};
+
+/** Ключ функционального индекса в формате спейса. */
+struct tuple_format_func {
+	/** Функция ключа, см. key_func_t. */
+	ssize_t (*func)(const char *data, const char *data_end, char *buf, size_t size);
+	/** Тип ключа. */
+	enum field_type type;
+	/** Функция может вернуть nil: индекс sparse. */
+	bool is_nullable;
+	/** Номер индекса в спейсе, для сообщений об ошибках. */
+	uint32_t index_id;
+	/** Слот field map со смещением ключа. */
+	int32_t offset_slot;
+};
+
+/**
+ * Формат таплов спейса: какие поля индексированы и где в field map
+ * тапла лежат их смещения. Смещение поля 0 известно и так (сразу за
+ * заголовком массива), поэтому слот ему не нужен, если поле обязательное.
+ * Слоты ключей функциональных индексов и маски фильтров идут после слотов
+ * полей.
+ */
+struct tuple_format {
+	/**
+	 * Ссылки на формат: их держат спейс и каждый тапл формата, см.
+	 * tuple_format_ref. Формат без ссылок удаляется.
+	 */
+	uint32_t refs;
+	/** Сколько полей обязано быть в тапле: последнее обязательное + 1. */
+	uint32_t min_field_count;
+	/** Сколько полей описано: последнее индексированное + 1. */
+	uint32_t field_count;
+	/** Число слотов в field map каждого тапла. */
+	uint32_t field_map_count;
+	/**
+	 * Сколько первых слотов было у формата, созданного вместе со
+	 * спейсом. tuple_format_add_key добавляет слоты только после них,
+	 * так что они одинаковы у таплов всех форматов спейса.
+	 */
+	uint32_t base_field_map_count;
+	/** Число функциональных индексов. */
+	uint32_t func_count;
+	/** Их ключи, в порядке индексов спейса. */
+	struct tuple_format_func *funcs;
+	/** Число частичных индексов. */
+	uint32_t filter_count;
+	/** Слот field map с маской фильтров, см. tuple_filter_mask. */
+	int32_t filter_slot;
+	/** Фильтры частичных индексов в порядке индексов спейса, см. key_filter_t. */
+	bool (**filters)(const char *data, const char *data_end);
+	struct tuple_format_field fields[];
+};
+
+/**
+ * Тапл - MsgPack массив, принятый от клиента как есть. Перед данными
+ * лежит field map: смещения индексированных полей от начала данных,
+ * чтобы сравнение и хеширование ключа не декодировали поля перед ним.
+ *
+ * +--------------+-------------------------+--------------------+-----------+
+ * | struct tuple | uint32_t field_map[...] | MsgPack array data | func keys |
+ * +--------------+-------------------------+--------------------+-----------+
+ *                                          ^ data_offset        ^ bsize
+ *
+ * Ключи функциональных индексов вычисляются один раз при создании тапла
+ * и хранятся после данных; их смещения, как и смещения полей, лежат в
+ * field map. Клиенту отдаются только данные (bsize байт). Фильтры
+ * частичных индексов тоже вызываются один раз, их результаты - битовая
+ * маска в отдельном слоте field map.
+ *
+ * Тапл живет, пока на него есть ссылки: по одной от каждого индекса, в
+ * котором он физически лежит, от его story, от стейтментов, которые его
+ * вставили или удалили, и от клиентов (box_tuple_ref). Последний
+ * tuple_unref не освобождает память сразу, а кладет тапл в очередь
+ * мусора: ее разбирает GC TX менеджера пачками, чтобы запись не платила
+ * за free() на каждый вытесненный тапл.
+ */
 //typedef struct tuple tuple;
 struct tuple {
-    uint8_t flags;
-#ifdef __cplusplus
-    std::vector<int> data;
-#endif
+	uint8_t flags;
+	/**
+	 * Число ссылок. Если оно не влезает в байт, излишек хранится в
+	 * отдельной таблице (флаг TUPLE_HAS_UPLOADED_REFS).
+	 */
+	uint8_t local_refs;
+	/** Смещение MsgPack данных от начала тапла. */
+	uint16_t data_offset;
+	/** Размер MsgPack данных. */
+	uint32_t bsize;
+	struct tuple_format *format;
 };
 
 /** Set flag of the tuple. */
@@ -46,13 +162,210 @@ tuple_clear_flag(struct tuple *tuple, enum tuple_flag flag)
 	tuple->flags &= ~(1 << flag);
 }
 
+/** MsgPack данные тапла. Указатель живет столько же, сколько тапл. */
+static inline const char *
+tuple_data(struct tuple *tuple)
+{
+	return (const char *)tuple + tuple->data_offset;
+}
+
+/** То же, что tuple_data, но еще и размер: отдается клиенту без копирования. */
+static inline const char *
+tuple_data_range(struct tuple *tuple, uint32_t *size)
+{
+	*size = tuple->bsize;
+	return tuple_data(tuple);
+}
+
+static inline const uint32_t *
+tuple_field_map(struct tuple *tuple)
+{
+	return (const uint32_t *)(tuple + 1);
+}
+
+static inline uint32_t
+tuple_field_count(struct tuple *tuple)
+{
+	const char *data = tuple_data(tuple);
+	return mp_decode_array(&data);
+}
+
+/**
+ * Поле @a fieldno тапла или NULL, если полей меньше. Индексированные
+ * поля достаются из field map за O(1), остальные - проходом по массиву.
+ */
+static inline const char *
+tuple_field(struct tuple *tuple, uint32_t fieldno)
+{
+	struct tuple_format *format = tuple->format;
+	if (fieldno < format->field_count) {
+		int32_t slot = format->fields[fieldno].offset_slot;
+		if (slot != TUPLE_OFFSET_SLOT_NIL) {
+			uint32_t offset = tuple_field_map(tuple)[slot];
+			/* 0 - необязательного поля нет в тапле. */
+			return offset != 0 ? tuple_data(tuple) + offset : NULL;
+		}
+	}
+	const char *data = tuple_data(tuple);
+	uint32_t field_count = mp_decode_array(&data);
+	if (fieldno >= field_count)
+		return NULL;
+	for (uint32_t i = 0; i < fieldno; i++)
+		mp_next(&data);
+	return data;
+}
+
+/**
+ * Значение key_def::offset_slot для ключа по полю @a fieldno спейса с
+ * форматом @a format: слот поля, если он одинаков у таплов всех форматов
+ * спейса, иначе TUPLE_OFFSET_SLOT_FORMAT.
+ */
+static inline int32_t
+tuple_format_key_slot(const struct tuple_format *format, uint32_t fieldno)
+{
+	assert(fieldno < format->field_count);
+	int32_t slot = format->fields[fieldno].offset_slot;
+	if (slot == TUPLE_OFFSET_SLOT_NIL || (uint32_t)slot < format->base_field_map_count)
+		return slot;
+	return TUPLE_OFFSET_SLOT_FORMAT;
+}
+
+/**
+ * Маска частичных индексов, из которых тапл исключен: бит i выставлен,
+ * если фильтр i-го частичного индекса спейса вернул false.
+ */
+static inline uint32_t
+tuple_filter_mask(struct tuple *tuple)
+{
+	assert(tuple->format->filter_slot != TUPLE_OFFSET_SLOT_NIL);
+	return tuple_field_map(tuple)[tuple->format->filter_slot];
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/** Перенести TUPLE_UPLOAD_REFS ссылок тапла в таблицу. */
+void
+tuple_upload_refs(struct tuple *tuple);
+
+/** Вернуть TUPLE_UPLOAD_REFS ссылок тапла из таблицы. */
+void
+tuple_acquire_uploaded_refs(struct tuple *tuple);
+
+/** Поставить тапл без ссылок в очередь на освобождение. */
+void
+tuple_put_garbage(struct tuple *tuple);
+
+/** Сколько таплов ждет освобождения. */
+size_t
+tuple_garbage_count(void);
+
+/**
+ * Освободить не больше @a limit таплов из очереди мусора.
+ * @return сколько освобождено.
+ */
+size_t
+tuple_collect_garbage(size_t limit);
+
+struct key_def;
+
+/**
+ * Создать формат спейса с индексами по ключам @a key_defs (@a key_count
+ * штук). Возвращает NULL, если одно поле в разных индексах имеет разные
+ * типы или частичных индексов больше TUPLE_FILTER_MAX. Ключ i-го
+ * функционального индекса лежит в слоте funcs[i].offset_slot, фильтру
+ * i-го частичного индекса соответствует бит i маски.
+ */
+struct tuple_format *
+tuple_format_new(const struct key_def *key_defs, uint32_t key_count);
+
+/**
+ * Формат @a format с еще одним индексом по ключу @a def (не
+ * функциональным и не частичным). Слоты field map старого формата не
+ * меняются, слот нового ключевого поля, если он нужен, добавляется в
+ * конец. Таплы старого формата остаются со своим форматом и держат
+ * ссылки на него. NULL, если тип поля в @a def не совпадает с типом в
+ * других индексах.
+ */
+struct tuple_format *
+tuple_format_add_key(const struct tuple_format *format, const struct key_def *def);
+
+/** Удалить формат без ссылок, например, так и не отданный спейсу. */
+void
+tuple_format_delete(struct tuple_format *format);
+
+/**
+ * Проверить данные тапла, созданного в другом формате, по формату
+ * @a format, как tuple_new. @retval 0 подходит, -1 нет (ошибка напечатана).
+ */
+int
+tuple_validate(struct tuple_format *format, struct tuple *tuple);
+
+/**
+ * Создать тапл из MsgPack массива [@a data, @a end). Данные проверяются
+ * и копируются как есть, без перекодирования; field map строится тем же
+ * проходом, затем вычисляются ключи функциональных индексов. Возвращает
+ * NULL, если данные не MsgPack массив или в нем не хватает
+ * индексированных полей либо их типы не совпадают с форматом, а также
+ * если функция ключа вернула ошибку или ключ не того типа. Новый тапл без
+ * ссылок: тот, кто его создал, должен сразу взять ссылку или удалить
+ * его через tuple_delete.
+ */
+struct tuple *
+tuple_new(struct tuple_format *format, const char *data, const char *end);
+
+void
+tuple_delete(struct tuple *tuple);
+
 char *
 tuple_str(struct tuple *tuple);
 
 #ifdef __cplusplus
 } // extern "C"
 #endif
+
+/**
+ * Взять ссылку на формат. Новый формат без ссылок; спейс берет ссылку
+ * на свой формат, tuple_new - на формат каждого тапла, так что формат
+ * живет, пока жив хоть один его тапл, даже если спейса уже нет.
+ */
+static inline void
+tuple_format_ref(struct tuple_format *format)
+{
+	format->refs++;
+}
+
+/** Отпустить ссылку на формат и удалить его, если она была последней. */
+static inline void
+tuple_format_unref(struct tuple_format *format)
+{
+	assert(format->refs > 0);
+	if (--format->refs == 0)
+		tuple_format_delete(format);
+}
+
+static inline void
+tuple_ref(struct tuple *tuple)
+{
+	if (unlikely(tuple->local_refs == TUPLE_LOCAL_REF_MAX))
+		tuple_upload_refs(tuple);
+	tuple->local_refs++;
+}
+
+/**
+ * Отпустить ссылку. Тапл, на который больше никто не ссылается, уходит
+ * в очередь мусора и остается читаемым до tuple_collect_garbage. Если
+ * до этого на него снова взяли ссылку (например, индекс вытеснил чистый
+ * тапл, и для него тут же создается story), он не освобождается.
+ */
+static inline void
+tuple_unref(struct tuple *tuple)
+{
+	assert(tuple->local_refs > 0);
+	if (unlikely(tuple->local_refs == 1 &&
+		     tuple_has_flag(tuple, TUPLE_HAS_UPLOADED_REFS)))
+		tuple_acquire_uploaded_refs(tuple);
+	if (--tuple->local_refs == 0)
+		tuple_put_garbage(tuple);
+}
@@ -0,0 +1,306 @@
+#include "tuple_update.h"
+#include "msgpack.h"
+#include "trivia/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/** Поле, которое меняют операции. */
+struct tuple_update_field {
+	uint32_t fieldno;
+	/** Поле в исходном тапле или NULL, если оно добавлено операцией. */
+	const char *old_value;
+	uint32_t old_size;
+	/** Текущее значение: исходное поле, аргумент "=" или scratch. */
+	const char *value;
+	uint32_t size;
+	/** Результат арифметики: число в MsgPack не длиннее 9 байт. */
+	char scratch[9];
+};
+
+/** Операнд "+" и "-". Целые складываются в __int128, чтобы поймать переполнение. */
+struct tuple_update_num {
+	bool is_double;
+	__int128 i;
+	double d;
+};
+
+static inline bool
+tuple_update_is_num(enum mp_type type)
+{
+	return type == MP_UINT || type == MP_INT || type == MP_FLOAT || type == MP_DOUBLE;
+}
+
+/**
+ * Проверить тип значения @a value, над которым выполняется операция
+ * @a op над полем @a fieldno: аргумента или самого поля.
+ */
+static int
+tuple_update_check_arg(char op, uint32_t fieldno, const char *value)
+{
+	enum mp_type type = mp_typeof(*value);
+	if ((op == '+' || op == '-') && !tuple_update_is_num(type)) {
+		fprintf(stderr, "Argument type in operation '%c' on field %u does not match field type: expected a number",
+			op, fieldno + 1);
+		return -1;
+	}
+	if ((op == '&' || op == '|' || op == '^') && type != MP_UINT) {
+		fprintf(stderr, "Argument type in operation '%c' on field %u does not match field type: expected a positive integer",
+			op, fieldno + 1);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Разобрать операцию номер @a op_no по адресу *@a pos и сдвинуть
+ * *@a pos за нее.
+ */
+static int
+tuple_update_decode_op(const char **pos, uint32_t op_no, char *op, uint32_t *fieldno, const char **arg)
+{
+	if (mp_typeof(**pos) != MP_ARRAY || mp_decode_array(pos) != 3) {
+		fprintf(stderr, "Illegal parameters, update operation must be an array {op,..}");
+		return -1;
+	}
+	if (mp_typeof(**pos) != MP_STR) {
+		fprintf(stderr, "Illegal parameters, update operation name must be a string");
+		return -1;
+	}
+	uint32_t len;
+	const char *name = mp_decode_str(pos, &len);
+	if (len != 1 || memchr("=+-&|^", name[0], 6) == NULL) {
+		fprintf(stderr, "Unknown UPDATE operation #%u: '%.*s'", op_no + 1, (int)len, name);
+		return -1;
+	}
+	*op = name[0];
+	if (mp_typeof(**pos) != MP_UINT) {
+		fprintf(stderr, "Illegal parameters, field id must be a number");
+		return -1;
+	}
+	uint64_t field = mp_decode_uint(pos);
+	if (field >= UINT32_MAX) {
+		fprintf(stderr, "Field %llu was not found in the tuple", (unsigned long long)field + 1);
+		return -1;
+	}
+	*fieldno = (uint32_t)field;
+	*arg = *pos;
+	if (tuple_update_check_arg(*op, *fieldno, *arg) != 0)
+		return -1;
+	mp_next(pos);
+	return 0;
+}
+
+int
+tuple_update_check_ops(const char *ops, const char *ops_end)
+{
+	const char *pos = ops;
+	if (ops == NULL || mp_check(&pos, ops_end) != 0 || pos != ops_end) {
+		fprintf(stderr, "Invalid MsgPack - update operations");
+		return -1;
+	}
+	if (mp_typeof(*ops) != MP_ARRAY) {
+		fprintf(stderr, "Illegal parameters, update operations must be an array {{op,..}, {op,..}}");
+		return -1;
+	}
+	pos = ops;
+	uint32_t op_count = mp_decode_array(&pos);
+	for (uint32_t i = 0; i < op_count; i++) {
+		char op;
+		uint32_t fieldno;
+		const char *arg;
+		if (tuple_update_decode_op(&pos, i, &op, &fieldno, &arg) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+int
+tuple_update_check_delta_ops(const char *ops, const char *ops_end)
+{
+	if (tuple_update_check_ops(ops, ops_end) != 0)
+		return -1;
+	const char *pos = ops;
+	uint32_t op_count = mp_decode_array(&pos);
+	for (uint32_t i = 0; i < op_count; i++) {
+		char op;
+		uint32_t fieldno;
+		const char *arg;
+		tuple_update_decode_op(&pos, i, &op, &fieldno, &arg);
+		if (op != '+' && op != '-') {
+			fprintf(stderr, "Illegal parameters, delta operation #%u must be '+' or '-', got '%c'",
+				i + 1, op);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static inline struct tuple_update_num
+tuple_update_decode_num(const char *value)
+{
+	struct tuple_update_num num = {false, 0, 0};
+	switch (mp_typeof(*value)) {
+	case MP_UINT:
+		num.i = mp_decode_uint(&value);
+		break;
+	case MP_INT:
+		num.i = mp_decode_int(&value);
+		break;
+	case MP_FLOAT:
+		num.is_double = true;
+		num.d = mp_decode_float(&value);
+		break;
+	default:
+		assert(mp_typeof(*value) == MP_DOUBLE);
+		num.is_double = true;
+		num.d = mp_decode_double(&value);
+		break;
+	}
+	return num;
+}
+
+/** Выполнить арифметическую или побитовую операцию над полем @a field. */
+static int
+tuple_update_do_arith(char op, struct tuple_update_field *field, const char *arg)
+{
+	if (tuple_update_check_arg(op, field->fieldno, field->value) != 0)
+		return -1;
+	char *end = field->scratch;
+	if (op == '&' || op == '|' || op == '^') {
+		const char *value = field->value;
+		uint64_t a = mp_decode_uint(&value);
+		uint64_t b = mp_decode_uint(&arg);
+		uint64_t result = op == '&' ? a & b : op == '|' ? a | b : a ^ b;
+		end = mp_encode_uint(end, result);
+	} else {
+		struct tuple_update_num a = tuple_update_decode_num(field->value);
+		struct tuple_update_num b = tuple_update_decode_num(arg);
+		if (a.is_double || b.is_double) {
+			double da = a.is_double ? a.d : (double)a.i;
+			double db = b.is_double ? b.d : (double)b.i;
+			end = mp_encode_double(end, op == '+' ? da + db : da - db);
+		} else {
+			__int128 result = op == '+' ? a.i + b.i : a.i - b.i;
+			if (result < INT64_MIN || result > (__int128)UINT64_MAX) {
+				fprintf(stderr, "Integer overflow when performing '%c' operation on field %u",
+					op, field->fieldno + 1);
+				return -1;
+			}
+			if (result >= 0)
+				end = mp_encode_uint(end, (uint64_t)result);
+			else
+				end = mp_encode_int(end, (int64_t)result);
+		}
+	}
+	field->value = field->scratch;
+	field->size = end - field->scratch;
+	return 0;
+}
+
+/** Порядок полей для сборки результата, сравниваются указатели на поля. */
+static int
+tuple_update_field_cmp(const void *a, const void *b)
+{
+	uint32_t fa = (*(struct tuple_update_field *const *)a)->fieldno;
+	uint32_t fb = (*(struct tuple_update_field *const *)b)->fieldno;
+	return fa < fb ? -1 : fa > fb;
+}
+
+char *
+tuple_update_execute(const char *ops, const char *ops_end, const char *data, const char *data_end, uint32_t *size)
+{
+	(void)ops_end;
+	const char *pos = ops;
+	uint32_t op_count = mp_decode_array(&pos);
+	struct tuple_update_field *fields =
+		xmalloc(MAX(op_count, 1) * sizeof(struct tuple_update_field));
+	struct tuple_update_field **order = NULL;
+	uint32_t touched = 0;
+	const char *first = data;
+	uint32_t old_count = mp_decode_array(&first);
+	uint32_t count = old_count;
+	char *result = NULL;
+	for (uint32_t i = 0; i < op_count; i++) {
+		char op;
+		uint32_t fieldno;
+		const char *arg;
+		if (tuple_update_decode_op(&pos, i, &op, &fieldno, &arg) != 0)
+			goto out;
+		struct tuple_update_field *field = NULL;
+		for (uint32_t j = 0; j < touched && field == NULL; j++) {
+			if (fields[j].fieldno == fieldno)
+				field = &fields[j];
+		}
+		if (field == NULL) {
+			if (fieldno >= count && !(op == '=' && fieldno == count)) {
+				fprintf(stderr, "Field %u was not found in the tuple", fieldno + 1);
+				goto out;
+			}
+			field = &fields[touched++];
+			field->fieldno = fieldno;
+			field->old_value = NULL;
+			field->old_size = 0;
+			if (fieldno < old_count) {
+				const char *value = first;
+				for (uint32_t j = 0; j < fieldno; j++)
+					mp_next(&value);
+				const char *value_end = value;
+				mp_next(&value_end);
+				field->old_value = value;
+				field->old_size = value_end - value;
+			} else {
+				count++;
+			}
+			field->value = field->old_value;
+			field->size = field->old_size;
+		}
+		if (op == '=') {
+			const char *arg_end = arg;
+			mp_next(&arg_end);
+			field->value = arg;
+			field->size = arg_end - arg;
+		} else if (tuple_update_do_arith(op, field, arg) != 0) {
+			goto out;
+		}
+	}
+	/*
+	 * Сами поля не двигаются: value поля после арифметики указывает на
+	 * его собственный scratch.
+	 */
+	order = xmalloc(MAX(touched, 1) * sizeof(*order));
+	for (uint32_t j = 0; j < touched; j++)
+		order[j] = &fields[j];
+	qsort(order, touched, sizeof(*order), tuple_update_field_cmp);
+
+	/* Исходные поля между измененными копируются одним куском. */
+	uint32_t new_size = mp_sizeof_array(count) + (data_end - first);
+	for (uint32_t j = 0; j < touched; j++)
+		new_size += fields[j].size - fields[j].old_size;
+	result = xmalloc(new_size);
+	char *out = mp_encode_array(result, count);
+	const char *copied = first;
+	for (uint32_t j = 0; j < touched; j++) {
+		struct tuple_update_field *field = order[j];
+		if (field->old_value != NULL) {
+			memcpy(out, copied, field->old_value - copied);
+			out += field->old_value - copied;
+			copied = field->old_value + field->old_size;
+		} else if (copied != data_end) {
+			/* Добавленные поля идут после всех исходных. */
+			memcpy(out, copied, data_end - copied);
+			out += data_end - copied;
+			copied = data_end;
+		}
+		memcpy(out, field->value, field->size);
+		out += field->size;
+	}
+	memcpy(out, copied, data_end - copied);
+	out += data_end - copied;
+	assert(out == result + new_size);
+	*size = new_size;
+out:
+	free(order);
+	free(fields);
+	return result;
+}
@@ -0,0 +1,49 @@
+#pragma once
+/*
+ * Операции UPDATE над полями тапла, как в tarantool. Операции - MsgPack
+ * массив, каждая операция - массив [op, fieldno, arg]:
+ *
+ *  "=" - записать arg в поле; fieldno может быть равен числу полей,
+ *        тогда поле добавляется в конец;
+ *  "+", "-" - прибавить или вычесть число arg; целые считаются точно и
+ *        проверяются на переполнение, с double результат double;
+ *  "&", "|", "^" - побитовые операции над неотрицательными целыми.
+ *
+ * fieldno - номер поля с нуля, как в key_def. Операции применяются по
+ * порядку, несколько операций над одним полем видят результаты друг друга.
+ */
+#include "stdint.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Проверить операции [@a ops, @a ops_end): формат, коды операций и
+ * типы аргументов. Поля тапла не проверяются.
+ */
+int
+tuple_update_check_ops(const char *ops, const char *ops_end);
+
+/**
+ * То же, что tuple_update_check_ops, но допускаются только "+" и "-":
+ * они коммутируют между собой, поэтому их можно применить к любой более
+ * новой версии тапла (см. box_update_delta).
+ */
+int
+tuple_update_check_delta_ops(const char *ops, const char *ops_end);
+
+/**
+ * Применить проверенные операции [@a ops, @a ops_end) к MsgPack массиву
+ * [@a data, @a data_end). Нетронутые поля копируются в результат
+ * кусками, как есть, без перекодирования.
+ *
+ * @param[out] size размер результата.
+ * @return новый MsgPack массив (освобождается free) или NULL.
+ */
+char *
+tuple_update_execute(const char *ops, const char *ops_end, const char *data, const char *data_end, uint32_t *size);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,75 @@
+#include "tx_profile.h"
+
+#include "stdio.h"
+#include "string.h"
+
+#ifdef ENABLE_TX_PROFILE
+struct tx_profile tx_profile_data;
+#endif
+
+/** Наибольшее значение, попадающее в корзину @a bucket. */
+static uint64_t
+tx_profile_bucket_upper(uint32_t bucket)
+{
+	if (bucket < 2 * TX_PROFILE_SUB_BUCKETS)
+		return bucket;
+	uint32_t shift = bucket / TX_PROFILE_SUB_BUCKETS - 1;
+	uint64_t sub = bucket % TX_PROFILE_SUB_BUCKETS;
+	return ((TX_PROFILE_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+uint64_t
+tx_profile_histogram_quantile(const struct tx_profile_histogram *h, double quantile)
+{
+	if (h->count == 0)
+		return 0;
+	uint64_t rank = (uint64_t)(quantile * h->count);
+	if (rank >= h->count)
+		rank = h->count - 1;
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < TX_PROFILE_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank) {
+			uint64_t upper = tx_profile_bucket_upper(i);
+			return upper < h->max ? upper : h->max;
+		}
+	}
+	return h->max;
+}
+
+double
+tx_profile_cycles_per_sec(void)
+{
+	static double rate = 0;
+	if (rate != 0)
+		return rate;
+	/* Калибруемся один раз: 10мс крутимся на монотонных часах. */
+	double start = clock_monotonic();
+	uint64_t start_cycles = tx_profile_cycles();
+	double now;
+	while ((now = clock_monotonic()) - start < 0.01)
+		;
+	rate = (tx_profile_cycles() - start_cycles) / (now - start);
+	return rate;
+}
+
+int
+tx_profile_get(struct tx_profile *profile)
+{
+#ifdef ENABLE_TX_PROFILE
+	memcpy(profile, &tx_profile_data, sizeof(*profile));
+	return 0;
+#else
+	(void)profile;
+	fprintf(stderr, "Transaction profiling is disabled, rebuild with ENABLE_TX_PROFILE");
+	return -1;
+#endif
+}
+
+void
+tx_profile_reset(void)
+{
+#ifdef ENABLE_TX_PROFILE
+	memset(&tx_profile_data, 0, sizeof(tx_profile_data));
+#endif
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+/*
+ * Профилирование пути транзакции: гистограммы задержек по фазам (в тактах
+ * TSC), счетчики абортов по причинам, длины цепочек stories, пройденных
+ * в clarify, и шаги GC против удаленных stories.
+ *
+ * Включается при сборке опцией ENABLE_TX_PROFILE. Без нее макросы
+ * TX_PROFILE_* раскрываются в пустоту, а tx_profile_get возвращает ошибку.
+ */
+
+#include "stdint.h"
+#include "trivia/config.h"
+#include "clock.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Фазы пути транзакции. Фазы могут быть вложены друг в друга. */
+enum tx_profile_phase {
+	/** txn_begin_stmt. */
+	TX_PROFILE_BEGIN_STMT = 0,
+	/** memtx_tx_history_add_stmt без GC (включает check_dup). */
+	TX_PROFILE_ADD_STMT = 1,
+	/** check_dup. */
+	TX_PROFILE_CHECK_DUP = 2,
+	/** memtx_tx_history_prepare_stmt без GC. */
+	TX_PROFILE_PREPARE_STMT = 3,
+	/** txn_commit целиком (включает prepare). */
+	TX_PROFILE_COMMIT = 4,
+	/** memtx_tx_story_gc на пути записи. */
+	TX_PROFILE_GC = 5,
+	TX_PROFILE_PHASE_MAX = 6,
+};
+
+enum tx_profile_counter {
+	/** Транзакция зааборчена конфликтом (TXN_IS_CONFLICTED). */
+	TX_PROFILE_ABORT_CONFLICT = 0,
+	/**
+	 * Из них: пишущая транзакция должна была уйти в read view и
+	 * поэтому зааборчена.
+	 */
+	TX_PROFILE_ABORT_READ_VIEW = 1,
+	/** Читающая транзакция ушла в read view (или понизила rv_psn). */
+	TX_PROFILE_SEND_TO_READ_VIEW = 2,
+	/** Транзакция зааборчена по таймауту. */
+	TX_PROFILE_ABORT_TIMEOUT = 3,
+	/** Шагов GC сделано. */
+	TX_PROFILE_GC_STEPS = 4,
+	/** Stories удалено GC. */
+	TX_PROFILE_GC_FREED = 5,
+	TX_PROFILE_COUNTER_MAX = 6,
+};
+
+enum {
+	/*
+	 * Гистограмма log-linear (как HDR): значения до 2 * SUB_BUCKETS
+	 * хранятся точно, дальше каждая степень двойки делится на
+	 * SUB_BUCKETS корзин, т.е. относительная погрешность не больше 1/16.
+	 */
+	TX_PROFILE_SUB_BUCKET_BITS = 4,
+	TX_PROFILE_SUB_BUCKETS = 1 << TX_PROFILE_SUB_BUCKET_BITS,
+	TX_PROFILE_BUCKETS = (64 - TX_PROFILE_SUB_BUCKET_BITS + 1) *
+			     TX_PROFILE_SUB_BUCKETS,
+};
+
+struct tx_profile_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[TX_PROFILE_BUCKETS];
+};
+
+struct tx_profile {
+	/** Задержки фаз в тактах, см. tx_profile_cycles_per_sec. */
+	struct tx_profile_histogram phases[TX_PROFILE_PHASE_MAX];
+	/** Сколько stories просмотрел один вызов clarify. */
+	struct tx_profile_histogram clarify_chain;
+	uint64_t counters[TX_PROFILE_COUNTER_MAX];
+};
+
+/** Текущее значение счетчика тактов. */
+static inline uint64_t
+tx_profile_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/** Номер корзины для значения @a value. */
+static inline uint32_t
+tx_profile_bucket(uint64_t value)
+{
+	if (value < 2 * TX_PROFILE_SUB_BUCKETS)
+		return value;
+	uint32_t shift = 63 - __builtin_clzll(value) - TX_PROFILE_SUB_BUCKET_BITS;
+	return (shift + 1) * TX_PROFILE_SUB_BUCKETS +
+	       ((value >> shift) & (TX_PROFILE_SUB_BUCKETS - 1));
+}
+
+static inline void
+tx_profile_histogram_add(struct tx_profile_histogram *h, uint64_t value)
+{
+	h->count++;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+	h->buckets[tx_profile_bucket(value)]++;
+}
+
+/**
+ * Значение, не меньше которого @a quantile (0..1) всех значений
+ * гистограммы (с точностью до корзины).
+ */
+uint64_t
+tx_profile_histogram_quantile(const struct tx_profile_histogram *h, double quantile);
+
+/** Сколько тактов tx_profile_cycles в секунде. */
+double
+tx_profile_cycles_per_sec(void);
+
+/**
+ * Скопировать накопленный профиль в @a profile.
+ * @retval -1 профилирование выключено при сборке.
+ */
+int
+tx_profile_get(struct tx_profile *profile);
+
+/** Обнулить профиль. */
+void
+tx_profile_reset(void);
+
+#ifdef ENABLE_TX_PROFILE
+
+extern struct tx_profile tx_profile_data;
+
+#define TX_PROFILE_START(var) uint64_t var = tx_profile_cycles()
+#define TX_PROFILE_STOP(phase, var) \
+	tx_profile_histogram_add(&tx_profile_data.phases[phase], tx_profile_cycles() - (var))
+#define TX_PROFILE_COUNT(counter, n) (tx_profile_data.counters[counter] += (n))
+#define TX_PROFILE_CHAIN(length) \
+	tx_profile_histogram_add(&tx_profile_data.clarify_chain, (length))
+
+#else /* ENABLE_TX_PROFILE */
+
+#define TX_PROFILE_START(var) ((void)0)
+#define TX_PROFILE_STOP(phase, var) ((void)0)
+#define TX_PROFILE_COUNT(counter, n) ((void)0)
+#define TX_PROFILE_CHAIN(length) ((void)0)
+
+#endif /* ENABLE_TX_PROFILE */
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
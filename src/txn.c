@@ -1,6 +1,8 @@
 #include "txn.h"
 #include "memtx_engine.h"
 #include "memtx_tx.h"
+#include "clock.h"
+#include "tx_profile.h"
 #include "assert.h"
 #include "stdbool.h"
 
@@ -13,6 +15,20 @@ int64_t txn_next_psn = TXN_MIN_PSN;
 
 RLIST_HEAD(txns);
 
+double txn_timeout_default = TXN_TIMEOUT_INFINITY;
+
+#define HEAP_NAME txn_timeout_heap
+#define HEAP_LESS(h, a, b) ((a)->deadline < (b)->deadline)
+#define heap_value_t struct txn
+#define heap_value_attr in_timeout_heap
+#include "salad/heap.h"
+
+/**
+ * Куча in-progress транзакций с конечным таймаутом. На вершине лежит
+ * транзакция с ближайшим deadline.
+ */
+static heap_t txn_timeouts = {0, 0, NULL};
+
 /** Initialize a new stmt object within txn. */
 static struct txn_stmt *
 txn_stmt_new(struct txn *txn)
@@ -42,6 +58,13 @@ static inline void
 txn_stmt_destroy(struct txn_stmt *stmt)
 {
 	assert(stmt->add_story == NULL && stmt->del_story == NULL);
+	/* Стейтмент может быть разрушен дважды: в txn_rollback_stmt и в txn_free. */
+	if (stmt->old_tuple != NULL)
+		tuple_unref(stmt->old_tuple);
+	if (stmt->new_tuple != NULL)
+		tuple_unref(stmt->new_tuple);
+	stmt->old_tuple = NULL;
+	stmt->new_tuple = NULL;
 }
 
 void
@@ -59,13 +82,14 @@ txn_send_to_read_view(struct txn *txn, int64_t psn)
 		return;
 	assert(txn->status == TXN_INPROGRESS || txn->status == TXN_IN_READ_VIEW);
 	//assert(txn_has_flag(txn, TXN_SUPPORTS_MVCC));
-	if (!stailq_empty(&txn->stmts)) {
+	if (txn_has_writes(txn)) {
 		/*
 		 * Если транзакция пишущая, абортим её, потому что она уже
 		 * в любом случае не сможет быть закоммичена, после того как
          * однажды отправилась в read view.
 		 */
 		assert(txn->status == TXN_INPROGRESS);
+		TX_PROFILE_COUNT(TX_PROFILE_ABORT_READ_VIEW, 1);
 		txn_abort_with_conflict(txn);
 		return;
 	}
@@ -86,6 +110,7 @@ txn_send_to_read_view(struct txn *txn, int64_t psn)
      * обязательно поддерживает MVCC. В engine.h объявлен один
      * глобальный engine.
      */
+			TX_PROFILE_COUNT(TX_PROFILE_SEND_TO_READ_VIEW, 1);
 			memtx_engine_send_to_read_view(/*engine, */txn, psn);
     //	} else {
 	//		assert(txn->engines[i] == NULL);
@@ -109,6 +134,7 @@ txn_abort_with_conflict(struct txn *txn)
 	//}
 	txn->status = TXN_ABORTED;
 	txn_set_flags(txn, TXN_IS_CONFLICTED);
+	TX_PROFILE_COUNT(TX_PROFILE_ABORT_CONFLICT, 1);
 }
 
 static void
@@ -117,6 +143,91 @@ txn_rollback_one_stmt(struct txn *txn, struct txn_stmt *stmt)
 	memtx_engine_rollback_statement(/*engine, */txn, stmt);
 }
 
+/** Убрать транзакцию из кучи таймаутов, если она там есть. */
+static inline void
+txn_timeout_stop(struct txn *txn)
+{
+	if (!heap_node_is_stray(&txn->in_timeout_heap))
+		txn_timeout_heap_delete(&txn_timeouts, txn);
+}
+
+void
+txn_set_timeout(struct txn *txn, double timeout)
+{
+	txn->timeout = timeout;
+	txn->deadline = clock_monotonic() + timeout;
+	if (timeout >= TXN_TIMEOUT_INFINITY) {
+		txn_timeout_stop(txn);
+	} else if (heap_node_is_stray(&txn->in_timeout_heap)) {
+		if (txn_timeout_heap_insert(&txn_timeouts, txn) != 0) {
+			/*panic*/fprintf(stderr, "Failed to allocate memory for txn timeout heap");
+			exit(1);
+		}
+	} else {
+		txn_timeout_heap_update(&txn_timeouts, txn);
+	}
+}
+
+/**
+ * Абортит транзакцию с причиной @a flag. В отличие от txn_rollback, может
+ * быть вызвана из любого файбера: транзакция остается привязанной к своему
+ * файберу, но все её stories и read списки отпускаются сразу, иначе
+ * "забытая" транзакция держала бы lowest_rv_psn и трекеры бесконечно.
+ */
+static void
+txn_abort_detached(struct txn *txn, enum txn_flag flag)
+{
+	assert(txn->status == TXN_INPROGRESS || txn->status == TXN_IN_READ_VIEW);
+	/* Удаляет транзакцию из read view, как и при конфликте. */
+	memtx_engine_abort_with_conflict(/*engine, */txn);
+	/*
+	 * Откатываем стейтменты в обратном порядке и затираем rollback_info,
+	 * чтобы последующий txn_rollback ничего не откатывал повторно.
+	 */
+	struct txn_stmt *stmt;
+	stailq_reverse(&txn->stmts);
+	stailq_foreach_entry(stmt, &txn->stmts, next) {
+		txn_rollback_one_stmt(txn, stmt);
+		txn_stmt_prepare_rollback_info(stmt, NULL, NULL);
+	}
+	stailq_reverse(&txn->stmts);
+	txn->status = TXN_ABORTED;
+	txn_set_flags(txn, flag);
+	memtx_tx_clean_txn(txn);
+}
+
+/** Абортит транзакцию по таймауту, см. txn_abort_detached. */
+static void
+txn_abort_by_timeout(struct txn *txn)
+{
+	if (txn->status == TXN_ABORTED)
+		return;
+	txn_abort_detached(txn, TXN_IS_ABORTED_BY_TIMEOUT);
+	TX_PROFILE_COUNT(TX_PROFILE_ABORT_TIMEOUT, 1);
+}
+
+void
+txn_abort_by_ddl(struct txn *txn)
+{
+	if (txn->status == TXN_ABORTED)
+		return;
+	txn_abort_detached(txn, TXN_IS_CONFLICTED);
+}
+
+void
+txn_process_timeouts(void)
+{
+	if (txn_timeouts.size == 0)
+		return;
+	double now = clock_monotonic();
+	struct txn *txn;
+	while ((txn = txn_timeout_heap_top(&txn_timeouts)) != NULL &&
+	       txn->deadline <= now) {
+		txn_timeout_heap_delete(&txn_timeouts, txn);
+		txn_abort_by_timeout(txn);
+	}
+}
+
 inline static struct txn *
 txn_new(void)
 {
@@ -132,16 +243,33 @@ txn_new(void)
 	rlist_create(&txn->gap_list);
 	rlist_create(&txn->in_read_view_txns);
 	rlist_create(&txn->in_txns);
+	rlist_create(&txn->ephemeral_spaces);
+	heap_node_create(&txn->in_timeout_heap);
 	return txn;
 }
 
+static void
+txn_delta_delete(struct txn_delta *delta)
+{
+	if (delta->tuple != NULL)
+		tuple_unref(delta->tuple);
+	free(delta);
+}
+
 void
 txn_free(struct txn *txn)
 {
+	txn_timeout_stop(txn);
 	memtx_tx_clean_txn(txn);
 	struct txn_stmt *stmt;
 	stailq_foreach_entry(stmt, &txn->stmts, next)
 		txn_stmt_destroy(stmt);
+	struct txn_delta *delta, *tmp;
+	stailq_foreach_entry_safe(delta, tmp, &txn->deltas, next)
+		txn_delta_delete(delta);
+	struct memtx_space *space, *next;
+	rlist_foreach_entry_safe(space, &txn->ephemeral_spaces, in_ephemeral_spaces, next)
+		memtx_space_delete_ephemeral(space);
 	rlist_del(&txn->in_txns);
 }
 
@@ -181,17 +309,21 @@ txn_begin(void)
 {
 	static int64_t tsn = 0;
 	assert(! in_txn());
+	txn_process_timeouts();
 	struct txn *txn = txn_new();
 	if (txn == NULL)
 		return NULL;
 
 	rlist_add_tail_entry(&txns, txn, in_txns);
 	stailq_create(&txn->stmts);
+	stailq_create(&txn->deltas);
 	txn->id = ++tsn;
 	txn->psn = 0;
 	txn->rv_psn = 0;
 	txn->status = TXN_INPROGRESS;
+	txn->flags = 0;
 	txn->fiber = NULL;
+	txn_set_timeout(txn, txn_timeout_default);
 	fiber_set_txn(fiber(), txn);
 	/* обновляет статы, нам не надо. */
     //memtx_tx_register_txn(txn);
@@ -203,6 +335,10 @@ txn_begin_stmt(struct txn *txn, struct memtx_space *space)
 {
 	assert(txn == in_txn());
 	assert(txn != NULL);
+	TX_PROFILE_START(start);
+
+	/* Может зааборить и саму txn, тогда txn_check_can_continue вернет ошибку. */
+	txn_process_timeouts();
 
 	if (txn->status == TXN_IN_READ_VIEW)
 		txn_abort_with_conflict(txn);
@@ -215,22 +351,144 @@ txn_begin_stmt(struct txn *txn, struct memtx_space *space)
 		return -1;
 
 	stailq_add_tail_entry(&txn->stmts, stmt, next);
+	stmt->space = space;
+	TX_PROFILE_STOP(TX_PROFILE_BEGIN_STMT, start);
+	return 0;
+}
 
-	if (space == NULL)
-		return 0;
+/**
+ * Выделить отложенное изменение с копией операций и местом под
+ * @a key_size байт ключа сразу за ними.
+ */
+static struct txn_delta *
+txn_delta_new(struct txn *txn, struct memtx_space *space, const char *ops, const char *ops_end, size_t key_size)
+{
+	assert(txn == in_txn());
+	txn_process_timeouts();
+	/* Это запись, как и txn_begin_stmt. */
+	if (txn->status == TXN_IN_READ_VIEW)
+		txn_abort_with_conflict(txn);
+	if (txn_check_can_continue(txn) != 0)
+		return NULL;
+	size_t ops_size = ops_end - ops;
+	size_t size = sizeof(struct txn_delta) + ops_size + key_size;
+	struct txn_delta *delta = (struct txn_delta *)malloc(size);
+	if (delta == NULL) {
+		fprintf(stderr, "Failed to allocate %zu bytes in %s for %s", size, "malloc", "delta");
+		return NULL;
+	}
+	char *data = (char *)(delta + 1);
+	memcpy(data, ops, ops_size);
+	delta->space = space;
+	delta->index_id = 0;
+	delta->key = NULL;
+	delta->ops = data;
+	delta->ops_end = data + ops_size;
+	delta->tuple = NULL;
+	stailq_add_tail_entry(&txn->deltas, delta, next);
+	return delta;
+}
 
-	stmt->space = space;
+int
+txn_add_delta(struct txn *txn, struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end, const char *ops, const char *ops_end)
+{
+	size_t key_size = key_end - key;
+	struct txn_delta *delta = txn_delta_new(txn, space, ops, ops_end, key_size);
+	if (delta == NULL)
+		return -1;
+	char *key_copy = (char *)delta->ops_end;
+	memcpy(key_copy, key, key_size);
+	delta->index_id = index_id;
+	delta->key = key_copy;
+	return 0;
+}
+
+int
+txn_add_upsert(struct txn *txn, struct memtx_space *space, struct tuple *tuple, const char *ops, const char *ops_end)
+{
+	/* Ключ берется из тапла при применении. */
+	struct txn_delta *delta = txn_delta_new(txn, space, ops, ops_end, 0);
+	if (delta == NULL)
+		return -1;
+	tuple_ref(tuple);
+	delta->tuple = tuple;
 	return 0;
 }
 
+/** Применить отложенное изменение отдельным стейтментом. */
+static int
+txn_apply_delta(struct txn *txn, struct txn_delta *delta, bool is_tracked)
+{
+	if (txn_begin_stmt(txn, delta->space) != 0)
+		return -1;
+	struct tuple *result;
+	int rc;
+	if (delta->tuple != NULL)
+		rc = memtx_space_execute_upsert(delta->space, txn, delta->tuple,
+						delta->ops, delta->ops_end, is_tracked);
+	else if (is_tracked)
+		rc = memtx_space_execute_update(delta->space, txn, delta->index_id, delta->key,
+						delta->ops, delta->ops_end, &result);
+	else
+		rc = memtx_space_execute_delta(delta->space, txn, delta->index_id, delta->key,
+					       delta->ops, delta->ops_end);
+	if (rc != 0)
+		txn_rollback_stmt(txn);
+	return rc;
+}
+
+/**
+ * Применить по порядку отложенные изменения спейса @a space или всех
+ * спейсов, если @a space == NULL. Примененные изменения удаляются,
+ * остальные, включая неудавшееся, остаются в прежнем порядке.
+ */
+static int
+txn_apply_deltas(struct txn *txn, struct memtx_space *space, bool is_tracked)
+{
+	struct stailq pending;
+	stailq_create(&pending);
+	stailq_concat(&pending, &txn->deltas);
+	while (!stailq_empty(&pending)) {
+		struct txn_delta *delta = stailq_shift_entry(&pending, struct txn_delta, next);
+		if (space != NULL && delta->space != space) {
+			stailq_add_tail_entry(&txn->deltas, delta, next);
+			continue;
+		}
+		if (txn_apply_delta(txn, delta, is_tracked) != 0) {
+			stailq_add_tail_entry(&txn->deltas, delta, next);
+			stailq_concat(&txn->deltas, &pending);
+			return -1;
+		}
+		txn_delta_delete(delta);
+	}
+	return 0;
+}
+
+int
+txn_flush_deltas(struct txn *txn, struct memtx_space *space)
+{
+	if (txn == NULL || stailq_empty(&txn->deltas))
+		return 0;
+	return txn_apply_deltas(txn, space, true);
+}
+
 /** Prepare a transaction using engines, run triggers, etc. */
 static int
 txn_prepare(struct txn *txn)
 {
 	if (txn_check_can_continue(txn) != 0)
 		return -1;
+	/*
+	 * Отложенные изменения ложатся на самые новые версии таплов прямо
+	 * перед prepare: их никто не читал, поэтому конкурентные изменения
+	 * одного тапла не конфликтуют.
+	 */
+	if (txn_apply_deltas(txn, NULL, false) != 0)
+		return -1;
 
 	assert(txn->psn == 0);
+	/* Prepared транзакцию уже нельзя зааборить по таймауту. */
+	txn_timeout_stop(txn);
 	/* psn должен быть выставлен до того, как позовутся engine-обработчки. */
 	txn->psn = txn_next_psn++;
 
@@ -244,26 +502,30 @@ txn_prepare(struct txn *txn)
 int
 txn_commit(struct txn *txn)
 {
+	TX_PROFILE_START(start);
 	txn->fiber = fiber();
 	if (txn_prepare(txn) != 0)
 		goto rollback;
 	fiber_set_txn(fiber(), NULL);
 	assert(!txn_has_flag(txn, TXN_IS_DONE));
-	assert(in_txn() == txn);
+	assert(in_txn() == NULL);
 	txn->status = TXN_COMMITTED;
 	memtx_engine_commit(/*engine, */txn);
-	assert(txn_has_flag(txn, TXN_IS_DONE));
+	txn_set_flags(txn, TXN_IS_DONE);
 	txn_free(txn);
+	TX_PROFILE_STOP(TX_PROFILE_COMMIT, start);
 	return 0;
 
 rollback:
 	assert(txn->fiber != NULL);
 	if (!txn_has_flag(txn, TXN_IS_DONE)) {
+		/* txn_rollback сам освобождает транзакцию. */
+		txn->fiber = NULL;
 		fiber_set_txn(fiber(), txn);
 		txn_rollback(txn);
-	} else {
-		assert(in_txn() == NULL);
+		return -1;
 	}
+	assert(in_txn() == NULL);
 	txn_free(txn);
 	return -1;
 }
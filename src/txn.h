@@ -6,6 +6,9 @@
 #include "small/rlist.h"
 #include "stdbool.h"
 
+#define HEAP_FORWARD_DECLARATION
+#include "salad/heap.h"
+
 /**
  * Incremental counter for psn (prepare sequence number) of a transaction.
  * The next prepared transaction will get psn == txn_next_psn++.
@@ -16,6 +19,15 @@ extern int64_t txn_next_psn;
 /** List of all in-progress transactions. */
 extern struct rlist txns;
 
+/** Таймаут, который означает, что транзакция живет сколько угодно долго. */
+#define TXN_TIMEOUT_INFINITY (365 * 86400 * 100.0)
+
+/**
+ * Таймаут (в секундах), который получает каждая новая транзакция.
+ * Может быть переопределен для конкретной транзакции через txn_set_timeout.
+ */
+extern double txn_timeout_default;
+
 enum txn_flag {
 	TXN_IS_DONE = 0x1,
 	//TXN_IS_ABORTED_BY_YIELD = 0x2,
@@ -25,7 +37,7 @@ enum txn_flag {
 	//TXN_WAIT_ACK = 0x20,
 	//TXN_FORCE_ASYNC = 0x40,
 	TXN_IS_CONFLICTED = 0x80,
-	//TXN_IS_ABORTED_BY_TIMEOUT = 0x100,
+	TXN_IS_ABORTED_BY_TIMEOUT = 0x100,
 	TXN_IS_ROLLED_BACK = 0x200,
 	//TXN_IS_STARTED_IN_ENGINE = 0x400,
 	//TXN_SUPPORTS_MVCC = 0x800,
@@ -97,6 +109,27 @@ struct txn_stmt {
 	bool is_own_change;
 };
 
+/**
+ * Отложенное коммутативное изменение тапла, см. box_update_delta, или
+ * upsert отсутствующего ключа, см. box_upsert. Оно не читает тапл и не
+ * создает story, пока транзакция его не применит: при prepare - к самой
+ * новой версии тапла, или раньше, если транзакция сама обратится к спейсу.
+ */
+struct txn_delta {
+	struct stailq_entry next;
+	struct memtx_space *space;
+	uint32_t index_id;
+	/**
+	 * Операции и ключ (значение без массива), копии лежат сразу за
+	 * структурой. У upsert ключа нет, он берется из тапла.
+	 */
+	const char *key;
+	const char *ops;
+	const char *ops_end;
+	/** Тапл upsert, держит ссылку на него; у box_update_delta - NULL. */
+	struct tuple *tuple;
+};
+
 struct txn {
 	int64_t id;
 	int64_t psn;
@@ -104,6 +137,8 @@ struct txn {
 	enum txn_status status;
 	//enum txn_isolation_level isolation;
 	struct stailq stmts;
+	/** Отложенные изменения, txn_delta, в порядке добавления. */
+	struct stailq deltas;
     unsigned flags;
 	struct fiber *fiber;
 	struct rlist in_read_view_txns;
@@ -111,6 +146,18 @@ struct txn {
 	struct rlist point_holes_list;
 	struct rlist gap_list;
 	struct rlist in_txns;
+	/** Ephemeral спейсы транзакции, удаляются вместе с ней. */
+	struct rlist ephemeral_spaces;
+	/** Таймаут транзакции в секундах. */
+	double timeout;
+	/**
+	 * Момент времени (clock_monotonic), после которого in-progress
+	 * транзакция будет зааборчена. Иначе она может сколько угодно
+	 * долго держать stories и трекеры, не давая GC их собрать.
+	 */
+	double deadline;
+	/** Узел в куче таймаутов, упорядоченной по deadline. */
+	struct heap_node in_timeout_heap;
 };
 
 static inline bool
@@ -129,7 +176,7 @@ txn_set_flags(struct txn *txn, unsigned int flags)
 /**
  * Returns the code of the error that caused abort of the given transaction.
  */
-static inline /*enum box_error_code*/ char *
+static inline /*enum box_error_code*/ const char *
 txn_flags_to_error_message(struct txn *txn)
 {
 	//if (txn_has_flag(txn, TXN_IS_ABORTED_RO_NODE))
@@ -143,6 +190,10 @@ txn_flags_to_error_message(struct txn *txn)
 	//	return ER_TRANSACTION_YIELD;
 	//else if (txn_has_flag(txn, TXN_IS_ABORTED_BY_TIMEOUT))
 	//	return ER_TRANSACTION_TIMEOUT;
+	if (txn_has_flag(txn, TXN_IS_CONFLICTED))
+		return "Transaction has been aborted by conflict";
+	if (txn_has_flag(txn, TXN_IS_ABORTED_BY_TIMEOUT))
+		return "Transaction has been aborted by timeout";
 	//else if (txn_has_flag(txn, TXN_IS_ROLLED_BACK))
 	//	return ER_TXN_ROLLBACK;
 	//return ER_UNKNOWN;
@@ -231,6 +282,39 @@ txn_rollback_stmt(struct txn *txn);
 void
 txn_rollback(struct txn *txn);
 
+/**
+ * Добавить в транзакцию отложенное изменение: операции [@a ops, @a ops_end)
+ * (проверенные tuple_update_check_delta_ops) над таплом с ключом
+ * [@a key, @a key_end) в индексе @a index_id. Ключ и операции копируются.
+ */
+int
+txn_add_delta(struct txn *txn, struct memtx_space *space, uint32_t index_id, const char *key, const char *key_end, const char *ops, const char *ops_end);
+
+/**
+ * Добавить в транзакцию отложенный upsert тапла @a tuple с операциями
+ * [@a ops, @a ops_end) (проверенными tuple_update_check_ops). Операции
+ * копируются, на тапл берется ссылка.
+ */
+int
+txn_add_upsert(struct txn *txn, struct memtx_space *space, struct tuple *tuple, const char *ops, const char *ops_end);
+
+/**
+ * Применить отложенные изменения транзакции в спейсе @a space обычными
+ * update стейтментами, с трекером чтения. Транзакция должна видеть свои
+ * изменения, поэтому это делается перед любым ее обращением к спейсу.
+ * Если изменение не удалось применить, оно остается в транзакции.
+ * @a txn может быть NULL.
+ */
+int
+txn_flush_deltas(struct txn *txn, struct memtx_space *space);
+
+/** Есть ли у транзакции записи: стейтменты или отложенные изменения. */
+static inline bool
+txn_has_writes(struct txn *txn)
+{
+	return !stailq_empty(&txn->stmts) || !stailq_empty(&txn->deltas);
+}
+
 /**
  * If the given transaction is read-only, send it to a read view in which it
  * can't see changes done with the given PSN or newer, otherwise abort it as
@@ -245,3 +329,27 @@ txn_send_to_read_view(struct txn *txn, int64_t psn);
  */
 void
 txn_abort_with_conflict(struct txn *txn);
+
+/**
+ * Абортить транзакцию из-за изменения схемы спейса, с которым она
+ * работала (см. memtx_space_build_index_step), как при конфликте. Как и
+ * по таймауту, изменения транзакции откатываются сразу, из любого файбера.
+ */
+void
+txn_abort_by_ddl(struct txn *txn);
+
+/**
+ * Выставить транзакции @a txn таймаут @a timeout секунд, отсчитывая
+ * от текущего момента. Стоит O(log n), где n - число транзакций с таймаутом.
+ */
+void
+txn_set_timeout(struct txn *txn, double timeout);
+
+/**
+ * Абортит все in-progress транзакции, у которых истек таймаут: откатывает
+ * их стейтменты и отпускает read списки, чтобы GC мог собрать stories.
+ * Сама транзакция остается в своем файбере в статусе TXN_ABORTED, пока
+ * её не откатят или не попробуют закоммитить.
+ */
+void
+txn_process_timeouts(void);
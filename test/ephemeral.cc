@@ -0,0 +1,65 @@
+/*
+ * Ephemeral спейсы: таплы, на которые взята ссылка, переживают спейс.
+ */
+#include "test.h"
+
+static struct tuple *
+get(struct memtx_space *space, int64_t key)
+{
+	struct tuple *tuple;
+	check(perf_get(space, 0, key, &tuple) == 0);
+	check(tuple != NULL);
+	return tuple;
+}
+
+static struct memtx_space *
+ephemeral_new()
+{
+	key_def def;
+	key_def_create(&def, 0, FIELD_TYPE_UNSIGNED);
+	struct memtx_space *space = box_ephemeral_space_new(&def, 1);
+	check(space != NULL);
+	return space;
+}
+
+/** Спейс удаляется вместе с транзакцией, тапл и его формат остаются. */
+static void
+test_tuple_outlives_txn()
+{
+	check(box_txn_begin() == 0);
+	struct memtx_space *space = ephemeral_new();
+	check(perf_insert(space, {1, 10, 20}) == 0);
+	struct tuple *tuple = get(space, 1);
+	box_tuple_ref(tuple);
+	check(box_txn_commit() == 0);
+	check(test_tuple_is(tuple, {1, 10, 20}));
+	box_tuple_unref(tuple);
+}
+
+/** То же при явном удалении спейса внутри транзакции. */
+static void
+test_tuple_outlives_delete()
+{
+	check(box_txn_begin() == 0);
+	struct memtx_space *space = ephemeral_new();
+	check(perf_insert(space, {2, 30, 40}) == 0);
+	check(perf_insert(space, {3, 50, 60}) == 0);
+	struct tuple *tuple = get(space, 3);
+	box_tuple_ref(tuple);
+	check(box_ephemeral_space_delete(space) == 0);
+	check(test_tuple_is(tuple, {3, 50, 60}));
+	check(box_txn_commit() == 0);
+	check(test_tuple_is(tuple, {3, 50, 60}));
+	box_tuple_unref(tuple);
+}
+
+int
+main()
+{
+	memtx_tx_manager_init();
+	perf_fiber fiber;
+	fiber.enter();
+	test_tuple_outlives_txn();
+	test_tuple_outlives_delete();
+	return 0;
+}
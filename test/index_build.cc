@@ -0,0 +1,104 @@
+/*
+ * Построение индекса на живом спейсе: отмена и завершение, форматы
+ * таплов и рост массива индексов.
+ */
+#include "test.h"
+
+static struct memtx_space *space;
+
+static struct tuple *
+get(uint32_t index_id, int64_t key)
+{
+	struct tuple *tuple;
+	check(box_txn_begin() == 0);
+	check(perf_get(space, index_id, key, &tuple) == 0);
+	check(box_txn_commit() == 0);
+	return tuple;
+}
+
+static void
+insert(const perf_tuple &tuple)
+{
+	check(box_txn_begin() == 0);
+	check(perf_insert(space, tuple) == 0);
+	check(box_txn_commit() == 0);
+}
+
+static int
+build(uint32_t fieldno, uint32_t *index_id)
+{
+	key_def def;
+	key_def_create(&def, fieldno, FIELD_TYPE_UNSIGNED);
+	check(box_index_build(space, &def, index_id) == 0);
+	int rc;
+	while ((rc = box_index_build_step(space, 0)) == 0)
+		;
+	return rc;
+}
+
+/**
+ * Дубликат в уникальном индексе отменяет построение. Таплы, вставленные
+ * во время построения в новом формате, остаются читаемыми, а номер
+ * индекса достается следующему построению.
+ */
+static void
+test_build_abort()
+{
+	insert({1, 5, 10, 100});
+	insert({2, 5, 20, 200});
+	key_def def;
+	key_def_create(&def, 1, FIELD_TYPE_UNSIGNED);
+	uint32_t index_id;
+	check(box_index_build(space, &def, &index_id) == 0);
+	check(index_id == 1);
+	insert({3, 7, 30, 300});
+	check(box_index_build_step(space, 0) == -1);
+	check(!memtx_space_build_index_is_active(space));
+	check(space->index_count == 1);
+	check(test_tuple_is(get(0, 3), {3, 7, 30, 300}));
+	check(test_tuple_is(get(0, 1), {1, 5, 10, 100}));
+
+	check(build(2, &index_id) == 1);
+	check(index_id == 1);
+	check(space->index_count == 2);
+	check(test_tuple_is(get(1, 30), {3, 7, 30, 300}));
+}
+
+/**
+ * Каждое построение добавляет индекс в массив. Таплы, созданные до
+ * построений, по-прежнему держат свои форматы.
+ */
+static void
+test_build_finish()
+{
+	struct tuple *old = get(0, 1);
+	box_tuple_ref(old);
+	uint32_t index_id;
+	check(build(3, &index_id) == 1);
+	check(index_id == 2);
+	insert({4, 9, 40, 400});
+	check(build(0, &index_id) == 1);
+	check(index_id == 3);
+	check(space->index_count == 4);
+	check(test_tuple_is(old, {1, 5, 10, 100}));
+	box_tuple_unref(old);
+	check(test_tuple_is(get(2, 200), {2, 5, 20, 200}));
+	check(test_tuple_is(get(2, 400), {4, 9, 40, 400}));
+	check(test_tuple_is(get(3, 4), {4, 9, 40, 400}));
+	check(test_tuple_is(get(1, 10), {1, 5, 10, 100}));
+}
+
+int
+main()
+{
+	memtx_tx_manager_init();
+	perf_fiber fiber;
+	fiber.enter();
+	key_def def;
+	key_def_create(&def, 0, FIELD_TYPE_UNSIGNED);
+	space = memtx_space_new_with_key_defs(&def, 1);
+	check(space != NULL);
+	test_build_abort();
+	test_build_finish();
+	return 0;
+}
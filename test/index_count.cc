@@ -0,0 +1,162 @@
+/*
+ * box_index_count, box_index_count_range, box_index_min и box_index_max
+ * при конкурентной записи: читатель видит снимок, а пишущая транзакция,
+ * чье чтение поменял чужой коммит, абортится.
+ */
+#include "test.h"
+
+static struct memtx_space *space;
+/** Ключ следующего тапла, который вставляет пишущая транзакция. */
+static int64_t next_id = 100;
+
+static size_t
+count(uint32_t index_id)
+{
+	size_t result;
+	check(box_index_count(space, index_id, NULL, NULL, &result) == 0);
+	return result;
+}
+
+static size_t
+count_key(uint32_t index_id, int64_t key)
+{
+	perf_key k(key);
+	size_t result;
+	check(box_index_count(space, index_id, k.begin(), k.end(), &result) == 0);
+	return result;
+}
+
+static size_t
+count_range(int64_t from, int64_t to)
+{
+	perf_key from_key(from), to_key(to);
+	size_t result;
+	check(box_index_count_range(space, 1, from_key.begin(), from_key.end(),
+				    to_key.begin(), to_key.end(), &result) == 0);
+	return result;
+}
+
+static int64_t
+min()
+{
+	struct tuple *tuple;
+	check(box_index_min(space, 1, &tuple) == 0);
+	return tuple == NULL ? -1 : perf_field(tuple, 1);
+}
+
+static int64_t
+max()
+{
+	struct tuple *tuple;
+	check(box_index_max(space, 1, &tuple) == 0);
+	return tuple == NULL ? -1 : perf_field(tuple, 1);
+}
+
+/** Таплы {id, 10 * id} для id от 1 до 10. */
+static void
+fill()
+{
+	check(box_txn_begin() == 0);
+	for (int64_t id = 1; id <= 10; id++)
+		check(perf_insert(space, {id, 10 * id}) == 0);
+	check(box_txn_commit() == 0);
+}
+
+/** Читающая транзакция уходит в read view и видит все по-старому. */
+static void
+test_reader_snapshot(perf_fiber &a, perf_fiber &b)
+{
+	a.enter();
+	check(box_txn_begin() == 0);
+	check(count(0) == 10);
+	check(count(1) == 10);
+	check(count_key(1, 50) == 1);
+	check(count_range(20, 50) == 4);
+	check(min() == 10 && max() == 100);
+
+	b.enter();
+	check(box_txn_begin() == 0);
+	check(perf_insert(space, {11, 5}) == 0);
+	check(perf_insert(space, {12, 50}) == 0);
+	check(perf_delete(space, 0, 10) == 0);
+	check(box_txn_commit() == 0);
+
+	a.enter();
+	check(count(0) == 10);
+	check(count(1) == 10);
+	check(count_key(1, 50) == 1);
+	check(count_range(20, 50) == 4);
+	check(min() == 10 && max() == 100);
+	check(box_txn_commit() == 0);
+
+	check(box_txn_begin() == 0);
+	check(count(0) == 11);
+	check(count_key(1, 50) == 2);
+	check(count_range(20, 50) == 5);
+	check(min() == 5 && max() == 90);
+	check(box_txn_commit() == 0);
+}
+
+/**
+ * Пишущая транзакция @a a прочитала что-то функцией @a read, а @a b
+ * закоммитила @a write. Вернуть результат коммита @a a.
+ */
+template <class Read, class Write>
+static int
+commit_after(perf_fiber &a, perf_fiber &b, Read read, Write write)
+{
+	a.enter();
+	check(box_txn_begin() == 0);
+	read();
+	check(perf_insert(space, {next_id++, 45}) == 0);
+	b.enter();
+	check(box_txn_begin() == 0);
+	write();
+	check(box_txn_commit() == 0);
+	a.enter();
+	int rc = box_txn_commit();
+	if (rc != 0)
+		fprintf(stderr, "\n");
+	return rc;
+}
+
+static void
+test_writer_conflicts(perf_fiber &a, perf_fiber &b)
+{
+	/* Вставка меняет число, замена - нет. */
+	check(commit_after(a, b, [] { count(0); },
+			   [] { check(perf_insert(space, {20, 7}) == 0); }) != 0);
+	check(commit_after(a, b, [] { count(0); },
+			   [] { check(perf_replace(space, {20, 8}) == 0); }) == 0);
+	/* Новый минимум - конфликт, вставка правее минимума - нет. */
+	check(commit_after(a, b, [] { min(); },
+			   [] { check(perf_insert(space, {21, 1}) == 0); }) != 0);
+	check(commit_after(a, b, [] { min(); },
+			   [] { check(perf_insert(space, {22, 30}) == 0); }) == 0);
+	/* Удаление максимума - конфликт. */
+	check(commit_after(a, b, [] { max(); },
+			   [] { check(perf_delete(space, 0, 9) == 0); }) != 0);
+	/* Ключ, перенесенный в отрезок, - конфликт, запись вне отрезка - нет. */
+	check(commit_after(a, b, [] { count_range(60, 80); },
+			   [] { check(perf_replace(space, {3, 65}) == 0); }) != 0);
+	check(commit_after(a, b, [] { count_range(60, 80); },
+			   [] { check(perf_replace(space, {4, 41}) == 0); }) == 0);
+}
+
+int
+main()
+{
+	memtx_tx_manager_init();
+	perf_fiber a, b;
+	key_def defs[2];
+	key_def_create(&defs[0], 0, FIELD_TYPE_UNSIGNED);
+	key_def_create(&defs[1], 1, FIELD_TYPE_UNSIGNED);
+	key_def_set_non_unique(&defs[1]);
+	space = memtx_space_new_with_key_defs(defs, 2);
+	check(space != NULL);
+	a.enter();
+	fill();
+	test_reader_snapshot(a, b);
+	test_writer_conflicts(a, b);
+	return 0;
+}
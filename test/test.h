@@ -0,0 +1,60 @@
+#pragma once
+/*
+ * Общие хелперы регрессионных тестов. Таплы, ключи и файберы берутся из
+ * perf_util.h бенчмарков. Не прошедшая проверка печатает место и условие
+ * и завершает тест с кодом 1.
+ */
+#include <cstdio>
+#include <cstdlib>
+
+#include "memtx_tx.h"
+#include "perf_util.h"
+
+#define check(expr) do {						\
+	if (!(expr)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n",		\
+			__FILE__, __LINE__, #expr);			\
+		exit(1);						\
+	}								\
+} while (0)
+
+/** Операции box_update: MsgPack массив [op, fieldno, arg] с целым arg. */
+struct test_ops {
+	char data[256];
+	char *data_end;
+
+	explicit test_ops(uint32_t count)
+	{
+		data_end = mp_encode_array(data, count);
+	}
+	test_ops &add(char op, uint32_t fieldno, int64_t arg)
+	{
+		data_end = mp_encode_array(data_end, 3);
+		data_end = mp_encode_str(data_end, &op, 1);
+		data_end = mp_encode_uint(data_end, fieldno);
+		if (arg >= 0)
+			data_end = mp_encode_uint(data_end, arg);
+		else
+			data_end = mp_encode_int(data_end, arg);
+		return *this;
+	}
+	const char *begin() const { return data; }
+	const char *end() const { return data_end; }
+};
+
+/** Проверить, что тапл @a tuple состоит из целых полей @a fields. */
+static inline bool
+test_tuple_is(struct tuple *tuple, std::initializer_list<int64_t> fields)
+{
+	if (tuple == NULL)
+		return false;
+	const char *data = tuple_data(tuple);
+	if (mp_decode_array(&data) != fields.size())
+		return false;
+	uint32_t fieldno = 0;
+	for (int64_t value : fields) {
+		if (perf_field(tuple, fieldno++) != value)
+			return false;
+	}
+	return true;
+}
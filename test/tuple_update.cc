@@ -0,0 +1,134 @@
+/*
+ * Операции box_update, box_update_delta и box_upsert.
+ */
+#include "test.h"
+
+static struct memtx_space *space;
+
+static struct tuple *
+get(int64_t key)
+{
+	struct tuple *tuple;
+	check(perf_get(space, 0, key, &tuple) == 0);
+	return tuple;
+}
+
+static void
+insert(const perf_tuple &tuple)
+{
+	check(box_txn_begin() == 0);
+	check(perf_insert(space, tuple) == 0);
+	check(box_txn_commit() == 0);
+}
+
+/**
+ * Операции идут не по возрастанию номера поля, а результат арифметики
+ * меняет размер поля: 300000 и 300001 кодируются пятью байтами, 10 и 11 -
+ * одним.
+ */
+static void
+test_update_out_of_order()
+{
+	insert({1, 10, 20, 300000});
+	perf_key key(1);
+	test_ops ops(2);
+	ops.add('+', 3, 1).add('+', 1, 1);
+	check(box_txn_begin() == 0);
+	check(box_update(space, 0, key.begin(), key.end(), ops.begin(), ops.end()) == 0);
+	check(test_tuple_is(get(1), {1, 11, 20, 300001}));
+
+	test_ops mixed(3);
+	mixed.add('-', 2, 5).add('=', 3, 7).add('+', 1, 100000);
+	check(box_update(space, 0, key.begin(), key.end(), mixed.begin(), mixed.end()) == 0);
+	check(test_tuple_is(get(1), {1, 100011, 15, 7}));
+	check(box_txn_commit() == 0);
+}
+
+static void
+test_update_delta_out_of_order()
+{
+	insert({2, 10, 20, 300000});
+	perf_key key(2);
+	test_ops ops(2);
+	ops.add('+', 3, 1).add('+', 1, 1);
+	check(box_txn_begin() == 0);
+	check(box_update_delta(space, 0, key.begin(), key.end(), ops.begin(), ops.end()) == 0);
+	check(box_update_delta(space, 0, key.begin(), key.end(), ops.begin(), ops.end()) == 0);
+	check(box_txn_commit() == 0);
+	check(box_txn_begin() == 0);
+	check(test_tuple_is(get(2), {2, 12, 20, 300002}));
+	check(box_txn_commit() == 0);
+}
+
+static int
+upsert(const perf_tuple &tuple, const test_ops &ops)
+{
+	return box_upsert(space, tuple.begin(), tuple.end(), ops.begin(), ops.end());
+}
+
+/**
+ * Upsert отсутствующего ключа ничего не читает: конкурентные upsert и
+ * вставка того же ключа коммитятся, а операции ложатся на новую версию.
+ */
+static void
+test_upsert_absent_key(perf_fiber &a, perf_fiber &b)
+{
+	test_ops ops(1);
+	ops.add('+', 1, 1);
+	a.enter();
+	check(box_txn_begin() == 0);
+	check(upsert({3, 10, 0, 0}, ops) == 0);
+	b.enter();
+	check(box_txn_begin() == 0);
+	check(upsert({3, 20, 0, 0}, ops) == 0);
+	a.enter();
+	check(box_txn_commit() == 0);
+	b.enter();
+	check(box_txn_commit() == 0);
+	check(box_txn_begin() == 0);
+	check(test_tuple_is(get(3), {3, 11, 0, 0}));
+	check(box_txn_commit() == 0);
+
+	a.enter();
+	check(box_txn_begin() == 0);
+	check(upsert({4, 10, 0, 0}, ops) == 0);
+	b.enter();
+	insert({4, 100, 0, 0});
+	a.enter();
+	check(box_txn_commit() == 0);
+	check(box_txn_begin() == 0);
+	check(test_tuple_is(get(4), {4, 101, 0, 0}));
+	check(box_txn_commit() == 0);
+}
+
+/** Транзакция, которая сама читает спейс после upsert, видит его. */
+static void
+test_upsert_then_read()
+{
+	test_ops ops(1);
+	ops.add('+', 1, 1);
+	check(box_txn_begin() == 0);
+	check(upsert({5, 10, 0, 0}, ops) == 0);
+	check(test_tuple_is(get(5), {5, 10, 0, 0}));
+	check(upsert({5, 10, 0, 0}, ops) == 0);
+	check(test_tuple_is(get(5), {5, 11, 0, 0}));
+	check(box_txn_commit() == 0);
+}
+
+int
+main()
+{
+	memtx_tx_manager_init();
+	perf_fiber fiber, other;
+	fiber.enter();
+	key_def def;
+	key_def_create(&def, 0, FIELD_TYPE_UNSIGNED);
+	space = memtx_space_new_with_key_defs(&def, 1);
+	check(space != NULL);
+	test_update_out_of_order();
+	test_update_delta_out_of_order();
+	test_upsert_absent_key(fiber, other);
+	fiber.enter();
+	test_upsert_then_read();
+	return 0;
+}
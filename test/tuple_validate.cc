@@ -0,0 +1,81 @@
+/*
+ * Проверка MsgPack данных тапла при вставке: обрезанные, лишние и
+ * некорректные байты не проходят, в том числе внутри multikey поля.
+ */
+#include <cstring>
+
+#include "test.h"
+
+static struct memtx_space *space;
+
+/**
+ * Вставить [@a data, @a end) из копии ровно такого размера, чтобы чтение
+ * за концом данных было видно санитайзерам.
+ */
+static int
+insert(const char *data, const char *end)
+{
+	size_t size = end - data;
+	char *copy = (char *)malloc(size + 1);
+	memcpy(copy, data, size);
+	check(box_txn_begin() == 0);
+	int rc = box_insert(space, copy, copy + size);
+	check(box_txn_rollback() == 0);
+	free(copy);
+	if (rc != 0)
+		fprintf(stderr, "\n");
+	return rc;
+}
+
+static void
+test_truncated()
+{
+	char data[256];
+	char *end = mp_encode_array(data, 4);
+	end = mp_encode_uint(end, 1);
+	end = mp_encode_array(end, 20);
+	for (int i = 0; i < 20; i++)
+		end = mp_encode_uint(end, 1000 * i);
+	end = mp_encode_str(end, "string of several bytes", 23);
+	end = mp_encode_double(end, 1.5);
+	check(insert(data, end) == 0);
+	for (const char *cut = data; cut < end; cut++)
+		check(insert(data, cut) != 0);
+	*end = 0x01;
+	check(insert(data, end + 1) != 0);
+}
+
+static void
+test_invalid()
+{
+	/* Неизвестный байт в поле за форматом. */
+	const char unknown[] = {(char)0x93, 0x01, (char)0x90, (char)0xc1};
+	check(insert(unknown, unknown + sizeof(unknown)) != 0);
+	const char header[] = {(char)0xdc, 0x00};
+	check(insert(header, header + sizeof(header)) != 0);
+	const char scalar[] = {0x05};
+	check(insert(scalar, scalar + sizeof(scalar)) != 0);
+	char data[32];
+	char *end = mp_encode_array(data, 2);
+	end = mp_encode_uint(end, 2);
+	end = mp_encode_array(end, 1);
+	end = mp_encode_str(end, "a", 1);
+	check(insert(data, end) != 0);
+}
+
+int
+main()
+{
+	memtx_tx_manager_init();
+	perf_fiber fiber;
+	fiber.enter();
+	key_def defs[2];
+	key_def_create(&defs[0], 0, FIELD_TYPE_UNSIGNED);
+	key_def_create_multikey(&defs[1], 1, FIELD_TYPE_UNSIGNED);
+	key_def_set_non_unique(&defs[1]);
+	space = memtx_space_new_with_key_defs(defs, 2);
+	check(space != NULL);
+	test_truncated();
+	test_invalid();
+	return 0;
+}